@@ -41,18 +41,30 @@
 #include "kernel/semaphore.h"
 #include "kernel/spinlock.h"
 #include "kernel/interrupt.h"
+#include "kernel/config.h"
 #include "lib/libc.h"
+#include "lib/debug.h"
 #include "drivers/device.h"
 #include "drivers/yams.h"
 #include "drivers/gbd.h"
 #include "drivers/disk.h"
 #include "drivers/disksched.h"
+#include "drivers/metadev.h"
 
 
 /**@name Disk driver
  *
  * This module contains functions for disk driver.
  *
+ * Normally the interrupt handler wakes up the requester of each
+ * completed request at once. When more than CONFIG_DISK_BATCH_DEPTH
+ * requests are queued, the driver enters batching mode: the handler
+ * still starts the next request right away, but collects completed
+ * requests and wakes up their requesters together, every
+ * CONFIG_DISK_BATCH_DEPTH completions and whenever the disk goes
+ * idle. The driver returns to waking requesters one at a time when
+ * the queue has drained below the limit.
+ *
  * @{
  */
 
@@ -64,6 +76,9 @@ static int disk_submit_request(gbd_t *gbd, gbd_request_t *request);
 static void disk_next_request(gbd_t *gbd);
 static uint32_t disk_block_size(gbd_t *gbd);
 static uint32_t disk_total_blocks(gbd_t *gbd);
+static void disk_account_request(disk_real_device_t *real_dev,
+				 volatile gbd_request_t *req);
+static void disk_wake_completed(disk_real_device_t *real_dev);
 
 
 /**
@@ -103,6 +118,15 @@ device_t *disk_init(io_descriptor_t *desc)
     real_dev->request_queue = NULL;
     real_dev->request_served = NULL;
 
+    ((disk_io_area_t *)dev->io_address)->command = DISK_COMMAND_BLOCKSIZE;
+    real_dev->block_size = ((disk_io_area_t *)dev->io_address)->data;
+    real_dev->last_block = 0;
+    memoryset(&real_dev->stats, 0, sizeof(disk_stats_t));
+
+    real_dev->batching = 0;
+    real_dev->completed = NULL;
+    real_dev->ncompleted = 0;
+
     irq_mask = 1 << (desc->irq + 10);
     interrupt_register(irq_mask, disk_interrupt_handle, dev);
 
@@ -112,8 +136,9 @@ device_t *disk_init(io_descriptor_t *desc)
 /**
  * Disk interrupt handler. Interrupt is raised so request is handled
  * by the disk. Sets return value of current request to zero, wakes up
- * function that is waiting this request and puts next request in work
- * by calling disk_next_request().
+ * function that is waiting this request (in batching mode, queues it
+ * to be woken up with others) and puts next request in work by calling
+ * disk_next_request().
  *
  * @param device Pointer to the device data structure
  */
@@ -121,6 +146,7 @@ static void disk_interrupt_handle(device_t *device)
 {
     disk_real_device_t *real_dev = device->real_device;
     disk_io_area_t *io = (disk_io_area_t *)device->io_address;
+    volatile gbd_request_t *req;
 
     spinlock_acquire(&real_dev->slock);
 
@@ -138,20 +164,64 @@ static void disk_interrupt_handle(device_t *device)
        service request. */
     KERNEL_ASSERT(real_dev->request_served != NULL);
 
-    real_dev->request_served->return_value = 0;
-	
-    /* Wake up the function that is waiting this request to be
-       handled.  In case of synchronous request that is
-       disk_submit_request. In case of asynchronous call it is
-       some other function.*/
-    semaphore_V(real_dev->request_served->sem);
+    req = real_dev->request_served;
+    req->return_value = 0;
+    disk_account_request(real_dev, req);
     real_dev->request_served = NULL;
+
+    if (real_dev->batching) {
+	req->next = (gbd_request_t *)real_dev->completed;
+	real_dev->completed = req;
+	real_dev->ncompleted++;
+    } else {
+	/* Wake up the function that is waiting this request to be
+	   handled.  In case of synchronous request that is
+	   disk_submit_request. In case of asynchronous call it is
+	   some other function.*/
+	semaphore_V(req->sem);
+    }
+
     disk_next_request(device->generic_device);
-    
+
+    /* Flush the batch when it is full or nothing more will complete */
+    if (real_dev->batching &&
+	(real_dev->ncompleted >= CONFIG_DISK_BATCH_DEPTH ||
+	 real_dev->request_served == NULL))
+	disk_wake_completed(real_dev);
+
     spinlock_release(&real_dev->slock);
 }
 
 
+/**
+ * Wakes up the requesters of the requests completed in batching mode
+ * and leaves batching mode if the queue is no longer deep. Assumes
+ * that interrupts are disabled and device spinlock is held.
+ *
+ * @param real_dev The disk.
+ */
+static void disk_wake_completed(disk_real_device_t *real_dev)
+{
+    volatile gbd_request_t *req, *next;
+
+    req = real_dev->completed;
+    real_dev->completed = NULL;
+    real_dev->ncompleted = 0;
+
+    /* The request may be gone as soon as its semaphore is raised, so
+       read the link first. */
+    while (req != NULL) {
+	next = req->next;
+	req->next = NULL;
+	semaphore_V(req->sem);
+	req = next;
+    }
+
+    if (real_dev->stats.queue_depth <= CONFIG_DISK_BATCH_DEPTH)
+	real_dev->batching = 0;
+}
+
+
 /**
  * Reads one block pointed by request from disk pointed by
  * gbd. Operation field of request is set to READ and request is
@@ -232,6 +302,17 @@ static int disk_submit_request(gbd_t *gbd, gbd_request_t *request)
     intr_status = _interrupt_disable();
     spinlock_acquire(&real_dev->slock);
 
+    request->timestamp = rtc_get_msec();
+    real_dev->stats.queue_depth++;
+    if(real_dev->stats.queue_depth > real_dev->stats.max_queue_depth)
+	real_dev->stats.max_queue_depth = real_dev->stats.queue_depth;
+
+    if(CONFIG_DISK_BATCH_DEPTH > 0 &&
+       real_dev->stats.queue_depth > CONFIG_DISK_BATCH_DEPTH) {
+	/* Deep queue, wake up requesters in batches */
+	real_dev->batching = 1;
+    }
+
     disksched_schedule(&real_dev->request_queue, request);
 
     if(real_dev->request_served == NULL) {
@@ -291,6 +372,13 @@ static void disk_next_request(gbd_t *gbd)
     
     real_dev->request_served = req;
 
+    real_dev->service_start = rtc_get_msec();
+    real_dev->stats.queue_time += real_dev->service_start - req->timestamp;
+    if(req->block > real_dev->last_block)
+	real_dev->stats.seek_distance += req->block - real_dev->last_block;
+    else
+	real_dev->stats.seek_distance += real_dev->last_block - req->block;
+    real_dev->last_block = req->block;
 
     io->tsector = req->block;
     io->dmaaddr = (uint32_t)req->buf;
@@ -366,4 +454,97 @@ static uint32_t disk_total_blocks(gbd_t *gbd)
     return ret;
 }
 
+/**
+ * Updates the statistics of a disk for a completed request. Assumes
+ * that interrupts are disabled and device spinlock is held.
+ *
+ * @param real_dev The disk.
+ *
+ * @param req The request that has just been completed.
+ */
+static void disk_account_request(disk_real_device_t *real_dev,
+				 volatile gbd_request_t *req)
+{
+    uint32_t now = rtc_get_msec();
+    uint32_t latency = now - req->timestamp;
+    int bucket = 0;
+
+    if(req->operation == GBD_OPERATION_READ) {
+	real_dev->stats.reads++;
+	real_dev->stats.bytes_read += real_dev->block_size;
+    } else {
+	real_dev->stats.writes++;
+	real_dev->stats.bytes_written += real_dev->block_size;
+    }
+
+    real_dev->stats.service_time += now - real_dev->service_start;
+    real_dev->stats.queue_depth--;
+
+    while(latency > 0 && bucket < DISKSTATS_BUCKETS - 1) {
+	latency >>= 1;
+	bucket++;
+    }
+    real_dev->stats.latency[bucket]++;
+}
+
+
+/**
+ * Copies the statistics of the nth disk of the system.
+ *
+ * @param n Index of the disk, as for device_get().
+ *
+ * @param stats Where to store the statistics.
+ *
+ * @return 0 on success, -1 if there is no such disk.
+ */
+int disk_get_stats(int n, disk_stats_t *stats)
+{
+    interrupt_status_t intr_status;
+    disk_real_device_t *real_dev;
+    device_t *dev;
+
+    if(n < 0)
+	return -1;
+
+    dev = device_get(YAMS_TYPECODE_DISK, n);
+    if(dev == NULL)
+	return -1;
+    real_dev = dev->real_device;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&real_dev->slock);
+
+    memcopy(sizeof(disk_stats_t), stats, &real_dev->stats);
+
+    spinlock_release(&real_dev->slock);
+    _interrupt_set_state(intr_status);
+
+    return 0;
+}
+
+
+/**
+ * Prints the statistics of all disks to the console if the boot
+ * argument diskstats is given.
+ */
+void disk_print_stats(void)
+{
+    disk_stats_t stats;
+    int n, i;
+
+    for(n = 0; disk_get_stats(n, &stats) == 0; n++) {
+	DEBUG("diskstats", "disk%d: %d reads (%d bytes), %d writes (%d bytes)\n",
+	      n, stats.reads, stats.bytes_read, stats.writes,
+	      stats.bytes_written);
+	DEBUG("diskstats", "disk%d: queue %d ms, service %d ms, seek %d blocks, "
+	      "max depth %d\n", n, stats.queue_time, stats.service_time,
+	      stats.seek_distance, stats.max_queue_depth);
+	for(i = 0; i < DISKSTATS_BUCKETS; i++) {
+	    if(stats.latency[i] != 0)
+		DEBUG("diskstats", "disk%d: latency < %d ms: %d\n",
+		      n, 1 << i, stats.latency[i]);
+	}
+    }
+}
+
 /** @} */
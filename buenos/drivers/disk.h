@@ -43,6 +43,7 @@
 #include "drivers/device.h"
 #include "drivers/yams.h"
 #include "drivers/gbd.h"
+#include "drivers/diskstats.h"
 
 
 #define DISK_COMMAND_READ            0x1
@@ -90,11 +91,32 @@ typedef struct {
 
     /* Request currently served by the driver. If NULL device is idle. */
     volatile gbd_request_t     *request_served;
+
+    /* Block size of the disk, cached for statistics */
+    uint32_t                   block_size;
+
+    /* Start time of request_served and the block of the previously
+       served request, for service time and seek distance. */
+    uint32_t                   service_start;
+    uint32_t                   last_block;
+
+    /* I/O statistics, protected by slock */
+    disk_stats_t               stats;
+
+    /* Nonzero while the driver is in batching mode, see disk.c */
+    int                        batching;
+
+    /* Completed requests whose requesters have not been woken up
+       yet, and their number. Only used in batching mode. */
+    volatile gbd_request_t     *completed;
+    int                        ncompleted;
 } disk_real_device_t;
 
 
 /* functions */
 device_t *disk_init(io_descriptor_t *desc);
+int disk_get_stats(int n, disk_stats_t *stats);
+void disk_print_stats(void);
 
 
 #endif /* DRIVERS_DISK_H */
@@ -0,0 +1,48 @@
+/*
+ * Disk I/O statistics.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef DRIVERS_DISKSTATS_H
+#define DRIVERS_DISKSTATS_H
+
+#include "lib/types.h"
+
+/* Number of buckets in the latency histogram. Bucket 0 counts
+   requests completed in less than 1 ms, bucket i (i > 0) requests
+   that took from 2^(i-1) to 2^i - 1 ms. The last bucket also counts
+   everything slower. */
+#define DISKSTATS_BUCKETS 16
+
+/* Statistics of one disk. All times are in milliseconds as given by
+   the real time clock. */
+typedef struct {
+    /* Completed requests */
+    uint32_t reads;
+    uint32_t writes;
+
+    /* Bytes transferred by completed requests */
+    uint32_t bytes_read;
+    uint32_t bytes_written;
+
+    /* Time requests spent in the queue before the disk started
+       working on them, summed over all requests */
+    uint32_t queue_time;
+
+    /* Time the disk spent serving requests, summed over all requests */
+    uint32_t service_time;
+
+    /* Sum of the distances in blocks between consecutive requests */
+    uint32_t seek_distance;
+
+    /* Requests queued or in service right now, and the maximum
+       ever seen */
+    uint32_t queue_depth;
+    uint32_t max_queue_depth;
+
+    /* Histogram of total request latency (queue + service time) */
+    uint32_t latency[DISKSTATS_BUCKETS];
+} disk_stats_t;
+
+#endif /* DRIVERS_DISKSTATS_H */
@@ -91,6 +91,10 @@ typedef struct gbd_request_struct {
        the sem is signaled, return value can be read from this field. 
        0 is success, other values indicate failure. */
     int             return_value;
+
+    /* Time (rtc_get_msec()) when the request was submitted. Used
+       internally by drivers for statistics. */
+    uint32_t        timestamp;
 } gbd_request_t;
 
 /* Generic block device descriptor. */
@@ -39,6 +39,8 @@
 
 #include "drivers/device.h"
 
+struct pollq_struct;
+
 /* Generic character device descriptor. */
 typedef struct gcd_struct {
     /* Pointer to the device */
@@ -53,6 +55,12 @@ typedef struct gcd_struct {
        device to buf. The function returns the number of bytes read.
        Note the call can block. */
     int  (*read)(struct gcd_struct *gcd, void *buf, int len);
+
+    /* Pointer to a function which returns the POLL_* events
+       (proc/poll.h) of the device that are ready now, and stores the
+       pollq notified when they change in pollq. NULL if reading and
+       writing never block. */
+    int (*poll)(struct gcd_struct *gcd, struct pollq_struct **pollq);
 } gcd_t;
 
 #endif /* DRIVERS_GCD_H */
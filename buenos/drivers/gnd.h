@@ -72,6 +72,13 @@ typedef struct gnd_struct {
      */
     int (*recv)(struct gnd_struct *gnd, void *frame);
 
+    /* Pointer to a function which returns non-zero if a received
+     * frame is waiting, so that the next call of recv will not
+     * block. The network layer uses it to receive frames in batches.
+     * May be NULL, in which case frames are received one at a time.
+     */
+    int (*poll)(struct gnd_struct *gnd);
+
     /* Pointer to a function which returns the size of the network
      * frame for the media in octets.
      */
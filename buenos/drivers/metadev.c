@@ -40,6 +40,7 @@
 #include "kernel/assert.h"
 #include "kernel/kmalloc.h"
 #include "kernel/interrupt.h"
+#include "vm/tlb.h"
 
 /**@name Metadevices
  *
@@ -257,13 +258,13 @@ void cpustatus_interrupt_handle(device_t *dev){
 
     spinlock_acquire(&cpu->slock);
 
-    /* If you really want to do something with inter-cpu interrupts,
-       do it here. */
-
     /* Clear the interrupt */
     iobase->command = CPU_COMMAND_CLEAR_IRQ;
     
     spinlock_release(&cpu->slock);
+
+    /* The only inter-cpu interrupts are TLB shootdowns */
+    tlb_shootdown_handle();
 }
 
 /** 
@@ -0,0 +1,448 @@
+/*
+ * Striping and mirroring meta block device.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#include "kernel/panic.h"
+#include "kernel/assert.h"
+#include "kernel/semaphore.h"
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
+#include "kernel/thread.h"
+#include "lib/libc.h"
+#include "vm/pagepool.h"
+#include "drivers/device.h"
+#include "drivers/yams.h"
+#include "drivers/gbd.h"
+#include "drivers/raid.h"
+
+
+/**@name RAID meta device
+ *
+ * This module implements a generic block device on top of several
+ * other generic block devices. Level 0 stripes consecutive blocks
+ * round robin over the members, level 1 keeps an identical copy of
+ * every block on every member.
+ *
+ * Requests to the members are always issued asynchronously, so the
+ * members work in parallel: a mirrored write goes to every disk at
+ * once, and independent requests to a striped array keep all disks
+ * busy. Mirrored reads are sent to the member with the fewest
+ * outstanding requests.
+ *
+ * Synchronous callers wait for their member requests in their own
+ * thread. Asynchronous callers are served by a per array service
+ * thread, which issues the member requests of all queued callers in
+ * one batch and signals each caller as its batch completes.
+ *
+ * @{
+ */
+
+static int raid_read_block(gbd_t *gbd, gbd_request_t *request);
+static int raid_write_block(gbd_t *gbd, gbd_request_t *request);
+static uint32_t raid_block_size(gbd_t *gbd);
+static uint32_t raid_total_blocks(gbd_t *gbd);
+static void raid_service(uint32_t arg);
+
+
+/**
+ * Creates a RAID array over the given member devices. All members
+ * must have the same block size. The size of the array is determined
+ * by the smallest member. Memory for the array is taken from the page
+ * pool, so this can be called after kmalloc has been disabled.
+ *
+ * @param level RAID_LEVEL_STRIPE or RAID_LEVEL_MIRROR
+ *
+ * @param members Array of member devices
+ *
+ * @param nmembers Number of members, 1 to RAID_MAX_MEMBERS
+ *
+ * @return The generic block device of the array, NULL on failure.
+ */
+gbd_t *raid_create(int level, gbd_t **members, int nmembers)
+{
+    uint32_t addr;
+    device_t *dev;
+    gbd_t *gbd;
+    raid_real_device_t *raid;
+    uint32_t smallest;
+    TID_t service;
+    int i;
+
+    if ((level != RAID_LEVEL_STRIPE && level != RAID_LEVEL_MIRROR)
+	|| nmembers < 1 || nmembers > RAID_MAX_MEMBERS)
+	return NULL;
+
+    for (i = 1; i < nmembers; i++) {
+	if (members[i]->block_size(members[i]) !=
+	    members[0]->block_size(members[0])) {
+	    kprintf("RAID: Members have different block sizes\n");
+	    return NULL;
+	}
+    }
+
+    KERNEL_ASSERT(PAGE_SIZE >= sizeof(device_t) + sizeof(gbd_t)
+		  + sizeof(raid_real_device_t));
+
+    addr = pagepool_get_phys_page();
+    if (addr == 0)
+	return NULL;
+    addr = ADDR_PHYS_TO_KERNEL(addr);
+
+    dev = (device_t *)addr;
+    gbd = (gbd_t *)(addr + sizeof(device_t));
+    raid = (raid_real_device_t *)(addr + sizeof(device_t) + sizeof(gbd_t));
+
+    raid->async_pending = semaphore_create(0);
+    raid->member_done = semaphore_create(0);
+    if (raid->async_pending == NULL || raid->member_done == NULL) {
+	if (raid->async_pending != NULL)
+	    semaphore_destroy(raid->async_pending);
+	if (raid->member_done != NULL)
+	    semaphore_destroy(raid->member_done);
+	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+	return NULL;
+    }
+
+    raid->level = level;
+    raid->nmembers = nmembers;
+    raid->block_size = members[0]->block_size(members[0]);
+    smallest = members[0]->total_blocks(members[0]);
+    for (i = 0; i < nmembers; i++) {
+	raid->members[i] = members[i];
+	raid->inflight[i] = 0;
+	smallest = MIN(smallest, members[i]->total_blocks(members[i]));
+    }
+
+    if (level == RAID_LEVEL_STRIPE)
+	raid->total_blocks = smallest * nmembers;
+    else
+	raid->total_blocks = smallest;
+
+    spinlock_reset(&raid->slock);
+    raid->async_queue = NULL;
+
+    /* The array has no YAMS device behind it. */
+    dev->real_device = raid;
+    dev->generic_device = gbd;
+    dev->descriptor = NULL;
+    dev->io_address = 0;
+    dev->type = YAMS_TYPECODE_DISK;
+
+    gbd->device = dev;
+    gbd->read_block = raid_read_block;
+    gbd->write_block = raid_write_block;
+    gbd->block_size = raid_block_size;
+    gbd->total_blocks = raid_total_blocks;
+
+    service = thread_create(&raid_service, (uint32_t)raid);
+    if (service < 0) {
+	semaphore_destroy(raid->async_pending);
+	semaphore_destroy(raid->member_done);
+	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+	return NULL;
+    }
+    thread_run(service);
+
+    kprintf("RAID: level %d array of %d disks, %d blocks\n",
+	    level, nmembers, raid->total_blocks);
+
+    return gbd;
+}
+
+
+/**
+ * Maps a request on the array to member requests and submits them
+ * asynchronously. Every member request signals sem on completion.
+ *
+ * @param raid The array.
+ *
+ * @param request The request on the array. block, buf and operation
+ * must be set.
+ *
+ * @param reqs Room for at least nmembers member requests.
+ *
+ * @param member Index of the member of each issued request is stored
+ * here, room for at least nmembers entries.
+ *
+ * @param sem Semaphore raised once per completed member request.
+ *
+ * @param accepted The number of member requests the members accepted
+ * is stored here. The caller must wait for sem this many times before
+ * calling raid_finish(). A refused request never raises sem, its
+ * return value is set to -1 instead.
+ *
+ * @return Number of member requests issued.
+ */
+static int raid_issue(raid_real_device_t *raid, gbd_request_t *request,
+		      gbd_request_t *reqs, int *member, semaphore_t *sem,
+		      int *accepted)
+{
+    interrupt_status_t intr_status;
+    uint32_t mblock;
+    gbd_t *disk;
+    int n, i, ok;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&raid->slock);
+
+    if (raid->level == RAID_LEVEL_STRIPE) {
+	member[0] = request->block % raid->nmembers;
+	mblock = request->block / raid->nmembers;
+	n = 1;
+    } else if (request->operation == GBD_OPERATION_READ) {
+	member[0] = 0;
+	for (i = 1; i < raid->nmembers; i++) {
+	    if (raid->inflight[i] < raid->inflight[member[0]])
+		member[0] = i;
+	}
+	mblock = request->block;
+	n = 1;
+    } else {
+	for (i = 0; i < raid->nmembers; i++)
+	    member[i] = i;
+	mblock = request->block;
+	n = raid->nmembers;
+    }
+
+    for (i = 0; i < n; i++)
+	raid->inflight[member[i]]++;
+
+    spinlock_release(&raid->slock);
+    _interrupt_set_state(intr_status);
+
+    *accepted = 0;
+    for (i = 0; i < n; i++) {
+	disk = raid->members[member[i]];
+	reqs[i].block = mblock;
+	reqs[i].buf = request->buf;
+	reqs[i].sem = sem;
+	if (request->operation == GBD_OPERATION_READ)
+	    ok = disk->read_block(disk, &reqs[i]);
+	else
+	    ok = disk->write_block(disk, &reqs[i]);
+
+	if (ok)
+	    (*accepted)++;
+	else
+	    reqs[i].return_value = -1;
+    }
+
+    return n;
+}
+
+
+/**
+ * Collects the results of completed member requests into the return
+ * value of the array request. The request fails if any member
+ * request failed.
+ *
+ * @param raid The array.
+ *
+ * @param request The request on the array.
+ *
+ * @param reqs The completed member requests.
+ *
+ * @param member Member indices as filled by raid_issue().
+ *
+ * @param n Number of member requests.
+ */
+static void raid_finish(raid_real_device_t *raid, gbd_request_t *request,
+			gbd_request_t *reqs, int *member, int n)
+{
+    interrupt_status_t intr_status;
+    int i;
+
+    request->return_value = 0;
+    for (i = 0; i < n; i++) {
+	if (reqs[i].return_value != 0)
+	    request->return_value = -1;
+    }
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&raid->slock);
+    for (i = 0; i < n; i++)
+	raid->inflight[member[i]]--;
+    spinlock_release(&raid->slock);
+    _interrupt_set_state(intr_status);
+}
+
+
+/**
+ * Submits a request to the array. Synchronous requests are handled
+ * in the calling thread, asynchronous ones are queued for the service
+ * thread.
+ *
+ * @param gbd The array.
+ *
+ * @param request The request, operation already set.
+ *
+ * @return 1 if success, 0 otherwise. Asynchronous requests always
+ * succeed at this point.
+ */
+static int raid_submit_request(gbd_t *gbd, gbd_request_t *request)
+{
+    raid_real_device_t *raid = gbd->device->real_device;
+    interrupt_status_t intr_status;
+    gbd_request_t reqs[RAID_MAX_MEMBERS];
+    int member[RAID_MAX_MEMBERS];
+    gbd_request_t **tail;
+    semaphore_t *sem;
+    int n, accepted, i;
+
+    if (request->block >= raid->total_blocks)
+	return 0;
+
+    request->internal = NULL;
+    request->next = NULL;
+    request->return_value = -1;
+
+    if (request->sem != NULL) {
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&raid->slock);
+
+	for (tail = &raid->async_queue; *tail != NULL; tail = &(*tail)->next)
+	    ;
+	*tail = request;
+
+	spinlock_release(&raid->slock);
+	_interrupt_set_state(intr_status);
+
+	semaphore_V(raid->async_pending);
+	return 1;
+    }
+
+    sem = semaphore_create(0);
+    if (sem == NULL)
+	return 0;
+
+    n = raid_issue(raid, request, reqs, member, sem, &accepted);
+    for (i = 0; i < accepted; i++)
+	semaphore_P(sem);
+    semaphore_destroy(sem);
+
+    raid_finish(raid, request, reqs, member, n);
+
+    return (request->return_value == 0);
+}
+
+
+/**
+ * Service thread of an array. Takes as many queued asynchronous
+ * requests as there are free member request slots, issues all their
+ * member requests at once, waits for them and signals the callers.
+ *
+ * @param arg Pointer to the raid_real_device_t of the array.
+ */
+static void raid_service(uint32_t arg)
+{
+    raid_real_device_t *raid = (raid_real_device_t *)arg;
+    interrupt_status_t intr_status;
+    gbd_request_t *batch[RAID_MAX_INFLIGHT];
+    int first[RAID_MAX_INFLIGHT];
+    int count[RAID_MAX_INFLIGHT];
+    int member[RAID_MAX_INFLIGHT];
+    int nbatch, slots, waits, accepted, i, j;
+
+    while (1) {
+	semaphore_P(raid->async_pending);
+
+	/* Every queued request needs at most nmembers slots. Requests
+	   beyond the first batch have raised async_pending as well,
+	   so they are picked up on the next rounds. */
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&raid->slock);
+	nbatch = 0;
+	while (raid->async_queue != NULL &&
+	       (nbatch + 1) * raid->nmembers <= RAID_MAX_INFLIGHT) {
+	    batch[nbatch++] = raid->async_queue;
+	    raid->async_queue = raid->async_queue->next;
+	}
+	spinlock_release(&raid->slock);
+	_interrupt_set_state(intr_status);
+
+	slots = 0;
+	waits = 0;
+	for (i = 0; i < nbatch; i++) {
+	    first[i] = slots;
+	    count[i] = raid_issue(raid, batch[i], &raid->member_reqs[slots],
+				  &member[slots], raid->member_done, &accepted);
+	    slots += count[i];
+	    waits += accepted;
+	}
+
+	for (j = 0; j < waits; j++)
+	    semaphore_P(raid->member_done);
+
+	for (i = 0; i < nbatch; i++) {
+	    raid_finish(raid, batch[i], &raid->member_reqs[first[i]],
+			&member[first[i]], count[i]);
+	    semaphore_V(batch[i]->sem);
+	}
+    }
+}
+
+
+/**
+ * Reads one block from the array. Implements gbd's read_block().
+ *
+ * @param gbd Pointer to the gbd of the array.
+ *
+ * @param request Request describing the block to read.
+ *
+ * @return 1 if success, 0 otherwise
+ */
+static int raid_read_block(gbd_t *gbd, gbd_request_t *request)
+{
+    request->operation = GBD_OPERATION_READ;
+    return raid_submit_request(gbd, request);
+}
+
+
+/**
+ * Writes one block to the array. Implements gbd's write_block().
+ *
+ * @param gbd Pointer to the gbd of the array.
+ *
+ * @param request Request describing the block to write.
+ *
+ * @return 1 if success, 0 otherwise
+ */
+static int raid_write_block(gbd_t *gbd, gbd_request_t *request)
+{
+    request->operation = GBD_OPERATION_WRITE;
+    return raid_submit_request(gbd, request);
+}
+
+
+/**
+ * Returns the block size of the array, which is the block size of
+ * its members. Implements gbd's block_size().
+ *
+ * @param gbd Pointer to the gbd of the array.
+ *
+ * @return Block size in bytes.
+ */
+static uint32_t raid_block_size(gbd_t *gbd)
+{
+    raid_real_device_t *raid = gbd->device->real_device;
+    return raid->block_size;
+}
+
+
+/**
+ * Returns the number of blocks in the array. Implements gbd's
+ * total_blocks().
+ *
+ * @param gbd Pointer to the gbd of the array.
+ *
+ * @return Number of blocks.
+ */
+static uint32_t raid_total_blocks(gbd_t *gbd)
+{
+    raid_real_device_t *raid = gbd->device->real_device;
+    return raid->total_blocks;
+}
+
+/** @} */
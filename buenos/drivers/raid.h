@@ -0,0 +1,64 @@
+/*
+ * Striping and mirroring meta block device.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef DRIVERS_RAID_H
+#define DRIVERS_RAID_H
+
+#include "lib/libc.h"
+#include "kernel/spinlock.h"
+#include "kernel/semaphore.h"
+#include "drivers/device.h"
+#include "drivers/gbd.h"
+
+/* Supported array levels */
+#define RAID_LEVEL_STRIPE 0
+#define RAID_LEVEL_MIRROR 1
+
+/* Maximum number of member devices in one array */
+#define RAID_MAX_MEMBERS 4
+
+/* Maximum number of member requests the service thread keeps in
+   flight on behalf of asynchronous callers */
+#define RAID_MAX_INFLIGHT 16
+
+/* Internal data structure for the RAID driver. */
+typedef struct {
+    /* One of RAID_LEVEL_* */
+    int level;
+
+    /* Member devices and their count */
+    gbd_t *members[RAID_MAX_MEMBERS];
+    int nmembers;
+
+    /* Member requests currently queued on each member. Used to pick
+       the least loaded mirror for reads. Protected by slock. */
+    int inflight[RAID_MAX_MEMBERS];
+
+    /* Block size shared by all members and the array size in blocks */
+    uint32_t block_size;
+    uint32_t total_blocks;
+
+    /* Protects the fields below and inflight[] */
+    spinlock_t slock;
+
+    /* Asynchronous requests waiting for the service thread */
+    gbd_request_t *async_queue;
+
+    /* Raised once for every request put to async_queue */
+    semaphore_t *async_pending;
+
+    /* Raised by the member devices when a member request issued by
+       the service thread completes */
+    semaphore_t *member_done;
+
+    /* Member request descriptors used by the service thread */
+    gbd_request_t member_reqs[RAID_MAX_INFLIGHT];
+} raid_real_device_t;
+
+/* functions */
+gbd_t *raid_create(int level, gbd_t **members, int nmembers);
+
+#endif /* DRIVERS_RAID_H */
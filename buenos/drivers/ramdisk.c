@@ -0,0 +1,221 @@
+/*
+ * Memory backed block device.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#include "kernel/assert.h"
+#include "lib/libc.h"
+#include "vm/pagepool.h"
+#include "drivers/device.h"
+#include "drivers/yams.h"
+#include "drivers/gbd.h"
+#include "drivers/ramdisk.h"
+
+
+/**@name RAM disk
+ *
+ * This module implements a generic block device whose blocks are kept
+ * in page frames taken from the page pool. Requests are served by
+ * copying between the frame and the request buffer in the calling
+ * thread, so they are complete when read_block() or write_block()
+ * returns. Asynchronous callers get their semaphore raised before the
+ * call returns.
+ *
+ * A RAM disk is empty (all zeros) when created and its contents are
+ * lost at shutdown.
+ *
+ * @{
+ */
+
+static int ramdisk_read_block(gbd_t *gbd, gbd_request_t *request);
+static int ramdisk_write_block(gbd_t *gbd, gbd_request_t *request);
+static uint32_t ramdisk_block_size(gbd_t *gbd);
+static uint32_t ramdisk_total_blocks(gbd_t *gbd);
+
+
+/**
+ * Creates a RAM disk. One page holds the device structures and the
+ * frame table, which limits the size of the disk to a bit less than
+ * a thousand frames.
+ *
+ * @param blocks Size of the disk in RAMDISK_BLOCK_SIZE byte blocks.
+ *
+ * @return The generic block device of the disk, NULL if the size is
+ * invalid or there is not enough memory.
+ */
+gbd_t *ramdisk_create(uint32_t blocks)
+{
+    uint32_t addr, frame;
+    device_t *dev;
+    gbd_t *gbd;
+    ramdisk_real_device_t *ram;
+    uint32_t nframes, maxframes, i;
+
+    nframes = (blocks + RAMDISK_BLOCKS_PER_FRAME - 1)
+	/ RAMDISK_BLOCKS_PER_FRAME;
+    maxframes = (PAGE_SIZE - sizeof(device_t) - sizeof(gbd_t)
+		 - sizeof(ramdisk_real_device_t)) / sizeof(uint32_t);
+    if (blocks == 0 || nframes > maxframes)
+	return NULL;
+
+    addr = pagepool_get_phys_page();
+    if (addr == 0)
+	return NULL;
+    addr = ADDR_PHYS_TO_KERNEL(addr);
+
+    dev = (device_t *)addr;
+    gbd = (gbd_t *)(addr + sizeof(device_t));
+    ram = (ramdisk_real_device_t *)(addr + sizeof(device_t) + sizeof(gbd_t));
+    ram->frames = (uint32_t *)((uint32_t)ram + sizeof(ramdisk_real_device_t));
+
+    for (i = 0; i < nframes; i++) {
+	frame = pagepool_get_phys_page();
+	if (frame == 0) {
+	    while (i > 0)
+		pagepool_free_phys_page(ram->frames[--i]);
+	    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+	    return NULL;
+	}
+	memoryset((void *)ADDR_PHYS_TO_KERNEL(frame), 0, PAGE_SIZE);
+	ram->frames[i] = frame;
+    }
+
+    ram->total_blocks = blocks;
+    ram->nframes = nframes;
+
+    /* There is no YAMS device behind a RAM disk. */
+    dev->real_device = ram;
+    dev->generic_device = gbd;
+    dev->descriptor = NULL;
+    dev->io_address = 0;
+    dev->type = YAMS_TYPECODE_DISK;
+
+    gbd->device = dev;
+    gbd->read_block = ramdisk_read_block;
+    gbd->write_block = ramdisk_write_block;
+    gbd->block_size = ramdisk_block_size;
+    gbd->total_blocks = ramdisk_total_blocks;
+
+    return gbd;
+}
+
+
+/**
+ * Returns the kernel address of a block of a RAM disk.
+ *
+ * @param ram The RAM disk.
+ *
+ * @param block Block number, must be valid.
+ *
+ * @return Kernel (segmented) address of the block.
+ */
+static uint32_t ramdisk_block_address(ramdisk_real_device_t *ram,
+				      uint32_t block)
+{
+    return ADDR_PHYS_TO_KERNEL(ram->frames[block / RAMDISK_BLOCKS_PER_FRAME])
+	+ (block % RAMDISK_BLOCKS_PER_FRAME) * RAMDISK_BLOCK_SIZE;
+}
+
+
+/**
+ * Serves a request by copying the block. Completes the request
+ * before returning, also for asynchronous requests.
+ *
+ * @param gbd The RAM disk.
+ *
+ * @param request The request, operation already set.
+ *
+ * @return 1 if success, 0 if the block number is out of range.
+ */
+static int ramdisk_serve(gbd_t *gbd, gbd_request_t *request)
+{
+    ramdisk_real_device_t *ram = gbd->device->real_device;
+    uint32_t block;
+
+    request->internal = NULL;
+    request->next = NULL;
+
+    if (request->block >= ram->total_blocks) {
+	request->return_value = -1;
+    } else {
+	block = ramdisk_block_address(ram, request->block);
+	if (request->operation == GBD_OPERATION_READ)
+	    memcopy(RAMDISK_BLOCK_SIZE,
+		    (void *)ADDR_PHYS_TO_KERNEL(request->buf), (void *)block);
+	else
+	    memcopy(RAMDISK_BLOCK_SIZE,
+		    (void *)block, (void *)ADDR_PHYS_TO_KERNEL(request->buf));
+	request->return_value = 0;
+    }
+
+    if (request->sem != NULL) {
+	semaphore_V(request->sem);
+	return 1;
+    }
+
+    return (request->return_value == 0);
+}
+
+
+/**
+ * Reads one block from the RAM disk. Implements gbd's read_block().
+ *
+ * @param gbd Pointer to the gbd of the RAM disk.
+ *
+ * @param request Request describing the block to read.
+ *
+ * @return 1 if success, 0 otherwise
+ */
+static int ramdisk_read_block(gbd_t *gbd, gbd_request_t *request)
+{
+    request->operation = GBD_OPERATION_READ;
+    return ramdisk_serve(gbd, request);
+}
+
+
+/**
+ * Writes one block to the RAM disk. Implements gbd's write_block().
+ *
+ * @param gbd Pointer to the gbd of the RAM disk.
+ *
+ * @param request Request describing the block to write.
+ *
+ * @return 1 if success, 0 otherwise
+ */
+static int ramdisk_write_block(gbd_t *gbd, gbd_request_t *request)
+{
+    request->operation = GBD_OPERATION_WRITE;
+    return ramdisk_serve(gbd, request);
+}
+
+
+/**
+ * Returns the block size of RAM disks. Implements gbd's block_size().
+ *
+ * @param gbd Pointer to the gbd of the RAM disk.
+ *
+ * @return Block size in bytes.
+ */
+static uint32_t ramdisk_block_size(gbd_t *gbd)
+{
+    gbd = gbd; /* All RAM disks have the same block size. */
+    return RAMDISK_BLOCK_SIZE;
+}
+
+
+/**
+ * Returns the size of a RAM disk in blocks. Implements gbd's
+ * total_blocks().
+ *
+ * @param gbd Pointer to the gbd of the RAM disk.
+ *
+ * @return Number of blocks.
+ */
+static uint32_t ramdisk_total_blocks(gbd_t *gbd)
+{
+    ramdisk_real_device_t *ram = gbd->device->real_device;
+    return ram->total_blocks;
+}
+
+/** @} */
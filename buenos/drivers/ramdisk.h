@@ -0,0 +1,35 @@
+/*
+ * Memory backed block device.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef DRIVERS_RAMDISK_H
+#define DRIVERS_RAMDISK_H
+
+#include "lib/libc.h"
+#include "drivers/device.h"
+#include "drivers/gbd.h"
+#include "drivers/yams.h"
+
+/* Block size of RAM disks. Equal to TFS and FAT32 block size. */
+#define RAMDISK_BLOCK_SIZE 512
+
+/* Blocks stored in one page frame */
+#define RAMDISK_BLOCKS_PER_FRAME (PAGE_SIZE / RAMDISK_BLOCK_SIZE)
+
+/* Internal data structure for the RAM disk driver. The frame table
+   follows it in the same page. */
+typedef struct {
+    /* Number of blocks and of page frames holding them */
+    uint32_t total_blocks;
+    uint32_t nframes;
+
+    /* Physical addresses of the frames, nframes entries */
+    uint32_t *frames;
+} ramdisk_real_device_t;
+
+/* functions */
+gbd_t *ramdisk_create(uint32_t blocks);
+
+#endif /* DRIVERS_RAMDISK_H */
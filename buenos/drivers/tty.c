@@ -55,6 +55,7 @@
 
 static int tty_write(gcd_t *gcd, const void *buf, int len);
 static int tty_read(gcd_t *gcd, void *buf, int len);
+static int tty_poll(gcd_t *gcd, pollq_t **pollq);
 
 /* We need this spinlock so that we can synchronise with the polling
  * tty drivers writes, since this driver cannot be used in some parts
@@ -92,6 +93,7 @@ device_t *tty_init(io_descriptor_t *desc) {
     gcd->device = dev;
     gcd->write  = tty_write;
     gcd->read   = tty_read;
+    gcd->poll   = tty_poll;
 
     tty_rd = kmalloc(sizeof(tty_real_device_t));
     if(tty_rd == NULL)
@@ -118,6 +120,8 @@ device_t *tty_init(io_descriptor_t *desc) {
     tty_rd->read_head = 0;
     tty_rd->read_count = 0;
 
+    pollq_init(&tty_rd->pollq);
+
     irq_mask = 1 << (desc->irq + 10);
     interrupt_register(irq_mask, tty_interrupt_handle, dev);
 
@@ -151,8 +155,10 @@ void tty_interrupt_handle(device_t *device) {
         }
         iobase->command = TTY_COMMAND_WIRQE;
 
-        if (tty_rd->write_count == 0)
+        if (tty_rd->write_count == 0) {
             sleepq_wake_all((void *)tty_rd->write_buf);
+            poll_notify((pollq_t *)&tty_rd->pollq);
+        }
 
 	spinlock_release(tty_rd->slock);
     }
@@ -180,6 +186,7 @@ void tty_interrupt_handle(device_t *device) {
 
         spinlock_release(tty_rd->slock);
         sleepq_wake_all((void *)tty_rd->read_buf);
+        poll_notify((pollq_t *)&tty_rd->pollq);
 
     }
 }
@@ -290,4 +297,38 @@ static int tty_read(gcd_t *gcd, void *buf, int len)
     return i;
 }
 
+
+/**
+ * Tells which of reading and writing the tty-device pointed by gcd
+ * can do without blocking. Implements poll from the gcd interface.
+ *
+ * @param gcd Pointer to the tty-device.
+ * @param pollq The pollq of the device is stored here.
+ *
+ * @return POLL_IN if there is input, POLL_OUT if the write buffer is
+ * empty.
+ */
+static int tty_poll(gcd_t *gcd, pollq_t **pollq)
+{
+    interrupt_status_t intr_status;
+    volatile tty_real_device_t *tty_rd
+        = (tty_real_device_t *)gcd->device->real_device;
+    int events = 0;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(tty_rd->slock);
+
+    if (tty_rd->read_count > 0)
+        events |= POLL_IN;
+    if (tty_rd->write_count == 0)
+        events |= POLL_OUT;
+
+    spinlock_release(tty_rd->slock);
+    _interrupt_set_state(intr_status);
+
+    *pollq = (pollq_t *)&tty_rd->pollq;
+
+    return events;
+}
+
 /** @} */
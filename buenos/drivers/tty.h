@@ -40,6 +40,7 @@
 #include "kernel/spinlock.h"
 #include "drivers/gcd.h"
 #include "drivers/yams.h"
+#include "proc/poll.h"
 
 /* The structure of the YAMS TTY IO area */
 typedef struct {
@@ -98,6 +99,8 @@ typedef struct {
     char write_buf[TTY_BUF_SIZE]; /* write buffer */
     int write_head;               /* index to the beginning of data */
     int write_count;              /* number of chars in buffers */
+
+    pollq_t pollq;                /* notified when either buffer changes */
 } tty_real_device_t;
 
 
@@ -13,10 +13,51 @@
 int little_to_big_short(int);
 int little_to_big_int(int);
 
+/**@name FAT32 filesystem
+ *
+ * Read and overwrite support for files in the root directory of a
+ * FAT32 volume. Files are found by their long name, if it is plain
+ * ASCII, or by their 8.3 name; both are compared case-insensitively.
+ * Creating, removing and resizing files is not supported.
+ *
+ * Walking a cluster chain costs one FAT lookup per cluster, so FAT
+ * sectors are cached and every open file remembers the runs of
+ * consecutive clusters found so far. Reading at offset N then only
+ * walks the part of the chain not seen before. Consecutive sectors
+ * are transferred as one batch of requests submitted together, so
+ * the disk can serve them back to back.
+ *
+ * @{
+ */
+
+/* A run of consecutive clusters of a file. */
 typedef struct {
-    /* Reference to the boot secter headers */
-    fat32_BPP_struct *fat32_BPP;
+    /* Index of the first cluster of the run inside the file */
+    uint32_t index;
+
+    /* First cluster of the run and the number of clusters in it */
+    uint32_t start;
+    uint32_t length;
+} fat32_run_t;
 
+/* An open file. The same file opened many times shares one entry. */
+typedef struct {
+    /* Number of opens, zero if the entry is free */
+    int refs;
+
+    /* First cluster and size from the directory entry */
+    uint32_t first_cluster;
+    uint32_t size;
+
+    /* Runs of the cluster chain found so far, in file order. The
+       runs cover the chain from the start, except that when the
+       table is full, the last entry slides forward along the chain
+       instead of growing the table. */
+    fat32_run_t runs[FAT32_CHAIN_RUNS];
+    int nruns;
+} fat32_file_t;
+
+typedef struct {
     /* Pointer to gbd device performing fat32 */
     gbd_t          *disk;
 
@@ -24,82 +65,597 @@ typedef struct {
        one operation at a time in any case) */
     semaphore_t    *lock;
 
+    /* Signaled by the disk when a request of a batch completes */
+    semaphore_t    *io_sem;
+
     unsigned long fat_begin_lba;
     unsigned long cluster_begin_lba;
     unsigned char sectors_per_cluster;
     unsigned long root_dir_first_cluster;
 
+    /* Number of data clusters and the FSInfo sector */
+    uint32_t total_clusters;
+    uint32_t fsinfo_sector;
+
+    /* Open files, indexed by fileid */
+    fat32_file_t files[FAT32_MAX_FILES];
+
+    /* FAT sector held in each fat_cache slot (zero if none) and the
+       slot to replace next */
+    uint32_t fat_sector[FAT32_FAT_CACHE];
+    int fat_victim;
+
+    /* Requests of the current batch */
+    gbd_request_t reqs[FAT32_IO_SECTORS];
+
+    /* Buffers: one sector for directory and boot sectors, the FAT
+       cache and the staging area for batched transfers. */
+    uint8_t *buffer;
+    uint8_t *fat_cache;
+    uint8_t *io_buffer;
 } fat32_t;
 
+/**
+ * Reads a little endian 16-bit value.
+ *
+ * @param p Address of the value, no alignment required.
+ *
+ * @return The value.
+ */
+static uint32_t fat32_le16(uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
 
-fs_t * fat32_init(gbd_t *disk) {
-    uint32_t addr;
+/**
+ * Reads a little endian 32-bit value.
+ *
+ * @param p Address of the value, no alignment required.
+ *
+ * @return The value.
+ */
+static uint32_t fat32_le32(uint8_t *p) {
+    return fat32_le16(p) | (fat32_le16(p + 2) << 16);
+}
+
+/**
+ * Reads one sector synchronously.
+ *
+ * @param fat32 The filesystem.
+ * @param sector Sector number.
+ * @param buf Kernel address of the buffer.
+ *
+ * @return Non-zero on success, zero on error.
+ */
+static int fat32_read_sector(fat32_t *fat32, uint32_t sector, uint8_t *buf) {
     gbd_request_t req;
+
+    req.block = sector;
+    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)buf);
+    req.sem = NULL;
+    return fat32->disk->read_block(fat32->disk, &req);
+}
+
+/**
+ * Transfers consecutive sectors between the disk and io_buffer. All
+ * requests are submitted before waiting for any of them.
+ *
+ * @param fat32 The filesystem.
+ * @param sector First sector.
+ * @param slot Sector sized slot of io_buffer for the first sector.
+ * @param count Number of sectors, slot + count at most
+ * FAT32_IO_SECTORS.
+ * @param write Non-zero to write, zero to read.
+ *
+ * @return Non-zero if every transfer succeeded, zero otherwise.
+ */
+static int fat32_transfer(fat32_t *fat32, uint32_t sector, int slot,
+                          int count, int write) {
+    gbd_t *disk = fat32->disk;
+    gbd_request_t *req;
+    int issued, i;
+    int ok = 1;
+
+    for(issued = 0; issued < count; issued++) {
+        req = &fat32->reqs[issued];
+        req->block = sector + issued;
+        req->buf = ADDR_KERNEL_TO_PHYS((uint32_t)fat32->io_buffer) +
+            (slot + issued) * FAT32_BLOCK_SIZE;
+        req->sem = fat32->io_sem;
+
+        if(write)
+            i = disk->write_block(disk, req);
+        else
+            i = disk->read_block(disk, req);
+        if(i == 0) {
+            ok = 0;
+            break;
+        }
+    }
+
+    for(i = 0; i < issued; i++) {
+        semaphore_P(fat32->io_sem);
+    }
+
+    for(i = 0; i < issued; i++) {
+        if(fat32->reqs[i].return_value != 0)
+            ok = 0;
+    }
+
+    return ok;
+}
+
+/**
+ * Looks up the FAT entry of a cluster, reading the FAT sector into
+ * the cache if needed.
+ *
+ * @param fat32 The filesystem.
+ * @param cluster The cluster.
+ *
+ * @return The next cluster of the chain, a value of at least
+ * FAT32_EOC at the end of the chain, or zero on error.
+ */
+static uint32_t fat32_next_cluster(fat32_t *fat32, uint32_t cluster) {
+    uint32_t sector = fat32->fat_begin_lba +
+        cluster / (FAT32_BLOCK_SIZE / 4);
+    uint32_t offset = (cluster % (FAT32_BLOCK_SIZE / 4)) * 4;
+    uint8_t *data;
+    int slot;
+
+    for(slot = 0; slot < FAT32_FAT_CACHE; slot++) {
+        if(fat32->fat_sector[slot] == sector)
+            break;
+    }
+
+    if(slot == FAT32_FAT_CACHE) {
+        slot = fat32->fat_victim;
+        fat32->fat_victim = (slot + 1) % FAT32_FAT_CACHE;
+
+        fat32->fat_sector[slot] = 0;
+        if(!fat32_read_sector(fat32, sector,
+                              fat32->fat_cache + slot * FAT32_BLOCK_SIZE))
+            return 0;
+        fat32->fat_sector[slot] = sector;
+    }
+
+    data = fat32->fat_cache + slot * FAT32_BLOCK_SIZE;
+    return fat32_le32(data + offset) & FAT32_CLUSTER_MASK;
+}
+
+/**
+ * Is the given value a cluster of the data area?
+ */
+static int fat32_valid_cluster(fat32_t *fat32, uint32_t cluster) {
+    return cluster >= 2 && cluster < fat32->total_clusters + 2;
+}
+
+/**
+ * Finds the run of a file containing the given cluster of the file.
+ * Walks the FAT only beyond what has been walked before.
+ *
+ * @param fat32 The filesystem.
+ * @param file The open file.
+ * @param index Index of the cluster inside the file.
+ *
+ * @return The run, or NULL if the chain is broken or shorter than
+ * index.
+ */
+static fat32_run_t *fat32_find_run(fat32_t *fat32, fat32_file_t *file,
+                                   uint32_t index) {
+    fat32_run_t *run, *prev;
+    uint32_t last, next;
+    int i;
+
+    for(i = 0; i < file->nruns; i++) {
+        run = &file->runs[i];
+        if(index >= run->index && index < run->index + run->length)
+            return run;
+    }
+
+    if(file->nruns == 0) {
+        if(!fat32_valid_cluster(fat32, file->first_cluster))
+            return NULL;
+        file->runs[0].index = 0;
+        file->runs[0].start = file->first_cluster;
+        file->runs[0].length = 1;
+        file->nruns = 1;
+    } else if(index < file->runs[file->nruns - 1].index) {
+        /* Behind the sliding last run, restart it where the fixed
+           runs end. */
+        prev = &file->runs[file->nruns - 2];
+        next = fat32_next_cluster(fat32, prev->start + prev->length - 1);
+        if(!fat32_valid_cluster(fat32, next))
+            return NULL;
+        run = &file->runs[file->nruns - 1];
+        run->index = prev->index + prev->length;
+        run->start = next;
+        run->length = 1;
+    }
+
+    while(1) {
+        run = &file->runs[file->nruns - 1];
+        if(index < run->index + run->length)
+            return run;
+
+        last = run->start + run->length - 1;
+        next = fat32_next_cluster(fat32, last);
+        if(!fat32_valid_cluster(fat32, next))
+            return NULL;
+
+        if(next == last + 1) {
+            run->length++;
+            continue;
+        }
+
+        if(file->nruns < FAT32_CHAIN_RUNS)
+            file->nruns++;
+        file->runs[file->nruns - 1].index = run->index + run->length;
+        file->runs[file->nruns - 1].start = next;
+        file->runs[file->nruns - 1].length = 1;
+    }
+}
+
+/**
+ * Reads or writes part of an open file. Transfers stop at the end of
+ * the file. Each batch covers consecutive sectors of one run.
+ *
+ * @param fat32 The filesystem.
+ * @param file The open file.
+ * @param buffer Buffer to read into or write from.
+ * @param size Number of bytes.
+ * @param offset Offset in the file.
+ * @param write Non-zero to write, zero to read.
+ *
+ * @return Number of bytes transferred, or VFS_ERROR.
+ */
+static int fat32_rw(fat32_t *fat32, fat32_file_t *file, uint8_t *buffer,
+                    int size, int offset, int write) {
+    uint32_t cluster_size = fat32->sectors_per_cluster * FAT32_BLOCK_SIZE;
+    uint32_t pos, in_cluster, sector, available;
+    fat32_run_t *run;
+    int done = 0;
+    int skip, count, n;
+
+    if(offset < 0 || offset > (int)file->size)
+        return VFS_ERROR;
+
+    size = MIN(size, (int)file->size - offset);
+
+    while(done < size) {
+        pos = offset + done;
+        run = fat32_find_run(fat32, file, pos / cluster_size);
+        if(run == NULL)
+            return VFS_ERROR;
+
+        /* Sectors left in the run from pos on */
+        in_cluster = pos % cluster_size;
+        sector = fat32->cluster_begin_lba +
+            (run->start - 2 + pos / cluster_size - run->index) *
+            fat32->sectors_per_cluster + in_cluster / FAT32_BLOCK_SIZE;
+        available = (run->index + run->length - pos / cluster_size) *
+            fat32->sectors_per_cluster - in_cluster / FAT32_BLOCK_SIZE;
+
+        skip = pos % FAT32_BLOCK_SIZE;
+        count = (skip + (size - done) + FAT32_BLOCK_SIZE - 1) /
+            FAT32_BLOCK_SIZE;
+        count = MIN(count, (int)MIN(available, FAT32_IO_SECTORS));
+        n = MIN(count * FAT32_BLOCK_SIZE - skip, size - done);
+
+        if(write) {
+            /* Partially overwritten sectors at either end of the batch
+               must be read first. */
+            if((skip != 0 ||
+                (count == 1 && (skip + n) % FAT32_BLOCK_SIZE != 0)) &&
+               !fat32_transfer(fat32, sector, 0, 1, 0))
+                return VFS_ERROR;
+            if(count > 1 && (skip + n) % FAT32_BLOCK_SIZE != 0 &&
+               !fat32_transfer(fat32, sector + count - 1, count - 1, 1, 0))
+                return VFS_ERROR;
+
+            memcopy(n, fat32->io_buffer + skip, buffer + done);
+            if(!fat32_transfer(fat32, sector, 0, count, 1))
+                return VFS_ERROR;
+        } else {
+            if(!fat32_transfer(fat32, sector, 0, count, 0))
+                return VFS_ERROR;
+            memcopy(n, buffer + done, fat32->io_buffer + skip);
+        }
+
+        done += n;
+    }
+
+    return done;
+}
+
+/**
+ * Upper case version of an ASCII character.
+ */
+static char fat32_toupper(char c) {
+    if(c >= 'a' && c <= 'z')
+        return c - 'a' + 'A';
+    return c;
+}
+
+/**
+ * Converts a file name to the padded 11 character form used in
+ * directory entries.
+ *
+ * @param filename The name.
+ * @param shortname Buffer of 11 characters for the result.
+ *
+ * @return Non-zero if the name has an 8.3 form, zero otherwise.
+ */
+static int fat32_shortname(char *filename, char *shortname) {
+    int i, j;
+
+    for(i = 0; i < 11; i++)
+        shortname[i] = ' ';
+
+    for(i = 0; filename[i] != '\0' && filename[i] != '.'; i++) {
+        if(i >= 8)
+            return 0;
+        shortname[i] = fat32_toupper(filename[i]);
+    }
+
+    if(filename[i] == '.') {
+        for(j = 0, i++; filename[i] != '\0'; i++, j++) {
+            if(j >= 3 || filename[i] == '.')
+                return 0;
+            shortname[8 + j] = fat32_toupper(filename[i]);
+        }
+    }
+
+    return i > 0;
+}
+
+/**
+ * Compares the name of a directory entry to an 11 character name.
+ */
+static int fat32_shortcmp(uint8_t *entry, char *shortname) {
+    int i;
+
+    for(i = 0; i < 11; i++) {
+        if(entry[FAT32_DIR_NAME + i] != (uint8_t)shortname[i])
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Compares two names ignoring case.
+ */
+static int fat32_namecmp(char *a, char *b) {
+    while(*a != '\0' && fat32_toupper(*a) == fat32_toupper(*b)) {
+        a++;
+        b++;
+    }
+    return fat32_toupper(*a) - fat32_toupper(*b);
+}
+
+/**
+ * Long file name characters stored in one entry: offsets of the
+ * 13 UTF-16 characters.
+ */
+static const uint8_t fat32_lfn_offsets[13] =
+    {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+/**
+ * Searches the root directory for a file.
+ *
+ * @param fat32 The filesystem.
+ * @param filename Name of the file.
+ * @param first_cluster The first cluster of the file is stored here.
+ * @param size The size of the file is stored here.
+ *
+ * @return VFS_OK, VFS_NOT_FOUND or VFS_ERROR.
+ */
+static int fat32_lookup(fat32_t *fat32, char *filename,
+                        uint32_t *first_cluster, uint32_t *size) {
+    /* Long names longer than VFS names can never match, so only the
+       first two long name entries are collected. */
+    char lfn[2 * 13 + 1];
+    int lfn_ok = 0;
+    uint8_t lfn_sum = 0;
+    char shortname[11];
+    int has_short = fat32_shortname(filename, shortname);
+    uint32_t cluster = fat32->root_dir_first_cluster;
+    uint32_t clusters = 0;
+    uint8_t *entry;
+    uint8_t sum;
+    uint32_t s, c;
+    int e, i, seq;
+
+    while(fat32_valid_cluster(fat32, cluster)) {
+        for(s = 0; s < fat32->sectors_per_cluster; s++) {
+            if(!fat32_read_sector(fat32, fat32->cluster_begin_lba +
+                                  (cluster - 2) * fat32->sectors_per_cluster +
+                                  s, fat32->buffer))
+                return VFS_ERROR;
+
+            for(e = 0; e < FAT32_BLOCK_SIZE / FAT32_DIRENTRY_SIZE; e++) {
+                entry = fat32->buffer + e * FAT32_DIRENTRY_SIZE;
+
+                if(entry[FAT32_DIR_NAME] == FAT32_DIR_END)
+                    return VFS_NOT_FOUND;
+                if(entry[FAT32_DIR_NAME] == FAT32_DIR_DELETED) {
+                    lfn_ok = 0;
+                    continue;
+                }
+
+                if(entry[FAT32_DIR_ATTR] == FAT32_ATTR_LFN) {
+                    seq = entry[FAT32_DIR_NAME] & 0x1f;
+                    if(entry[FAT32_DIR_NAME] & FAT32_LFN_LAST) {
+                        memoryset(lfn, 0, sizeof(lfn));
+                        lfn_sum = entry[FAT32_DIR_LFN_SUM];
+                        lfn_ok = (seq >= 1 && seq <= 2);
+                    }
+                    if(!lfn_ok || seq < 1 || seq > 2 ||
+                       entry[FAT32_DIR_LFN_SUM] != lfn_sum) {
+                        lfn_ok = 0;
+                        continue;
+                    }
+                    for(i = 0; i < 13; i++) {
+                        c = fat32_le16(entry + fat32_lfn_offsets[i]);
+                        if(c == 0 || c == 0xffff)
+                            break;
+                        if(c > 0x7f)
+                            lfn_ok = 0;
+                        lfn[(seq - 1) * 13 + i] = c;
+                    }
+                    continue;
+                }
+
+                if(entry[FAT32_DIR_ATTR] &
+                   (FAT32_ATTR_VOLUME_ID | FAT32_ATTR_DIRECTORY)) {
+                    lfn_ok = 0;
+                    continue;
+                }
+
+                /* A long name belongs to this entry only if the
+                   checksum of the short name matches. */
+                sum = 0;
+                for(i = 0; i < 11; i++)
+                    sum = ((sum & 1) << 7) + (sum >> 1) +
+                        entry[FAT32_DIR_NAME + i];
+
+                if((lfn_ok && sum == lfn_sum &&
+                    fat32_namecmp(lfn, filename) == 0) ||
+                   (has_short && fat32_shortcmp(entry, shortname) == 0)) {
+                    *first_cluster =
+                        (fat32_le16(entry + FAT32_DIR_CLUS_HI) << 16) |
+                        fat32_le16(entry + FAT32_DIR_CLUS_LO);
+                    *size = fat32_le32(entry + FAT32_DIR_SIZE);
+                    return VFS_OK;
+                }
+                lfn_ok = 0;
+            }
+        }
+
+        /* Guard against loops in a corrupted chain */
+        if(++clusters > fat32->total_clusters)
+            return VFS_ERROR;
+
+        cluster = fat32_next_cluster(fat32, cluster);
+    }
+
+    return cluster >= FAT32_EOC ? VFS_NOT_FOUND : VFS_ERROR;
+}
+
+
+
+
+/**
+ * Releases what fat32_init() has allocated so far.
+ *
+ * @param sem The lock semaphore, or NULL.
+ * @param io_sem The batch semaphore, or NULL.
+ * @param pages Kernel addresses of the pages, zero if not allocated.
+ */
+static void fat32_init_cleanup(semaphore_t *sem, semaphore_t *io_sem,
+                               uint32_t *pages) {
+    int i;
+
+    if(sem != NULL)
+        semaphore_destroy(sem);
+    if(io_sem != NULL)
+        semaphore_destroy(io_sem);
+
+    for(i = 0; i < 3; i++) {
+        if(pages[i] != 0)
+            pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(pages[i]));
+    }
+}
+
+/**
+ * Initializes FAT32. Allocates one page for the filesystem data
+ * structures and the sector buffer, one for the FAT cache and one
+ * for batched transfers.
+ *
+ * @param disk Pointer to gbd-device performing fat32.
+ *
+ * @return Pointer to the filesystem data structure fs_t, or NULL if
+ * the disk does not contain a FAT32 volume or memory ran out.
+ */
+fs_t * fat32_init(gbd_t *disk) {
+    uint32_t pages[3] = {0, 0, 0};
     fs_t *fs;
     fat32_t *fat32;
     fat32_BPP_struct *fat32_BPP;
-    int r;
-    semaphore_t *sem;
+    semaphore_t *sem, *io_sem;
+    uint32_t total_sectors;
+    int i;
 
     if(disk->block_size(disk) != FAT32_BLOCK_SIZE)
         return NULL;
 
     /* check semaphore availability before memory allocation */
     sem = semaphore_create(1);
-    if (sem == NULL) {
+    io_sem = semaphore_create(0);
+    if (sem == NULL || io_sem == NULL) {
+        fat32_init_cleanup(sem, io_sem, pages);
         kprintf("fat32_init: could not create a new semaphore.\n");
         return NULL;
     }
 
-    addr = pagepool_get_phys_page();
-    if(addr == 0) {
-        semaphore_destroy(sem);
-        kprintf("fat32_init: could not allocate memory.\n");
-        return NULL;
+    for(i = 0; i < 3; i++) {
+        pages[i] = pagepool_get_phys_page();
+        if(pages[i] == 0) {
+            fat32_init_cleanup(sem, io_sem, pages);
+            kprintf("fat32_init: could not allocate memory.\n");
+            return NULL;
+        }
+        pages[i] = ADDR_PHYS_TO_KERNEL(pages[i]); /* transform to vm address */
     }
-    addr = ADDR_PHYS_TO_KERNEL(addr);      /* transform to vm address */
-
 
     /* Assert that one page is enough */
-    KERNEL_ASSERT(PAGE_SIZE >= (3*FAT32_BLOCK_SIZE+sizeof(fat32_BPP_struct)+sizeof(fat32_t)+sizeof(fs_t)));
+    KERNEL_ASSERT(PAGE_SIZE >= (FAT32_BLOCK_SIZE+sizeof(fat32_t)+sizeof(fs_t)));
 
     /* Assert that the struct size is a multiple of 4 */
     KERNEL_ASSERT(sizeof(fat32_BPP_struct) % 4 == 0);
-    
+
+    fs = (fs_t *)pages[0];
+    fat32 = (fat32_t *)(pages[0] + sizeof(fs_t));
+    memoryset(fat32, 0, sizeof(fat32_t));
+    fat32->buffer = (uint8_t *)(pages[0] + sizeof(fs_t) + sizeof(fat32_t));
+    fat32->fat_cache = (uint8_t *)pages[1];
+    fat32->io_buffer = (uint8_t *)pages[2];
+    fat32->disk = disk;
+
     /* Read header block, and make sure this is fat32 drive */
-    req.block = 0;
-    req.sem = NULL;
-    req.buf = ADDR_KERNEL_TO_PHYS(addr);   /* disk needs physical addr */
-    r = disk->read_block(disk, &req);
-    if(r == 0) {
-        semaphore_destroy(sem);
-        pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+    if(!fat32_read_sector(fat32, 0, fat32->buffer)) {
+        fat32_init_cleanup(sem, io_sem, pages);
         kprintf("fat32_init: Error during disk read. Initialization failed.\n");
-        return NULL; 
+        return NULL;
     }
-    short *fat32_magic = (short*) (addr + 510);
 
-    if(*fat32_magic != 0x55aa) {
-        semaphore_destroy(sem);
-        pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+    fat32_BPP = (fat32_BPP_struct *)fat32->buffer;
+    if(((fat32->buffer[510] << 8) | fat32->buffer[511]) != FAT32_MAGIC ||
+       little_to_big_short(fat32_BPP->BPB_BytsPerSec) != FAT32_BLOCK_SIZE ||
+       fat32_BPP->BPB_SecPerClus == 0 || fat32_BPP->BPB_FATSz16 != 0 ||
+       fat32_BPP->BPB_FATSz32 == 0) {
+        /* Not FAT32, or a geometry we do not handle */
+        fat32_init_cleanup(sem, io_sem, pages);
         return NULL;
     }
 
-    fat32_BPP  = (fat32_BPP_struct *)addr;
-    fat32 = (void *) (addr + sizeof(fat32_BPP_struct));
-    fs = (fs_t *) (addr + sizeof(fat32_BPP_struct) + sizeof(fat32_t *));
-
-    /* save the semaphore to the fat32_t */
+    /* save the semaphores to the fat32_t */
     fat32->lock = sem;
+    fat32->io_sem = io_sem;
 
-    fat32->disk = disk;
-    fat32->fat32_BPP = fat32_BPP;
     fat32->fat_begin_lba = little_to_big_short(fat32_BPP->BPB_RsvdSecCnt);
     fat32->cluster_begin_lba =
         little_to_big_short(fat32_BPP->BPB_RsvdSecCnt) +
         (fat32_BPP->BPB_NumFATs * little_to_big_int(fat32_BPP->BPB_FATSz32));
     fat32->sectors_per_cluster = fat32_BPP->BPB_SecPerClus;
     fat32->root_dir_first_cluster = little_to_big_int(fat32_BPP->BPB_RootClus);
+    fat32->fsinfo_sector = little_to_big_short(fat32_BPP->BPB_FSInfo);
+
+    total_sectors = little_to_big_short(fat32_BPP->BPB_TotSec16);
+    if(total_sectors == 0)
+        total_sectors = little_to_big_int(fat32_BPP->BPB_TotSec32);
+    total_sectors = MIN(total_sectors, disk->total_blocks(disk));
+    if(total_sectors > fat32->cluster_begin_lba)
+        fat32->total_clusters = (total_sectors - fat32->cluster_begin_lba) /
+            fat32->sectors_per_cluster;
 
     kprintf("fat_begin_lba: %x\n", fat32->fat_begin_lba);
     kprintf("cluster_begin_lba: %x\n", fat32->cluster_begin_lba);
@@ -118,6 +674,8 @@ fs_t * fat32_init(gbd_t *disk) {
     fs->read    = fat32_read;
     fs->write   = fat32_write;
     fs->getfree  = fat32_getfree;
+    fs->readahead = NULL;
+    fs->sync      = NULL;
 
     return fs;
 }
@@ -141,69 +699,233 @@ int little_to_big_int(int x) {
     return result;
 }
 
+/**
+ * Unmounts the filesystem. Implements fs.unmount(). Nothing is
+ * cached for writing, so only memory is released.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ *
+ * @return VFS_OK
+ */
 int fat32_unmount(fs_t *fs) {
     fat32_t *fat32;
+    uint32_t pages[3];
 
     fat32 = (fat32_t *)fs->internal;
 
     semaphore_P(fat32->lock); /* The semaphore should be free at this
       point, we get it just in case something has gone wrong. */
 
-    /* free semaphore and allocated memory */
-    semaphore_destroy(fat32->lock);
-    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)fs));
+    /* free semaphores and allocated memory */
+    pages[0] = (uint32_t)fs;
+    pages[1] = (uint32_t)fat32->fat_cache;
+    pages[2] = (uint32_t)fat32->io_buffer;
+    fat32_init_cleanup(fat32->lock, fat32->io_sem, pages);
     return VFS_OK;
 }
 
+/**
+ * Opens a file of the root directory. Implements fs.open(). Opens of
+ * the same file share one entry and its cluster run cache.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param filename Name of the file to be opened.
+ *
+ * @return File id, VFS_NOT_FOUND, VFS_LIMIT if too many files are
+ * open, or VFS_ERROR.
+ */
 int fat32_open(fs_t *fs, char *filename) {
-    fs = fs;
-    filename = filename;
-    return 0;
+    fat32_t *fat32 = (fat32_t *)fs->internal;
+    fat32_file_t *file;
+    uint32_t first_cluster, size;
+    int i, fileid = VFS_LIMIT;
+    int r;
+
+    semaphore_P(fat32->lock);
+
+    r = fat32_lookup(fat32, filename, &first_cluster, &size);
+    if(r != VFS_OK) {
+        semaphore_V(fat32->lock);
+        return r;
+    }
+
+    for(i = 0; i < FAT32_MAX_FILES; i++) {
+        file = &fat32->files[i];
+        if(file->refs > 0 && first_cluster != 0 &&
+           file->first_cluster == first_cluster) {
+            file->refs++;
+            semaphore_V(fat32->lock);
+            return i;
+        }
+        if(file->refs == 0 && fileid < 0)
+            fileid = i;
+    }
+
+    if(fileid >= 0) {
+        file = &fat32->files[fileid];
+        file->refs = 1;
+        file->first_cluster = first_cluster;
+        file->size = size;
+        file->nruns = 0;
+    }
+
+    semaphore_V(fat32->lock);
+    return fileid;
 }
 
+/**
+ * Returns the open file entry of a file id, or NULL if the id is not
+ * open.
+ */
+static fat32_file_t *fat32_get_file(fat32_t *fat32, int fileid) {
+    if(fileid < 0 || fileid >= FAT32_MAX_FILES ||
+       fat32->files[fileid].refs == 0)
+        return NULL;
+    return &fat32->files[fileid];
+}
+
+/**
+ * Closes a file. Implements fs.close().
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param fileid File id of the file.
+ *
+ * @return VFS_OK, or VFS_NOT_OPEN.
+ */
 int fat32_close(fs_t *fs, int fileid) {
-    fs = fs;
-    fileid = fileid;
+    fat32_t *fat32 = (fat32_t *)fs->internal;
+    fat32_file_t *file;
 
-    return 0;
+    semaphore_P(fat32->lock);
+
+    file = fat32_get_file(fat32, fileid);
+    if(file == NULL) {
+        semaphore_V(fat32->lock);
+        return VFS_NOT_OPEN;
+    }
+    file->refs--;
+
+    semaphore_V(fat32->lock);
+    return VFS_OK;
 }
 
+/**
+ * Creating files is not supported. Implements fs.create().
+ *
+ * @return VFS_NOT_SUPPORTED
+ */
 int fat32_create(fs_t *fs, char *filename, int size) {
     fs = fs;
     filename = filename;
     size = size;
 
-    return 0;
+    return VFS_NOT_SUPPORTED;
 }
 
+/**
+ * Removing files is not supported. Implements fs.remove().
+ *
+ * @return VFS_NOT_SUPPORTED
+ */
 int fat32_remove(fs_t *fs, char *filename) {
     fs = fs;
     filename = filename;
 
-    return 0;
+    return VFS_NOT_SUPPORTED;
 }
 
+/**
+ * Reads at most bufsize bytes from the file starting from offset.
+ * Implements fs.read().
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param fileid File id of the file.
+ * @param buffer Pointer to the buffer the data is read into.
+ * @param bufsize Maximum number of bytes to be read.
+ * @param offset Start position of reading.
+ *
+ * @return Number of bytes read into buffer, or a negative error code.
+ */
 int fat32_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset) {
-    fs = fs;
-    fileid = fileid;
-    buffer = buffer;
-    bufsize = bufsize;
-    offset = offset;
+    fat32_t *fat32 = (fat32_t *)fs->internal;
+    fat32_file_t *file;
+    int r;
 
-    return 0;
+    semaphore_P(fat32->lock);
+
+    file = fat32_get_file(fat32, fileid);
+    if(file == NULL)
+        r = VFS_NOT_OPEN;
+    else
+        r = fat32_rw(fat32, file, buffer, bufsize, offset, 0);
+
+    semaphore_V(fat32->lock);
+    return r;
 }
+
+/**
+ * Writes at most datasize bytes to the file starting from offset.
+ * Files are never extended, writing stops at the end of the file.
+ * Implements fs.write().
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param fileid File id of the file.
+ * @param buffer Pointer to the buffer the data is written from.
+ * @param datasize Maximum number of bytes to be written.
+ * @param offset Start position of writing.
+ *
+ * @return Number of bytes written, or a negative error code.
+ */
 int fat32_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset) {
-    fs = fs;
-    fileid = fileid;
-    buffer = buffer;
-    datasize = datasize;
-    offset = offset;
+    fat32_t *fat32 = (fat32_t *)fs->internal;
+    fat32_file_t *file;
+    int r;
 
-    return 0;
+    semaphore_P(fat32->lock);
+
+    file = fat32_get_file(fat32, fileid);
+    if(file == NULL)
+        r = VFS_NOT_OPEN;
+    else
+        r = fat32_rw(fat32, file, buffer, datasize, offset, 1);
+
+    semaphore_V(fat32->lock);
+    return r;
 }
 
+/**
+ * Returns the number of free bytes as recorded in the FSInfo sector.
+ * Implements fs.getfree().
+ *
+ * @param fs Pointer to fs data structure of the device.
+ *
+ * @return Number of free bytes, or VFS_NOT_SUPPORTED if the volume
+ * does not record it.
+ */
 int fat32_getfree(fs_t *fs) {
-    fs = fs;
+    fat32_t *fat32 = (fat32_t *)fs->internal;
+    uint32_t free;
+    int r = VFS_NOT_SUPPORTED;
+
+    semaphore_P(fat32->lock);
+
+    if(fat32->fsinfo_sector != 0 &&
+       fat32_read_sector(fat32, fat32->fsinfo_sector, fat32->buffer) &&
+       fat32_le32(fat32->buffer) == 0x41615252 &&
+       fat32_le32(fat32->buffer + 484) == 0x61417272) {
+        free = fat32_le32(fat32->buffer + 488);
+        if(free <= fat32->total_clusters) {
+            /* Saturate at the largest value we can return */
+            if(free > 0x7fffffff / (fat32->sectors_per_cluster *
+                                    FAT32_BLOCK_SIZE))
+                r = 0x7fffffff;
+            else
+                r = free * fat32->sectors_per_cluster * FAT32_BLOCK_SIZE;
+        }
+    }
 
-    return 0;
+    semaphore_V(fat32->lock);
+    return r;
 }
+
+/** @} */
@@ -8,6 +8,7 @@
 #define FS_FAT32_H
 
 #include "fs/filesystems.h"
+#include "drivers/yams.h"
 
 /* FAT32 sector size */
 #define FAT32_BLOCK_SIZE 512
@@ -15,6 +16,45 @@
 /* FAT32 magic */
 #define FAT32_MAGIC 0x55aa
 
+/* Number of FAT sectors kept in memory. They share one page. */
+#define FAT32_FAT_CACHE (PAGE_SIZE / FAT32_BLOCK_SIZE)
+
+/* Maximum number of sectors read or written with one batch of
+   requests. The batch is staged in one page. */
+#define FAT32_IO_SECTORS (PAGE_SIZE / FAT32_BLOCK_SIZE)
+
+/* Maximum number of distinct files open at the same time */
+#define FAT32_MAX_FILES 16
+
+/* Number of cluster runs remembered for each open file */
+#define FAT32_CHAIN_RUNS 8
+
+/* Directory entry layout */
+#define FAT32_DIRENTRY_SIZE 32
+#define FAT32_DIR_NAME       0
+#define FAT32_DIR_ATTR      11
+#define FAT32_DIR_LFN_SUM   13
+#define FAT32_DIR_CLUS_HI   20
+#define FAT32_DIR_CLUS_LO   26
+#define FAT32_DIR_SIZE      28
+
+/* Directory entry attributes */
+#define FAT32_ATTR_VOLUME_ID 0x08
+#define FAT32_ATTR_DIRECTORY 0x10
+#define FAT32_ATTR_LFN       0x0f
+
+/* First byte of the name of an unused and a deleted entry */
+#define FAT32_DIR_END     0x00
+#define FAT32_DIR_DELETED 0xe5
+
+/* Sequence number flag of the last long file name entry */
+#define FAT32_LFN_LAST 0x40
+
+/* FAT entries are 28 bits. Values at or above FAT32_EOC mark the end
+   of a cluster chain. */
+#define FAT32_CLUSTER_MASK 0x0fffffff
+#define FAT32_EOC          0x0ffffff8
+
 
 /* Boot sector information */
 
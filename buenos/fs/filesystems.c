@@ -36,6 +36,7 @@
 
 #include "fs/filesystems.h"
 #include "fs/tfs.h"
+#include "fs/tfs2.h"
 #include "fs/fat32.h"
 #include "drivers/device.h"
 
@@ -43,6 +44,7 @@
 
 static filesystems_t filesystems[] = {
     {"TFS", &tfs_init},
+    {"TFS2", &tfs2_init},
     {"FAT32", &fat32_init},
     { NULL, NULL} /* Last entry must be a NULL pair. */ 
 };
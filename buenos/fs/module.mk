@@ -3,6 +3,6 @@
 # Set the module name
 MODULE := fs
 
-FILES := vfs.c tfs.c fat32.c filesystems.c
+FILES := vfs.c tfs.c tfs2.c fat32.c filesystems.c
 
 SRC += $(patsubst %, $(MODULE)/%, $(FILES))
@@ -36,8 +36,14 @@
 
 #include "kernel/kmalloc.h"
 #include "kernel/assert.h"
+#include "kernel/interrupt.h"
+#include "kernel/spinlock.h"
+#include "kernel/lock_cond.h"
+#include "kernel/thread.h"
+#include "kernel/timeout.h"
 #include "vm/pagepool.h"
 #include "drivers/gbd.h"
+#include "drivers/metadev.h"
 #include "fs/vfs.h"
 #include "fs/tfs.h"
 #include "lib/libc.h"
@@ -51,12 +57,100 @@
  */
 
 
+/* In-core state of an inode that is open, or being read, written or
+   removed. Operations on the same file are serialized by the lock,
+   operations on different files run in parallel. */
+typedef struct {
+    /* Inode block number, 0 if the entry is free */
+    uint32_t    inode;
+
+    /* Number of threads using or waiting for this entry */
+    int         refs;
+
+    /* Number of times the file is open */
+    int         opens;
+
+    /* Copy of the inode block, NULL if not cached. Only cached while
+       the file is open. */
+    tfs_inode_t *cached;
+
+    /* Data blocks of a new file are not zeroed on disk when it is
+       created. Blocks from this one to the end of the file have not
+       been written since and read as zeros. -1 when all blocks have
+       been written. The entry is kept while this is not -1. See
+       tfs_zero_blocks(). */
+    int         unwritten;
+
+    /* Held while the file is accessed */
+    lock_t      lock;
+} tfs_incore_t;
+
+/* Entries are held by threads (at most one each) and by open files.
+   Unless removed files are kept open, this is always enough. */
+#define TFS_MAX_INCORE (CONFIG_MAX_THREADS + TFS_MAX_FILES)
+
+/* Number of inodes cached, all in one page */
+#define TFS_ICACHE_SIZE (PAGE_SIZE / TFS_BLOCK_SIZE)
+
+/* Number of chains in the directory hash */
+#define TFS_DIR_HASH 32
+
+/* Buffers used by one read or write operation. */
+typedef struct {
+    tfs_inode_t inode;
+    uint8_t     data[TFS_BLOCK_SIZE];
+} tfs_opbuf_t;
+
+/* Number of operation buffers, all in one page */
+#define TFS_OPBUFS (PAGE_SIZE / sizeof(tfs_opbuf_t))
+
+/* States of a readahead slot */
+#define TFS_RA_FREE    0   /* holds nothing */
+#define TFS_RA_PENDING 1   /* read issued, not waited for yet */
+#define TFS_RA_VALID   2   /* holds the data of block */
+
+/* A data block read ahead for a sequential reader. The data is in
+   tfs_t.ra_data at the index of the slot. */
+typedef struct {
+    /* Disk block held by the slot */
+    uint32_t      block;
+
+    /* One of TFS_RA_* */
+    int           state;
+
+    /* Set when the data has been read by tfs_read() */
+    int           used;
+
+    /* Set while a thread waits for the read or reuses the slot. Only
+       that thread may change the fields above. Protected by slock. */
+    int           busy;
+
+    /* Raised when the read of a pending slot completes */
+    semaphore_t   *done;
+
+    /* The read request of a pending slot */
+    gbd_request_t req;
+} tfs_raslot_t;
+
+/* Number of readahead slots, data of all in one page */
+#define TFS_RA_SLOTS (PAGE_SIZE / TFS_BLOCK_SIZE)
+
+/* Most blocks read ahead by one tfs_readahead() call, so that the
+   block being read stays cached */
+#define TFS_RA_BATCH (TFS_RA_SLOTS / 2)
+
 /* Data structure used internally by TFS filesystem. This data structure 
    is used by tfs-functions. it is initialized during tfs_init(). Also
    memory for the buffers is reserved _dynamically_ during init.
 
    Buffers are used when reading/writing system or data blocks from/to 
-   disk.
+   disk. The three buffers in this structure are used by operations
+   holding the filesystem lock (directory and allocation block
+   updates). File reads and writes take an operation buffer from the
+   pool instead, and only lock the inode of the file.
+
+   The allocation and directory blocks are kept in memory. Changes to
+   them are written back by tfs_commit(), not by every operation.
 */
 typedef struct {
     /* Total number of blocks of the disk */ 
@@ -65,20 +159,342 @@ typedef struct {
     /* Pointer to gbd device performing tfs */
     gbd_t          *disk;
 
-    /* lock for mutual exclusion of fs-operations (we support only
-       one operation at a time in any case) */
+    /* lock for mutual exclusion of operations on the allocation
+       and directory blocks */
     semaphore_t    *lock;
 
+    /* Protects incore and opbufs_used */
+    spinlock_t     slock;
+
+    /* In-core inodes, see tfs_inode_lock() */
+    tfs_incore_t   incore[TFS_MAX_INCORE];
+
+    /* Pool of operation buffers. opbufs_free counts free buffers,
+       bit i of opbufs_used is set when buffer i is taken. */
+    tfs_opbuf_t    *opbufs;
+    semaphore_t    *opbufs_free;
+    uint32_t       opbufs_used;
+
+    /* Inode cache. Bit i of icache_used is set when slot i is in use.
+       Protected by slock. */
+    tfs_inode_t    *icache;
+    uint32_t       icache_used;
+
+    /* Hash chains over the directory entries in buffer_md, which is
+       read at mount and kept up to date. Both hold directory index + 1,
+       0 ends a chain. Protected by lock. */
+    uint8_t        dir_hash[TFS_DIR_HASH];
+    uint8_t        dir_next[TFS_MAX_FILES];
+
+    /* Readahead cache, see tfs_readahead(). ra_data is NULL when
+       there was no memory for it. ra_victim is where the search for a
+       slot to reuse starts. Protected by slock. */
+    tfs_raslot_t   ra[TFS_RA_SLOTS];
+    uint8_t        *ra_data;
+    int            ra_victim;
+
+    /* Set when buffer_bat or buffer_md have changes not yet written
+       to disk, and the time of the oldest such change. Protected by
+       lock. */
+    int            bat_dirty;
+    int            dir_dirty;
+    uint32_t       dirty_since;
+
+    /* Commit thread, see tfs_commit_thread(). commit_timeout raises
+       commit_wake when the thread is due to look at the delayed
+       changes. commit_stop asks the thread to exit, and it raises
+       commit_exited when it has. commit_wake is NULL if there is no
+       thread. */
+    semaphore_t    *commit_wake;
+    semaphore_t    *commit_exited;
+    timeout_t      commit_timeout;
+    int            commit_stop;
+
+    /* First block of the metadata journal, 0 if the volume has
+       none. See tfs_journal_t. */
+    uint32_t       journal_start;
+
+    /* Raised by the disk for each write issued by tfs_write_group() */
+    semaphore_t    *io_sem;
+
     /* Buffers for read/write operations on disk. */       
     tfs_inode_t    *buffer_inode;   /* buffer for inode blocks */
     bitmap_t       *buffer_bat;     /* buffer for allocation block */
     tfs_direntry_t *buffer_md;      /* buffer for directory block */
 } tfs_t;
 
+static void tfs_commit_start(tfs_t *tfs);
+
+
+/**
+ * Releases the resources reserved by a failed tfs_init().
+ *
+ * @param sem, opbufs_sem, io_sem Semaphores to destroy.
+ * @param addr, opbufs, icache Pages to free, 0 if not allocated.
+ */
+static void tfs_init_cleanup(semaphore_t *sem, semaphore_t *opbufs_sem,
+			     semaphore_t *io_sem, uint32_t addr,
+			     uint32_t opbufs, uint32_t icache)
+{
+    semaphore_destroy(sem);
+    semaphore_destroy(opbufs_sem);
+    semaphore_destroy(io_sem);
+    if(addr != 0)
+	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+    if(opbufs != 0)
+	pagepool_free_phys_page(opbufs);
+    if(icache != 0)
+	pagepool_free_phys_page(icache);
+}
+
+/**
+ * Sets up the readahead cache. Readahead is only an optimization, so
+ * if the memory or semaphores for it can't be had the filesystem
+ * works without.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ */
+static void tfs_ra_init(tfs_t *tfs)
+{
+    uint32_t page;
+    int i;
+
+    tfs->ra_data = NULL;
+    tfs->ra_victim = 0;
+
+    for(i=0; i<(int)TFS_RA_SLOTS; i++) {
+	tfs->ra[i].state = TFS_RA_FREE;
+	tfs->ra[i].busy = 0;
+	tfs->ra[i].done = semaphore_create(0);
+	if(tfs->ra[i].done == NULL)
+	    break;
+    }
+
+    page = 0;
+    if(i == (int)TFS_RA_SLOTS)
+	page = pagepool_get_phys_page();
+
+    if(page == 0) {
+	while(--i >= 0)
+	    semaphore_destroy(tfs->ra[i].done);
+	return;
+    }
+
+    tfs->ra_data = (uint8_t *)ADDR_PHYS_TO_KERNEL(page);
+}
+
+/**
+ * Computes the directory hash chain of a file name.
+ */
+static int tfs_dir_hashfunc(char *filename)
+{
+    uint32_t h = 0;
+    int i;
+
+    for(i=0; i<TFS_FILENAME_MAX && filename[i] != 0; i++)
+	h = h*31 + filename[i];
+
+    return h % TFS_DIR_HASH;
+}
+
+/**
+ * Links directory entry index to its hash chain.
+ */
+static void tfs_dir_link(tfs_t *tfs, int index)
+{
+    int h = tfs_dir_hashfunc(tfs->buffer_md[index].name);
+
+    tfs->dir_next[index] = tfs->dir_hash[h];
+    tfs->dir_hash[h] = index + 1;
+}
+
+/**
+ * Unlinks directory entry index from its hash chain. Call before
+ * changing the name of the entry.
+ */
+static void tfs_dir_unlink(tfs_t *tfs, int index)
+{
+    uint8_t *link = &tfs->dir_hash[tfs_dir_hashfunc(tfs->buffer_md[index].name)];
+
+    while(*link != index + 1)
+	link = &tfs->dir_next[*link - 1];
+    *link = tfs->dir_next[index];
+}
+
+/**
+ * Builds the directory hash from the directory block in buffer_md.
+ */
+static void tfs_dir_rehash(tfs_t *tfs)
+{
+    uint32_t i;
+
+    for(i=0; i<TFS_DIR_HASH; i++)
+	tfs->dir_hash[i] = 0;
+
+    for(i=0; i<TFS_MAX_FILES; i++) {
+	if(tfs->buffer_md[i].inode != 0)
+	    tfs_dir_link(tfs, i);
+    }
+}
+
+/**
+ * Finds a file from the in-memory directory. The filesystem lock
+ * must be held.
+ *
+ * @return Index of the directory entry, -1 if not found.
+ */
+static int tfs_dir_lookup(tfs_t *tfs, char *filename)
+{
+    int i = tfs->dir_hash[tfs_dir_hashfunc(filename)];
+
+    while(i != 0) {
+	if(stringcmp(tfs->buffer_md[i-1].name, filename) == 0)
+	    return i - 1;
+	i = tfs->dir_next[i-1];
+    }
+
+    return -1;
+}
+
+/**
+ * Computes the checksum of a block copy in the journal.
+ *
+ * @param block The block, TFS_BLOCK_SIZE bytes.
+ *
+ * @return The checksum.
+ */
+uint32_t tfs_journal_checksum(const uint32_t *block)
+{
+    uint32_t h = 5381;
+    uint32_t i;
+
+    for(i=0; i<TFS_BLOCK_SIZE/sizeof(uint32_t); i++)
+	h = h*33 + block[i];
+
+    return h;
+}
+
+/**
+ * Writes blocks to the disk in parallel and waits for all of the
+ * writes to complete.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param blocks Numbers of the blocks to write.
+ * @param bufs Data of each block.
+ * @param n Number of blocks, at most TFS_JOURNAL_BLOCKS.
+ *
+ * @return 0 if any write failed, non-zero otherwise.
+ */
+static int tfs_write_group(tfs_t *tfs, uint32_t *blocks, void **bufs, int n)
+{
+    gbd_request_t req[TFS_JOURNAL_BLOCKS];
+    int issued = 0;
+    int ok = 1;
+    int i;
+
+    for(i=0; i<n; i++) {
+	req[issued].block = blocks[i];
+	req[issued].buf   = ADDR_KERNEL_TO_PHYS((uint32_t)bufs[i]);
+	req[issued].sem   = tfs->io_sem;
+	if(tfs->disk->write_block(tfs->disk, &req[issued]) == 0)
+	    ok = 0;
+	else
+	    issued++;
+    }
+
+    for(i=0; i<issued; i++) {
+	semaphore_P(tfs->io_sem);
+	if(req[i].return_value != 0)
+	    ok = 0;
+    }
+
+    return ok;
+}
+
+/**
+ * Empties the journal, so that nothing is replayed at the next mount.
+ * Uses buffer_inode.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ *
+ * @return 0 if an error occured, non-zero otherwise.
+ */
+static int tfs_journal_clear(tfs_t *tfs)
+{
+    gbd_request_t req;
+
+    memoryset(tfs->buffer_inode, 0, TFS_BLOCK_SIZE);
+    req.block = tfs->journal_start;
+    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
+    req.sem   = NULL;
+    return tfs->disk->write_block(tfs->disk, &req);
+}
+
+/**
+ * Replays the journal at mount. If the journal holds a complete
+ * transaction, the block copies in it are written to their own
+ * blocks, which finishes a commit cut short by a crash. An incomplete
+ * transaction never reached its own blocks and is dropped. Uses all
+ * three buffers.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ *
+ * @return 0 if an error occured, non-zero otherwise.
+ */
+static int tfs_journal_replay(tfs_t *tfs)
+{
+    gbd_request_t req;
+    tfs_journal_t *jb = (tfs_journal_t *)tfs->buffer_inode;
+    void *copies[TFS_JOURNAL_COPIES];
+    int valid;
+    uint32_t i;
+
+    copies[0] = tfs->buffer_bat;
+    copies[1] = tfs->buffer_md;
+
+    req.block = tfs->journal_start;
+    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)jb);
+    req.sem   = NULL;
+    if(tfs->disk->read_block(tfs->disk, &req) == 0)
+	return 0;
+
+    if(jb->magic != TFS_JOURNAL_MAGIC)
+	return 1;
+
+    valid = (jb->count <= TFS_JOURNAL_COPIES);
+    for(i=0; valid && i<jb->count; i++) {
+	if(jb->target[i] != TFS_ALLOCATION_BLOCK &&
+	   jb->target[i] != TFS_DIRECTORY_BLOCK) {
+	    valid = 0;
+	    break;
+	}
+
+	req.block = tfs->journal_start + 1 + i;
+	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)copies[i]);
+	req.sem   = NULL;
+	if(tfs->disk->read_block(tfs->disk, &req) == 0)
+	    return 0;
+
+	if(tfs_journal_checksum(copies[i]) != jb->checksum[i])
+	    valid = 0;
+    }
+
+    if(valid) {
+	kprintf("tfs_init: Replaying journal.\n");
+	if(tfs_write_group(tfs, jb->target, copies, jb->count) == 0)
+	    return 0;
+    }
+
+    return tfs_journal_clear(tfs);
+}
 
 /** 
  * Initialize trivial filesystem. Allocates 1 page of memory dynamically for
- * filesystem data structure, tfs data structure and buffers needed.
+ * filesystem data structure, tfs data structure and buffers needed, and
+ * two more pages for the pool of operation buffers and the inode
+ * cache. Replays the metadata journal if needed. Reads the directory
+ * and allocation blocks to memory, where they are kept while the
+ * filesystem is mounted.
  * Sets fs_t and tfs_t fields. If initialization is succesful, returns
  * pointer to fs_t data structure. Else NULL pointer is returned.
  *
@@ -89,13 +505,15 @@ typedef struct {
  */
 fs_t * tfs_init(gbd_t *disk) 
 {
-    uint32_t addr;
+    uint32_t addr, opbufs, icache;
     gbd_request_t req;
     char name[TFS_VOLUMENAME_MAX];
     fs_t *fs;
     tfs_t *tfs;
     int r;
-    semaphore_t *sem;
+    semaphore_t *sem, *opbufs_sem, *io_sem;
+    uint32_t journal_start, journal_blocks;
+    uint32_t i;
 
     if(disk->block_size(disk) != TFS_BLOCK_SIZE)
 	return NULL;
@@ -106,11 +524,26 @@ fs_t * tfs_init(gbd_t *disk)
 	kprintf("tfs_init: could not create a new semaphore.\n");
 	return NULL;
     }
+    opbufs_sem = semaphore_create(TFS_OPBUFS);
+    if (opbufs_sem == NULL) {
+        semaphore_destroy(sem);
+	kprintf("tfs_init: could not create a new semaphore.\n");
+	return NULL;
+    }
+    io_sem = semaphore_create(0);
+    if (io_sem == NULL) {
+        semaphore_destroy(sem);
+        semaphore_destroy(opbufs_sem);
+	kprintf("tfs_init: could not create a new semaphore.\n");
+	return NULL;
+    }
 
     addr = pagepool_get_phys_page();
-    if(addr == 0) {
-        semaphore_destroy(sem);
+    opbufs = pagepool_get_phys_page();
+    icache = pagepool_get_phys_page();
+    if(addr == 0 || opbufs == 0 || icache == 0) {
 	kprintf("tfs_init: could not allocate memory.\n");
+	tfs_init_cleanup(sem, opbufs_sem, io_sem, addr, opbufs, icache);
 	return NULL;
     }
     addr = ADDR_PHYS_TO_KERNEL(addr);      /* transform to vm address */
@@ -125,20 +558,20 @@ fs_t * tfs_init(gbd_t *disk)
     req.buf = ADDR_KERNEL_TO_PHYS(addr);   /* disk needs physical addr */
     r = disk->read_block(disk, &req);
     if(r == 0) {
-        semaphore_destroy(sem);
-	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
 	kprintf("tfs_init: Error during disk read. Initialization failed.\n");
+	tfs_init_cleanup(sem, opbufs_sem, io_sem, addr, opbufs, icache);
 	return NULL; 
     }
 
     if(((uint32_t *)addr)[0] != TFS_MAGIC) {
-        semaphore_destroy(sem);
-	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+	tfs_init_cleanup(sem, opbufs_sem, io_sem, addr, opbufs, icache);
 	return NULL;
     }
 
     /* Copy volume name from header block. */
     stringcopy(name, (char *)(addr+4), TFS_VOLUMENAME_MAX);
+    journal_start  = ((tfs_header_t *)addr)->journal_start;
+    journal_blocks = ((tfs_header_t *)addr)->journal_blocks;
 
     /* fs_t, tfs_t and all buffers in tfs_t fit in one page, so obtain
        addresses for each structure and buffer inside the allocated
@@ -153,10 +586,71 @@ fs_t * tfs_init(gbd_t *disk)
 
     tfs->totalblocks = MIN(disk->total_blocks(disk), 8*TFS_BLOCK_SIZE);
     tfs->disk        = disk;
+    tfs->io_sem      = io_sem;
+
+    /* Finish the last metadata transaction if the system stopped in
+       the middle of it. */
+    tfs->journal_start = 0;
+    if(journal_blocks != 0) {
+	if(journal_blocks < TFS_JOURNAL_BLOCKS ||
+	   journal_start <= TFS_DIRECTORY_BLOCK ||
+	   journal_start + TFS_JOURNAL_BLOCKS > tfs->totalblocks) {
+	    kprintf("tfs_init: Invalid journal. Initialization failed.\n");
+	    tfs_init_cleanup(sem, opbufs_sem, io_sem, addr, opbufs, icache);
+	    return NULL;
+	}
+	tfs->journal_start = journal_start;
+
+	if(tfs_journal_replay(tfs) == 0) {
+	    kprintf("tfs_init: Error during journal replay. "
+		    "Initialization failed.\n");
+	    tfs_init_cleanup(sem, opbufs_sem, io_sem, addr, opbufs, icache);
+	    return NULL;
+	}
+    }
+
+    /* The directory block stays in buffer_md from now on. */
+    req.block = TFS_DIRECTORY_BLOCK;
+    req.sem = NULL;
+    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
+    r = disk->read_block(disk, &req);
+    if(r == 0) {
+	kprintf("tfs_init: Error during disk read. Initialization failed.\n");
+	tfs_init_cleanup(sem, opbufs_sem, io_sem, addr, opbufs, icache);
+	return NULL; 
+    }
+    tfs_dir_rehash(tfs);
+
+    /* So does the allocation block. */
+    req.block = TFS_ALLOCATION_BLOCK;
+    req.sem = NULL;
+    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
+    r = disk->read_block(disk, &req);
+    if(r == 0) {
+	kprintf("tfs_init: Error during disk read. Initialization failed.\n");
+	tfs_init_cleanup(sem, opbufs_sem, io_sem, addr, opbufs, icache);
+	return NULL; 
+    }
+    tfs->bat_dirty = 0;
+    tfs->dir_dirty = 0;
 
     /* save the semaphore to the tfs_t */
     tfs->lock = sem;
 
+    spinlock_reset(&tfs->slock);
+    for(i=0; i<TFS_MAX_INCORE; i++)
+	tfs->incore[i].inode = 0;
+
+    tfs->opbufs = (tfs_opbuf_t *)ADDR_PHYS_TO_KERNEL(opbufs);
+    tfs->opbufs_free = opbufs_sem;
+    tfs->opbufs_used = 0;
+
+    tfs->icache = (tfs_inode_t *)ADDR_PHYS_TO_KERNEL(icache);
+    tfs->icache_used = 0;
+
+    tfs_ra_init(tfs);
+    tfs_commit_start(tfs);
+
     fs->internal = (void *)tfs;
     stringcopy(fs->volume_name, name, VFS_NAME_LENGTH);
 
@@ -168,41 +662,818 @@ fs_t * tfs_init(gbd_t *disk)
     fs->read    = tfs_read;
     fs->write   = tfs_write;
     fs->getfree  = tfs_getfree;
+    fs->readahead = tfs_readahead;
+    fs->sync      = tfs_sync;
 
     return fs;
 }
 
 
+/**
+ * Gets the in-core inode of the given file and locks it. Waits while
+ * another thread holds the lock of the same inode.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param inode Inode block number of the file.
+ *
+ * @return The locked in-core inode, NULL if the in-core inode table
+ * is full. Release with tfs_inode_unlock().
+ */
+static tfs_incore_t *tfs_inode_lock(tfs_t *tfs, uint32_t inode)
+{
+    interrupt_status_t intr_status;
+    tfs_incore_t *ic = NULL;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    for(i=0; i<(int)TFS_MAX_INCORE; i++) {
+	if(tfs->incore[i].inode == inode) {
+	    ic = &tfs->incore[i];
+	    break;
+	}
+	if(ic == NULL && tfs->incore[i].inode == 0)
+	    ic = &tfs->incore[i];
+    }
+
+    if(ic == NULL) {
+	spinlock_release(&tfs->slock);
+	_interrupt_set_state(intr_status);
+	return NULL;
+    }
+
+    if(ic->inode != inode) {
+	ic->inode = inode;
+	ic->refs = 0;
+	ic->opens = 0;
+	ic->cached = NULL;
+	ic->unwritten = -1;
+	lock_reset(&ic->lock);
+    }
+    ic->refs++;
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+
+    lock_acquire(&ic->lock);
+    return ic;
+}
+
+/**
+ * Unlocks an in-core inode locked with tfs_inode_lock(). The entry is
+ * freed when no other thread is waiting for it, the file is not open
+ * and it has no unwritten blocks.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param ic The in-core inode.
+ */
+static void tfs_inode_unlock(tfs_t *tfs, tfs_incore_t *ic)
+{
+    interrupt_status_t intr_status;
+
+    lock_release(&ic->lock);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    ic->refs--;
+    if(ic->refs == 0 && ic->opens == 0 && ic->unwritten < 0)
+	ic->inode = 0;
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Drops the cached inode of a locked in-core inode, if any.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param ic The locked in-core inode.
+ */
+static void tfs_icache_drop(tfs_t *tfs, tfs_incore_t *ic)
+{
+    interrupt_status_t intr_status;
+
+    if(ic->cached == NULL)
+	return;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    tfs->icache_used &= ~(1 << (ic->cached - tfs->icache));
+    ic->cached = NULL;
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Caches the inode of a locked in-core inode, if there is room in the
+ * inode cache.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param ic The locked in-core inode.
+ */
+static void tfs_icache_load(tfs_t *tfs, tfs_incore_t *ic)
+{
+    interrupt_status_t intr_status;
+    gbd_request_t req;
+    tfs_inode_t *slot = NULL;
+    uint32_t i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    for(i=0; i<TFS_ICACHE_SIZE; i++) {
+	if(!(tfs->icache_used & (1 << i))) {
+	    tfs->icache_used |= (1 << i);
+	    slot = &tfs->icache[i];
+	    break;
+	}
+    }
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+
+    if(slot == NULL)
+	return;
+
+    req.block = ic->inode;
+    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)slot);
+    req.sem   = NULL;
+    if(tfs->disk->read_block(tfs->disk, &req) == 0) {
+	/* Not fatal, the inode is just not cached. */
+	ic->cached = slot;
+	tfs_icache_drop(tfs, ic);
+	return;
+    }
+
+    ic->cached = slot;
+}
+
+/**
+ * Gets the inode of a locked in-core inode, from the inode cache if
+ * possible and otherwise from the disk into the given buffer.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param ic The locked in-core inode.
+ * @param buffer Buffer to read the inode into if it is not cached.
+ *
+ * @return The inode, NULL if reading it failed.
+ */
+static tfs_inode_t *tfs_inode_get(tfs_t *tfs, tfs_incore_t *ic,
+				  tfs_inode_t *buffer)
+{
+    gbd_request_t req;
+
+    if(ic->cached != NULL)
+	return ic->cached;
+
+    req.block = ic->inode;
+    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)buffer);
+    req.sem   = NULL;
+    if(tfs->disk->read_block(tfs->disk, &req) == 0)
+	return NULL;
+
+    return buffer;
+}
+
+/**
+ * Takes an operation buffer from the pool, waiting if all are in use.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ *
+ * @return The buffer. Return it with tfs_opbuf_put().
+ */
+static tfs_opbuf_t *tfs_opbuf_get(tfs_t *tfs)
+{
+    interrupt_status_t intr_status;
+    int i;
+
+    semaphore_P(tfs->opbufs_free);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    for(i=0; tfs->opbufs_used & (1 << i); i++)
+	;
+    tfs->opbufs_used |= (1 << i);
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+
+    return &tfs->opbufs[i];
+}
+
+/**
+ * Returns an operation buffer to the pool.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param ob The buffer.
+ */
+static void tfs_opbuf_put(tfs_t *tfs, tfs_opbuf_t *ob)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    tfs->opbufs_used &= ~(1 << (ob - tfs->opbufs));
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+
+    semaphore_V(tfs->opbufs_free);
+}
+
+/**
+ * Waits for the read of a readahead slot to complete, if it is still
+ * pending. The calling thread must have the slot busy.
+ *
+ * @param slot The readahead slot.
+ */
+static void tfs_ra_wait(tfs_raslot_t *slot)
+{
+    if(slot->state != TFS_RA_PENDING)
+	return;
+
+    semaphore_P(slot->done);
+    if(slot->req.return_value == 0)
+	slot->state = TFS_RA_VALID;
+    else
+	slot->state = TFS_RA_FREE;
+}
+
+/**
+ * Finds the readahead slot holding the given block and marks it busy.
+ * A slot already busy is being reused for another block, so it is not
+ * returned.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param block Disk block number.
+ *
+ * @return The slot, NULL if the block is not cached. Release with
+ * tfs_ra_release().
+ */
+static tfs_raslot_t *tfs_ra_claim(tfs_t *tfs, uint32_t block)
+{
+    interrupt_status_t intr_status;
+    tfs_raslot_t *slot = NULL;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    for(i=0; i<(int)TFS_RA_SLOTS; i++) {
+	if(!tfs->ra[i].busy && tfs->ra[i].state != TFS_RA_FREE &&
+	   tfs->ra[i].block == block) {
+	    slot = &tfs->ra[i];
+	    slot->busy = 1;
+	    break;
+	}
+    }
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+
+    return slot;
+}
+
+/**
+ * Picks a readahead slot to reuse and marks it busy. Slots are reused
+ * in turn, skipping the ones read ahead but not read yet if possible.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ *
+ * @return The slot, NULL if all slots are busy. Release with
+ * tfs_ra_release().
+ */
+static tfs_raslot_t *tfs_ra_victim(tfs_t *tfs)
+{
+    interrupt_status_t intr_status;
+    tfs_raslot_t *slot = NULL;
+    int pass, n, i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    for(pass=0; pass<2 && slot == NULL; pass++) {
+	for(n=0; n<(int)TFS_RA_SLOTS; n++) {
+	    i = (tfs->ra_victim + n) % TFS_RA_SLOTS;
+	    if(tfs->ra[i].busy)
+		continue;
+	    if(pass == 0 && tfs->ra[i].state != TFS_RA_FREE &&
+	       !tfs->ra[i].used)
+		continue;
+
+	    slot = &tfs->ra[i];
+	    slot->busy = 1;
+	    tfs->ra_victim = (i + 1) % TFS_RA_SLOTS;
+	    break;
+	}
+    }
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+
+    return slot;
+}
+
+/**
+ * Releases a readahead slot marked busy by tfs_ra_claim() or
+ * tfs_ra_victim().
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param slot The slot.
+ */
+static void tfs_ra_release(tfs_t *tfs, tfs_raslot_t *slot)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    slot->busy = 0;
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Drops the given block from the readahead cache. Called before the
+ * block is written so that the cache never holds stale data.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param block Disk block number.
+ */
+static void tfs_ra_forget(tfs_t *tfs, uint32_t block)
+{
+    tfs_raslot_t *slot;
+
+    if(tfs->ra_data == NULL)
+	return;
+
+    slot = tfs_ra_claim(tfs, block);
+    if(slot == NULL)
+	return;
+
+    /* The read in progress must not complete after the write. */
+    tfs_ra_wait(slot);
+    slot->state = TFS_RA_FREE;
+    tfs_ra_release(tfs, slot);
+}
+
+/**
+ * Reads a data block, from the readahead cache if it is there and
+ * otherwise from the disk.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param block Disk block number.
+ * @param buffer Buffer of TFS_BLOCK_SIZE bytes to read the block into.
+ *
+ * @return 0 if an error occured, non-zero otherwise, like
+ * gbd.read_block().
+ */
+static int tfs_read_data(tfs_t *tfs, uint32_t block, void *buffer)
+{
+    gbd_request_t req;
+    tfs_raslot_t *slot;
+
+    if(tfs->ra_data != NULL) {
+	slot = tfs_ra_claim(tfs, block);
+	if(slot != NULL) {
+	    tfs_ra_wait(slot);
+	    if(slot->state == TFS_RA_VALID) {
+		memcopy(TFS_BLOCK_SIZE, buffer,
+			tfs->ra_data + (slot - tfs->ra) * TFS_BLOCK_SIZE);
+		slot->used = 1;
+		tfs_ra_release(tfs, slot);
+		return 1;
+	    }
+	    tfs_ra_release(tfs, slot);
+	}
+    }
+
+    req.block = block;
+    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)buffer);
+    req.sem   = NULL;
+    return tfs->disk->read_block(tfs->disk, &req);
+}
+
+/**
+ * Reads block b of a file. Blocks not written since the file was
+ * created are not read from the disk, they are zero.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param ic The locked in-core inode of the file.
+ * @param inode The inode of the file.
+ * @param b Block number within the file.
+ * @param buffer Buffer of TFS_BLOCK_SIZE bytes to read the block into.
+ *
+ * @return 0 if an error occured, non-zero otherwise.
+ */
+static int tfs_read_file_block(tfs_t *tfs, tfs_incore_t *ic,
+			       tfs_inode_t *inode, int b, void *buffer)
+{
+    if(ic->unwritten >= 0 && b >= ic->unwritten) {
+	memoryset(buffer, 0, TFS_BLOCK_SIZE);
+	return 1;
+    }
+
+    return tfs_read_data(tfs, inode->block[b], buffer);
+}
+
+/**
+ * Records that the blocks of a file before block end have been
+ * written.
+ *
+ * @param ic The locked in-core inode of the file.
+ * @param inode The inode of the file.
+ * @param end Block number within the file.
+ */
+static void tfs_set_written(tfs_incore_t *ic, tfs_inode_t *inode, int end)
+{
+    if(ic->unwritten < 0 || end <= ic->unwritten)
+	return;
+
+    ic->unwritten = end;
+    if(ic->unwritten >= (int)((inode->filesize + TFS_BLOCK_SIZE - 1)
+			      / TFS_BLOCK_SIZE))
+	ic->unwritten = -1;
+}
+
+/**
+ * Writes zeros to the unwritten blocks of a new file, up to but not
+ * including block end. Done before the file is written past its
+ * unwritten blocks and before the directory entry of the file goes
+ * to disk, so that no stale data is ever visible in the file.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ * @param ic The locked in-core inode of the file.
+ * @param inode The inode of the file.
+ * @param zero Buffer of TFS_BLOCK_SIZE bytes, overwritten with zeros.
+ * @param end Block number within the file, at most the number of
+ * blocks in the file.
+ *
+ * @return 0 if an error occured, non-zero otherwise.
+ */
+static int tfs_zero_blocks(tfs_t *tfs, tfs_incore_t *ic,
+			   tfs_inode_t *inode, void *zero, int end)
+{
+    gbd_request_t req;
+    int b;
+
+    if(ic->unwritten < 0 || end <= ic->unwritten)
+	return 1;
+
+    memoryset(zero, 0, TFS_BLOCK_SIZE);
+    for(b=ic->unwritten; b<end; b++) {
+	tfs_ra_forget(tfs, inode->block[b]);
+	req.block = inode->block[b];
+	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)zero);
+	req.sem   = NULL;
+	if(tfs->disk->write_block(tfs->disk, &req) == 0) {
+	    tfs_set_written(ic, inode, b);
+	    return 0;
+	}
+    }
+
+    tfs_set_written(ic, inode, end);
+    return 1;
+}
+
+/**
+ * Writes the delayed changes to disk. The unwritten blocks of new
+ * files are zeroed first, then the allocation block and the directory
+ * block are written if they have changed, through the journal if the
+ * volume has one. All changes since the previous commit go in one
+ * transaction. The filesystem lock must be held, and buffer_inode is
+ * used.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ *
+ * @return VFS_OK, or VFS_ERROR if an error occured. The changes not
+ * written stay in memory.
+ */
+static int tfs_commit(tfs_t *tfs)
+{
+    interrupt_status_t intr_status;
+    tfs_incore_t *ic;
+    tfs_opbuf_t *ob;
+    tfs_inode_t *inode;
+    tfs_journal_t *jb;
+    uint32_t block;
+    uint32_t blocks[TFS_JOURNAL_COPIES], jblocks[TFS_JOURNAL_BLOCKS];
+    void *bufs[TFS_JOURNAL_COPIES], *jbufs[TFS_JOURNAL_BLOCKS];
+    int i, n, r;
+
+    /* New files are always in the directory block, so there are none
+       unless it is dirty. */
+    if(!tfs->bat_dirty && !tfs->dir_dirty)
+	return VFS_OK;
+
+    for(i=0; i<(int)TFS_MAX_INCORE; i++) {
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&tfs->slock);
+
+	block = 0;
+	if(tfs->incore[i].unwritten >= 0)
+	    block = tfs->incore[i].inode;
+
+	spinlock_release(&tfs->slock);
+	_interrupt_set_state(intr_status);
+
+	if(block == 0)
+	    continue;
+
+	ic = tfs_inode_lock(tfs, block);
+	if(ic == NULL)
+	    return VFS_ERROR;
+	ob = tfs_opbuf_get(tfs);
+
+	inode = tfs_inode_get(tfs, ic, &ob->inode);
+	r = 0;
+	if(inode != NULL)
+	    r = tfs_zero_blocks(tfs, ic, inode, ob->data,
+				(inode->filesize + TFS_BLOCK_SIZE - 1)
+				/ TFS_BLOCK_SIZE);
+
+	tfs_opbuf_put(tfs, ob);
+	tfs_inode_unlock(tfs, ic);
+	if(r == 0)
+	    return VFS_ERROR;
+    }
+
+    n = 0;
+    if(tfs->bat_dirty) {
+	blocks[n] = TFS_ALLOCATION_BLOCK;
+	bufs[n]   = tfs->buffer_bat;
+	n++;
+    }
+    if(tfs->dir_dirty) {
+	blocks[n] = TFS_DIRECTORY_BLOCK;
+	bufs[n]   = tfs->buffer_md;
+	n++;
+    }
+
+    if(tfs->journal_start == 0) {
+	/* No journal, so the blocks are written one at a time. */
+	for(i=0; i<n; i++) {
+	    if(tfs_write_group(tfs, &blocks[i], &bufs[i], 1) == 0)
+		return VFS_ERROR;
+	}
+    } else {
+	/* One transaction covers all the changes since the last
+	   commit. The commit block and the copies go to the journal
+	   together, and the blocks to their own places after that. */
+	jb = (tfs_journal_t *)tfs->buffer_inode;
+	memoryset(jb, 0, TFS_BLOCK_SIZE);
+	jb->magic = TFS_JOURNAL_MAGIC;
+	jb->count = n;
+	for(i=0; i<n; i++) {
+	    jb->target[i]   = blocks[i];
+	    jb->checksum[i] = tfs_journal_checksum(bufs[i]);
+	    jblocks[i] = tfs->journal_start + 1 + i;
+	    jbufs[i]   = bufs[i];
+	}
+	jblocks[n] = tfs->journal_start;
+	jbufs[n]   = jb;
+
+	if(tfs_write_group(tfs, jblocks, jbufs, n + 1) == 0)
+	    return VFS_ERROR;
+	if(tfs_write_group(tfs, blocks, bufs, n) == 0)
+	    return VFS_ERROR;
+    }
+
+    tfs->bat_dirty = 0;
+    tfs->dir_dirty = 0;
+    return VFS_OK;
+}
+
+/**
+ * Commits the delayed changes if the oldest of them has waited for
+ * CONFIG_FS_COMMIT_DELAY milliseconds. The filesystem lock must be
+ * held. Errors are not reported, the changes stay in memory and are
+ * tried again later.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ */
+static void tfs_commit_if_due(tfs_t *tfs)
+{
+    if((tfs->bat_dirty || tfs->dir_dirty) &&
+       rtc_get_msec() - tfs->dirty_since >= CONFIG_FS_COMMIT_DELAY)
+	tfs_commit(tfs);
+}
+
+/**
+ * Timeout function of the commit thread, wakes it up.
+ *
+ * @param arg Pointer to tfs data structure of the device.
+ */
+static void tfs_commit_tick(void *arg)
+{
+    semaphore_V(((tfs_t *)arg)->commit_wake);
+}
+
+/**
+ * Commit thread of a volume. Commits the delayed changes when they
+ * are due even if no operation comes to do it, sleeping until the
+ * oldest change has waited CONFIG_FS_COMMIT_DELAY milliseconds, or
+ * that long if there are none. Exits when asked to by tfs_unmount().
+ *
+ * @param arg Pointer to tfs data structure of the device.
+ */
+static void tfs_commit_thread(uint32_t arg)
+{
+    tfs_t *tfs = (tfs_t *)arg;
+    uint32_t wait, age;
+
+    while(1) {
+	semaphore_P(tfs->lock);
+	tfs_commit_if_due(tfs);
+
+	wait = CONFIG_FS_COMMIT_DELAY;
+	if(tfs->bat_dirty || tfs->dir_dirty) {
+	    /* Not due, or the commit failed and is tried again later */
+	    age = rtc_get_msec() - tfs->dirty_since;
+	    if(age < CONFIG_FS_COMMIT_DELAY)
+		wait = CONFIG_FS_COMMIT_DELAY - age;
+	}
+	semaphore_V(tfs->lock);
+
+	timeout_set(&tfs->commit_timeout, wait, tfs_commit_tick, tfs);
+	semaphore_P(tfs->commit_wake);
+	if(tfs->commit_stop)
+	    break;
+    }
+
+    timeout_cancel(&tfs->commit_timeout);
+    semaphore_V(tfs->commit_exited);
+    thread_finish();
+}
+
+/**
+ * Starts the commit thread of a volume. Without one the delayed
+ * changes are still committed by the operations that find them due,
+ * so if the thread can't be had the filesystem works without.
+ *
+ * @param tfs Pointer to tfs data structure of the device.
+ */
+static void tfs_commit_start(tfs_t *tfs)
+{
+    TID_t tid;
+
+    tfs->commit_stop = 0;
+    tfs->commit_timeout.pending = 0;
+    tfs->commit_wake = NULL;
+    if(CONFIG_FS_COMMIT_DELAY == 0)
+	return;
+
+    tfs->commit_exited = semaphore_create(0);
+    if(tfs->commit_exited == NULL)
+	return;
+    tfs->commit_wake = semaphore_create(0);
+    tid = -1;
+    if(tfs->commit_wake != NULL)
+	tid = thread_create(&tfs_commit_thread, (uint32_t)tfs);
+
+    if(tid < 0) {
+	kprintf("tfs_init: no commit thread, changes are committed "
+		"by later operations only.\n");
+	semaphore_destroy(tfs->commit_exited);
+	if(tfs->commit_wake != NULL)
+	    semaphore_destroy(tfs->commit_wake);
+	tfs->commit_wake = NULL;
+	return;
+    }
+    thread_run(tid);
+}
+
+/**
+ * Writes an empty trivial filesystem to the given disk, like the
+ * create command of tfstool. Data blocks are not touched, since new
+ * files are zeroed when created. Used for disks that have no image
+ * file, such as RAM disks. No journal is made, as the contents of
+ * such disks do not survive a crash anyway.
+ *
+ * @param disk Pointer to gbd-device to format.
+ *
+ * @param volumename Name of the new volume.
+ *
+ * @return VFS_OK on success, VFS_ERROR otherwise.
+ */
+int tfs_format(gbd_t *disk, char *volumename)
+{
+    uint32_t addr;
+    gbd_request_t req;
+    int r;
+
+    if(disk->block_size(disk) != TFS_BLOCK_SIZE ||
+       disk->total_blocks(disk) < 3)
+	return VFS_ERROR;
+
+    addr = pagepool_get_phys_page();
+    if(addr == 0)
+	return VFS_ERROR;
+    addr = ADDR_PHYS_TO_KERNEL(addr);
+
+    /* Header block */
+    memoryset((void *)addr, 0, TFS_BLOCK_SIZE);
+    ((uint32_t *)addr)[0] = TFS_MAGIC;
+    stringcopy((char *)(addr+4), volumename, TFS_VOLUMENAME_MAX);
+    req.block = TFS_HEADER_BLOCK;
+    req.buf = ADDR_KERNEL_TO_PHYS(addr);
+    req.sem = NULL;
+    r = disk->write_block(disk, &req);
+
+    /* Allocation block with the three system blocks in use */
+    if(r != 0) {
+	memoryset((void *)addr, 0, TFS_BLOCK_SIZE);
+	bitmap_set((bitmap_t *)addr, TFS_HEADER_BLOCK, 1);
+	bitmap_set((bitmap_t *)addr, TFS_ALLOCATION_BLOCK, 1);
+	bitmap_set((bitmap_t *)addr, TFS_DIRECTORY_BLOCK, 1);
+	req.block = TFS_ALLOCATION_BLOCK;
+	req.sem = NULL;
+	r = disk->write_block(disk, &req);
+    }
+
+    /* Empty directory */
+    if(r != 0) {
+	memoryset((void *)addr, 0, TFS_BLOCK_SIZE);
+	req.block = TFS_DIRECTORY_BLOCK;
+	req.sem = NULL;
+	r = disk->write_block(disk, &req);
+    }
+
+    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+
+    return (r == 0) ? VFS_ERROR : VFS_OK;
+}
+
 /**
  * Unmounts tfs filesystem from gbd device. After this TFS-driver and
  * gbd-device are no longer linked together. Implements
- * fs.unmount(). Waits for the current operation(s) to finish, frees
- * reserved memory and returns OK.
+ * fs.unmount(). Waits for the current operation(s) to finish, writes
+ * the delayed changes to disk and frees reserved memory.
  *
  * @param fs Pointer to fs data structure of the device.
  *
- * @return VFS_OK
+ * @return VFS_OK, or VFS_ERROR if the delayed changes could not be
+ * written.
  */
 int tfs_unmount(fs_t *fs) 
 {
     tfs_t *tfs;
+    int i, r;
 
     tfs = (tfs_t *)fs->internal;
 
+    /* Stop the commit thread, the last changes are committed below */
+    if(tfs->commit_wake != NULL) {
+	tfs->commit_stop = 1;
+	semaphore_V(tfs->commit_wake);
+	semaphore_P(tfs->commit_exited);
+	semaphore_destroy(tfs->commit_wake);
+	semaphore_destroy(tfs->commit_exited);
+    }
+
     semaphore_P(tfs->lock); /* The semaphore should be free at this
       point, we get it just in case something has gone wrong. */
 
+    r = tfs_commit(tfs);
+
+    /* A clean volume has an empty journal. */
+    if(r == VFS_OK && tfs->journal_start != 0 &&
+       tfs_journal_clear(tfs) == 0)
+	r = VFS_ERROR;
+
+    /* No reads may be left pending when the readahead cache is
+       freed. */
+    if(tfs->ra_data != NULL) {
+	for(i=0; i<(int)TFS_RA_SLOTS; i++) {
+	    tfs_ra_wait(&tfs->ra[i]);
+	    semaphore_destroy(tfs->ra[i].done);
+	}
+	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)tfs->ra_data));
+    }
+
     /* free semaphore and allocated memory */
     semaphore_destroy(tfs->lock);
+    semaphore_destroy(tfs->opbufs_free);
+    semaphore_destroy(tfs->io_sem);
+    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)tfs->opbufs));
+    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)tfs->icache));
     pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)fs));
-    return VFS_OK;
+    return r;
 }
 
 
 /**
- * Opens file. Implements fs.open(). Reads directory block of tfs
- * device and finds given file. Returns file's inode block number or
- * VFS_NOT_FOUND, if file not found.
+ * Opens file. Implements fs.open(). Finds given file from the
+ * directory kept in memory and caches its inode while the file is
+ * open. Returns file's inode block number or VFS_NOT_FOUND, if file
+ * not found.
  * 
  * @param fs Pointer to fs data structure of the device.
  * @param filename Name of the file to be opened.
@@ -213,59 +1484,109 @@ int tfs_unmount(fs_t *fs)
 int tfs_open(fs_t *fs, char *filename)
 {
     tfs_t *tfs;
-    gbd_request_t req;
-    uint32_t i;
-    int r;
+    tfs_incore_t *ic;
+    int index;
+    int inode;
 
     tfs = (tfs_t *)fs->internal;
 
     semaphore_P(tfs->lock);
-    
-    req.block     = TFS_DIRECTORY_BLOCK;
-    req.buf       = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
-    req.sem       = NULL;
-    r = tfs->disk->read_block(tfs->disk,&req);
-    if(r == 0) {
-	/* An error occured during read. */
+
+    tfs_commit_if_due(tfs);
+
+    index = tfs_dir_lookup(tfs, filename);
+    if(index < 0) {
 	semaphore_V(tfs->lock);
-	return VFS_ERROR;
+	return VFS_NOT_FOUND;
     }
+    inode = tfs->buffer_md[index].inode;
 
-    for(i=0;i < TFS_MAX_FILES;i++) {
-	if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
-	    semaphore_V(tfs->lock);
-	    return tfs->buffer_md[i].inode;
-	}
+    ic = tfs_inode_lock(tfs, inode);
+    if(ic == NULL) {
+	semaphore_V(tfs->lock);
+	return VFS_ERROR;
     }
-    
+
+    ic->opens++;
+    if(ic->cached == NULL)
+	tfs_icache_load(tfs, ic);
+
+    tfs_inode_unlock(tfs, ic);
     semaphore_V(tfs->lock);
-    return VFS_NOT_FOUND;
+    return inode;
 }
 
 
 /**
- * Closes file. Implements fs.close(). There is nothing to be done, no
- * data strucutures or similar are reserved for file. Returns VFS_OK.
+ * Closes file. Implements fs.close(). Drops the reference the open
+ * file has to the in-core inode; the inode leaves the cache when the
+ * file is no longer open. Then writes the delayed changes of the
+ * filesystem to disk.
  *
  * @param fs Pointer to fs data structure of the device.
  * @param fileid File id (inode block number) of the file.
  *
- * @return VFS_OK
+ * @return VFS_OK, or VFS_ERROR if the delayed changes could not be
+ * written.
  */
 int tfs_close(fs_t *fs, int fileid)
 {
-    fs = fs;
-    fileid = fileid;
+    tfs_t *tfs = (tfs_t *)fs->internal;
+    tfs_incore_t *ic;
+    int r;
+
+    ic = tfs_inode_lock(tfs, fileid);
+    if(ic == NULL)
+	return VFS_OK;
+
+    if(ic->opens > 0)
+	ic->opens--;
+    if(ic->opens == 0)
+	tfs_icache_drop(tfs, ic);
+
+    tfs_inode_unlock(tfs, ic);
+
+    semaphore_P(tfs->lock);
+    r = tfs_commit(tfs);
+    semaphore_V(tfs->lock);
+
+    return r;
+}
+
+
+/**
+ * Writes the delayed changes of the filesystem to disk. Implements
+ * fs.sync().
+ *
+ * @param fs Pointer to fs data structure of the device.
+ *
+ * @return VFS_OK, or VFS_ERROR if an error occured.
+ */
+int tfs_sync(fs_t *fs)
+{
+    tfs_t *tfs = (tfs_t *)fs->internal;
+    int r;
+
+    semaphore_P(tfs->lock);
+    r = tfs_commit(tfs);
+    semaphore_V(tfs->lock);
 
-    return VFS_OK;    
+    return r;
 }
 
 
 /**
  * Creates file of given size. Implements fs.create(). Checks that
- * file name doesn't allready exist in directory block.Allocates
+ * file name doesn't allready exist in directory.Allocates
  * enough blocks from the allocation block for the file (1 for inode
- * and then enough for the file of given size). Reserved blocks are zeroed.
+ * and then enough for the file of given size).
+ *
+ * Only the inode is written at once. The allocation and directory
+ * blocks are changed in memory and written by tfs_commit(). The data
+ * blocks are not zeroed here: they read as zeros until written, and
+ * the blocks still unwritten are zeroed when the changes are
+ * committed. A file that is written whole before that is never
+ * zeroed at all.
  *
  * @param fs Pointer to fs data structure of the device.
  * @param filename File name of the file to be created
@@ -277,37 +1598,32 @@ int tfs_close(fs_t *fs, int fileid)
 int tfs_create(fs_t *fs, char *filename, int size) 
 {
     tfs_t *tfs = (tfs_t *)fs->internal;
+    tfs_incore_t *ic;
     gbd_request_t req;
     uint32_t i;
     uint32_t numblocks = (size + TFS_BLOCK_SIZE - 1)/TFS_BLOCK_SIZE; 
+    uint32_t allocated;
     int index = -1;
+    int inode;
     int r;
 
     semaphore_P(tfs->lock);
 
+    tfs_commit_if_due(tfs);
+
     if(numblocks > (TFS_BLOCK_SIZE / 4 - 1)) {
 	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }
     
-    /* Read directory block. Check that file doesn't allready exist and
-       there is space left for the file in directory block. */
-    req.block = TFS_DIRECTORY_BLOCK;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
+    /* Check that file doesn't allready exist and there is space left
+       for the file in directory block. */
+    if(tfs_dir_lookup(tfs, filename) >= 0) {
 	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }
 
     for(i=0;i<TFS_MAX_FILES;i++) {
-	if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
-	}
-
 	if(tfs->buffer_md[i].inode == 0) {
 	    /* found free slot from directory */
 	    index = i;
@@ -320,24 +1636,9 @@ int tfs_create(fs_t *fs, char *filename, int size)
 	return VFS_ERROR;
     }
 
-    stringcopy(tfs->buffer_md[index].name,filename, TFS_FILENAME_MAX);
-
-    /* Read allocation block and... */
-    req.block = TFS_ALLOCATION_BLOCK;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r==0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
-
-
-    /* ...find space for inode... */
-    tfs->buffer_md[index].inode = bitmap_findnset(tfs->buffer_bat,
-						  tfs->totalblocks);
-    if((int)tfs->buffer_md[index].inode == -1) {
+    /* Find space for inode... */
+    inode = bitmap_findnset(tfs->buffer_bat, tfs->totalblocks);
+    if(inode == -1) {
 	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }
@@ -350,60 +1651,51 @@ int tfs_create(fs_t *fs, char *filename, int size)
 						      tfs->totalblocks);
 	if((int)tfs->buffer_inode->block[i] == -1) {
 	    /* Disk full. No free block found. */
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
+	    break;
 	}
     }
-    
+
     /* Mark rest of the blocks in inode as unused. */
+    allocated = i;
     while(i < (TFS_BLOCK_SIZE / 4 - 1))
 	tfs->buffer_inode->block[i++] = 0;
 
-    req.block = TFS_ALLOCATION_BLOCK;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r==0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
+    /* The file is kept in core until its data blocks have been
+       written or zeroed. */
+    ic = NULL;
+    if(allocated == numblocks)
+	ic = tfs_inode_lock(tfs, inode);
 
-    req.block = TFS_DIRECTORY_BLOCK;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r==0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
+    r = 0;
+    if(ic != NULL) {
+	req.block = inode;
+	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
+	req.sem   = NULL;
+	r = tfs->disk->write_block(tfs->disk, &req);
+	if(r != 0 && numblocks > 0)
+	    ic->unwritten = 0;
+	tfs_inode_unlock(tfs, ic);
     }
 
-    req.block = tfs->buffer_md[index].inode;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r==0) {
-	/* An error occured. */
+    if(r == 0) {
+	/* Disk full or an error occured. Nothing has been written
+	   to the allocation block, so just release the blocks. */
+	bitmap_set(tfs->buffer_bat, inode, 0);
+	for(i=0; i<allocated; i++)
+	    bitmap_set(tfs->buffer_bat, tfs->buffer_inode->block[i], 0);
 	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }
 
-    /* Write zeros to the reserved blocks. Buffer for allocation block
-       is no longer needed, so lets use it as zero buffer. */ 
-    memoryset(tfs->buffer_bat, 0, TFS_BLOCK_SIZE);
-    for(i=0;i<numblocks;i++) {
-	req.block = tfs->buffer_inode->block[i];
-	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-	req.sem   = NULL;
-	r = tfs->disk->write_block(tfs->disk, &req);
-	if(r==0) {
-	    /* An error occured. */
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
-	}
-       
-    }
+    /* Add the directory entry. */
+    stringcopy(tfs->buffer_md[index].name,filename, TFS_FILENAME_MAX);
+    tfs->buffer_md[index].inode = inode;
+    tfs_dir_link(tfs, index);
+
+    if(!tfs->bat_dirty && !tfs->dir_dirty)
+	tfs->dirty_since = rtc_get_msec();
+    tfs->bat_dirty = 1;
+    tfs->dir_dirty = 1;
 
     semaphore_V(tfs->lock);
     return VFS_OK;
@@ -411,17 +1703,21 @@ int tfs_create(fs_t *fs, char *filename, int size)
 
 /**
  * Removes given file. Implements fs.remove(). Frees blocks allocated
- * for the file and directory entry.
+ * for the file and directory entry. The removal is committed to disk
+ * at once, together with any other delayed changes, so that the freed
+ * blocks are not reused while the disk still gives them to the file.
  *
  * @param fs Pointer to fs data structure of the device.
  * @param filename file to be removed.
  *
  * @return VFS_OK if file succesfully removed. If file not found
- * VFS_NOT_FOUND.
+ * VFS_NOT_FOUND. VFS_ERROR if the removal could not be written to
+ * disk; it is then written by a later commit.
  */
 int tfs_remove(fs_t *fs, char *filename) 
 {
     tfs_t *tfs = (tfs_t *)fs->internal;
+    tfs_incore_t *ic;
     gbd_request_t req;
     uint32_t i;
     int index = -1;
@@ -429,52 +1725,38 @@ int tfs_remove(fs_t *fs, char *filename)
 
     semaphore_P(tfs->lock);
 
-    /* Find file and inode block number from directory block.
+    /* Find file and inode block number from directory.
        If not found return VFS_NOT_FOUND. */
-    req.block = TFS_DIRECTORY_BLOCK;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
-
-    for(i=0;i<TFS_MAX_FILES;i++) {
-	if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
-	    index = i;
-	    break;
-	}
-    }
+    index = tfs_dir_lookup(tfs, filename);
     if(index == -1) {
 	semaphore_V(tfs->lock);
 	return VFS_NOT_FOUND;
     }
 
-    /* Read allocation block of the device and inode block of the file.
-       Free reserved blocks (marked in inode) from allocation block. */
-    req.block = TFS_ALLOCATION_BLOCK;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
+    /* Wait for reads and writes in progress on the file to finish. */
+    ic = tfs_inode_lock(tfs, tfs->buffer_md[index].inode);
+    if(ic == NULL) {
 	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }
 
+    /* The inode blocks are freed, so don't let open instances of the
+       file see a cached copy that may later belong to another file. */
+    tfs_icache_drop(tfs, ic);
+
+    /* Read inode block of the file. Free reserved blocks (marked in
+       inode) from allocation block. */
     req.block = tfs->buffer_md[index].inode;
     req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
     req.sem = NULL;
     r = tfs->disk->read_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
+	tfs_inode_unlock(tfs, ic);
 	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }
 
-
     bitmap_set(tfs->buffer_bat,tfs->buffer_md[index].inode,0);
     i=0;
     while(tfs->buffer_inode->block[i] != 0 && 
@@ -482,89 +1764,56 @@ int tfs_remove(fs_t *fs, char *filename)
 	bitmap_set(tfs->buffer_bat,tfs->buffer_inode->block[i],0);
 	i++;
     }
+
+    /* The blocks of a new file need no zeroing any more. */
+    ic->unwritten = -1;
     
     /* Free directory entry. */ 
+    tfs_dir_unlink(tfs, index);
     tfs->buffer_md[index].inode   = 0;
     tfs->buffer_md[index].name[0] = 0;
-    
-    req.block = TFS_ALLOCATION_BLOCK;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
 
-    req.block = TFS_DIRECTORY_BLOCK;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
+    if(!tfs->bat_dirty && !tfs->dir_dirty)
+	tfs->dirty_since = rtc_get_msec();
+    tfs->bat_dirty = 1;
+    tfs->dir_dirty = 1;
 
+    tfs_inode_unlock(tfs, ic);
+
+    r = tfs_commit(tfs);
     semaphore_V(tfs->lock);
-    return VFS_OK;
+    return r;
 }
 
 
 /**
- * Reads at most bufsize bytes from file to the buffer starting from
- * the offset. bufsize bytes is always read if possible. Returns
- * number of bytes read. Buffer size must be atleast bufsize.
- * Implements fs.read().
- * 
- * @param fs  Pointer to fs data structure of the device.
- * @param fileid Fileid of the file. 
- * @param buffer Pointer to the buffer the data is read into.
- * @param bufsize Maximum number of bytes to be read.
- * @param offset Start position of reading.
- *
- * @return Number of bytes read into buffer, or VFS_ERROR if error 
- * occured.
- */ 
-int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
+ * Does the work of tfs_read() for a file whose inode is locked, using
+ * the given operation buffer. The inode is taken from the inode cache
+ * when the file is open.
+ */
+static int tfs_read_blocks(tfs_t *tfs, tfs_incore_t *ic, tfs_opbuf_t *ob,
+			   void *buffer, int bufsize, int offset)
 {
-    tfs_t *tfs = (tfs_t *)fs->internal;
-    gbd_request_t req;
+    tfs_inode_t *inode;
     int b1, b2;
     int read=0;
     int r;
 
-    semaphore_P(tfs->lock);
-
-    /* fileid is blocknum so ensure that we don't read system blocks
-       or outside the disk */
-    if(fileid < 2 || fileid > (int)tfs->totalblocks) {
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
-
-    req.block = fileid;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
-    req.sem   = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
+    inode = tfs_inode_get(tfs, ic, &ob->inode);
+    if(inode == NULL) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }   
 
     /* Check that offset is inside the file */
-    if(offset < 0 || offset > (int)tfs->buffer_inode->filesize) {
-	semaphore_V(tfs->lock);
+    if(offset < 0 || offset > (int)inode->filesize) {
 	return VFS_ERROR;
     }
 
     /* Read at most what is left from the file. */ 
-    bufsize = MIN(bufsize,((int)tfs->buffer_inode->filesize) - offset);
+    bufsize = MIN(bufsize,((int)inode->filesize) - offset);
 
     if(bufsize==0) {
-	semaphore_V(tfs->lock);
 	return 0;
     }
 
@@ -577,13 +1826,9 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
     /* Read blocks from b1 to b2. First and last are
        special cases because whole block might not be written
        to the buffer. */
-    req.block = tfs->buffer_inode->block[b1];
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
+    r = tfs_read_file_block(tfs, ic, inode, b1, ob->data);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -592,99 +1837,188 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
     read = MIN(TFS_BLOCK_SIZE - (offset % TFS_BLOCK_SIZE),bufsize);
     memcopy(read,
 	    buffer,
-	    (const uint32_t *)(((uint32_t)tfs->buffer_bat) + 
+	    (const uint32_t *)(((uint32_t)ob->data) + 
 			       (offset % TFS_BLOCK_SIZE)));   
     
     buffer = (void *)((uint32_t)buffer + read);
     b1++;
     while(b1 <= b2) {
-	req.block = tfs->buffer_inode->block[b1];
-	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-	req.sem   = NULL;
-	r = tfs->disk->read_block(tfs->disk, &req);
+	r = tfs_read_file_block(tfs, ic, inode, b1, ob->data);
 	if(r == 0) {
 	    /* An error occured. */
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
+		    return VFS_ERROR;
 	}
 
 	if(b1 == b2) {
 	    /* Last block. Whole block might not be read.*/
 	    memcopy(bufsize - read,
 		    buffer,
-		    (const uint32_t *)tfs->buffer_bat);
+		    (const uint32_t *)ob->data);
 	    read += (bufsize - read);
 	}
 	else {
 	    /* Read whole block */
 	    memcopy(TFS_BLOCK_SIZE,
 		    buffer,
-		    (const uint32_t *)tfs->buffer_bat);
+		    (const uint32_t *)ob->data);
 	    read += TFS_BLOCK_SIZE;
 	    buffer = (void *)((uint32_t)buffer + TFS_BLOCK_SIZE);
 	}
 	b1++;
     }
 
-    semaphore_V(tfs->lock);
     return read;
 }
 
 
-
 /**
- * Write at most datasize bytes from buffer to the file starting from
- * the offset. datasize bytes is always written if possible. Returns
- * number of bytes written. Buffer size must be atleast datasize.
+ * Reads at most bufsize bytes from file to the buffer starting from
+ * the offset. bufsize bytes is always read if possible. Returns
+ * number of bytes read. Buffer size must be atleast bufsize.
  * Implements fs.read().
  * 
  * @param fs  Pointer to fs data structure of the device.
  * @param fileid Fileid of the file. 
- * @param buffer Pointer to the buffer the data is written from.
- * @param datasize Maximum number of bytes to be written.
- * @param offset Start position of writing.
+ * @param buffer Pointer to the buffer the data is read into.
+ * @param bufsize Maximum number of bytes to be read.
+ * @param offset Start position of reading.
  *
- * @return Number of bytes written into buffer, or VFS_ERROR if error 
+ * Only the inode of the file is locked, so reads and writes of
+ * different files proceed in parallel.
+ *
+ * @return Number of bytes read into buffer, or VFS_ERROR if error 
  * occured.
  */ 
-int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
+int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 {
     tfs_t *tfs = (tfs_t *)fs->internal;
-    gbd_request_t req;
-    int b1, b2;
-    int written=0;
+    tfs_incore_t *ic;
+    tfs_opbuf_t *ob;
     int r;
 
-    semaphore_P(tfs->lock);
-
     /* fileid is blocknum so ensure that we don't read system blocks
        or outside the disk */
-    if(fileid < 2 || fileid > (int)tfs->totalblocks) {
-	semaphore_V(tfs->lock);
+    if(fileid < 2 || fileid > (int)tfs->totalblocks)
 	return VFS_ERROR;
+
+    ic = tfs_inode_lock(tfs, fileid);
+    if(ic == NULL)
+	return VFS_ERROR;
+    ob = tfs_opbuf_get(tfs);
+    r = tfs_read_blocks(tfs, ic, ob, buffer, bufsize, offset);
+    tfs_opbuf_put(tfs, ob);
+    tfs_inode_unlock(tfs, ic);
+
+    return r;
+}
+
+
+/**
+ * Starts reading the blocks of a file covering size bytes from offset
+ * into the readahead cache, where tfs_read() finds them. Implements
+ * fs.readahead(). Does not wait for the reads to complete. Blocks
+ * already cached are skipped, and at most TFS_RA_BATCH blocks are read
+ * in one call.
+ *
+ * @param fs  Pointer to fs data structure of the device.
+ * @param fileid Fileid of the file.
+ * @param offset Start position of the readahead.
+ * @param size Number of bytes to read ahead.
+ */
+void tfs_readahead(fs_t *fs, int fileid, int offset, int size)
+{
+    tfs_t *tfs = (tfs_t *)fs->internal;
+    tfs_incore_t *ic;
+    tfs_opbuf_t *ob;
+    tfs_inode_t *inode;
+    tfs_raslot_t *slot;
+    uint32_t block;
+    int b1, b2, n;
+
+    if(tfs->ra_data == NULL || offset < 0 || size <= 0)
+	return;
+
+    if(fileid < 2 || fileid > (int)tfs->totalblocks)
+	return;
+
+    ic = tfs_inode_lock(tfs, fileid);
+    if(ic == NULL)
+	return;
+    ob = tfs_opbuf_get(tfs);
+
+    inode = tfs_inode_get(tfs, ic, &ob->inode);
+    if(inode != NULL && offset < (int)inode->filesize) {
+	b1 = offset / TFS_BLOCK_SIZE;
+	b2 = (MIN(offset + size, (int)inode->filesize) - 1) / TFS_BLOCK_SIZE;
+
+	/* Unwritten blocks of a new file are not read from the disk. */
+	if(ic->unwritten >= 0)
+	    b2 = MIN(b2, ic->unwritten - 1);
+
+	for(n=0; b1 <= b2 && n < (int)TFS_RA_BATCH; b1++) {
+	    block = inode->block[b1];
+
+	    slot = tfs_ra_claim(tfs, block);
+	    if(slot != NULL) {
+		/* Already cached or on its way */
+		tfs_ra_release(tfs, slot);
+		continue;
+	    }
+
+	    slot = tfs_ra_victim(tfs);
+	    if(slot == NULL)
+		break;
+
+	    tfs_ra_wait(slot);
+	    slot->block = block;
+	    slot->state = TFS_RA_PENDING;
+	    slot->used  = 0;
+	    slot->req.block = block;
+	    slot->req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->ra_data +
+					      (slot - tfs->ra) * TFS_BLOCK_SIZE);
+	    slot->req.sem   = slot->done;
+	    if(tfs->disk->read_block(tfs->disk, &slot->req) == 0)
+		slot->state = TFS_RA_FREE;
+	    tfs_ra_release(tfs, slot);
+	    n++;
+	}
     }
- 
-    req.block = fileid;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
-    req.sem   = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
+
+    tfs_opbuf_put(tfs, ob);
+    tfs_inode_unlock(tfs, ic);
+}
+
+
+
+/**
+ * Does the work of tfs_write() for a file whose inode is locked, using
+ * the given operation buffer. The inode is taken from the inode cache
+ * when the file is open.
+ */
+static int tfs_write_blocks(tfs_t *tfs, tfs_incore_t *ic, tfs_opbuf_t *ob,
+			    void *buffer, int datasize, int offset)
+{
+    gbd_request_t req;
+    tfs_inode_t *inode;
+    int b1, b2;
+    int written=0;
+    int r;
+
+    inode = tfs_inode_get(tfs, ic, &ob->inode);
+    if(inode == NULL) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }
 
     /* check that start position is inside the disk */
-    if(offset < 0 || offset > (int)tfs->buffer_inode->filesize) {
-	semaphore_V(tfs->lock);
+    if(offset < 0 || offset > (int)inode->filesize) {
 	return VFS_ERROR;
     }
 
     /* write at most the number of bytes left in the file */
-    datasize = MIN(datasize,(int)tfs->buffer_inode->filesize-offset);
+    datasize = MIN(datasize,(int)inode->filesize-offset);
 
     if(datasize==0) {
-	semaphore_V(tfs->lock);
 	return 0;
     }
 
@@ -694,6 +2028,12 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
     /* last block to be written into */
     b2 = (offset+datasize-1) / TFS_BLOCK_SIZE;
 
+    /* Unwritten blocks of a new file before the first one written
+       now must be zeroed first. */
+    if(!tfs_zero_blocks(tfs, ic, inode, ob->data, b1)) {
+	return VFS_ERROR;
+    }
+
     /* Write data to blocks from b1 to b2. First and last are special
        cases because whole block might not be written. Because of possible
        partial write, first and last block must be read before writing. 
@@ -704,29 +2044,25 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
        function. */
     written = MIN(TFS_BLOCK_SIZE - (offset % TFS_BLOCK_SIZE),datasize);
     if(written < TFS_BLOCK_SIZE) {
-	req.block = tfs->buffer_inode->block[b1];
-	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-	req.sem   = NULL;
-	r = tfs->disk->read_block(tfs->disk, &req);
+	r = tfs_read_file_block(tfs, ic, inode, b1, ob->data);
 	if(r == 0) {
 	    /* An error occured. */
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
+		    return VFS_ERROR;
 	}
     }
 
     memcopy(written,
-	    (uint32_t *)(((uint32_t)tfs->buffer_bat) + 
+	    (uint32_t *)(((uint32_t)ob->data) + 
 			       (offset % TFS_BLOCK_SIZE)),
 	    buffer);   
     
-    req.block = tfs->buffer_inode->block[b1];
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
+    tfs_ra_forget(tfs, inode->block[b1]);
+    req.block = inode->block[b1];
+    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)ob->data);
     req.sem   = NULL;
     r = tfs->disk->write_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -738,51 +2074,90 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 	    /* Last block. If partial write, read the block first.
 	       Write anyway always to the beginning of the block */ 
 	    if((datasize - written)  < TFS_BLOCK_SIZE) {
-		req.block = tfs->buffer_inode->block[b1];
-		req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-		req.sem   = NULL;
-		r = tfs->disk->read_block(tfs->disk, &req);
+		r = tfs_read_file_block(tfs, ic, inode, b1, ob->data);
 		if(r == 0) {
 		    /* An error occured. */
-		    semaphore_V(tfs->lock);
-		    return VFS_ERROR;
+				    return VFS_ERROR;
 		}
 	    }
 	    
 	    memcopy(datasize - written,
-		    (uint32_t *)tfs->buffer_bat,
+		    (uint32_t *)ob->data,
 		    buffer);
 	    written = datasize;
 	}
 	else {
 	    /* Write whole block */
 	    memcopy(TFS_BLOCK_SIZE,
-		    (uint32_t *)tfs->buffer_bat,
+		    (uint32_t *)ob->data,
 		    buffer);
 	    written += TFS_BLOCK_SIZE;
 	    buffer = (void *)((uint32_t)buffer + TFS_BLOCK_SIZE);
 	}
 
-	req.block = tfs->buffer_inode->block[b1];
-	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
+	tfs_ra_forget(tfs, inode->block[b1]);
+	req.block = inode->block[b1];
+	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)ob->data);
 	req.sem   = NULL;
 	r = tfs->disk->write_block(tfs->disk, &req);
 	if(r == 0) {
 	    /* An error occured. */
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
+		    return VFS_ERROR;
 	}
 
 	b1++;
     }
 
-    semaphore_V(tfs->lock);
+    tfs_set_written(ic, inode, b2 + 1);
+
     return written;
 }
 
+
+/**
+ * Write at most datasize bytes from buffer to the file starting from
+ * the offset. datasize bytes is always written if possible. Returns
+ * number of bytes written. Buffer size must be atleast datasize.
+ * Implements fs.read().
+ * 
+ * @param fs  Pointer to fs data structure of the device.
+ * @param fileid Fileid of the file. 
+ * @param buffer Pointer to the buffer the data is written from.
+ * @param datasize Maximum number of bytes to be written.
+ * @param offset Start position of writing.
+ *
+ * Only the inode of the file is locked, so reads and writes of
+ * different files proceed in parallel.
+ *
+ * @return Number of bytes written into buffer, or VFS_ERROR if error 
+ * occured.
+ */ 
+int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
+{
+    tfs_t *tfs = (tfs_t *)fs->internal;
+    tfs_incore_t *ic;
+    tfs_opbuf_t *ob;
+    int r;
+
+    /* fileid is blocknum so ensure that we don't read system blocks
+       or outside the disk */
+    if(fileid < 2 || fileid > (int)tfs->totalblocks)
+	return VFS_ERROR;
+
+    ic = tfs_inode_lock(tfs, fileid);
+    if(ic == NULL)
+	return VFS_ERROR;
+    ob = tfs_opbuf_get(tfs);
+    r = tfs_write_blocks(tfs, ic, ob, buffer, datasize, offset);
+    tfs_opbuf_put(tfs, ob);
+    tfs_inode_unlock(tfs, ic);
+
+    return r;
+}
+
 /**
  * Get number of free bytes on the disk. Implements fs.getfree().
- * Reads allocation blocks and counts number of zeros in the bitmap.
+ * Counts number of zeros in the allocation bitmap kept in memory.
  * Result is multiplied by the block size and returned.
  *
  * @param fs Pointer to the fs data structure of the device.
@@ -792,22 +2167,12 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 int tfs_getfree(fs_t *fs)
 {
     tfs_t *tfs = (tfs_t *)fs->internal;
-    gbd_request_t req;
     int allocated = 0;
     uint32_t i;
-    int r;
 
     semaphore_P(tfs->lock);
 
-    req.block = TFS_ALLOCATION_BLOCK;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
+    tfs_commit_if_due(tfs);
 
     for(i=0;i<tfs->totalblocks;i++) {
 	allocated += bitmap_get(tfs->buffer_bat,i);
@@ -58,6 +58,53 @@
 #define TFS_VOLUMENAME_MAX 16
 #define TFS_FILENAME_MAX 16
 
+/* Header block. Everything after the fields below is zero. Volumes
+   made before the journal existed have zero journal fields. */
+typedef struct {
+    /* TFS_MAGIC */
+    uint32_t magic;
+
+    /* Volume name */
+    char     volumename[TFS_VOLUMENAME_MAX];
+
+    /* First block and length of the metadata journal, 0 if the
+       volume has no journal */
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+} tfs_header_t;
+
+/* Magic number of a journal commit block holding a transaction */
+#define TFS_JOURNAL_MAGIC 0x4a524e4c
+
+/* Blocks in the journal: the commit block followed by room for a copy
+   of the allocation block and the directory block */
+#define TFS_JOURNAL_BLOCKS 3
+
+/* Most block copies in one transaction */
+#define TFS_JOURNAL_COPIES (TFS_JOURNAL_BLOCKS - 1)
+
+/* Journal commit block, the first block of the journal. The copies of
+   the blocks changed by the transaction follow it. Changes to the
+   allocation and directory blocks are first written to the journal
+   and only then to their own blocks, so that a crash in between can
+   be repaired by writing the copies again when the volume is next
+   mounted. The commit block and the copies are written together, and
+   the transaction is only complete if the checksum of every copy
+   matches. The magic is cleared when nothing needs replaying. */
+typedef struct {
+    /* TFS_JOURNAL_MAGIC, or 0 if the journal is empty */
+    uint32_t magic;
+
+    /* Number of block copies in the transaction */
+    uint32_t count;
+
+    /* Block numbers where the copies belong */
+    uint32_t target[TFS_JOURNAL_COPIES];
+
+    /* Checksums of the copies, see tfs_journal_checksum() */
+    uint32_t checksum[TFS_JOURNAL_COPIES];
+} tfs_journal_t;
+
 /*
    Maximum number of block pointers in one inode. Block pointers
    are of type uint32_t and one pointer "slot" is reserved for
@@ -100,7 +147,10 @@ typedef struct {
 #define TFS_MAX_FILES (TFS_BLOCK_SIZE/sizeof(tfs_direntry_t))
 
 /* functions */
+uint32_t tfs_journal_checksum(const uint32_t *block);
+
 fs_t * tfs_init(gbd_t *disk);
+int tfs_format(gbd_t *disk, char *volumename);
 
 int tfs_unmount(fs_t *fs);
 int tfs_open(fs_t *fs, char *filename);
@@ -109,6 +159,8 @@ int tfs_create(fs_t *fs, char *filename, int size);
 int tfs_remove(fs_t *fs, char *filename);
 int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset);
 int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset);
+void tfs_readahead(fs_t *fs, int fileid, int offset, int size);
+int tfs_sync(fs_t *fs);
 int tfs_getfree(fs_t *fs);
 
 
@@ -0,0 +1,1066 @@
+/*
+ * Extent based Trivial Filesystem (TFS2).
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#include "kernel/assert.h"
+#include "kernel/semaphore.h"
+#include "vm/pagepool.h"
+#include "drivers/gbd.h"
+#include "fs/vfs.h"
+#include "fs/tfs2.h"
+#include "lib/libc.h"
+#include "lib/bitmap.h"
+
+/**@name Extent based Trivial Filesystem (TFS2)
+ *
+ * TFS2 lifts the size limits of TFS while keeping its simplicity:
+ * files are described by extents reachable through the inode, an
+ * indirect extent block and a doubly indirect block; the allocation
+ * bitmap and the directory may span any number of blocks, and
+ * directory entries are placed by hashing the file name so that a
+ * lookup usually reads a single directory block.
+ *
+ * Like TFS, one operation at a time is served. The block last read
+ * into each buffer is remembered, so metadata blocks are only read
+ * again when some other block has been needed in between.
+ *
+ * @{
+ */
+
+/* Data structure used internally by TFS2. It is initialized during
+   tfs2_init() and lives in the same page as the buffers. */
+typedef struct {
+    /* Size of the volume in blocks and the number of free ones */
+    uint32_t       totalblocks;
+    uint32_t       freeblocks;
+
+    /* Volume layout, from the header block */
+    uint32_t       bitmap_start;
+    uint32_t       bitmap_blocks;
+    uint32_t       dir_start;
+    uint32_t       dir_blocks;
+
+    /* Pointer to gbd device performing tfs2 */
+    gbd_t          *disk;
+
+    /* lock for mutual exclusion of fs-operations */
+    semaphore_t    *lock;
+
+    /* Disk block currently held in each buffer, zero if none. Block
+       zero is the header, which is never kept in these buffers. */
+    uint32_t       inode_block;
+    uint32_t       bat_block;
+    uint32_t       md_block;
+    uint32_t       ext_block;
+    uint32_t       dind_block;
+
+    /* Has buffer_bat been modified after it was read? */
+    int            bat_dirty;
+
+    /* Extent found by the last tfs2_bmap() call: the inode it belongs
+       to, its index in the extent list, the file block it starts at
+       and the extent itself. map_inode is zero if nothing is cached. */
+    uint32_t       map_inode;
+    uint32_t       map_index;
+    uint32_t       map_fblock;
+    tfs2_extent_t  map_extent;
+
+    /* Buffers for read/write operations on disk. */
+    tfs2_inode_t   *buffer_inode;   /* buffer for inode blocks */
+    bitmap_t       *buffer_bat;     /* buffer for one bitmap block */
+    tfs_direntry_t *buffer_md;      /* buffer for one directory block */
+    tfs2_extent_t  *buffer_ext;     /* buffer for extent blocks */
+    uint32_t       *buffer_dind;    /* buffer for doubly indirect block */
+    uint8_t        *buffer_data;    /* buffer for partial data blocks */
+} tfs2_t;
+
+/**
+ * Hashes a file name to pick its home slot in the directory. The
+ * same function is used by tfstool, so it must never change.
+ *
+ * @param name The file name.
+ *
+ * @return The hash value.
+ */
+uint32_t tfs2_hash(const char *name)
+{
+    uint32_t h = 5381;
+
+    while(*name != '\0')
+	h = h * 33 + (uint8_t)*name++;
+
+    return h;
+}
+
+/**
+ * Reads or writes one block synchronously.
+ *
+ * @param tfs2 The filesystem.
+ * @param block Block number.
+ * @param buf Kernel address of the buffer.
+ * @param write Non-zero to write, zero to read.
+ *
+ * @return Non-zero on success, zero on error.
+ */
+static int tfs2_rw(tfs2_t *tfs2, uint32_t block, void *buf, int write)
+{
+    gbd_request_t req;
+
+    req.block = block;
+    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)buf);
+    req.sem   = NULL;
+
+    if(write)
+	return tfs2->disk->write_block(tfs2->disk, &req);
+    return tfs2->disk->read_block(tfs2->disk, &req);
+}
+
+/**
+ * Reads a block into a buffer unless the buffer already holds it.
+ *
+ * @param tfs2 The filesystem.
+ * @param block Block number.
+ * @param buf The buffer.
+ * @param cached The field of tfs2 remembering what buf holds.
+ *
+ * @return Non-zero on success, zero on error.
+ */
+static int tfs2_load(tfs2_t *tfs2, uint32_t block, void *buf,
+		     uint32_t *cached)
+{
+    if(*cached == block)
+	return 1;
+
+    *cached = 0;
+    if(!tfs2_rw(tfs2, block, buf, 0))
+	return 0;
+
+    *cached = block;
+    return 1;
+}
+
+/**
+ * Forgets the contents of the extent buffers and the cached mapping.
+ * Needed whenever the buffers have been used for something else or
+ * the blocks they held may have been freed.
+ *
+ * @param tfs2 The filesystem.
+ */
+static void tfs2_forget_extents(tfs2_t *tfs2)
+{
+    tfs2->ext_block  = 0;
+    tfs2->dind_block = 0;
+    tfs2->map_inode  = 0;
+}
+
+/**
+ * Writes the bitmap buffer back to disk if it has been modified.
+ *
+ * @param tfs2 The filesystem.
+ *
+ * @return Non-zero on success, zero on error.
+ */
+static int tfs2_bat_flush(tfs2_t *tfs2)
+{
+    if(tfs2->bat_dirty) {
+	if(!tfs2_rw(tfs2, tfs2->bat_block, tfs2->buffer_bat, 1))
+	    return 0;
+	tfs2->bat_dirty = 0;
+    }
+    return 1;
+}
+
+/**
+ * Makes the bitmap buffer hold the bitmap block covering the given
+ * block, writing the previous one back if needed.
+ *
+ * @param tfs2 The filesystem.
+ * @param block Block whose allocation bit is needed.
+ *
+ * @return Non-zero on success, zero on error.
+ */
+static int tfs2_bat_load(tfs2_t *tfs2, uint32_t block)
+{
+    uint32_t bat = tfs2->bitmap_start + block / TFS2_BITS_PER_BLOCK;
+
+    if(tfs2->bat_block == bat)
+	return 1;
+
+    if(!tfs2_bat_flush(tfs2))
+	return 0;
+
+    return tfs2_load(tfs2, bat, tfs2->buffer_bat, &tfs2->bat_block);
+}
+
+/**
+ * Marks a block free. The change reaches the disk on the next
+ * tfs2_bat_flush().
+ *
+ * @param tfs2 The filesystem.
+ * @param block The block to free.
+ *
+ * @return Non-zero on success, zero on error.
+ */
+static int tfs2_free_block(tfs2_t *tfs2, uint32_t block)
+{
+    if(!tfs2_bat_load(tfs2, block))
+	return 0;
+
+    if(bitmap_get(tfs2->buffer_bat, block % TFS2_BITS_PER_BLOCK)) {
+	bitmap_set(tfs2->buffer_bat, block % TFS2_BITS_PER_BLOCK, 0);
+	tfs2->bat_dirty = 1;
+	tfs2->freeblocks++;
+    }
+    return 1;
+}
+
+/**
+ * Allocates the first free block at or after hint, wrapping around
+ * at the end of the volume. Allocating from where the previous block
+ * of the same file was found keeps files in long extents.
+ *
+ * @param tfs2 The filesystem.
+ * @param hint Block to start the search from.
+ *
+ * @return The allocated block, or zero if the disk is full or an
+ * error occurred.
+ */
+static uint32_t tfs2_alloc_block(tfs2_t *tfs2, uint32_t hint)
+{
+    uint32_t block, n, bit;
+
+    if(tfs2->freeblocks == 0)
+	return 0;
+
+    if(hint >= tfs2->totalblocks)
+	hint = 0;
+
+    block = hint;
+    for(n = 0; n < tfs2->totalblocks; n++) {
+	if(!tfs2_bat_load(tfs2, block))
+	    return 0;
+
+	bit = block % TFS2_BITS_PER_BLOCK;
+
+	/* Skip fully allocated words at once */
+	if(bit % 32 == 0 && tfs2->buffer_bat[bit / 32] == 0xffffffff &&
+	   block + 32 <= tfs2->totalblocks) {
+	    n += 31;
+	    block += 32;
+	} else if(bitmap_get(tfs2->buffer_bat, bit) == 0) {
+	    bitmap_set(tfs2->buffer_bat, bit, 1);
+	    tfs2->bat_dirty = 1;
+	    tfs2->freeblocks--;
+	    return block;
+	} else {
+	    block++;
+	}
+
+	if(block >= tfs2->totalblocks)
+	    block = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns a pointer to a directory entry, reading the directory
+ * block holding it if needed.
+ *
+ * @param tfs2 The filesystem.
+ * @param slot Index of the entry in the whole directory.
+ *
+ * @return The entry inside buffer_md, or NULL on error.
+ */
+static tfs_direntry_t *tfs2_dir_entry(tfs2_t *tfs2, uint32_t slot)
+{
+    uint32_t block = tfs2->dir_start + slot / TFS2_DIRENTRIES_PER_BLOCK;
+
+    if(!tfs2_load(tfs2, block, tfs2->buffer_md, &tfs2->md_block))
+	return NULL;
+
+    return &tfs2->buffer_md[slot % TFS2_DIRENTRIES_PER_BLOCK];
+}
+
+/**
+ * Finds a file from the directory. Entries are placed at the slot
+ * given by the name hash or, if that is taken, at the first usable
+ * slot after it. A lookup therefore probes forward from the home
+ * slot until it finds the name or a never used slot.
+ *
+ * @param tfs2 The filesystem.
+ * @param filename The name to look for.
+ * @param freeslot If not NULL, the first slot on the probe path
+ * where the name could be inserted is stored here, or -1 if the
+ * directory is full.
+ *
+ * @return Slot of the entry, VFS_NOT_FOUND or VFS_ERROR.
+ */
+static int tfs2_dir_find(tfs2_t *tfs2, char *filename, int *freeslot)
+{
+    tfs_direntry_t *entry;
+    uint32_t nslots = tfs2->dir_blocks * TFS2_DIRENTRIES_PER_BLOCK;
+    uint32_t slot, i;
+
+    if(freeslot != NULL)
+	*freeslot = -1;
+
+    slot = tfs2_hash(filename) % nslots;
+    for(i = 0; i < nslots; i++) {
+	entry = tfs2_dir_entry(tfs2, slot);
+	if(entry == NULL)
+	    return VFS_ERROR;
+
+	if(entry->inode == TFS2_DIR_FREE || entry->inode == TFS2_DIR_DELETED) {
+	    if(freeslot != NULL && *freeslot < 0)
+		*freeslot = slot;
+	    if(entry->inode == TFS2_DIR_FREE)
+		return VFS_NOT_FOUND;
+	} else if(stringcmp(entry->name, filename) == 0) {
+	    return slot;
+	}
+
+	if(++slot == nslots)
+	    slot = 0;
+    }
+
+    return VFS_NOT_FOUND;
+}
+
+/**
+ * Returns a pointer to an extent of the file whose inode is in
+ * buffer_inode, reading extent blocks as needed.
+ *
+ * @param tfs2 The filesystem.
+ * @param index Index of the extent in the extent list.
+ *
+ * @return The extent, or NULL on error.
+ */
+static tfs2_extent_t *tfs2_extent(tfs2_t *tfs2, uint32_t index)
+{
+    tfs2_inode_t *inode = tfs2->buffer_inode;
+    uint32_t block;
+
+    if(index < TFS2_DIRECT_EXTENTS)
+	return &inode->extent[index];
+    index -= TFS2_DIRECT_EXTENTS;
+
+    if(index < TFS2_EXTENTS_PER_BLOCK) {
+	block = inode->indirect;
+    } else {
+	index -= TFS2_EXTENTS_PER_BLOCK;
+	if(!tfs2_load(tfs2, inode->dindirect, tfs2->buffer_dind,
+		      &tfs2->dind_block))
+	    return NULL;
+	block = tfs2->buffer_dind[index / TFS2_EXTENTS_PER_BLOCK];
+	index %= TFS2_EXTENTS_PER_BLOCK;
+    }
+
+    if(block == 0 ||
+       !tfs2_load(tfs2, block, tfs2->buffer_ext, &tfs2->ext_block))
+	return NULL;
+
+    return &tfs2->buffer_ext[index];
+}
+
+/**
+ * Maps a block of the file whose inode is in buffer_inode to a disk
+ * block. The extent found is remembered and the next search starts
+ * from it, so sequential access does not walk the extent list.
+ *
+ * @param tfs2 The filesystem.
+ * @param fblock Block number inside the file.
+ *
+ * @return The disk block, or zero on error.
+ */
+static uint32_t tfs2_bmap(tfs2_t *tfs2, uint32_t fblock)
+{
+    tfs2_extent_t *extent;
+    uint32_t index = 0, first = 0;
+
+    if(tfs2->map_inode == tfs2->inode_block && fblock >= tfs2->map_fblock) {
+	if(fblock < tfs2->map_fblock + tfs2->map_extent.length)
+	    return tfs2->map_extent.start + fblock - tfs2->map_fblock;
+
+	index = tfs2->map_index + 1;
+	first = tfs2->map_fblock + tfs2->map_extent.length;
+    }
+
+    for(; index < tfs2->buffer_inode->nextents; index++) {
+	extent = tfs2_extent(tfs2, index);
+	if(extent == NULL)
+	    return 0;
+
+	if(fblock < first + extent->length) {
+	    tfs2->map_inode  = tfs2->inode_block;
+	    tfs2->map_index  = index;
+	    tfs2->map_fblock = first;
+	    tfs2->map_extent = *extent;
+	    return extent->start + fblock - first;
+	}
+	first += extent->length;
+    }
+
+    return 0;
+}
+
+/**
+ * Appends an extent to the file being built in buffer_inode by
+ * tfs2_create(). Extent blocks are allocated as needed and written
+ * out when they become full; tfs2_extents_finish() writes the last,
+ * partially filled ones.
+ *
+ * @param tfs2 The filesystem.
+ * @param start First block of the extent.
+ * @param length Number of blocks in the extent.
+ *
+ * @return Non-zero on success, zero if the extent list is full or
+ * an error occurred.
+ */
+static int tfs2_extent_append(tfs2_t *tfs2, uint32_t start, uint32_t length)
+{
+    tfs2_inode_t *inode = tfs2->buffer_inode;
+    uint32_t index = inode->nextents;
+    uint32_t *block;
+
+    if(index >= TFS2_MAX_EXTENTS)
+	return 0;
+
+    if(index < TFS2_DIRECT_EXTENTS) {
+	inode->extent[index].start  = start;
+	inode->extent[index].length = length;
+	inode->nextents++;
+	return 1;
+    }
+    index -= TFS2_DIRECT_EXTENTS;
+
+    if(index < TFS2_EXTENTS_PER_BLOCK) {
+	block = &inode->indirect;
+    } else {
+	index -= TFS2_EXTENTS_PER_BLOCK;
+	if(index == 0) {
+	    inode->dindirect = tfs2_alloc_block(tfs2, start + length);
+	    if(inode->dindirect == 0)
+		return 0;
+	    memoryset(tfs2->buffer_dind, 0, TFS_BLOCK_SIZE);
+	}
+	block = &tfs2->buffer_dind[index / TFS2_EXTENTS_PER_BLOCK];
+	index %= TFS2_EXTENTS_PER_BLOCK;
+    }
+
+    if(index == 0) {
+	*block = tfs2_alloc_block(tfs2, start + length);
+	if(*block == 0)
+	    return 0;
+	memoryset(tfs2->buffer_ext, 0, TFS_BLOCK_SIZE);
+    }
+
+    tfs2->buffer_ext[index].start  = start;
+    tfs2->buffer_ext[index].length = length;
+    inode->nextents++;
+
+    if(index == TFS2_EXTENTS_PER_BLOCK - 1)
+	return tfs2_rw(tfs2, *block, tfs2->buffer_ext, 1);
+    return 1;
+}
+
+/**
+ * Writes the extent blocks tfs2_extent_append() has not yet written.
+ *
+ * @param tfs2 The filesystem.
+ *
+ * @return Non-zero on success, zero on error.
+ */
+static int tfs2_extents_finish(tfs2_t *tfs2)
+{
+    tfs2_inode_t *inode = tfs2->buffer_inode;
+    uint32_t index, block;
+
+    if(inode->nextents > TFS2_DIRECT_EXTENTS) {
+	index = inode->nextents - TFS2_DIRECT_EXTENTS;
+	if(index <= TFS2_EXTENTS_PER_BLOCK) {
+	    block = inode->indirect;
+	} else {
+	    index -= TFS2_EXTENTS_PER_BLOCK;
+	    block = tfs2->buffer_dind[(index - 1) / TFS2_EXTENTS_PER_BLOCK];
+	}
+
+	/* Full blocks were written by tfs2_extent_append() */
+	if(index % TFS2_EXTENTS_PER_BLOCK != 0 &&
+	   !tfs2_rw(tfs2, block, tfs2->buffer_ext, 1))
+	    return 0;
+    }
+
+    if(inode->dindirect != 0 &&
+       !tfs2_rw(tfs2, inode->dindirect, tfs2->buffer_dind, 1))
+	return 0;
+
+    return 1;
+}
+
+/**
+ * Frees the data and extent blocks of the file whose inode is in
+ * buffer_inode. The inode block itself is not freed.
+ *
+ * @param tfs2 The filesystem.
+ *
+ * @return Non-zero on success, zero on error.
+ */
+static int tfs2_free_file(tfs2_t *tfs2)
+{
+    tfs2_inode_t *inode = tfs2->buffer_inode;
+    tfs2_extent_t *extent;
+    uint32_t i, j;
+
+    tfs2_forget_extents(tfs2);
+
+    for(i = 0; i < inode->nextents; i++) {
+	extent = tfs2_extent(tfs2, i);
+	if(extent == NULL)
+	    return 0;
+
+	for(j = 0; j < extent->length; j++)
+	    if(!tfs2_free_block(tfs2, extent->start + j))
+		return 0;
+    }
+
+    if(inode->indirect != 0 && !tfs2_free_block(tfs2, inode->indirect))
+	return 0;
+
+    if(inode->dindirect != 0) {
+	if(!tfs2_load(tfs2, inode->dindirect, tfs2->buffer_dind,
+		      &tfs2->dind_block))
+	    return 0;
+	for(i = 0; i < TFS2_POINTERS_PER_BLOCK; i++)
+	    if(tfs2->buffer_dind[i] != 0 &&
+	       !tfs2_free_block(tfs2, tfs2->buffer_dind[i]))
+		return 0;
+	if(!tfs2_free_block(tfs2, inode->dindirect))
+	    return 0;
+    }
+
+    tfs2_forget_extents(tfs2);
+    return 1;
+}
+
+/**
+ * Initialize TFS2. Allocates 1 page of memory for the filesystem
+ * data structure, tfs2 data structure and buffers needed, reads the
+ * header and counts the free blocks from the bitmap.
+ *
+ * @param disk Pointer to gbd-device performing tfs2.
+ *
+ * @return Pointer to the filesystem data structure fs_t, if fails
+ * return NULL.
+ */
+fs_t * tfs2_init(gbd_t *disk)
+{
+    uint32_t addr;
+    tfs2_header_t header;
+    fs_t *fs;
+    tfs2_t *tfs2;
+    semaphore_t *sem;
+    uint32_t i, block;
+
+    if(disk->block_size(disk) != TFS_BLOCK_SIZE)
+	return NULL;
+
+    /* check semaphore availability before memory allocation */
+    sem = semaphore_create(1);
+    if (sem == NULL) {
+	kprintf("tfs2_init: could not create a new semaphore.\n");
+	return NULL;
+    }
+
+    addr = pagepool_get_phys_page();
+    if(addr == 0) {
+	semaphore_destroy(sem);
+	kprintf("tfs2_init: could not allocate memory.\n");
+	return NULL;
+    }
+    addr = ADDR_PHYS_TO_KERNEL(addr);      /* transform to vm address */
+
+    /* Assert that one page is enough */
+    KERNEL_ASSERT(PAGE_SIZE >= (6*TFS_BLOCK_SIZE+sizeof(tfs2_t)+sizeof(fs_t)));
+
+    fs   = (fs_t *)addr;
+    tfs2 = (tfs2_t *)(addr + sizeof(fs_t));
+    memoryset(tfs2, 0, sizeof(tfs2_t));
+    tfs2->buffer_inode = (tfs2_inode_t *)((uint32_t)tfs2 + sizeof(tfs2_t));
+    tfs2->buffer_bat   = (bitmap_t *)((uint32_t)tfs2->buffer_inode +
+				      TFS_BLOCK_SIZE);
+    tfs2->buffer_md    = (tfs_direntry_t *)((uint32_t)tfs2->buffer_bat +
+					    TFS_BLOCK_SIZE);
+    tfs2->buffer_ext   = (tfs2_extent_t *)((uint32_t)tfs2->buffer_md +
+					   TFS_BLOCK_SIZE);
+    tfs2->buffer_dind  = (uint32_t *)((uint32_t)tfs2->buffer_ext +
+				      TFS_BLOCK_SIZE);
+    tfs2->buffer_data  = (uint8_t *)((uint32_t)tfs2->buffer_dind +
+				     TFS_BLOCK_SIZE);
+    tfs2->disk = disk;
+
+    /* Read header block, and make sure this is tfs2 drive */
+    if(!tfs2_rw(tfs2, TFS2_HEADER_BLOCK, tfs2->buffer_data, 0)) {
+	semaphore_destroy(sem);
+	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+	kprintf("tfs2_init: Error during disk read. Initialization failed.\n");
+	return NULL;
+    }
+
+    memcopy(sizeof(tfs2_header_t), &header, tfs2->buffer_data);
+    if(header.magic != TFS2_MAGIC || header.bitmap_blocks == 0 ||
+       header.dir_blocks == 0 ||
+       header.bitmap_blocks * TFS2_BITS_PER_BLOCK < header.totalblocks ||
+       header.dir_start + header.dir_blocks > header.totalblocks ||
+       header.totalblocks > disk->total_blocks(disk)) {
+	semaphore_destroy(sem);
+	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+	return NULL;
+    }
+
+    tfs2->totalblocks   = header.totalblocks;
+    tfs2->bitmap_start  = header.bitmap_start;
+    tfs2->bitmap_blocks = header.bitmap_blocks;
+    tfs2->dir_start     = header.dir_start;
+    tfs2->dir_blocks    = header.dir_blocks;
+
+    /* Count the free blocks, so that getfree and the disk full check
+       in create do not need to scan the bitmap */
+    for(i = 0; i < tfs2->totalblocks; i++) {
+	if(i % TFS2_BITS_PER_BLOCK == 0) {
+	    block = tfs2->bitmap_start + i / TFS2_BITS_PER_BLOCK;
+	    if(!tfs2_load(tfs2, block, tfs2->buffer_bat, &tfs2->bat_block)) {
+		semaphore_destroy(sem);
+		pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
+		kprintf("tfs2_init: Error during disk read. "
+			"Initialization failed.\n");
+		return NULL;
+	    }
+	}
+	if(bitmap_get(tfs2->buffer_bat, i % TFS2_BITS_PER_BLOCK) == 0)
+	    tfs2->freeblocks++;
+    }
+
+    /* save the semaphore to the tfs2_t */
+    tfs2->lock = sem;
+
+    fs->internal = (void *)tfs2;
+    stringcopy(fs->volume_name, header.volumename, VFS_NAME_LENGTH);
+
+    fs->unmount = tfs2_unmount;
+    fs->open    = tfs2_open;
+    fs->close   = tfs2_close;
+    fs->create  = tfs2_create;
+    fs->remove  = tfs2_remove;
+    fs->read    = tfs2_read;
+    fs->write   = tfs2_write;
+    fs->getfree = tfs2_getfree;
+    fs->readahead = NULL;
+    fs->sync      = NULL;
+
+    return fs;
+}
+
+/**
+ * Unmounts tfs2 filesystem from gbd device. Implements fs.unmount().
+ * Waits for the current operation to finish, frees reserved memory
+ * and returns OK.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ *
+ * @return VFS_OK
+ */
+int tfs2_unmount(fs_t *fs)
+{
+    tfs2_t *tfs2;
+
+    tfs2 = (tfs2_t *)fs->internal;
+
+    semaphore_P(tfs2->lock); /* The semaphore should be free at this
+      point, we get it just in case something has gone wrong. */
+
+    /* free semaphore and allocated memory */
+    semaphore_destroy(tfs2->lock);
+    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)fs));
+    return VFS_OK;
+}
+
+/**
+ * Opens file. Implements fs.open(). Looks the file up from the
+ * directory.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param filename Name of the file to be opened.
+ *
+ * @return If file found, return inode block number as fileid, otherwise
+ * return VFS_NOT_FOUND or VFS_ERROR.
+ */
+int tfs2_open(fs_t *fs, char *filename)
+{
+    tfs2_t *tfs2 = (tfs2_t *)fs->internal;
+    int slot;
+    int r;
+
+    semaphore_P(tfs2->lock);
+
+    slot = tfs2_dir_find(tfs2, filename, NULL);
+    if(slot < 0) {
+	semaphore_V(tfs2->lock);
+	return slot;
+    }
+
+    r = tfs2->buffer_md[slot % TFS2_DIRENTRIES_PER_BLOCK].inode;
+
+    semaphore_V(tfs2->lock);
+    return r;
+}
+
+/**
+ * Closes file. Implements fs.close(). There is nothing to be done.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param fileid File id (inode block number) of the file.
+ *
+ * @return VFS_OK
+ */
+int tfs2_close(fs_t *fs, int fileid)
+{
+    fs = fs;
+    fileid = fileid;
+
+    return VFS_OK;
+}
+
+/**
+ * Creates file of given size. Implements fs.create(). Allocates the
+ * inode and the data blocks, preferring blocks right after the
+ * previous one so that the file gets as few extents as possible.
+ * The data blocks are zeroed. The directory entry is written last,
+ * after everything it points to is on disk. If the disk runs out of
+ * space midway, everything allocated so far is released.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param filename File name of the file to be created
+ * @param size Size of the file to be created
+ *
+ * @return If file allready exists or not enough space return VFS_ERROR,
+ * otherwise return VFS_OK.
+ */
+int tfs2_create(fs_t *fs, char *filename, int size)
+{
+    tfs2_t *tfs2 = (tfs2_t *)fs->internal;
+    tfs2_inode_t *inode = tfs2->buffer_inode;
+    tfs2_extent_t *extent;
+    tfs_direntry_t *entry;
+    uint32_t numblocks = (size + TFS_BLOCK_SIZE - 1)/TFS_BLOCK_SIZE;
+    uint32_t inode_block, block, run_start = 0, run_length = 0;
+    uint32_t i, j;
+    int slot;
+    int r;
+
+    if(size < 0)
+	return VFS_ERROR;
+
+    semaphore_P(tfs2->lock);
+
+    r = tfs2_dir_find(tfs2, filename, &slot);
+    if(r != VFS_NOT_FOUND || slot < 0 ||
+       numblocks + 1 > tfs2->freeblocks) {
+	/* Already exists, error, directory full or disk full */
+	semaphore_V(tfs2->lock);
+	return VFS_ERROR;
+    }
+
+    inode_block = tfs2_alloc_block(tfs2, tfs2->dir_start + tfs2->dir_blocks);
+    if(inode_block == 0) {
+	semaphore_V(tfs2->lock);
+	return VFS_ERROR;
+    }
+
+    /* The buffers are reused for building the new file */
+    tfs2_forget_extents(tfs2);
+    tfs2->inode_block = 0;
+    memoryset(inode, 0, TFS_BLOCK_SIZE);
+    inode->filesize = size;
+
+    /* Collect the data blocks into runs */
+    block = inode_block;
+    for(i = 0; i < numblocks; i++) {
+	block = tfs2_alloc_block(tfs2, block + 1);
+	if(block == 0)
+	    break;
+
+	if(run_length > 0 && block == run_start + run_length) {
+	    run_length++;
+	    continue;
+	}
+
+	if(run_length > 0 &&
+	   !tfs2_extent_append(tfs2, run_start, run_length)) {
+	    tfs2_free_block(tfs2, block);
+	    break;
+	}
+	run_start  = block;
+	run_length = 1;
+    }
+
+    if(i < numblocks ||
+       (run_length > 0 && !tfs2_extent_append(tfs2, run_start, run_length))) {
+	/* Disk full or too fragmented, return what we got. The current
+	   run was never appended. */
+	for(j = 0; j < run_length; j++)
+	    tfs2_free_block(tfs2, run_start + j);
+	tfs2_extents_finish(tfs2);
+	tfs2_free_file(tfs2);
+	tfs2_free_block(tfs2, inode_block);
+	tfs2_bat_flush(tfs2);
+	semaphore_V(tfs2->lock);
+	return VFS_ERROR;
+    }
+
+    r = tfs2_extents_finish(tfs2) &&
+	tfs2_rw(tfs2, inode_block, inode, 1);
+    tfs2->inode_block = inode_block;
+
+    /* Write zeros to the reserved blocks. */
+    memoryset(tfs2->buffer_data, 0, TFS_BLOCK_SIZE);
+    for(i = 0; r && i < inode->nextents; i++) {
+	extent = tfs2_extent(tfs2, i);
+	if(extent == NULL) {
+	    r = 0;
+	    break;
+	}
+	for(j = 0; r && j < extent->length; j++)
+	    r = tfs2_rw(tfs2, extent->start + j, tfs2->buffer_data, 1);
+    }
+
+    r = r && tfs2_bat_flush(tfs2);
+
+    entry = tfs2_dir_entry(tfs2, slot);
+    if(!r || entry == NULL) {
+	semaphore_V(tfs2->lock);
+	return VFS_ERROR;
+    }
+
+    entry->inode = inode_block;
+    stringcopy(entry->name, filename, TFS_FILENAME_MAX);
+    if(!tfs2_rw(tfs2, tfs2->md_block, tfs2->buffer_md, 1)) {
+	tfs2->md_block = 0;
+	semaphore_V(tfs2->lock);
+	return VFS_ERROR;
+    }
+
+    semaphore_V(tfs2->lock);
+    return VFS_OK;
+}
+
+/**
+ * Removes given file. Implements fs.remove(). Frees blocks allocated
+ * for the file and marks the directory entry deleted.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param filename file to be removed.
+ *
+ * @return VFS_OK if file succesfully removed. If file not found
+ * VFS_NOT_FOUND.
+ */
+int tfs2_remove(fs_t *fs, char *filename)
+{
+    tfs2_t *tfs2 = (tfs2_t *)fs->internal;
+    tfs_direntry_t *entry;
+    uint32_t inode_block;
+    int slot;
+
+    semaphore_P(tfs2->lock);
+
+    slot = tfs2_dir_find(tfs2, filename, NULL);
+    if(slot < 0) {
+	semaphore_V(tfs2->lock);
+	return slot;
+    }
+    inode_block = tfs2->buffer_md[slot % TFS2_DIRENTRIES_PER_BLOCK].inode;
+
+    if(!tfs2_load(tfs2, inode_block, tfs2->buffer_inode,
+		  &tfs2->inode_block) ||
+       !tfs2_free_file(tfs2) ||
+       !tfs2_free_block(tfs2, inode_block) ||
+       !tfs2_bat_flush(tfs2)) {
+	semaphore_V(tfs2->lock);
+	return VFS_ERROR;
+    }
+    tfs2->inode_block = 0;
+
+    /* Deleted, not free, so that probes for names stored after this
+       entry continue past it. */
+    entry = tfs2_dir_entry(tfs2, slot);
+    if(entry == NULL) {
+	semaphore_V(tfs2->lock);
+	return VFS_ERROR;
+    }
+    entry->inode   = TFS2_DIR_DELETED;
+    entry->name[0] = 0;
+    if(!tfs2_rw(tfs2, tfs2->md_block, tfs2->buffer_md, 1)) {
+	tfs2->md_block = 0;
+	semaphore_V(tfs2->lock);
+	return VFS_ERROR;
+    }
+
+    semaphore_V(tfs2->lock);
+    return VFS_OK;
+}
+
+/**
+ * Reads the inode of an open file into buffer_inode.
+ *
+ * @param tfs2 The filesystem.
+ * @param fileid The file.
+ *
+ * @return Non-zero on success, zero if fileid is not a valid inode
+ * block or on error.
+ */
+static int tfs2_get_inode(tfs2_t *tfs2, int fileid)
+{
+    /* fileid is blocknum so ensure that we don't read system blocks
+       or outside the disk */
+    if(fileid < (int)(tfs2->dir_start + tfs2->dir_blocks) ||
+       fileid >= (int)tfs2->totalblocks)
+	return 0;
+
+    return tfs2_load(tfs2, fileid, tfs2->buffer_inode, &tfs2->inode_block);
+}
+
+/**
+ * Reads at most bufsize bytes from file to the buffer starting from
+ * the offset. bufsize bytes is always read if possible. Returns
+ * number of bytes read. Implements fs.read().
+ *
+ * @param fs  Pointer to fs data structure of the device.
+ * @param fileid Fileid of the file.
+ * @param buffer Pointer to the buffer the data is read into.
+ * @param bufsize Maximum number of bytes to be read.
+ * @param offset Start position of reading.
+ *
+ * @return Number of bytes read into buffer, or VFS_ERROR if error
+ * occured.
+ */
+int tfs2_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
+{
+    tfs2_t *tfs2 = (tfs2_t *)fs->internal;
+    uint32_t block;
+    int read = 0;
+    int n, boff;
+
+    semaphore_P(tfs2->lock);
+
+    if(!tfs2_get_inode(tfs2, fileid) ||
+       offset < 0 || offset > (int)tfs2->buffer_inode->filesize) {
+	semaphore_V(tfs2->lock);
+	return VFS_ERROR;
+    }
+
+    /* Read at most what is left from the file. */
+    bufsize = MIN(bufsize, ((int)tfs2->buffer_inode->filesize) - offset);
+
+    while(read < bufsize) {
+	boff = (offset + read) % TFS_BLOCK_SIZE;
+	n = MIN(TFS_BLOCK_SIZE - boff, bufsize - read);
+
+	block = tfs2_bmap(tfs2, (offset + read) / TFS_BLOCK_SIZE);
+	if(block == 0 || !tfs2_rw(tfs2, block, tfs2->buffer_data, 0)) {
+	    semaphore_V(tfs2->lock);
+	    return VFS_ERROR;
+	}
+
+	memcopy(n, (void *)((uint32_t)buffer + read),
+		tfs2->buffer_data + boff);
+	read += n;
+    }
+
+    semaphore_V(tfs2->lock);
+    return read;
+}
+
+/**
+ * Write at most datasize bytes from buffer to the file starting from
+ * the offset. datasize bytes is always written if possible. Returns
+ * number of bytes written. Implements fs.write().
+ *
+ * @param fs  Pointer to fs data structure of the device.
+ * @param fileid Fileid of the file.
+ * @param buffer Pointer to the buffer the data is written from.
+ * @param datasize Maximum number of bytes to be written.
+ * @param offset Start position of writing.
+ *
+ * @return Number of bytes written, or VFS_ERROR if error occured.
+ */
+int tfs2_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
+{
+    tfs2_t *tfs2 = (tfs2_t *)fs->internal;
+    uint32_t block;
+    int written = 0;
+    int n, boff;
+
+    semaphore_P(tfs2->lock);
+
+    if(!tfs2_get_inode(tfs2, fileid) ||
+       offset < 0 || offset > (int)tfs2->buffer_inode->filesize) {
+	semaphore_V(tfs2->lock);
+	return VFS_ERROR;
+    }
+
+    /* write at most the number of bytes left in the file */
+    datasize = MIN(datasize, (int)tfs2->buffer_inode->filesize - offset);
+
+    while(written < datasize) {
+	boff = (offset + written) % TFS_BLOCK_SIZE;
+	n = MIN(TFS_BLOCK_SIZE - boff, datasize - written);
+
+	block = tfs2_bmap(tfs2, (offset + written) / TFS_BLOCK_SIZE);
+	if(block == 0) {
+	    semaphore_V(tfs2->lock);
+	    return VFS_ERROR;
+	}
+
+	/* A partially written block must be read first */
+	if(n < TFS_BLOCK_SIZE &&
+	   !tfs2_rw(tfs2, block, tfs2->buffer_data, 0)) {
+	    semaphore_V(tfs2->lock);
+	    return VFS_ERROR;
+	}
+
+	memcopy(n, tfs2->buffer_data + boff,
+		(void *)((uint32_t)buffer + written));
+
+	if(!tfs2_rw(tfs2, block, tfs2->buffer_data, 1)) {
+	    semaphore_V(tfs2->lock);
+	    return VFS_ERROR;
+	}
+	written += n;
+    }
+
+    semaphore_V(tfs2->lock);
+    return written;
+}
+
+/**
+ * Get number of free bytes on the disk. Implements fs.getfree().
+ *
+ * @param fs Pointer to the fs data structure of the device.
+ *
+ * @return Number of free bytes.
+ */
+int tfs2_getfree(fs_t *fs)
+{
+    tfs2_t *tfs2 = (tfs2_t *)fs->internal;
+    int free;
+
+    semaphore_P(tfs2->lock);
+    free = tfs2->freeblocks * TFS_BLOCK_SIZE;
+    semaphore_V(tfs2->lock);
+
+    return free;
+}
+
+/** @} */
@@ -0,0 +1,121 @@
+/*
+ * Extent based Trivial Filesystem (TFS2).
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef FS_TFS2_H
+#define FS_TFS2_H
+
+#include "drivers/gbd.h"
+#include "fs/vfs.h"
+#include "fs/tfs.h"
+#include "lib/libc.h"
+#include "lib/bitmap.h"
+
+/* TFS2 uses the same block size, name lengths and directory entry
+   layout as TFS. Only the volume layout and the inode differ. */
+
+/* Magic number found on each TFS2 filesystem's header block. It
+   differs from TFS_MAGIC so that TFS never mounts a TFS2 volume. */
+#define TFS2_MAGIC 3746
+
+/* Block number of the header block. The allocation bitmap starts
+   right after it, followed by the directory. */
+#define TFS2_HEADER_BLOCK 0
+#define TFS2_BITMAP_START 1
+
+/* Number of blocks one bitmap block keeps track of */
+#define TFS2_BITS_PER_BLOCK (8*TFS_BLOCK_SIZE)
+
+/* Default number of directory blocks used by tfstool */
+#define TFS2_DEFAULT_DIR_BLOCKS 16
+
+/* Directory entry inode values with a special meaning. An entry that
+   was never used ends a hash probe, a deleted one does not. */
+#define TFS2_DIR_FREE    0
+#define TFS2_DIR_DELETED 0xffffffff
+
+/* Header block. Everything after the fields below is zero. */
+typedef struct {
+    /* TFS2_MAGIC */
+    uint32_t magic;
+
+    /* Volume name, at the same offset as in TFS */
+    char     volumename[TFS_VOLUMENAME_MAX];
+
+    /* Size of the volume in blocks */
+    uint32_t totalblocks;
+
+    /* First block and length of the allocation bitmap */
+    uint32_t bitmap_start;
+    uint32_t bitmap_blocks;
+
+    /* First block and length of the directory */
+    uint32_t dir_start;
+    uint32_t dir_blocks;
+} tfs2_header_t;
+
+/* A run of consecutive disk blocks belonging to a file. */
+typedef struct {
+    /* First disk block of the run */
+    uint32_t start;
+
+    /* Number of blocks in the run */
+    uint32_t length;
+} tfs2_extent_t;
+
+/* Number of extents stored directly in the inode */
+#define TFS2_DIRECT_EXTENTS \
+    ((TFS_BLOCK_SIZE - 4*sizeof(uint32_t)) / sizeof(tfs2_extent_t))
+
+/* Number of extents in one extent block */
+#define TFS2_EXTENTS_PER_BLOCK (TFS_BLOCK_SIZE / sizeof(tfs2_extent_t))
+
+/* Number of extent block pointers in the doubly indirect block */
+#define TFS2_POINTERS_PER_BLOCK (TFS_BLOCK_SIZE / sizeof(uint32_t))
+
+/* Maximum number of extents in one file */
+#define TFS2_MAX_EXTENTS (TFS2_DIRECT_EXTENTS + TFS2_EXTENTS_PER_BLOCK + \
+			  TFS2_POINTERS_PER_BLOCK * TFS2_EXTENTS_PER_BLOCK)
+
+/* File inode block. The file data is described by a list of extents,
+   in file order. The first TFS2_DIRECT_EXTENTS extents are stored in
+   the inode itself, the next TFS2_EXTENTS_PER_BLOCK in the indirect
+   extent block and the rest in extent blocks listed by the doubly
+   indirect block. A file of any size fits as long as it is not split
+   into more than TFS2_MAX_EXTENTS runs. */
+typedef struct {
+    /* filesize in bytes */
+    uint32_t filesize;
+
+    /* Number of extents in use */
+    uint32_t nextents;
+
+    /* Indirect extent block, zero if not needed */
+    uint32_t indirect;
+
+    /* Doubly indirect block, zero if not needed */
+    uint32_t dindirect;
+
+    tfs2_extent_t extent[TFS2_DIRECT_EXTENTS];
+} tfs2_inode_t;
+
+/* Number of directory entries in one directory block */
+#define TFS2_DIRENTRIES_PER_BLOCK (TFS_BLOCK_SIZE/sizeof(tfs_direntry_t))
+
+/* functions */
+uint32_t tfs2_hash(const char *name);
+
+fs_t * tfs2_init(gbd_t *disk);
+
+int tfs2_unmount(fs_t *fs);
+int tfs2_open(fs_t *fs, char *filename);
+int tfs2_close(fs_t *fs, int fileid);
+int tfs2_create(fs_t *fs, char *filename, int size);
+int tfs2_remove(fs_t *fs, char *filename);
+int tfs2_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset);
+int tfs2_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset);
+int tfs2_getfree(fs_t *fs);
+
+#endif    /* FS_TFS2_H */
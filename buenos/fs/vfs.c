@@ -36,10 +36,15 @@
 
 #include "fs/vfs.h"
 #include "kernel/semaphore.h"
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
 #include "kernel/assert.h"
 #include "kernel/config.h"
 #include "lib/libc.h"
 #include "drivers/device.h"
+#include "drivers/bootargs.h"
+#include "drivers/raid.h"
+#include "drivers/ramdisk.h"
 #include "fs/tfs.h"
 #include "fs/filesystems.h"
 
@@ -68,8 +73,28 @@ typedef struct {
     /* Filesystem specific file id for this open file. */
     int fileid;
 
+    /* Number of references to this open file: one from vfs_open()
+       and one from each vfs_dup(). Zero when the entry is free. */
+    int refcount;
+
+    /* Next entry in the free list of openfile_table, -1 at the end.
+       Only meaningful when the entry is free. */
+    int next_free;
+
+    /* Spinlock protecting refcount, seek_position and the readahead
+       state. */
+    spinlock_t slock;
+
     /* Current seek position in the file. */
     int seek_position;
+
+    /* Readahead state, see vfs_readahead_update(). Offset where the
+       previous read ended, offset up to which the file has been read
+       ahead and the current readahead window in bytes (0 when the
+       file is not read sequentially). */
+    int ra_next;
+    int ra_end;
+    int ra_window;
 } openfile_entry_t;
 
 
@@ -83,10 +108,14 @@ static struct {
 } vfs_table;
 
 
-/* Table of open files. */
+/* Table of open files. Free entries are kept in a list so that
+   vfs_open() finds one without scanning the table. */
 static struct {
-    /* Binary semaphore for locking this table. */
-    semaphore_t *sem;
+    /* Spinlock protecting the free list. */
+    spinlock_t slock;
+
+    /* First free entry, -1 if the table is full. */
+    int free;
 
     /* Table of open files. */
     openfile_entry_t files[CONFIG_MAX_OPEN_FILES];
@@ -123,19 +152,25 @@ void vfs_init(void)
     int i;
 
     vfs_table.sem = semaphore_create(1);
-    openfile_table.sem = semaphore_create(1);
 
-    KERNEL_ASSERT(vfs_table.sem != NULL && openfile_table.sem != NULL);
+    KERNEL_ASSERT(vfs_table.sem != NULL);
 
     /* Clear table of mounted filesystems. */
     for(i=0; i<CONFIG_MAX_FILESYSTEMS; i++) {
 	vfs_table.filesystems[i].filesystem = NULL;
     }
 
-    /* Clear table of open files. */
+    /* Clear table of open files and chain all entries to the free
+       list. */
+    spinlock_reset(&openfile_table.slock);
     for (i = 0; i < CONFIG_MAX_OPEN_FILES; i++) {
 	openfile_table.files[i].filesystem = NULL;
+	openfile_table.files[i].refcount = 0;
+	openfile_table.files[i].next_free = i + 1;
+	spinlock_reset(&openfile_table.files[i].slock);
     }
+    openfile_table.files[CONFIG_MAX_OPEN_FILES - 1].next_free = -1;
+    openfile_table.free = 0;
 
     vfs_op_sem = semaphore_create(1);
     vfs_unmount_sem = semaphore_create(0);
@@ -174,7 +209,6 @@ void vfs_deinit(void)
     }
 
     semaphore_P(vfs_table.sem);
-    semaphore_P(openfile_table.sem);
     
     for (row = 0; row < CONFIG_MAX_FILESYSTEMS; row++) {
         fs = vfs_table.filesystems[row].filesystem;
@@ -186,7 +220,6 @@ void vfs_deinit(void)
         }
     }
 
-    semaphore_V(openfile_table.sem);
     semaphore_V(vfs_table.sem);
     semaphore_V(vfs_op_sem);
 }
@@ -243,16 +276,58 @@ int vfs_mount_fs(gbd_t *disk, char *volumename)
 
 /**
  * Mounts all filesystems found in all disks of the system.
- * Tries all known filesystems for all disks.
+ * Tries all known filesystems for all disks. If the boot argument
+ * raid is given, the first disks are first combined into a RAID
+ * array (see drivers/raid.c) and the array is mounted in their place.
+ * The boot argument ramdisk adds a memory backed volume.
  *
  */
 
 void vfs_mount_all(void)
 {
-    int i;
+    int i, first = 0;
     device_t *dev;
+    gbd_t *members[RAID_MAX_MEMBERS];
+    gbd_t *array;
+    gbd_t *ramdisk;
+    int nmembers;
+
+    /* Boot argument ramdisk=<blocks> creates an empty TFS volume
+       named ram in memory. */
+    if(bootargs_get("ramdisk") != NULL) {
+	ramdisk = ramdisk_create(atoi(bootargs_get("ramdisk")));
+	if(ramdisk == NULL || tfs_format(ramdisk, "ram") != VFS_OK)
+	    kprintf("VFS: Warning, could not create RAM disk\n");
+	else
+	    vfs_mount_fs(ramdisk, NULL);
+    }
 
-    for(i=0; i<CONFIG_MAX_FILESYSTEMS; i++) {
+    /* Boot argument raid=<level> combines the first raiddisks=<n>
+       disks (default: as many as possible) into one array, which is
+       mounted instead of its members. */
+    if(bootargs_get("raid") != NULL) {
+	nmembers = RAID_MAX_MEMBERS;
+	if(bootargs_get("raiddisks") != NULL)
+	    nmembers = MIN(atoi(bootargs_get("raiddisks")), RAID_MAX_MEMBERS);
+
+	for(i=0; i<nmembers; i++) {
+	    dev = device_get(YAMS_TYPECODE_DISK, i);
+	    if(dev == NULL || dev->generic_device == NULL)
+		break;
+	    members[i] = (gbd_t *) dev->generic_device;
+	}
+
+	array = raid_create(atoi(bootargs_get("raid")), members, i);
+	if(array == NULL) {
+	    kprintf("VFS: Warning, could not create RAID array, "
+		    "mounting disks separately\n");
+	} else {
+	    vfs_mount_fs(array, NULL);
+	    first = i;
+	}
+    }
+
+    for(i=first; i<CONFIG_MAX_FILESYSTEMS; i++) {
 	dev = device_get(YAMS_TYPECODE_DISK, i);
 	if(dev == NULL) {
 	    /* No more disks. */
@@ -493,10 +568,10 @@ int vfs_unmount(char *name)
 	return VFS_NOT_FOUND;
     }
     
-    semaphore_P(openfile_table.sem);
+    /* vfs_open() binds open files to their filesystem while holding
+       vfs_table.sem, so no new ones can appear during this scan. */
     for(i = 0; i < CONFIG_MAX_OPEN_FILES; i++) {
 	if(openfile_table.files[i].filesystem == fs) {
-	    semaphore_V(openfile_table.sem);
 	    semaphore_V(vfs_table.sem);
             vfs_end_op();
 	    return VFS_IN_USE;
@@ -506,12 +581,62 @@ int vfs_unmount(char *name)
     fs->unmount(fs);
     vfs_table.filesystems[row].filesystem = NULL;
     
-    semaphore_V(openfile_table.sem);
     semaphore_V(vfs_table.sem);
     vfs_end_op();
     return VFS_OK;
 }
 
+/**
+ * Takes an entry from the free list of the open file table.
+ *
+ * @return Index of the entry, with one reference, or -1 if the table
+ * is full.
+ *
+ */
+
+static openfile_t vfs_alloc_openfile(void)
+{
+    interrupt_status_t intr_status;
+    openfile_t file;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&openfile_table.slock);
+
+    file = openfile_table.free;
+    if(file >= 0) {
+	openfile_table.free = openfile_table.files[file].next_free;
+	openfile_table.files[file].refcount = 1;
+    }
+
+    spinlock_release(&openfile_table.slock);
+    _interrupt_set_state(intr_status);
+
+    return file;
+}
+
+/**
+ * Returns an entry of the open file table to the free list.
+ *
+ * @param file Index of the entry.
+ *
+ */
+
+static void vfs_free_openfile(openfile_t file)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&openfile_table.slock);
+
+    openfile_table.files[file].filesystem = NULL;
+    openfile_table.files[file].refcount = 0;
+    openfile_table.files[file].next_free = openfile_table.free;
+    openfile_table.free = file;
+
+    spinlock_release(&openfile_table.slock);
+    _interrupt_set_state(intr_status);
+}
+
 /**
  * Opens a file on any filesystem.
  * 
@@ -526,6 +651,7 @@ int vfs_unmount(char *name)
 openfile_t vfs_open(char *pathname)
 {
     openfile_t file;
+    openfile_entry_t *openfile;
     int fileid;
     char volumename[VFS_NAME_LENGTH];
     char filename[VFS_NAME_LENGTH];
@@ -539,49 +665,40 @@ openfile_t vfs_open(char *pathname)
 	return VFS_ERROR;
     }
 
-    semaphore_P(vfs_table.sem);
-    semaphore_P(openfile_table.sem);
-    
-    for(file=3; file<CONFIG_MAX_OPEN_FILES; file++) {
-	if(openfile_table.files[file].filesystem == NULL) {
-	    break;
-	}
-    }
+    file = vfs_alloc_openfile();
 
-    if(file >= CONFIG_MAX_OPEN_FILES) {
-	semaphore_V(openfile_table.sem);
-	semaphore_V(vfs_table.sem);
+    if(file < 0) {
 	kprintf("VFS: Warning, maximum number of open files exceeded.");
         vfs_end_op();
 	return VFS_LIMIT;
     }
 
+    openfile = &openfile_table.files[file];
+
+    semaphore_P(vfs_table.sem);
     fs = vfs_get_filesystem(volumename);
+    openfile->filesystem = fs;
+    semaphore_V(vfs_table.sem);
 
     if(fs == NULL) {
-	semaphore_V(openfile_table.sem);
-	semaphore_V(vfs_table.sem);
+	vfs_free_openfile(file);
         vfs_end_op();
 	return VFS_NO_SUCH_FS;
     }
 
-    openfile_table.files[file].filesystem = fs;
-
-    semaphore_V(openfile_table.sem);
-    semaphore_V(vfs_table.sem);
-
     fileid = fs->open(fs, filename);
 
     if(fileid < 0) {
-	semaphore_P(openfile_table.sem);
-	openfile_table.files[file].filesystem = NULL;
-	semaphore_V(openfile_table.sem);
+	vfs_free_openfile(file);
         vfs_end_op();
 	return fileid; /* negative -> error*/
     }
 
-    openfile_table.files[file].fileid = fileid;
-    openfile_table.files[file].seek_position = 0;
+    openfile->fileid = fileid;
+    openfile->seek_position = 0;
+    openfile->ra_next = 0;
+    openfile->ra_end = 0;
+    openfile->ra_window = 0;
 
     vfs_end_op();
     return file;
@@ -603,14 +720,43 @@ static openfile_entry_t *vfs_verify_open(openfile_t file)
 
     KERNEL_ASSERT(file >= 0 && file < CONFIG_MAX_OPEN_FILES);
     openfile = &openfile_table.files[file];
-    KERNEL_ASSERT(openfile->filesystem != NULL);
+    KERNEL_ASSERT(openfile->filesystem != NULL && openfile->refcount > 0);
 
     return openfile;
 }
 
 
 /**
- * Close open file.
+ * Adds a reference to an open file, so that it stays open until
+ * vfs_close() has been called once more. Does not sleep, so it may be
+ * called with a spinlock held.
+ *
+ * @param file Openfile id
+ *
+ * @return VFS_OK, panics on invalid arguments.
+ *
+ */
+
+int vfs_dup(openfile_t file)
+{
+    openfile_entry_t *openfile;
+    interrupt_status_t intr_status;
+
+    openfile = vfs_verify_open(file);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&openfile->slock);
+    openfile->refcount++;
+    spinlock_release(&openfile->slock);
+    _interrupt_set_state(intr_status);
+
+    return VFS_OK;
+}
+
+
+/**
+ * Drops a reference to an open file. The file is closed when the
+ * last reference is dropped.
  *
  * @param file Openfile id
  *
@@ -621,27 +767,58 @@ static openfile_entry_t *vfs_verify_open(openfile_t file)
 int vfs_close(openfile_t file)
 {
     openfile_entry_t *openfile;
+    interrupt_status_t intr_status;
     fs_t *fs;
+    int refcount;
     int ret;
 
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
 
-    semaphore_P(openfile_table.sem);
-
     openfile = vfs_verify_open(file);
     fs = openfile->filesystem;
 
-    ret = fs->close(fs, openfile->fileid);
-    openfile->filesystem = NULL;
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&openfile->slock);
+    refcount = --openfile->refcount;
+    spinlock_release(&openfile->slock);
+    _interrupt_set_state(intr_status);
+
+    if(refcount > 0) {
+	vfs_end_op();
+	return VFS_OK;
+    }
 
-    semaphore_V(openfile_table.sem);
+    ret = fs->close(fs, openfile->fileid);
+    vfs_free_openfile(file);
     
     vfs_end_op();
     return ret;
 }
 
 
+/**
+ * Tells which file an open file refers to. Two open files refer to
+ * the same file exactly when both values are equal.
+ *
+ * @param file Openfile id
+ *
+ * @param fs Set to the filesystem of the file.
+ *
+ * @param fileid Set to the filesystem specific id of the file.
+ *
+ */
+
+void vfs_identify(openfile_t file, fs_t **fs, int *fileid)
+{
+    openfile_entry_t *openfile;
+
+    openfile = vfs_verify_open(file);
+    *fs = openfile->filesystem;
+    *fileid = openfile->fileid;
+}
+
+
 /**
  * Seek given file to given position. The position is not verified
  * to be within the file's size.
@@ -657,17 +834,20 @@ int vfs_close(openfile_t file)
 int vfs_seek(openfile_t file, int seek_position)
 {
     openfile_entry_t *openfile;
+    interrupt_status_t intr_status;
 
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
 
     KERNEL_ASSERT(seek_position >= 0);
-    semaphore_P(openfile_table.sem);
 
     openfile = vfs_verify_open(file);
-    openfile->seek_position = seek_position;
 
-    semaphore_V(openfile_table.sem);
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&openfile->slock);
+    openfile->seek_position = seek_position;
+    spinlock_release(&openfile->slock);
+    _interrupt_set_state(intr_status);
 
     vfs_end_op();
     return VFS_OK;
@@ -675,9 +855,63 @@ int vfs_seek(openfile_t file, int seek_position)
 
 
 /**
- * Reads at most bufsize bytes from given open file to given buffer.
- * The read is started from current seek position and after read, the
- * position is updated.
+ * Updates the readahead state of an open file after a read. A read
+ * starting where the previous one ended is sequential and doubles the
+ * readahead window, up to CONFIG_READAHEAD_MAX. Any other read halves
+ * the window and forgets what was read ahead, so random access soon
+ * stops reading ahead altogether. Must be called with the spinlock
+ * of the open file held.
+ *
+ * @param openfile The open file.
+ *
+ * @param offset Offset where the read started.
+ *
+ * @param count Number of bytes read.
+ *
+ * @param ra_offset Set to the offset where readahead should start.
+ *
+ * @return Number of bytes to read ahead, 0 if nothing.
+ *
+ */
+
+static int vfs_readahead_update(openfile_entry_t *openfile, int offset,
+				int count, int *ra_offset)
+{
+    int size;
+
+    if(offset != openfile->ra_next) {
+	openfile->ra_window /= 2;
+	if(openfile->ra_window < CONFIG_READAHEAD_MIN)
+	    openfile->ra_window = 0;
+	openfile->ra_next = offset + count;
+	openfile->ra_end = openfile->ra_next;
+	return 0;
+    }
+
+    if(openfile->ra_window == 0)
+	openfile->ra_window = CONFIG_READAHEAD_MIN;
+    else
+	openfile->ra_window = MIN(2 * openfile->ra_window,
+				  CONFIG_READAHEAD_MAX);
+
+    openfile->ra_next = offset + count;
+    if(openfile->ra_end < openfile->ra_next)
+	openfile->ra_end = openfile->ra_next;
+
+    /* Read ahead in batches, once half of the window is consumed. */
+    if(openfile->ra_end - openfile->ra_next >= openfile->ra_window / 2)
+	return 0;
+
+    size = openfile->ra_next + openfile->ra_window - openfile->ra_end;
+    *ra_offset = openfile->ra_end;
+    openfile->ra_end += size;
+    return size;
+}
+
+
+/**
+ * Reads from an open file, either at the seek position or at the
+ * given offset.
  *
  * @param file Open file
  *
@@ -685,15 +919,23 @@ int vfs_seek(openfile_t file, int seek_position)
  *
  * @param bufsize maximum number of bytes to read.
  *
+ * @param offset Offset to read from, or -1 to read from the seek
+ * position and advance it.
+ *
  * @return Number of bytes read. Zero indicates end of file and
  * negative values are errors.
  *
  */
 
-int vfs_read(openfile_t file, void *buffer, int bufsize)
+static int vfs_read_at(openfile_t file, void *buffer, int bufsize,
+		       int offset)
 {
     openfile_entry_t *openfile;
+    interrupt_status_t intr_status;
     fs_t *fs;
+    int seek = (offset < 0);
+    int ra_offset = 0;
+    int ra_size = 0;
     int ret;
 
     if (vfs_start_op() != VFS_OK)
@@ -704,40 +946,104 @@ int vfs_read(openfile_t file, void *buffer, int bufsize)
 
     KERNEL_ASSERT(bufsize >= 0 && buffer != NULL);
 
-    ret = fs->read(fs, openfile->fileid, buffer, bufsize, 
-			openfile->seek_position);
+    if(seek)
+	offset = openfile->seek_position;
+    ret = fs->read(fs, openfile->fileid, buffer, bufsize, offset);
 
+    /* Positional reads feed the readahead too, so files scanned with
+       pread are read ahead like any other. */
     if(ret > 0) {
-        semaphore_P(openfile_table.sem);
-	openfile->seek_position += ret;
-        semaphore_V(openfile_table.sem);
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&openfile->slock);
+	if(seek)
+	    openfile->seek_position += ret;
+	if(fs->readahead != NULL)
+	    ra_size = vfs_readahead_update(openfile, offset, ret, &ra_offset);
+	spinlock_release(&openfile->slock);
+	_interrupt_set_state(intr_status);
     }
 
+    /* The readahead only queues disk reads, so this returns as soon
+       as they are issued. */
+    if(ra_size > 0)
+	fs->readahead(fs, openfile->fileid, ra_offset, ra_size);
+
     vfs_end_op();
     return ret;
 }
 
 
 /**
- * Writes datasize bytes from given buffer to given open file.
- * The write is started from current seek position and after writing, the
+ * Reads at most bufsize bytes from given open file to given buffer.
+ * The read is started from current seek position and after read, the
  * position is updated.
  *
  * @param file Open file
  *
+ * @param buffer Buffer to read from the file
+ *
+ * @param bufsize maximum number of bytes to read.
+ *
+ * @return Number of bytes read. Zero indicates end of file and
+ * negative values are errors.
+ *
+ */
+
+int vfs_read(openfile_t file, void *buffer, int bufsize)
+{
+    return vfs_read_at(file, buffer, bufsize, -1);
+}
+
+
+/**
+ * Reads at most bufsize bytes from given offset of given open file.
+ * The seek position is neither used nor changed.
+ *
+ * @param file Open file
+ *
+ * @param buffer Buffer to read from the file
+ *
+ * @param bufsize maximum number of bytes to read.
+ *
+ * @param offset Positive offset to start reading from.
+ *
+ * @return Number of bytes read. Zero indicates end of file and
+ * negative values are errors.
+ *
+ */
+
+int vfs_pread(openfile_t file, void *buffer, int bufsize, int offset)
+{
+    KERNEL_ASSERT(offset >= 0);
+    return vfs_read_at(file, buffer, bufsize, offset);
+}
+
+
+/**
+ * Writes to an open file, either at the seek position or at the
+ * given offset.
+ *
+ * @param file Open file
+ *
  * @param buffer Buffer to be written to file.
  *
  * @param datasize Number of bytes to write.
  *
+ * @param offset Offset to write to, or -1 to write to the seek
+ * position and advance it.
+ *
  * @return Number of bytes written. All bytes are written unless error
  * prevented to do that. Negative values are specific error conditions.
  *
  */
 
-int vfs_write(openfile_t file, void *buffer, int datasize)
+static int vfs_write_at(openfile_t file, void *buffer, int datasize,
+			int offset)
 {
     openfile_entry_t *openfile;
+    interrupt_status_t intr_status;
     fs_t *fs;
+    int seek = (offset < 0);
     int ret;
 
     if (vfs_start_op() != VFS_OK)
@@ -748,13 +1054,16 @@ int vfs_write(openfile_t file, void *buffer, int datasize)
 
     KERNEL_ASSERT(datasize >= 0 && buffer != NULL);
 
-    ret = fs->write(fs, openfile->fileid, buffer, datasize, 
-			 openfile->seek_position);
+    if(seek)
+	offset = openfile->seek_position;
+    ret = fs->write(fs, openfile->fileid, buffer, datasize, offset);
 
-    if(ret > 0) {
-        semaphore_P(openfile_table.sem);
+    if(ret > 0 && seek) {
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&openfile->slock);
 	openfile->seek_position += ret;
-        semaphore_V(openfile_table.sem);
+	spinlock_release(&openfile->slock);
+	_interrupt_set_state(intr_status);
     }
 
     vfs_end_op();
@@ -762,6 +1071,52 @@ int vfs_write(openfile_t file, void *buffer, int datasize)
 }
 
 
+/**
+ * Writes datasize bytes from given buffer to given open file.
+ * The write is started from current seek position and after writing, the
+ * position is updated.
+ *
+ * @param file Open file
+ *
+ * @param buffer Buffer to be written to file.
+ *
+ * @param datasize Number of bytes to write.
+ *
+ * @return Number of bytes written. All bytes are written unless error
+ * prevented to do that. Negative values are specific error conditions.
+ *
+ */
+
+int vfs_write(openfile_t file, void *buffer, int datasize)
+{
+    return vfs_write_at(file, buffer, datasize, -1);
+}
+
+
+/**
+ * Writes datasize bytes from given buffer to given offset of given
+ * open file. The seek position is neither used nor changed.
+ *
+ * @param file Open file
+ *
+ * @param buffer Buffer to be written to file.
+ *
+ * @param datasize Number of bytes to write.
+ *
+ * @param offset Positive offset to start writing to.
+ *
+ * @return Number of bytes written. All bytes are written unless error
+ * prevented to do that. Negative values are specific error conditions.
+ *
+ */
+
+int vfs_pwrite(openfile_t file, void *buffer, int datasize, int offset)
+{
+    KERNEL_ASSERT(offset >= 0);
+    return vfs_write_at(file, buffer, datasize, offset);
+}
+
+
 /**
  * Creates new file.
  *
@@ -888,5 +1243,41 @@ int vfs_getfree(char *filesystem)
     return ret;
 }
 
+/**
+ * Writes the changes all mounted filesystems keep in memory to their
+ * disks.
+ *
+ * @return VFS_OK on success, negative (VFS_*) if any filesystem
+ * failed.
+ *
+ */
+
+int vfs_sync(void)
+{
+    fs_t *fs;
+    int i, r;
+    int ret = VFS_OK;
+
+    if (vfs_start_op() != VFS_OK)
+        return VFS_UNUSABLE;
+
+    semaphore_P(vfs_table.sem);
+
+    for(i = 0; i < CONFIG_MAX_FILESYSTEMS; i++) {
+	fs = vfs_table.filesystems[i].filesystem;
+	if(fs == NULL || fs->sync == NULL)
+	    continue;
+
+	r = fs->sync(fs);
+	if(r < 0)
+	    ret = r;
+    }
+
+    semaphore_V(vfs_table.sem);
+
+    vfs_end_op();
+    return ret;
+}
+
 /** @} */
 
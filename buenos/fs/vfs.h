@@ -134,6 +134,23 @@ typedef struct fs_struct{
 
        Returns the number of free bytes, negative values are errors. */
     int (*getfree)(struct fs_struct *fs);
+
+    /* Function pointer to a function which starts reading size bytes
+       of given open file (fileid) from the given offset into the
+       filesystem's own cache, without waiting for the data. Called by
+       VFS when the file is being read sequentially, so that later
+       reads find the data ready. The filesystem may read less, or
+       nothing at all. NULL if the filesystem does not read ahead. */
+    void (*readahead)(struct fs_struct *fs, int fileid, int offset,
+		      int size);
+
+    /* Function pointer to a function which writes all changes the
+       filesystem keeps in memory to the disk. Pointer to this
+       structure is given as argument. NULL if the filesystem writes
+       everything immediately.
+
+       Returns success value as defined above (VFS_OK, etc.) */
+    int (*sync)(struct fs_struct *fs);
 } fs_t;
 
 
@@ -146,13 +163,18 @@ int vfs_mount(fs_t *fs, char *name);
 int vfs_unmount(char *name);
 
 openfile_t vfs_open(char *pathname);
+int vfs_dup(openfile_t file);
 int vfs_close(openfile_t file);
+void vfs_identify(openfile_t file, fs_t **fs, int *fileid);
 int vfs_seek(openfile_t file, int seek_position);
 int vfs_read(openfile_t file, void *buffer, int bufsize);
 int vfs_write(openfile_t file, void *buffer, int datasize);
+int vfs_pread(openfile_t file, void *buffer, int bufsize, int offset);
+int vfs_pwrite(openfile_t file, void *buffer, int datasize, int offset);
 
 int vfs_create(char *pathname, int size);
 int vfs_remove(char *pathname);
 int vfs_getfree(char *filesystem);
+int vfs_sync(void);
 
 #endif
@@ -51,6 +51,7 @@
 #include "kernel/scheduler.h"
 #include "kernel/synch.h"
 #include "kernel/thread.h"
+#include "kernel/timeout.h"
 #include "lib/debug.h"
 #include "lib/libc.h"
 #include "net/network.h"
@@ -204,6 +205,9 @@ void init(void)
     kwrite("Initializing semaphores\n");
     semaphore_init();
 
+    kwrite("Initializing timeouts\n");
+    timeout_init();
+
     kwrite("Initializing device drivers\n");
     device_init();
 
@@ -85,27 +85,122 @@
 
 #define CONFIG_MAX_FILESYSTEMS 8
 
+/* Number of queued disk requests above which the disk driver wakes
+ * up requesters in batches of this many completions instead of one
+ * at a time. 0 disables batching.
+ * Range from 0 to 512
+ */
+#define CONFIG_DISK_BATCH_DEPTH 4
+
 /* Define maximum number of open files
  * Range from 16 to 65536
  */
 
 #define CONFIG_MAX_OPEN_FILES 512
 
+/* Number of file pages that read-only memory mappings can share
+ * between processes. Pages that don't fit are mapped unshared.
+ * Range from 1 to 4096
+ */
+#define CONFIG_MMAP_SHARED_PAGES 128
+
+/* Number of persistent poll sets, shared by all processes, and the
+ * number of descriptors each can hold. A wait keeps arrays of
+ * CONFIG_POLLSET_SIZE entries on the kernel stack.
+ * Range from 1 to 256 and from 16 to 64
+ */
+#define CONFIG_MAX_POLLSETS 8
+#define CONFIG_POLLSET_SIZE 32
+
+/* Initial and maximum readahead window of a file read sequentially,
+ * in bytes. The window doubles on every sequential read and halves on
+ * every other read.
+ * Range from 512 to 65536
+ */
+#define CONFIG_READAHEAD_MIN 512
+#define CONFIG_READAHEAD_MAX 2048
+
+/* Milliseconds a filesystem may keep metadata changes (such as newly
+ * created files) in memory before writing them to disk. Closing a
+ * file or syncing writes them out earlier.
+ * Range from 0 to 60000
+ */
+#define CONFIG_FS_COMMIT_DELAY 5000
+
 /* Maximum number of simultaneously open sockets for POP/SOP 
  * Range from 4 to 65536
  */
 #define CONFIG_MAX_OPEN_SOCKETS 64
 
-/* Size of the POP receive queue 
- * Range from 4 to 512
+/* Maximum number of received POP packets queued on each socket, the
+ * largest backlog socket_set_backlog() accepts. Receiving a batch
+ * keeps an array of this many entries on the kernel stack.
+ * Range from 1 to 64
+ */
+#define CONFIG_POP_SOCKET_QUEUE_SIZE 64
+
+/* Default number of received POP packets queued on a socket. Packets
+ * arriving at a socket with a full queue are dropped.
+ * Range from 1 to CONFIG_POP_SOCKET_QUEUE_SIZE
+ */
+#define CONFIG_POP_SOCKET_BACKLOG 16
+
+/* Size in pages of the send and receive buffers of each SOP
+ * connection. The receive buffer is the largest window.
+ * Range from 1 to 8
+ */
+#define CONFIG_SOP_BUFFER_PAGES 4
+
+/* Initial retransmission timeout of SOP connections in milliseconds.
+ * Doubled on each timeout in a row.
+ * Range from 10 to 10000
+ */
+#define CONFIG_SOP_RTO 200
+
+/* Number of retransmission timeouts in a row after which a SOP
+ * connection is given up
+ * Range from 1 to 32
+ */
+#define CONFIG_SOP_RETRIES 8
+
+/* Largest POP datagram in bytes. Datagrams larger than one packet are
+ * fragmented and reassembled, up to POP_MAX_FRAGMENTS packets.
+ * Range from 1 to 65536
+ */
+#define CONFIG_POP_MAX_DATAGRAM 16384
+
+/* Number of POP datagrams that can be in reassembly at once
+ * Range from 1 to 256
+ */
+#define CONFIG_POP_REASM_SLOTS 16
+
+/* Time in milliseconds after which a POP datagram still missing
+ * fragments may be discarded to make room for another
+ * Range from 10 to 60000
+ */
+#define CONFIG_POP_REASM_TIMEOUT 1000
+
+/* Number of free network frame pages cached on each CPU
+ * Range from 1 to 256
+ */
+#define CONFIG_NETBUF_CACHE_SIZE 16
+
+/* Maximum number of frames a network receive thread takes from its
+ * interface before handing them to the protocols
+ * Range from 1 to 64
+ */
+#define CONFIG_NETWORK_RX_BATCH 8
+
+/* Number of frames that can wait in each network receive queue
+ * for a worker thread. There is one queue and worker per CPU.
+ * Range from 1 to 1024
  */
-#define CONFIG_POP_QUEUE_SIZE 32
+#define CONFIG_NETWORK_RX_QUEUE_SIZE 64
 
-/* Minimum time in milliseconds that POP packets stay in the input queue
- * if nobody is interested in receiving them.
- * Range from 0 to 10000
+/* Number of frame buffers in each raw frame ring (net/netmap.h).
+ * Range from 1 to 64, a power of two
  */
-#define CONFIG_POP_QUEUE_MIN_AGE 250
+#define CONFIG_NETMAP_SLOTS 16
 
 /* Maximum number of network interfaces 
  * Range from 1 to 64
@@ -80,15 +80,25 @@ void kernel_exception_handle(int exception)
     _interrupt_clear_EXL();
 
     switch(exception) {
+    /* The kernel may take TLB exceptions on userland addresses, for
+       example when a syscall copies data to a memory mapped file.
+       Such pages have been read in by mmap_prefault(), since a driver
+       may hold spinlocks here. */
     case EXCEPTION_TLBM:
+	if(tlb_modified_exception(1))
+	    break;
         print_tlb_debug();
 	KERNEL_PANIC("TLB Modification: not handled yet");
 	break;
     case EXCEPTION_TLBL:
+	if(tlb_load_exception(1))
+	    break;
         print_tlb_debug();
 	KERNEL_PANIC("TLB Load: not handled yet");
 	break;
     case EXCEPTION_TLBS:
+	if(tlb_store_exception(1))
+	    break;
         print_tlb_debug();
 	KERNEL_PANIC("TLB Store: not handled yet");
 	break;
@@ -35,6 +35,8 @@
  */
 #include "kernel/halt.h"
 #include "drivers/metadev.h"
+#include "drivers/disk.h"
+#include "net/network.h"
 #include "lib/libc.h"
 #include "fs/vfs.h"
 
@@ -49,6 +51,12 @@ void halt_kernel(void)
     /* Unmount all filesystems */
     vfs_deinit();
 
+    /* Dump disk statistics if requested with boot argument diskstats */
+    disk_print_stats();
+
+    /* Dump network statistics if requested with boot argument netstats */
+    network_print_stats();
+
     kprintf("Kernel: System shutdown complete, powering off\n");
     shutdown(POWEROFF_SHUTDOWN_MAGIC);
 }
@@ -42,6 +42,7 @@
 #include "kernel/interrupt.h"
 #include "drivers/polltty.h"
 #include "kernel/thread.h"
+#include "kernel/timeout.h"
 #include "lib/libc.h"
 #include "vm/tlb.h"
 
@@ -179,6 +180,10 @@ void interrupt_handle(uint32_t cause) {
     }
 
 
+    /* Run the timeouts that are due on every timer interrupt */
+    if(cause & INTERRUPT_CAUSE_HARDWARE_5)
+	timeout_expire();
+
     /* Timer interrupt (HW5) or requested context switch (SW0)
      * Also call scheduler if we're running the idle thread.
      */
@@ -187,16 +192,9 @@ void interrupt_handle(uint32_t cause) {
        scheduler_current_thread[this_cpu] == IDLE_THREAD_TID) {
 	scheduler_schedule();
 	
-	/* Until we have proper VM we must manually fill
-	   the TLB with pagetable entries before running code using
-	   given pagetable. Note that this method limits pagetable
-	   rows (possible mapping pairs) to 16 and can't be used
-	   with proper pagetables and VM.
-
-           Note that if you remove this call (which you probably do when
-           you implement proper VM), you must manually call _tlb_set_asid
-           here. See the implementation of tlb_fill on details how to do that.
-        */
+	/* Fill the TLB with the first pagetable entries of the
+	   thread and clear the rest, which also sets the ASID. Entries
+	   that don't fit are loaded by the TLB miss handlers. */
 	tlb_fill(thread_get_current_thread_entry()->pagetable);
     }
 }
@@ -0,0 +1,151 @@
+/*
+ * Timeouts run from the timer interrupt.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#include "kernel/timeout.h"
+#include "kernel/interrupt.h"
+#include "kernel/spinlock.h"
+#include "drivers/metadev.h"
+#include "lib/libc.h"
+
+/** @name Timeouts
+ *
+ * There are no timed sleeps in the kernel, so a thread that must wake
+ * up at some time sets a timeout whose function raises a semaphore
+ * or wakes a sleep queue resource. Pending timeouts are kept in a
+ * list sorted by deadline. Every CPU gets a timer interrupt at least
+ * once per scheduler timeslice, and each of them runs the timeouts
+ * that are due, so a timeout runs at most a timeslice late.
+ *
+ * Timeout functions are called with interrupts disabled and the
+ * timeout lock held. They may raise semaphores and wake sleep queue
+ * resources, but must not set or cancel timeouts. In turn, timeouts
+ * must not be set or cancelled while holding a semaphore, sleep queue
+ * or thread table spinlock.
+ *
+ * @{
+ */
+
+static spinlock_t timeout_slock;
+
+/* Pending timeouts, the earliest first */
+static timeout_t *timeout_head;
+
+/* Has the time t passed? Correct across the wraparound of the
+   millisecond counter as long as deadlines are less than 24 days
+   away. */
+#define TIMEOUT_PASSED(t, now) ((int32_t)((now) - (t)) >= 0)
+
+/**
+ * Initializes the list of pending timeouts.
+ */
+void timeout_init(void)
+{
+    spinlock_reset(&timeout_slock);
+    timeout_head = NULL;
+}
+
+/**
+ * Removes a pending timeout from the list. timeout_slock must be
+ * held.
+ */
+static void timeout_unlink(timeout_t *timeout)
+{
+    timeout_t **link;
+
+    for(link = &timeout_head; *link != timeout; link = &(*link)->next)
+        ;
+    *link = timeout->next;
+    timeout->pending = 0;
+}
+
+/**
+ * Sets a timeout to call func(arg) once msec milliseconds have
+ * passed. A timeout that is already pending is moved to the new time.
+ *
+ * @param timeout The timeout, owned by the caller.
+ *
+ * @param msec Milliseconds from now.
+ *
+ * @param func, arg The function to call and its argument.
+ */
+void timeout_set(timeout_t *timeout, uint32_t msec,
+                 void (*func)(void *arg), void *arg)
+{
+    interrupt_status_t intr_status;
+    timeout_t **link;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&timeout_slock);
+
+    if(timeout->pending)
+        timeout_unlink(timeout);
+
+    timeout->deadline = rtc_get_msec() + msec;
+    timeout->func = func;
+    timeout->arg = arg;
+    timeout->pending = 1;
+
+    for(link = &timeout_head;
+        *link != NULL && TIMEOUT_PASSED((*link)->deadline, timeout->deadline);
+        link = &(*link)->next)
+        ;
+    timeout->next = *link;
+    *link = timeout;
+
+    spinlock_release(&timeout_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Cancels a timeout. When this returns the function of the timeout
+ * is not running and will not be called, so the timeout may be
+ * reused or freed.
+ *
+ * @param timeout The timeout. It need not be pending.
+ */
+void timeout_cancel(timeout_t *timeout)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&timeout_slock);
+
+    if(timeout->pending)
+        timeout_unlink(timeout);
+
+    spinlock_release(&timeout_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Runs the timeouts that are due. Called from the timer interrupt
+ * with interrupts disabled.
+ */
+void timeout_expire(void)
+{
+    timeout_t *timeout;
+    uint32_t now;
+
+    /* Most ticks have nothing to do, and a timeout set just now is
+       found on the next one */
+    if(timeout_head == NULL)
+        return;
+
+    spinlock_acquire(&timeout_slock);
+
+    now = rtc_get_msec();
+    while(timeout_head != NULL &&
+          TIMEOUT_PASSED(timeout_head->deadline, now)) {
+        timeout = timeout_head;
+        timeout_head = timeout->next;
+        timeout->pending = 0;
+        timeout->func(timeout->arg);
+    }
+
+    spinlock_release(&timeout_slock);
+}
+
+/** @} */
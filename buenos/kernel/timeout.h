@@ -0,0 +1,32 @@
+/*
+ * Timeouts run from the timer interrupt.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef BUENOS_KERNEL_TIMEOUT_H
+#define BUENOS_KERNEL_TIMEOUT_H
+
+#include "lib/types.h"
+
+/* A function to be called once some milliseconds have passed. The
+ * structure belongs to the caller and must stay valid until the
+ * timeout has run or has been cancelled. */
+typedef struct timeout_struct {
+    /* rtc_get_msec() time at which func is due */
+    uint32_t deadline;
+    void (*func)(void *arg);
+    void *arg;
+    /* Nonzero while the timeout is waiting to run */
+    int pending;
+    /* Next pending timeout, in deadline order */
+    struct timeout_struct *next;
+} timeout_t;
+
+void timeout_init(void);
+void timeout_set(timeout_t *timeout, uint32_t msec,
+                 void (*func)(void *arg), void *arg);
+void timeout_cancel(timeout_t *timeout);
+void timeout_expire(void);
+
+#endif /* BUENOS_KERNEL_TIMEOUT_H */
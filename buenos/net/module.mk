@@ -4,7 +4,7 @@
 MODULE := net
 
 
-FILES := network.c protocols.c socket.c pop.c
+FILES := network.c netbuf.c protocols.c socket.c pop.c sop.c netmap.c
 
 SRC += $(patsubst %, $(MODULE)/%, $(FILES))
 
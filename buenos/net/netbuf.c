@@ -0,0 +1,198 @@
+/*
+ * Network frame buffers.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#include "net/netbuf.h"
+#include "kernel/assert.h"
+#include "kernel/config.h"
+#include "kernel/interrupt.h"
+#include "drivers/yams.h"
+#include "vm/pagepool.h"
+#include "lib/libc.h"
+
+/** @name Network frame buffers
+ *
+ * Every frame sent or received lives in one page, which travels
+ * through the layers by reference: the sender writes the payload
+ * once, each layer prepends its header into the headroom left in
+ * front of it, and the page is handed to the device as is. Received
+ * frames stay in the page the device wrote until the receiver has
+ * copied the payload out.
+ *
+ * Frame pages are recycled through a small cache on each CPU, so the
+ * per-packet cost is a few instructions with interrupts disabled
+ * instead of a trip to the page pool and its lock.
+ *
+ * @{
+ */
+
+/* Free frame pages cached on one CPU. Only touched by that CPU with
+ * interrupts disabled, so no lock is needed.
+ */
+typedef struct {
+    int count;
+    uint32_t pages[CONFIG_NETBUF_CACHE_SIZE];
+} netbuf_cache_t;
+
+static netbuf_cache_t netbuf_caches[CONFIG_MAX_CPUS];
+
+/**
+ * Initializes the frame page caches. They start empty and fill up as
+ * frames are freed.
+ */
+void netbuf_init(void)
+{
+    int i;
+
+    for (i = 0; i < CONFIG_MAX_CPUS; i++)
+	netbuf_caches[i].count = 0;
+}
+
+/**
+ * Gets a page for a network frame, from the cache of this CPU if it
+ * has one.
+ *
+ * @return Physical address of the page, 0 if out of memory.
+ */
+uint32_t netbuf_get_page(void)
+{
+    interrupt_status_t intr_status;
+    netbuf_cache_t *cache;
+    uint32_t phys = 0;
+
+    intr_status = _interrupt_disable();
+    cache = &netbuf_caches[_interrupt_getcpu()];
+    if (cache->count > 0)
+	phys = cache->pages[--cache->count];
+    _interrupt_set_state(intr_status);
+
+    if (phys == 0)
+	phys = pagepool_get_phys_page();
+
+    return phys;
+}
+
+/**
+ * Frees a page got from netbuf_get_page(). The page is kept in the
+ * cache of this CPU unless the cache is full.
+ *
+ * @param phys Physical address of the page.
+ */
+void netbuf_free_page(uint32_t phys)
+{
+    interrupt_status_t intr_status;
+    netbuf_cache_t *cache;
+
+    intr_status = _interrupt_disable();
+    cache = &netbuf_caches[_interrupt_getcpu()];
+    if (cache->count < CONFIG_NETBUF_CACHE_SIZE) {
+	cache->pages[cache->count++] = phys;
+	phys = 0;
+    }
+    _interrupt_set_state(intr_status);
+
+    if (phys != 0)
+	pagepool_free_phys_page(phys);
+}
+
+/**
+ * Allocates an empty frame buffer.
+ *
+ * @param buf The buffer to initialize.
+ *
+ * @param headroom Number of bytes to leave in front of the data for
+ * the headers that will be pushed. When the buffer is sent, the
+ * pushed headers must fill the headroom exactly.
+ *
+ * @return 0 on success, negative if out of memory.
+ */
+int netbuf_alloc(netbuf_t *buf, int headroom)
+{
+    KERNEL_ASSERT(headroom >= 0 && headroom <= PAGE_SIZE);
+
+    buf->phys = netbuf_get_page();
+    if (buf->phys == 0)
+	return -1;
+
+    buf->data = (uint8_t *)ADDR_PHYS_TO_KERNEL(buf->phys) + headroom;
+    buf->length = 0;
+
+    return 0;
+}
+
+/**
+ * Frees the page of a frame buffer.
+ *
+ * @param buf The buffer.
+ */
+void netbuf_free(netbuf_t *buf)
+{
+    netbuf_free_page(buf->phys);
+    buf->phys = 0;
+    buf->data = NULL;
+    buf->length = 0;
+}
+
+/**
+ * Prepends len bytes to the data of a buffer, taking them from the
+ * headroom.
+ *
+ * @param buf The buffer.
+ *
+ * @param len Number of bytes, at most the headroom left.
+ *
+ * @return Pointer to the new first byte of data.
+ */
+void *netbuf_push(netbuf_t *buf, int len)
+{
+    KERNEL_ASSERT(len >= 0 && len <= netbuf_headroom(buf));
+
+    buf->data -= len;
+    buf->length += len;
+
+    return buf->data;
+}
+
+/**
+ * Appends len bytes to the data of a buffer.
+ *
+ * @param buf The buffer.
+ *
+ * @param len Number of bytes, at most the tailroom left.
+ *
+ * @return Pointer to the first appended byte.
+ */
+void *netbuf_put(netbuf_t *buf, int len)
+{
+    uint8_t *tail = buf->data + buf->length;
+
+    KERNEL_ASSERT(len >= 0 && len <= netbuf_tailroom(buf));
+
+    buf->length += len;
+
+    return tail;
+}
+
+/**
+ * @param buf The buffer.
+ *
+ * @return Number of bytes free in front of the data.
+ */
+int netbuf_headroom(netbuf_t *buf)
+{
+    return (uint32_t)buf->data - ADDR_PHYS_TO_KERNEL(buf->phys);
+}
+
+/**
+ * @param buf The buffer.
+ *
+ * @return Number of bytes free after the data.
+ */
+int netbuf_tailroom(netbuf_t *buf)
+{
+    return PAGE_SIZE - netbuf_headroom(buf) - buf->length;
+}
+
+/** @} */
@@ -0,0 +1,35 @@
+/*
+ * Network frame buffers.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef NET_NETBUF_H
+#define NET_NETBUF_H
+
+#include "lib/types.h"
+
+/* A frame being built or received, held in one page. The data starts
+ * after some headroom, so each layer can prepend its header in place
+ * with netbuf_push() instead of copying the frame.
+ */
+typedef struct {
+    uint32_t phys;             /* physical address of the page */
+    uint8_t *data;             /* first byte of data in the page */
+    int length;                /* number of bytes of data */
+} netbuf_t;
+
+void netbuf_init(void);
+
+uint32_t netbuf_get_page(void);
+void netbuf_free_page(uint32_t phys);
+
+int netbuf_alloc(netbuf_t *buf, int headroom);
+void netbuf_free(netbuf_t *buf);
+
+void *netbuf_push(netbuf_t *buf, int len);
+void *netbuf_put(netbuf_t *buf, int len);
+int netbuf_headroom(netbuf_t *buf);
+int netbuf_tailroom(netbuf_t *buf);
+
+#endif /* NET_NETBUF_H */
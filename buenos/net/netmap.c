@@ -0,0 +1,500 @@
+/*
+ * Raw frame rings shared with userland.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#include "net/netmap.h"
+#include "net/network.h"
+#include "proc/process.h"
+#include "proc/syscall.h"
+#include "kernel/config.h"
+#include "kernel/assert.h"
+#include "kernel/interrupt.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleepq.h"
+#include "kernel/thread.h"
+#include "drivers/yams.h"
+#include "vm/vm.h"
+#include "vm/tlb.h"
+#include "vm/pagepool.h"
+#include "lib/libc.h"
+
+/** @name Raw frame rings
+ *
+ * A process attaches an interface with netmap_attach(). The kernel
+ * allocates a receive and a transmit ring of frame buffers, one page
+ * each, and maps them into the process, so frames are never copied
+ * between the kernel and the process.
+ *
+ * While an interface is attached, its receive thread in network.c
+ * receives frames straight into the free buffers of the receive ring
+ * instead of handing them to the protocols. Frames arriving while the
+ * ring is full are dropped. The transmit ring is sent by
+ * netmap_sync(), which also publishes the frames received since the
+ * previous sync and takes back the slots userland has released. So
+ * any number of frames are received and sent with one system call.
+ *
+ * The rings of a process are only changed by its own syscalls. A
+ * program must not sync an interface while another of its threads
+ * detaches it.
+ *
+ * @{
+ */
+
+/* statistics and the spinlock of the process table, from network.c
+ * and process.c */
+extern netstats_percpu_t network_if_stats[CONFIG_MAX_GNDS];
+extern spinlock_t process_table_slock;
+
+/* States of an attachment */
+#define NETMAP_FREE     0 /* the interface is not attached */
+#define NETMAP_SETUP    1 /* being attached */
+#define NETMAP_ATTACHED 2 /* frames go to the rings */
+#define NETMAP_DETACHED 3 /* unmapped, the pages wait for the receive
+			     thread to return from the device */
+
+/* Pages of an attachment: the rings, then the receive buffers and
+ * the transmit buffers */
+#define NETMAP_PAGES (1 + 2 * CONFIG_NETMAP_SLOTS)
+
+/* The attachment of one interface */
+typedef struct {
+    int state;
+
+    /* the process the rings are mapped into */
+    process_id_t owner;
+
+    /* userland address of the rings */
+    uint32_t address;
+
+    /* the rings, through the kernel segment */
+    netmap_rings_t *rings;
+
+    /* frame size of the interface, userland may change the copy in
+       the rings */
+    uint32_t frame_size;
+
+    /* physical pages of the rings and the buffers */
+    uint32_t pages[NETMAP_PAGES];
+
+    /* the page frames dropped on a full ring are received into */
+    uint32_t scratch;
+
+    /* frames received so far, and the part of them published to
+       userland by the last sync */
+    uint32_t rx_tail;
+    uint32_t rx_published;
+
+    /* receive slots released by userland, as of the last sync */
+    uint32_t rx_head;
+
+    /* frames sent so far */
+    uint32_t tx_head;
+
+    /* the receive thread is in the device with one of our pages */
+    int rx_busy;
+} netmap_t;
+
+static netmap_t netmap_table[CONFIG_MAX_GNDS];
+
+/* protects the states, owners, receive counters and rx_busy */
+static spinlock_t netmap_slock;
+
+/**
+ * Initializes the attachment table.
+ */
+void netmap_init(void)
+{
+    int i;
+
+    KERNEL_ASSERT(CONFIG_NETMAP_SLOTS <= NETMAP_MAX_SLOTS &&
+		  (CONFIG_NETMAP_SLOTS & (CONFIG_NETMAP_SLOTS - 1)) == 0);
+    KERNEL_ASSERT(sizeof(netmap_rings_t) <= PAGE_SIZE &&
+		  NETMAP_PAGES * PAGE_SIZE <= NETMAP_AREA_SIZE);
+
+    spinlock_reset(&netmap_slock);
+    for(i = 0; i < CONFIG_MAX_GNDS; i++)
+	netmap_table[i].state = NETMAP_FREE;
+}
+
+/**
+ * Frees the pages of an attachment and makes it free. Must be called
+ * without locks, after the pages have been unmapped.
+ *
+ * @param nm The attachment.
+ */
+static void netmap_free(netmap_t *nm)
+{
+    interrupt_status_t intr_status;
+    int i;
+
+    for(i = 0; i < NETMAP_PAGES; i++) {
+	if(nm->pages[i] != 0)
+	    pagepool_free_phys_page(nm->pages[i]);
+    }
+    if(nm->scratch != 0)
+	pagepool_free_phys_page(nm->scratch);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&netmap_slock);
+    nm->state = NETMAP_FREE;
+    spinlock_release(&netmap_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Finds the attachment of the given interface if it belongs to the
+ * current process.
+ *
+ * @param interface The index of the interface.
+ *
+ * @return The attachment, or NULL.
+ */
+static netmap_t *netmap_find(int interface)
+{
+    interrupt_status_t intr_status;
+    netmap_t *nm;
+
+    if(interface < 0 || interface >= CONFIG_MAX_GNDS)
+	return NULL;
+    nm = &netmap_table[interface];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&netmap_slock);
+    if(nm->state != NETMAP_ATTACHED ||
+       nm->owner != process_get_current_process())
+	nm = NULL;
+    spinlock_release(&netmap_slock);
+    _interrupt_set_state(intr_status);
+
+    return nm;
+}
+
+/**
+ * Attaches an interface to the current process. Frames received by
+ * the interface go to the receive ring from now on, not to the
+ * protocols.
+ *
+ * @param interface The index of the interface.
+ *
+ * @return Userland address of the rings (netmap_rings_t), or a
+ * negative error code.
+ */
+int netmap_attach(int interface)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    interrupt_status_t intr_status;
+    netmap_t *nm;
+    netmap_rings_t *rings;
+    gnd_t *gnd;
+    int i, fits;
+
+    gnd = network_get_gnd(interface);
+    if(gnd == NULL)
+	return SYSCALL_ILLEGAL_ARGUMENT;
+    nm = &netmap_table[interface];
+
+    /* reserve the attachment */
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&netmap_slock);
+    if(nm->state != NETMAP_FREE) {
+	spinlock_release(&netmap_slock);
+	_interrupt_set_state(intr_status);
+	return SYSCALL_OPERATION_NOT_POSSIBLE;
+    }
+    nm->state = NETMAP_SETUP;
+    spinlock_release(&netmap_slock);
+    _interrupt_set_state(intr_status);
+
+    for(i = 0; i < NETMAP_PAGES; i++)
+	nm->pages[i] = 0;
+    nm->scratch = pagepool_get_phys_page();
+
+    /* the pages are given to userland, so no old data may be left */
+    for(i = 0; i < NETMAP_PAGES; i++) {
+	nm->pages[i] = pagepool_get_phys_page();
+	if(nm->pages[i] == 0)
+	    break;
+	memoryset((void *)ADDR_PHYS_TO_KERNEL(nm->pages[i]), 0, PAGE_SIZE);
+    }
+
+    if(nm->scratch == 0 || i < NETMAP_PAGES) {
+	netmap_free(nm);
+	return SYSCALL_OPERATION_NOT_POSSIBLE;
+    }
+
+    nm->address = NETMAP_AREA_START + interface * NETMAP_AREA_SIZE;
+    nm->rings = (netmap_rings_t *)ADDR_PHYS_TO_KERNEL(nm->pages[0]);
+
+    nm->frame_size = gnd->frame_size(gnd);
+
+    rings = nm->rings;
+    rings->frame_size = nm->frame_size;
+    rings->rx.entries = CONFIG_NETMAP_SLOTS;
+    rings->rx.buffers = (uint8_t *)(nm->address + PAGE_SIZE);
+    rings->tx.entries = CONFIG_NETMAP_SLOTS;
+    rings->tx.buffers = (uint8_t *)(nm->address +
+				    (1 + CONFIG_NETMAP_SLOTS) * PAGE_SIZE);
+
+    /* map everything writable, the area starts on an even page so
+       the pages take one pagetable entry per pair */
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process_table_slock);
+    fits = (pagetable->valid_count + (NETMAP_PAGES + 1) / 2
+	    <= PAGETABLE_ENTRIES);
+    if(fits) {
+	for(i = 0; i < NETMAP_PAGES; i++)
+	    vm_map(pagetable, nm->pages[i], nm->address + i * PAGE_SIZE, 1);
+    }
+    spinlock_release(&process_table_slock);
+    _interrupt_set_state(intr_status);
+
+    if(!fits) {
+	netmap_free(nm);
+	return SYSCALL_OPERATION_NOT_POSSIBLE;
+    }
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&netmap_slock);
+    nm->owner = process_get_current_process();
+    nm->rx_tail = 0;
+    nm->rx_published = 0;
+    nm->rx_head = 0;
+    nm->tx_head = 0;
+    nm->rx_busy = 0;
+    nm->state = NETMAP_ATTACHED;
+    spinlock_release(&netmap_slock);
+    _interrupt_set_state(intr_status);
+
+    return nm->address;
+}
+
+/**
+ * Sends the frames userland has put in the transmit ring, takes back
+ * the receive slots it has released and publishes the frames received
+ * since the previous sync. Frames larger than the frame size of the
+ * interface are not sent.
+ *
+ * @param interface The index of the interface.
+ *
+ * @param flags NETMAP_SYNC_WAIT to wait for a frame if there is none
+ * in the receive ring, or 0.
+ *
+ * @return Number of frames in the receive ring, or a negative error
+ * code.
+ */
+int netmap_sync(int interface, int flags)
+{
+    interrupt_status_t intr_status;
+    netstats_block_t *stats;
+    netmap_t *nm;
+    netmap_rings_t *rings;
+    netmap_slot_t *slot;
+    gnd_t *gnd;
+    uint32_t tail, head, page;
+    int ret;
+
+    nm = netmap_find(interface);
+    if(nm == NULL || (flags & ~NETMAP_SYNC_WAIT) != 0)
+	return SYSCALL_ILLEGAL_ARGUMENT;
+
+    gnd = network_get_gnd(interface);
+    stats = network_if_stats[interface];
+    rings = nm->rings;
+
+    /* Transmit. The ring belongs to this process, so the sends are
+       done without locks. */
+    tail = rings->tx.tail;
+    if(tail - nm->tx_head > CONFIG_NETMAP_SLOTS)
+	return SYSCALL_ILLEGAL_ARGUMENT;
+
+    for(; nm->tx_head != tail; nm->tx_head++) {
+	slot = &rings->tx.slots[nm->tx_head & (CONFIG_NETMAP_SLOTS - 1)];
+	page = nm->pages[1 + CONFIG_NETMAP_SLOTS +
+			 (nm->tx_head & (CONFIG_NETMAP_SLOTS - 1))];
+
+	/* the destination is the first field of the frame header */
+	if(slot->length > nm->frame_size ||
+	   gnd->send(gnd, (void *)page,
+		     *(network_address_t *)ADDR_PHYS_TO_KERNEL(page)) != 0) {
+	    netstats_add(stats, NETSTATS_FIELD(send_errors), 1);
+	    continue;
+	}
+
+	netstats_add(stats, NETSTATS_FIELD(frames_out), 1);
+	netstats_add(stats, NETSTATS_FIELD(bytes_out), slot->length);
+    }
+    rings->tx.head = nm->tx_head;
+
+    /* Receive */
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&netmap_slock);
+
+    /* userland can only release what it has been given */
+    head = rings->rx.head;
+    if(head - nm->rx_head > nm->rx_published - nm->rx_head) {
+	spinlock_release(&netmap_slock);
+	_interrupt_set_state(intr_status);
+	return SYSCALL_ILLEGAL_ARGUMENT;
+    }
+    nm->rx_head = head;
+
+    while((flags & NETMAP_SYNC_WAIT) && nm->state == NETMAP_ATTACHED &&
+	  nm->rx_tail == nm->rx_head) {
+	sleepq_add(nm);
+	spinlock_release(&netmap_slock);
+	thread_switch();
+	spinlock_acquire(&netmap_slock);
+    }
+
+    if(nm->state == NETMAP_ATTACHED) {
+	nm->rx_published = nm->rx_tail;
+	rings->rx.tail = nm->rx_tail;
+	ret = nm->rx_tail - nm->rx_head;
+    } else {
+	/* detached while we waited */
+	ret = SYSCALL_NOT_OPEN;
+    }
+
+    spinlock_release(&netmap_slock);
+    _interrupt_set_state(intr_status);
+
+    return ret;
+}
+
+/**
+ * Detaches an interface from the current process. Its rings are
+ * unmapped and frames go to the protocols again.
+ *
+ * @param interface The index of the interface.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int netmap_detach(int interface)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    interrupt_status_t intr_status;
+    netmap_t *nm;
+    int i, busy;
+
+    nm = netmap_find(interface);
+    if(nm == NULL)
+	return SYSCALL_ILLEGAL_ARGUMENT;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process_table_slock);
+    for(i = 0; i < NETMAP_PAGES; i++) {
+	vm_unmap(pagetable, nm->address + i * PAGE_SIZE);
+	tlb_update(pagetable, nm->address + i * PAGE_SIZE);
+    }
+    spinlock_release(&process_table_slock);
+    _interrupt_set_state(intr_status);
+
+    /* The pages must be out of every TLB before they can be freed */
+    tlb_shootdown(pagetable);
+
+    /* a page in the device is freed by the receive thread when the
+       device returns it */
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&netmap_slock);
+    nm->state = NETMAP_DETACHED;
+    busy = nm->rx_busy;
+    sleepq_wake_all(nm);
+    spinlock_release(&netmap_slock);
+    _interrupt_set_state(intr_status);
+
+    if(!busy)
+	netmap_free(nm);
+
+    return 0;
+}
+
+/**
+ * Detaches all interfaces attached to the current process. Called
+ * when the last thread of the process exits.
+ */
+void netmap_detach_all(void)
+{
+    int i;
+
+    for(i = 0; i < CONFIG_MAX_GNDS; i++)
+	netmap_detach(i);
+}
+
+/**
+ * Receives one frame into the receive ring of an interface, if it is
+ * attached. Called by the receive thread of the interface, blocks
+ * until a frame arrives.
+ *
+ * @param interface The index of the interface.
+ *
+ * @return 0 if the interface is not attached and nothing was done,
+ * 1 if a frame was received or dropped.
+ */
+int netmap_receive(int interface)
+{
+    interrupt_status_t intr_status;
+    netstats_block_t *stats = network_if_stats[interface];
+    netmap_t *nm = &netmap_table[interface];
+    gnd_t *gnd = network_get_gnd(interface);
+    uint32_t page, size, count = 0;
+    int slot = -1, received;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&netmap_slock);
+
+    if(nm->state != NETMAP_ATTACHED) {
+	spinlock_release(&netmap_slock);
+	_interrupt_set_state(intr_status);
+	return 0;
+    }
+
+    if(nm->rx_tail - nm->rx_head < CONFIG_NETMAP_SLOTS) {
+	slot = nm->rx_tail & (CONFIG_NETMAP_SLOTS - 1);
+	page = nm->pages[1 + slot];
+    } else {
+	page = nm->scratch;
+    }
+    size = nm->frame_size;
+    nm->rx_busy = 1;
+
+    spinlock_release(&netmap_slock);
+    _interrupt_set_state(intr_status);
+
+    received = (gnd->recv(gnd, (void *)page) == 0);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&netmap_slock);
+
+    nm->rx_busy = 0;
+    if(nm->state == NETMAP_DETACHED) {
+	spinlock_release(&netmap_slock);
+	_interrupt_set_state(intr_status);
+	netmap_free(nm);
+	return 1;
+    }
+
+    if(received && slot >= 0) {
+	nm->rings->rx.slots[slot].length = size;
+	nm->rx_tail++;
+	count = nm->rx_tail - nm->rx_head;
+	sleepq_wake_all(nm);
+    }
+
+    spinlock_release(&netmap_slock);
+    _interrupt_set_state(intr_status);
+
+    if(received) {
+	netstats_add(stats, NETSTATS_FIELD(frames_in), 1);
+	netstats_add(stats, NETSTATS_FIELD(bytes_in), size);
+	if(slot >= 0)
+	    netstats_max(stats, NETSTATS_FIELD(queue_max), count);
+	else
+	    netstats_add(stats, NETSTATS_FIELD(drop_queue_full), 1);
+    }
+
+    return 1;
+}
+
+/** @} */
@@ -0,0 +1,72 @@
+/*
+ * Raw frame rings shared with userland.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef NET_NETMAP_H
+#define NET_NETMAP_H
+
+#include "lib/types.h"
+
+/* The rings of interface n are mapped at NETMAP_AREA_START +
+   n * NETMAP_AREA_SIZE */
+#define NETMAP_AREA_START 0x60000000
+#define NETMAP_AREA_SIZE  0x00100000
+
+/* Maximum number of slots in one ring */
+#define NETMAP_MAX_SLOTS 64
+
+/* Distance between the buffers of consecutive slots */
+#define NETMAP_BUF_STRIDE 4096
+
+/* Flag of syscall_netmap_sync: wait until a frame has been received */
+#define NETMAP_SYNC_WAIT 0x1
+
+/* One slot of a ring */
+typedef struct {
+    /* Length of the frame in the buffer of the slot */
+    uint32_t length;
+} netmap_slot_t;
+
+/* A single producer / single consumer ring of frame buffers. Heads
+ * and tails are free running counters, the slot is the counter masked
+ * with entries-1. The consumer owns the slots from head to tail and
+ * releases them by advancing head; the producer fills slots at tail.
+ * Userland consumes the receive ring and produces the transmit ring.
+ * The kernel only looks at the indices of userland, and publishes its
+ * own, in syscall_netmap_sync. */
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    /* Number of slots, a power of two */
+    uint32_t entries;
+    /* Buffer of slot 0, the buffer of slot i is i * NETMAP_BUF_STRIDE
+       bytes after it */
+    uint8_t *buffers;
+    netmap_slot_t slots[NETMAP_MAX_SLOTS];
+} netmap_ring_t;
+
+/* The rings of one interface, at the start of its area. A buffer
+ * holds a whole frame: the destination address, the source address
+ * and the protocol id, 4 bytes each, and then the payload. */
+typedef struct {
+    /* Size of the frames of the interface */
+    uint32_t frame_size;
+    netmap_ring_t rx;
+    netmap_ring_t tx;
+} netmap_rings_t;
+
+/* Buffer of slot counter n of ring */
+#define NETMAP_BUF(ring, n) \
+    ((ring)->buffers + ((n) & ((ring)->entries - 1)) * NETMAP_BUF_STRIDE)
+
+/* Kernel side */
+void netmap_init(void);
+int netmap_attach(int interface);
+int netmap_sync(int interface, int flags);
+int netmap_detach(int interface);
+void netmap_detach_all(void);
+int netmap_receive(int interface);
+
+#endif /* NET_NETMAP_H */
@@ -0,0 +1,55 @@
+/*
+ * Network statistics.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef NET_NETSTATS_H
+#define NET_NETSTATS_H
+
+#include "lib/types.h"
+
+/* Which statistics to get. For NETSTATS_INTERFACE the number is the
+   index of the interface, for NETSTATS_PROTOCOL the protocol id (1
+   for POP, 2 for SOP). */
+#define NETSTATS_INTERFACE 0
+#define NETSTATS_LOOPBACK  1
+#define NETSTATS_PROTOCOL  2
+
+/* Statistics of one network interface or protocol. Interfaces count
+   whole frames as sent on the media, protocols count payload bytes.
+   Counters not meaningful for a layer stay zero. */
+typedef struct {
+    /* Frames received and their bytes, including dropped ones */
+    uint32_t frames_in;
+    uint32_t bytes_in;
+
+    /* Frames sent successfully and their bytes */
+    uint32_t frames_out;
+    uint32_t bytes_out;
+
+    /* Frames the layer below failed to send */
+    uint32_t send_errors;
+
+    /* Received frames dropped because a receive queue was full (for
+       SOP, data that did not fit the window) */
+    uint32_t drop_queue_full;
+
+    /* Received frames dropped because nobody listens at the port or
+       the protocol is unknown */
+    uint32_t drop_no_listener;
+
+    /* Received frames dropped because the socket was closed before
+       they were read, or its connection was closed */
+    uint32_t drop_closed;
+
+    /* Received frames dropped as malformed, duplicate or part of a
+       datagram that was never completed */
+    uint32_t drop_invalid;
+
+    /* Most frames ever waiting in one receive queue (for SOP, most
+       bytes waiting in one receive buffer) */
+    uint32_t queue_max;
+} netstats_t;
+
+#endif /* NET_NETSTATS_H */
@@ -37,11 +37,18 @@
 #include "net/network.h"
 #include "net/protocols.h"
 #include "net/socket.h"
+#include "net/netmap.h"
 #include "kernel/config.h"
 #include "kernel/assert.h"
+#include "kernel/interrupt.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleepq.h"
 #include "drivers/yams.h"
+#include "drivers/metadev.h"
 #include "kernel/thread.h"
 #include "vm/pagepool.h"
+#include "lib/libc.h"
+#include "lib/debug.h"
 
 /** @name Network frame layer
  *
@@ -49,6 +56,14 @@
  * This layer is an abstraction above the GND layer. Packets are
  * received from all GNDs found in the system and forwarded for
  * further processing to the upper layers.
+ *
+ * Each GND has a thread that only takes frames from the device. The
+ * frames are steered to one receive queue per CPU by a hash of their
+ * source address and destination port, and a worker thread per queue
+ * runs the protocol handlers. So different flows are handled in
+ * parallel, while the frames of one flow stay in order. The scheduler
+ * has no CPU affinity, so a worker is not tied to a particular CPU;
+ * the queues only bound how many flows are processed at once.
  */
 
 /* Structure of the network frame header. */
@@ -88,14 +103,95 @@ typedef struct {
 /* A table of network interfaces. */
 network_interface_info_t network_interfaces[CONFIG_MAX_GNDS];
 
+/* Statistics of each interface and of loopback */
+netstats_percpu_t network_if_stats[CONFIG_MAX_GNDS];
+static netstats_percpu_t network_loopback_stats;
+
+/* Number of counters in a netstats_t */
+#define NETSTATS_COUNTERS (sizeof(netstats_t) / sizeof(uint32_t))
+
+/* A frame in a receive queue */
+typedef struct {
+    network_frame_t *frame;
+    /* the interface it came from */
+    int interface;
+} network_rx_entry_t;
+
+/* A queue of received frames waiting for its worker thread, which
+ * sleeps on the queue while it is empty. */
+typedef struct {
+    spinlock_t slock;
+    network_rx_entry_t frames[CONFIG_NETWORK_RX_QUEUE_SIZE];
+    int head;
+    int count;
+} network_rx_queue_t;
+
+/* Receive queues, one per CPU */
+static network_rx_queue_t network_rx_queues[CONFIG_MAX_CPUS];
+static int network_rx_nqueues;
+
+/**
+ * Finds a counter in the block of this CPU. Interrupts must be
+ * disabled.
+ */
+static uint32_t *netstats_counter(netstats_block_t *stats, uint32_t field)
+{
+    return (uint32_t *)((uint8_t *)&stats[_interrupt_getcpu()].stats
+                        + field);
+}
+
+/**
+ * Adds to a network statistics counter, in the block of this CPU.
+ *
+ * @param stats The statistics, a netstats_percpu_t.
+ *
+ * @param field The counter, given by NETSTATS_FIELD().
+ *
+ * @param value The amount to add.
+ */
+void netstats_add(netstats_block_t *stats, uint32_t field, uint32_t value)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    *netstats_counter(stats, field) += value;
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Raises a network statistics high-water mark, in the block of this
+ * CPU.
+ *
+ * @param stats The statistics, a netstats_percpu_t.
+ *
+ * @param field The mark, given by NETSTATS_FIELD().
+ *
+ * @param value The value just seen.
+ */
+void netstats_max(netstats_block_t *stats, uint32_t field, uint32_t value)
+{
+    interrupt_status_t intr_status;
+    uint32_t *mark;
+
+    intr_status = _interrupt_disable();
+    mark = netstats_counter(stats, field);
+    if(value > *mark)
+	*mark = value;
+    _interrupt_set_state(intr_status);
+}
+
 /** 
  * Forwards a received frame to the upper protocol layers. 
  *
  * @param frame The frame that was received.
  *
+ * @param stats Statistics of the interface it came from, for frames
+ * of unknown protocols.
+ *
  * @return 0 on failure. Other values mean success.
  */
-static int network_receive_frame(network_frame_t *frame)
+static int network_receive_frame(network_frame_t *frame,
+				 netstats_block_t *stats)
 {
     frame_handler_t frame_handler;
     
@@ -109,40 +205,173 @@ static int network_receive_frame(network_frame_t *frame)
 				 frame->payload);
     }
 
+    netstats_add(stats, NETSTATS_FIELD(drop_no_listener), 1);
     return 0;
 }
 
 /**
- * Continually receives frames from a given network interface.
+ * Appends a received frame to the receive queue of its flow. The
+ * flow is the source address and the destination port of the frame;
+ * the headers of all transport protocols start with the source and
+ * destination ports.
+ *
+ * @param frame The frame.
+ *
+ * @param interface The interface the frame came from.
+ *
+ * @return 1 if the frame was queued, 0 if the queue is full.
+ */
+static int network_rx_steer(network_frame_t *frame, int interface)
+{
+    interrupt_status_t intr_status;
+    network_rx_queue_t *queue;
+    network_rx_entry_t *entry;
+    uint32_t hash;
+    uint16_t dport;
+    int accepted = 0, count;
+
+    dport = ((uint16_t *)frame->payload)[1];
+    hash = (frame->header.source ^ ((uint32_t)dport << 16 | dport))
+	* 0x9e3779b1;
+    queue = &network_rx_queues[(hash >> 16) % network_rx_nqueues];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&queue->slock);
+
+    if(queue->count < CONFIG_NETWORK_RX_QUEUE_SIZE) {
+	entry = &queue->frames[(queue->head + queue->count)
+			       % CONFIG_NETWORK_RX_QUEUE_SIZE];
+	entry->frame = frame;
+	entry->interface = interface;
+	queue->count++;
+	accepted = 1;
+
+	/* the worker only sleeps on an empty queue */
+	if(queue->count == 1)
+	    sleepq_wake(queue);
+    }
+    count = queue->count;
+
+    spinlock_release(&queue->slock);
+    _interrupt_set_state(intr_status);
+
+    if(accepted)
+	netstats_max(network_if_stats[interface], NETSTATS_FIELD(queue_max),
+		     count);
+    else
+	netstats_add(network_if_stats[interface],
+		     NETSTATS_FIELD(drop_queue_full), 1);
+
+    return accepted;
+}
+
+/**
+ * Hands the frames of one receive queue to the protocols, up to
+ * CONFIG_NETWORK_RX_BATCH frames at a time. Frames refused by the
+ * protocols are freed.
+ *
+ * @param index The index of the queue.
+ */
+static void network_rx_worker(uint32_t index)
+{
+    interrupt_status_t intr_status;
+    network_rx_queue_t *queue = &network_rx_queues[index];
+    network_rx_entry_t batch[CONFIG_NETWORK_RX_BATCH];
+    int i, n;
+
+    while(1) {
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&queue->slock);
+
+	while(queue->count == 0) {
+	    sleepq_add(queue);
+	    spinlock_release(&queue->slock);
+	    thread_switch();
+	    spinlock_acquire(&queue->slock);
+	}
+
+	n = MIN(queue->count, CONFIG_NETWORK_RX_BATCH);
+	for(i = 0; i < n; i++) {
+	    batch[i] = queue->frames[queue->head];
+	    queue->head = (queue->head + 1) % CONFIG_NETWORK_RX_QUEUE_SIZE;
+	}
+	queue->count -= n;
+
+	spinlock_release(&queue->slock);
+	_interrupt_set_state(intr_status);
+
+	for(i = 0; i < n; i++) {
+	    if(network_receive_frame(batch[i].frame,
+				     network_if_stats[batch[i].interface])
+	       == 0)
+		netbuf_free_page(ADDR_KERNEL_TO_PHYS((uint32_t)batch[i].frame));
+	}
+    }
+}
+
+/**
+ * Continually receives frames from a given network interface. The
+ * thread keeps a ring of CONFIG_NETWORK_RX_BATCH empty frame pages.
+ * On each wakeup it receives into the ring every frame the device
+ * has waiting, up to the size of the ring, and then steers the batch
+ * to the receive queues. Pages queued are replaced before the next
+ * batch; pages of frames dropped on a full queue are reused as is.
  *
  * @param interface The index of the interface from which frames are
  * received.
  */
 static void network_receive_thread(uint32_t interface)
 {
-    network_frame_t *frame = NULL;
-    uint32_t frame_phys_addr = 0;
+    uint32_t ring[CONFIG_NETWORK_RX_BATCH];
+    int received[CONFIG_NETWORK_RX_BATCH];
     gnd_t *gnd;
-    int ret = 1; /*Initialize to success, so a new page will be allocated.*/
+    int i, n, frames;
 
     gnd = network_interfaces[interface].gnd;
 
+    for(i = 0; i < CONFIG_NETWORK_RX_BATCH; i++)
+	ring[i] = 0;
+
     while(1) {
-	if(ret != 0) {
-	    /* We need new page */
-	    frame_phys_addr = pagepool_get_phys_page();
-	    KERNEL_ASSERT(frame_phys_addr != 0);
-	    frame = (network_frame_t *) ADDR_PHYS_TO_KERNEL(frame_phys_addr);
+	/* While the interface is attached to raw frame rings, frames
+	   go to the rings instead */
+	if(netmap_receive(interface))
+	    continue;
+
+	/* Replace the pages handed to the protocols */
+	for(i = 0; i < CONFIG_NETWORK_RX_BATCH; i++) {
+	    if(ring[i] == 0) {
+		ring[i] = netbuf_get_page();
+		KERNEL_ASSERT(ring[i] != 0);
+	    }
 	}
 
-	ret = 0;
-
         /* Receive a frame. This call blocks until frame is transfered
-           to memory. */
-	if(gnd->recv(gnd, (void *) frame_phys_addr) == 0) {
-	    /* success */
-	    ret = network_receive_frame(frame);
+           to memory. Then drain whatever else the device has ready
+           without blocking again. */
+	n = 0;
+	do {
+	    received[n] = (gnd->recv(gnd, (void *) ring[n]) == 0);
+	    n++;
+	} while(n < CONFIG_NETWORK_RX_BATCH &&
+		gnd->poll != NULL && gnd->poll(gnd));
+
+	frames = 0;
+	for(i = 0; i < n; i++) {
+	    if(!received[i])
+		continue;
+	    frames++;
+	    if(network_rx_steer((network_frame_t *)
+				ADDR_PHYS_TO_KERNEL(ring[i]), interface)) {
+		/* the queue owns the page now */
+		ring[i] = 0;
+	    }
 	}
+
+	netstats_add(network_if_stats[interface], NETSTATS_FIELD(frames_in),
+		     frames);
+	netstats_add(network_if_stats[interface], NETSTATS_FIELD(bytes_in),
+		     frames * network_interfaces[interface].mtu);
     }
 }
 
@@ -155,6 +384,8 @@ void network_init(void)
     int i;
     device_t *dev;
 
+    KERNEL_ASSERT(sizeof(network_frame_header_t) == NETWORK_HEADER_SIZE);
+
     /* Find all network devices in system */
     for(i=0; i<CONFIG_MAX_GNDS; i++) {
 	dev = device_get(YAMS_TYPECODE_NIC, i);
@@ -180,11 +411,32 @@ void network_init(void)
 	}
     }
 
+    netbuf_init();
+    netmap_init();
+
     /* Initialize sockets. Should be done before protocol inits*/
     socket_init();
     /* Initialize upper level network protocols. */
     protocols_init();
 
+    /* Create the receive queues and their workers, if there is
+       anything to receive from. */
+    if(network_interfaces[0].gnd != NULL) {
+	network_rx_nqueues = MIN(MAX(cpustatus_count(), 1), CONFIG_MAX_CPUS);
+
+	for(i=0; i<network_rx_nqueues; i++) {
+	    TID_t tid;
+
+	    spinlock_reset(&network_rx_queues[i].slock);
+	    network_rx_queues[i].head = 0;
+	    network_rx_queues[i].count = 0;
+
+	    tid = thread_create(&network_rx_worker, i);
+	    KERNEL_ASSERT(tid > 0);
+	    thread_run(tid);
+	}
+    }
+
     /* Create and start a receiving thread for each network
        interface. */
     for(i=0; i<CONFIG_MAX_GNDS; i++) {
@@ -221,6 +473,22 @@ network_address_t network_get_source_address(int interface)
     return network_interfaces[interface].address;
 }
 
+/**
+ * Gets the GND of the given interface.
+ *
+ * @param interface The index of the interface.
+ *
+ * @return The GND, or NULL if there is no interface with given
+ * interface index.
+ */
+gnd_t *network_get_gnd(int interface)
+{
+    if(interface<0 || interface>= CONFIG_MAX_GNDS)
+	return NULL;
+
+    return network_interfaces[interface].gnd;
+}
+
 /**
  * Gets the network broadcast address.
  *
@@ -314,15 +582,26 @@ static int network_send_interface(int interface,
 				  network_frame_t *frame)
 {
     gnd_t *gnd;
+    netstats_block_t *stats = network_if_stats[interface];
 
     gnd = network_interfaces[interface].gnd;
-    return gnd->send(gnd, 
-		     (void *) ADDR_KERNEL_TO_PHYS((uint32_t) frame), 
-		     destination);
+    if(gnd->send(gnd,
+		 (void *) ADDR_KERNEL_TO_PHYS((uint32_t) frame),
+		 destination) != 0) {
+	netstats_add(stats, NETSTATS_FIELD(send_errors), 1);
+	return -1;
+    }
+
+    netstats_add(stats, NETSTATS_FIELD(frames_out), 1);
+    netstats_add(stats, NETSTATS_FIELD(bytes_out),
+		 network_interfaces[interface].mtu);
+    return 0;
 }
 
 /**
  * Send a frame from the source interface to the destination address.
+ * The payload is copied into a new frame buffer; callers that can
+ * build the payload in place should use network_send_buf().
  *
  * @param source The interface to use for sending. If this is
  * broadcast address the frame is sent through all interfaces in the
@@ -346,36 +625,77 @@ int network_send(network_address_t source,
 		 int length,
 		 void *buffer)
 {
-    uint32_t phys_frame;
-    network_frame_t *frame;
-    int send_ret=NET_OK;
+    netbuf_t buf;
 
     /* The frame should fit into one page. */
     KERNEL_ASSERT(length > 0 &&
 		  length <= (int)(PAGE_SIZE-sizeof(network_frame_header_t)));
 
-    /* Allocate a page for this frame. */
-    phys_frame = pagepool_get_phys_page();
-    if(phys_frame == 0)
+    if(netbuf_alloc(&buf, sizeof(network_frame_header_t)) != 0)
 	return NET_ERROR;
-    frame = (network_frame_t *) ADDR_PHYS_TO_KERNEL(phys_frame);
+
+    memcopy(length, netbuf_put(&buf, length), buffer);
+
+    return network_send_buf(source, destination, protocol_id, &buf);
+}
+
+/**
+ * Send a frame buffer from the source interface to the destination
+ * address. The frame header is written into the headroom of the
+ * buffer, which must be exactly NETWORK_HEADER_SIZE bytes at this
+ * point, and the page of the buffer is given to the device as is. The
+ * buffer is consumed: it is freed, or on loopback handed over to the
+ * receiver.
+ *
+ * @param source The interface to use for sending. If this is
+ * broadcast address the frame is sent through all interfaces in the
+ * system.
+ *
+ * @param destination The destination address for this frame.
+ *
+ * @param protocol_id The higher level protocol id to be used with
+ * this frame.
+ *
+ * @param buf The payload of the frame.
+ *
+ * @return Generic network error codes.
+ */
+int network_send_buf(network_address_t source,
+		     network_address_t destination,
+		     uint32_t protocol_id,
+		     netbuf_t *buf)
+{
+    network_frame_t *frame;
+    int send_ret=NET_OK;
+
+    KERNEL_ASSERT(buf->length > 0 &&
+		  netbuf_headroom(buf) == sizeof(network_frame_header_t));
 
     /* Initialize the frame header. */
+    frame = (network_frame_t *)netbuf_push(buf, sizeof(network_frame_header_t));
     frame->header.source = source;
     frame->header.destination = destination;
     frame->header.protocol_id = protocol_id;
-    memcopy(length, frame->payload, buffer);
 
     /* If loopback, push the frame immediately to the upper layers. */
     if(destination == NETWORK_LOOPBACK_ADDRESS) {
 	if(frame->header.source == NETWORK_BROADCAST_ADDRESS)
 	    frame->header.source = NETWORK_LOOPBACK_ADDRESS;
-	if(network_receive_frame(frame) == 0) {
+
+	netstats_add(network_loopback_stats, NETSTATS_FIELD(frames_in), 1);
+	netstats_add(network_loopback_stats, NETSTATS_FIELD(bytes_in),
+		     buf->length);
+	if(network_receive_frame(frame, network_loopback_stats) == 0) {
 	    /* push failed */
-	    pagepool_free_phys_page(phys_frame);
+	    netstats_add(network_loopback_stats,
+			 NETSTATS_FIELD(send_errors), 1);
+	    netbuf_free(buf);
 	    return NET_ERROR;
 	}
-	
+
+	netstats_add(network_loopback_stats, NETSTATS_FIELD(frames_out), 1);
+	netstats_add(network_loopback_stats, NETSTATS_FIELD(bytes_out),
+		     buf->length);
 	return NET_OK;
     }
 
@@ -387,7 +707,7 @@ int network_send(network_address_t source,
 	interface = network_get_interface(source);
 	if(interface < 0) {
             /* No such interface. */
-	    pagepool_free_phys_page(phys_frame);
+	    netbuf_free(buf);
 	    return NET_DOESNT_EXIST;
 	}
 
@@ -407,7 +727,7 @@ int network_send(network_address_t source,
 	}
     }
 
-    pagepool_free_phys_page(phys_frame);
+    netbuf_free(buf);
     return send_ret;
 }
 
@@ -421,6 +741,98 @@ void network_free_frame(void *payload_frame)
 {
     uint32_t frame = ADDR_KERNEL_TO_PHYS((uint32_t)payload_frame) 
 	& PAGE_SIZE_MASK;
-    pagepool_free_phys_page(frame);
+    netbuf_free_page(frame);
 }
 
+
+/**
+ * Copies network statistics.
+ *
+ * @param kind NETSTATS_INTERFACE, NETSTATS_LOOPBACK or
+ * NETSTATS_PROTOCOL.
+ *
+ * @param n The index of the interface or the id of the protocol.
+ *
+ * @param stats The statistics are copied here.
+ *
+ * @return 0 on success, negative if there is no such interface or
+ * protocol.
+ */
+int network_get_stats(int kind, int n, netstats_t *stats)
+{
+    netstats_block_t *source;
+    uint32_t queue_max = 0;
+    uint32_t i;
+    int cpu;
+
+    switch(kind) {
+    case NETSTATS_INTERFACE:
+	if(n < 0 || n >= CONFIG_MAX_GNDS ||
+	   network_interfaces[n].gnd == NULL)
+	    return -1;
+	source = network_if_stats[n];
+	break;
+    case NETSTATS_LOOPBACK:
+	source = network_loopback_stats;
+	break;
+    case NETSTATS_PROTOCOL:
+	source = protocols_get_stats(n);
+	if(source == NULL)
+	    return -1;
+	break;
+    default:
+	return -1;
+    }
+
+    /* Sum the blocks of all CPUs, except for the high-water mark.
+       The counters are read without locking, each one as a whole. */
+    memoryset(stats, 0, sizeof(netstats_t));
+    for(cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+	for(i = 0; i < NETSTATS_COUNTERS; i++)
+	    ((uint32_t *)stats)[i] += ((uint32_t *)&source[cpu].stats)[i];
+	queue_max = MAX(queue_max, source[cpu].stats.queue_max);
+    }
+    stats->queue_max = queue_max;
+
+    return 0;
+}
+
+/**
+ * Prints the statistics of one interface or protocol.
+ */
+static void network_print_one(char *name, netstats_t *stats)
+{
+    DEBUG("netstats", "%s: in %d frames (%d bytes), out %d frames "
+	  "(%d bytes), %d send errors\n", name, stats->frames_in,
+	  stats->bytes_in, stats->frames_out, stats->bytes_out,
+	  stats->send_errors);
+    DEBUG("netstats", "%s: dropped %d queue full, %d no listener, "
+	  "%d closed, %d invalid, max queue %d\n", name,
+	  stats->drop_queue_full, stats->drop_no_listener,
+	  stats->drop_closed, stats->drop_invalid, stats->queue_max);
+}
+
+/**
+ * Prints the statistics of all interfaces, loopback and protocols to
+ * the console if the boot argument netstats is given.
+ */
+void network_print_stats(void)
+{
+    netstats_t stats;
+    char name[8];
+    int n;
+
+    for(n = 0; network_get_stats(NETSTATS_INTERFACE, n, &stats) == 0; n++) {
+	snprintf(name, sizeof(name), "if%d", n);
+	network_print_one(name, &stats);
+    }
+
+    if(network_get_stats(NETSTATS_LOOPBACK, 0, &stats) == 0)
+	network_print_one("loopback", &stats);
+
+    if(network_get_stats(NETSTATS_PROTOCOL, PROTOCOL_POP, &stats) == 0)
+	network_print_one("pop", &stats);
+
+    if(network_get_stats(NETSTATS_PROTOCOL, PROTOCOL_SOP, &stats) == 0)
+	network_print_one("sop", &stats);
+}
@@ -38,11 +38,15 @@
 #define NET_NETWORK_H
 
 #include "lib/types.h"
+#include "kernel/config.h"
 #include "drivers/gnd.h"
+#include "net/netbuf.h"
+#include "net/netstats.h"
 
 void network_init(void);
 
 network_address_t network_get_source_address(int interface);
+gnd_t *network_get_gnd(int interface);
 network_address_t network_get_broadcast_address(void);
 network_address_t network_get_loopback_address(void);
 int network_get_mtu(network_address_t local_address);
@@ -52,9 +56,34 @@ int network_send(network_address_t source,
 		 uint32_t protocol_id,
 		 int length,
 		 void *buffer);
+int network_send_buf(network_address_t source,
+		     network_address_t destination,
+		     uint32_t protocol_id,
+		     netbuf_t *buf);
 
 void network_free_frame(void *frame);
 
+/* Cache line size assumed when laying out per-CPU statistics */
+#define NETSTATS_LINE_SIZE 64
+
+/* The counters of one CPU, alone on their cache lines */
+typedef struct {
+    netstats_t stats;
+} __attribute__ ((aligned (NETSTATS_LINE_SIZE))) netstats_block_t;
+
+/* Statistics with a block of counters for each CPU, so that CPUs
+ * don't share a lock or a cache line when counting. The blocks are
+ * summed when the statistics are read. */
+typedef netstats_block_t netstats_percpu_t[CONFIG_MAX_CPUS];
+
+/* Names a counter for netstats_add() and netstats_max() */
+#define NETSTATS_FIELD(field) __builtin_offsetof(netstats_t, field)
+
+int network_get_stats(int kind, int n, netstats_t *stats);
+void network_print_stats(void);
+void netstats_add(netstats_block_t *stats, uint32_t field, uint32_t value);
+void netstats_max(netstats_block_t *stats, uint32_t field, uint32_t value);
+
 /* Return values of the network frame layer functions. */
 #define NET_OK 0
 #define NET_ERROR -1
@@ -64,6 +93,10 @@ void network_free_frame(void *frame);
 #define NETWORK_LOOPBACK_ADDRESS  0x00000000
 #define NETWORK_MAX_MTU 4096
 
+/* Size of the frame layer header, the headroom network_send_buf()
+   needs in front of the payload. */
+#define NETWORK_HEADER_SIZE 12
+
 #endif /* NET_NETWORK_H */
 
 
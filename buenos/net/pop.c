@@ -40,41 +40,140 @@
 #include "net/protocols.h"
 #include "kernel/config.h"
 #include "kernel/semaphore.h"
-#include "vm/pagepool.h"
 #include "kernel/panic.h"
 #include "kernel/assert.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleepq.h"
 #include "kernel/thread.h"
 #include "lib/libc.h"
-#include "drivers/metadev.h"
 #include "kernel/interrupt.h"
+#include "drivers/metadev.h"
+#include "drivers/yams.h"
 
 /* socket data from socket.c */
 extern socket_descriptor_t open_sockets[CONFIG_MAX_OPEN_SOCKETS];
 extern semaphore_t *open_sockets_sem;
+extern spinlock_t open_sockets_slock;
+
+/* States of a reassembly slot */
+#define POP_REASM_FREE 0 /* unused */
+#define POP_REASM_BUSY 1 /* collecting fragments */
+#define POP_REASM_DONE 2 /* complete, owned by the socket it was queued to */
+
+/* A fragmented datagram being reassembled. The fragments are kept in
+ * their frames and copied to the receiver's buffer only once, by
+ * socket_recvmsgs().
+ */
+typedef struct {
+    int state;
+    /* the datagram is identified by these */
+    network_address_t from;
+    uint16_t sport;
+    uint16_t dport;
+    uint16_t id;
+    int nfrags;
+    /* bitmap of the fragments in frames */
+    uint32_t received;
+    /* length of the datagram so far */
+    uint32_t length;
+    /* arrival time of the first fragment, in milliseconds */
+    uint32_t timestamp;
+    void *frames[POP_MAX_FRAGMENTS];
+} pop_reasm_t;
 
-/* input queue to hold incoming packets and a semaphore to synch access */
-static pop_queue_t pop_queue[CONFIG_POP_QUEUE_SIZE];
-static semaphore_t *pop_queue_sem;
+static pop_reasm_t pop_reasm[CONFIG_POP_REASM_SLOTS];
 
-/* Buffer to hold packets that are being sent to the network (+ semaphore) */
-static void *pop_send_buffer;
-static semaphore_t *pop_send_buffer_sem;
+/* protects pop_reasm and pop_next_id */
+static spinlock_t pop_reasm_slock;
 
-/* The thread ID of the service thread */
-static TID_t pop_service_thread_id;
+/* id of the next fragmented datagram sent */
+static uint16_t pop_next_id;
 
-/* Semaphore used to signal the service thread when there are new
- * packets in the queue 
+/* statistics of POP, see netstats.h */
+netstats_percpu_t pop_stats;
+
+
+
+/** Build the POP header of a packet in front of its payload and send
+ * the packet. The frame buffer is consumed.
+ *
+ * @param s      The socket to be used
+ * @param addr   The address of the recipient
+ * @param dport  The destination port on the recipient host
+ * @param frame  The payload of the packet, with POP_HEADROOM headroom
+ * @param id     The datagram number, if fragmented
+ * @param frag   Index of the fragment in the datagram
+ * @param nfrags Number of fragments in the datagram, 1 if unfragmented
+ * @param offset Offset of the payload in the datagram
+ *
+ * @return The payload size sent, or negative on error
  */
-static semaphore_t *pop_service_thread_sem;
+static int pop_send(sock_t s,
+		    network_address_t addr,
+		    uint16_t dport,
+		    netbuf_t *frame,
+		    uint16_t id,
+		    int frag,
+		    int nfrags,
+		    uint32_t offset)
+{
+    uint16_t sport;
+    pop_header_t *hdr;
+    int size;
 
+    semaphore_P(open_sockets_sem);
 
+    /* Check that it is a POP socket and the port is not 0, which is
+     * a special port and not used for communication.
+     */
+    if (open_sockets[s].protocol != PROTOCOL_POP || dport == 0) {
+	semaphore_V(open_sockets_sem);
+	netbuf_free(frame);
+	return -1;
+    }
+    sport = open_sockets[s].port;
+
+    semaphore_V(open_sockets_sem);
 
+    /* Limit the size to the MTU */
+    size = MIN((uint32_t)frame->length,
+	       network_get_mtu(NETWORK_BROADCAST_ADDRESS) -
+	       sizeof(pop_header_t));
+    frame->length = size;
 
-/** Send a POP packet to the network. The packet is sent to the given
- * address and port, using socket s. The data is read from buf, no
- * more than size bytes are sent (but no more bytes than fit in one
- * packet are sent either, so return value may be less than size).
+    /* construct the header in front of the payload */
+    hdr = (pop_header_t *)netbuf_push(frame, sizeof(pop_header_t));
+    hdr->source_port = sport;
+    hdr->dest_port = dport;
+    hdr->size = size;
+    hdr->id = id;
+    hdr->frag = frag;
+    hdr->nfrags = nfrags;
+    hdr->offset = offset;
+
+    /* Send the packet through ALL network interfaces */
+    if (network_send_buf(NETWORK_BROADCAST_ADDRESS, /* source: don't care */
+			 addr,                      /* destination */
+			 PROTOCOL_POP,
+			 frame) != NET_OK) {
+	netstats_add(pop_stats, NETSTATS_FIELD(send_errors), 1);
+	return -1;
+    }
+
+    netstats_add(pop_stats, NETSTATS_FIELD(frames_out), 1);
+    netstats_add(pop_stats, NETSTATS_FIELD(bytes_out), size);
+    return size;
+}
+
+
+
+/** Send a POP datagram to the network. The datagram is sent to the
+ * given address and port, using socket s. The data is read from buf,
+ * no more than size bytes are sent (but no more than
+ * CONFIG_POP_MAX_DATAGRAM bytes either, so return value may be less
+ * than size). A datagram that does not fit in one packet is sent as
+ * fragments, which the receiver reassembles. The data is copied once,
+ * into the frames that go to the network.
  *
  * @param s     The socket to be used
  * @param addr  The address of the recipient
@@ -90,72 +189,82 @@ int socket_sendto(sock_t s,
 		  void *buf,
 		  int size)
 {
-    uint16_t sport;
-    pop_header_t *hdr;
-    int r;
-
-    /* check sanity */
-    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
-
-    /* 0 is a special port and not used for communication */
-    if (dport == 0)
-	return -1;
+    interrupt_status_t intr_status;
+    netbuf_t frame;
+    uint16_t id;
+    int mss, nfrags, frag, offset, n;
 
     /* parameter sanity... */
+    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
     KERNEL_ASSERT(size >= 1 && buf != NULL);
 
-    /* Limit the size to the MTU or page size */
-    size = MIN(MIN((uint32_t)size, 
-		   network_get_mtu(NETWORK_BROADCAST_ADDRESS) -
-		   sizeof(pop_header_t)),
-	       PAGE_SIZE - sizeof(pop_header_t));
+    /* payload that fits in one packet */
+    mss = MIN(network_get_mtu(NETWORK_BROADCAST_ADDRESS) -
+	      sizeof(pop_header_t), PAGE_SIZE - POP_HEADROOM);
+
+    size = MIN(size, CONFIG_POP_MAX_DATAGRAM);
+    size = MIN(size, mss * POP_MAX_FRAGMENTS);
+    nfrags = (size + mss - 1) / mss;
+
+    id = 0;
+    if (nfrags > 1) {
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&pop_reasm_slock);
+	id = pop_next_id++;
+	spinlock_release(&pop_reasm_slock);
+	_interrupt_set_state(intr_status);
+    }
 
-    semaphore_P(open_sockets_sem);
+    for (frag = 0, offset = 0; frag < nfrags; frag++, offset += n) {
+	if (netbuf_alloc(&frame, POP_HEADROOM) != 0)
+	    return -1;
 
-    /* Check that it is a POP socket */
-    if (open_sockets[s].protocol != PROTOCOL_POP) {
-	semaphore_V(open_sockets_sem);
-	return -1;
+	n = MIN(size - offset, mss);
+	memcopy(n, netbuf_put(&frame, n), (uint8_t *)buf + offset);
+
+	if (pop_send(s, addr, dport, &frame, id, frag, nfrags, offset) != n)
+	    return -1;
     }
-    sport = open_sockets[s].port;
 
-    semaphore_V(open_sockets_sem);
+    return size;
+}
 
-    semaphore_P(pop_send_buffer_sem);
 
-    /* construct the header at the beginning of the send buffer */
-    hdr = (pop_header_t *)pop_send_buffer;
-    hdr->source_port = sport;
-    hdr->dest_port = dport;
-    hdr->size = size;
 
-    /* Copy the payload to its place in the send buffer */
-    memcopy(size,
-	    (void*)((uint32_t)pop_send_buffer + sizeof(pop_header_t)),
-	    buf);
+/** Send a POP packet whose payload has been built in a frame buffer.
+ * The buffer must have been allocated with POP_HEADROOM bytes of
+ * headroom; the POP and frame headers are written there and the page
+ * goes to the network without being copied. The buffer is consumed
+ * whether or not the send succeeds. A payload larger than one packet
+ * is truncated.
+ *
+ * @param s     The socket to be used
+ * @param addr  The address of the recipient
+ * @param dport The destination port on the recipient host
+ * @param frame The payload of the packet
+ *
+ * @return The number of bytes actually sent, or negative on error
+ */
+int socket_sendto_buf(sock_t s,
+		      network_address_t addr,
+		      uint16_t dport,
+		      netbuf_t *frame)
+{
+    /* check sanity */
+    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
+    KERNEL_ASSERT(frame->length >= 1 &&
+		  netbuf_headroom(frame) == POP_HEADROOM);
 
-    /* Send the packet through ALL network interfaces */
-    r = network_send(NETWORK_BROADCAST_ADDRESS, /* source: don't care */
-		     addr,                      /* destination */
-		     PROTOCOL_POP,
-		     size + sizeof(pop_header_t),
-		     (void *)pop_send_buffer);
-
-    /* Return value to error if send failed */
-    if (r != NET_OK)
-	size = -1;
-
-    semaphore_V(pop_send_buffer_sem);
-    
-    return size;
+    return pop_send(s, addr, dport, frame, 0, 0, 1, 0);
 }
 
 
 
-/** Receive a POP packet from the network. Waits for a packet whose
- * destination is the given socket and copies the packet payload to
+/** Receive a POP datagram from the network. Waits for a datagram
+ * whose destination is the given socket and copies its payload to
  * the given buffer. The sender's address and port are placed in add
- * and sport.
+ * and sport. Datagrams that arrived before the call are received in
+ * order of arrival (of their last fragment).
  *
  * @param s         Use this socket
  * @param addr      Place the sender's address here
@@ -173,64 +282,131 @@ int socket_recvfrom(sock_t s,
 		    int buflength,
 		    int *length)
 {
+    socket_msg_t msg;
 
     /* check parameter sanity */
-    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
-    
     KERNEL_ASSERT(buflength >= 1 && buf != NULL && addr != NULL && 
 		  sport != NULL && length != NULL);
 
-    semaphore_P(open_sockets_sem);
+    msg.buf = buf;
+    msg.buflength = buflength;
 
-    /* either no POP socket or another recvfrom already in progress
-     * (no queueing implemented)
-     */
-    if (open_sockets[s].protocol != PROTOCOL_POP ||
-	open_sockets[s].rbuf != NULL) {
-	semaphore_V(open_sockets_sem);
+    if (socket_recvmsgs(s, &msg, 1, 0) != 1)
 	return -1;
-    }
 
-    /* place the return value variables into the socket structure */
-    open_sockets[s].rbuf = buf;
-    open_sockets[s].bufsize = buflength;
-    open_sockets[s].sender = addr;
-    open_sockets[s].copied = length;
-    open_sockets[s].sport = sport;
+    *addr = msg.addr;
+    *sport = msg.sport;
+    *length = msg.length;
 
-    /* release the semaphore */
-    semaphore_V(open_sockets_sem);
+    return msg.length;
+}
+
+
+
+/** Receive several POP datagrams from the network in one call. Takes
+ * up to count datagrams queued on the given socket, in order of
+ * arrival, and copies them to the buffers of msgs. If no datagram is
+ * queued, waits for one unless SOCKET_NONBLOCK is given. Any number
+ * of threads may receive from the same socket at once; each datagram
+ * goes to exactly one of them.
+ *
+ * @param s     Use this socket
+ * @param msgs  Buffers for the packets, see socket_msg_t
+ * @param count Number of entries in msgs
+ * @param flags SOCKET_NONBLOCK or 0
+ *
+ * @return The number of packets received (0 only with
+ * SOCKET_NONBLOCK), or negative on error
+ */
+int socket_recvmsgs(sock_t s, socket_msg_t *msgs, int count, int flags)
+{
+    interrupt_status_t intr_status;
+    socket_descriptor_t *sock;
+    socket_rx_entry_t taken[CONFIG_POP_SOCKET_QUEUE_SIZE];
+    pop_reasm_t *r;
+    pop_header_t *hdr;
+    uint32_t len;
+    int i, j, n;
+
+    /* check parameter sanity */
+    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
+    KERNEL_ASSERT(count >= 1 && msgs != NULL);
 
-    /* Note: no one can foul up the FIFO in
-     * open_sockets[s].receive_complete between these two semaphore
-     * operations since there can be only one active recvfrom at a
-     * time 
+    sock = &open_sockets[s];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&sock->slock);
+
+    /* wait until there is a packet in the ring, or the socket is
+     * closed under us
      */
+    while (sock->protocol == PROTOCOL_POP && sock->rx_count == 0 &&
+	   !(flags & SOCKET_NONBLOCK)) {
+	sleepq_add(&sock->rx);
+	spinlock_release(&sock->slock);
+	thread_switch();
+	spinlock_acquire(&sock->slock);
+    }
 
-    /* Wake up service thread so that we can get packets which have
-       already received before the call to this function. */
-    semaphore_V(pop_service_thread_sem);
+    if (sock->protocol != PROTOCOL_POP) {
+	spinlock_release(&sock->slock);
+	_interrupt_set_state(intr_status);
+	return -1;
+    }
 
-    /* and wait until the packet has arrived and been copied to our buffer */
-    semaphore_P(open_sockets[s].receive_complete);
-    
-    return *length;
-}
+    /* take the whole batch at once, copying is done unlocked */
+    n = MIN(count, sock->rx_count);
+    for (i = 0; i < n; i++) {
+	taken[i] = sock->rx[sock->rx_head];
+	sock->rx_head = (sock->rx_head + 1) % CONFIG_POP_SOCKET_QUEUE_SIZE;
+    }
+    sock->rx_count -= n;
+
+    spinlock_release(&sock->slock);
+    _interrupt_set_state(intr_status);
+
+    /* copy the payloads and set the return value variables */
+    for (i = 0; i < n; i++) {
+	KERNEL_ASSERT(msgs[i].buflength >= 1 && msgs[i].buf != NULL);
+
+	if (taken[i].frame != NULL) {
+	    hdr = (pop_header_t *)taken[i].frame;
+	    msgs[i].length = MIN(hdr->size, (uint32_t)msgs[i].buflength);
+	    memcopy(msgs[i].length, msgs[i].buf,
+		    (void*)((uint32_t)hdr + sizeof(pop_header_t)));
+	} else {
+	    /* a reassembled datagram, copy each fragment in place */
+	    r = &pop_reasm[taken[i].reasm];
+	    KERNEL_ASSERT(r->state == POP_REASM_DONE);
+
+	    for (j = 0; j < r->nfrags; j++) {
+		hdr = (pop_header_t *)r->frames[j];
+		if (hdr->offset >= (uint32_t)msgs[i].buflength)
+		    continue;
+		len = MIN(hdr->size, msgs[i].buflength - hdr->offset);
+		memcopy(len, (uint8_t *)msgs[i].buf + hdr->offset,
+			(void*)((uint32_t)hdr + sizeof(pop_header_t)));
+	    }
+	    msgs[i].length = MIN(r->length, (uint32_t)msgs[i].buflength);
+	    hdr = (pop_header_t *)r->frames[0];
+	}
 
+	msgs[i].addr = taken[i].from;
+	msgs[i].sport = hdr->source_port;
 
+	pop_discard(&taken[i]);
+    }
 
-/* forward for pop_init */
-static void pop_service_thread(uint32_t dummy);
+    return n;
+}
 
 
-/** Initialize the POP protocol. Allocate the send buffer, create the
- * semaphores, zero the POP queue entries and start the service
- * thread.
+
+/** Initialize the POP protocol.
  */
 void pop_init()
 {
     static int init_done = 0;
-    uint32_t addr;
     int i;
 
     /* do not execute more than once */
@@ -240,51 +416,223 @@ void pop_init()
     /* Check that the compiler has made correct size structures
      * (ie. that __attribute__((packed)) works)
      */
-    KERNEL_ASSERT(sizeof(pop_header_t) == 8);
+    KERNEL_ASSERT(sizeof(pop_header_t) == 16);
+
+    spinlock_reset(&pop_reasm_slock);
+    for (i = 0; i < CONFIG_POP_REASM_SLOTS; i++)
+	pop_reasm[i].state = POP_REASM_FREE;
+    pop_next_id = 0;
+}
+
+
+/** Free a datagram taken from (or never put into) the receive ring of
+ * a socket, with all its frames.
+ *
+ * @param entry The ring entry of the datagram
+ */
+void pop_discard(socket_rx_entry_t *entry)
+{
+    interrupt_status_t intr_status;
+    pop_reasm_t *r;
+    int i;
+
+    if (entry->frame != NULL) {
+	network_free_frame(entry->frame);
+	return;
+    }
+
+    /* the slot is ours until it is marked free */
+    r = &pop_reasm[entry->reasm];
+    for (i = 0; i < r->nfrags; i++)
+	network_free_frame(r->frames[i]);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pop_reasm_slock);
+    r->state = POP_REASM_FREE;
+    spinlock_release(&pop_reasm_slock);
+    _interrupt_set_state(intr_status);
+}
+
+
+/** Append a datagram to the receive ring of the socket bound to the
+ * given port and wake up one receiver.
+ *
+ * @param entry The datagram, see socket_rx_entry_t
+ * @param dport The destination port of the datagram
+ *
+ * @return 1 if the datagram was queued, 0 if nobody listens at the
+ * port or the ring of the socket is full
+ */
+static int pop_deliver(socket_rx_entry_t *entry, uint16_t dport)
+{
+    interrupt_status_t intr_status;
+    socket_descriptor_t *sock;
+    sock_t s;
+    int tail, count = 0, accepted = 0, listener = 0;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&open_sockets_slock);
+
+    s = socket_find(dport);
+
+    if (s >= 0 && open_sockets[s].protocol == PROTOCOL_POP) {
+	sock = &open_sockets[s];
+	listener = 1;
+
+	spinlock_acquire(&sock->slock);
+	if (sock->rx_count < sock->rx_limit) {
+	    tail = (sock->rx_head + sock->rx_count)
+		% CONFIG_POP_SOCKET_QUEUE_SIZE;
+	    sock->rx[tail] = *entry;
+	    count = ++sock->rx_count;
+	    accepted = 1;
+
+	    /* one datagram is enough for one receiver */
+	    sleepq_wake(&sock->rx);
+	    poll_notify(&sock->pollq);
+	}
+	spinlock_release(&sock->slock);
+    }
+
+    spinlock_release(&open_sockets_slock);
+    _interrupt_set_state(intr_status);
+
+    if (accepted)
+	netstats_max(pop_stats, NETSTATS_FIELD(queue_max), count);
+    else if (listener)
+	netstats_add(pop_stats, NETSTATS_FIELD(drop_queue_full), 1);
+    else
+	netstats_add(pop_stats, NETSTATS_FIELD(drop_no_listener), 1);
+
+    return accepted;
+}
+
+
+/** Add a fragment to the datagram it belongs to, starting the
+ * reassembly of a new datagram if needed, and deliver the datagram
+ * when all its fragments are in. A datagram that has been missing
+ * fragments for CONFIG_POP_REASM_TIMEOUT milliseconds is dropped when
+ * its slot is needed for another datagram.
+ *
+ * @param fromaddr Sender address of the fragment
+ * @param frame    The fragment, POP header first
+ *
+ * @return 1 if the fragment was accepted, 0 if not (malformed,
+ * duplicate or no free reassembly slot)
+ */
+static int pop_reassemble(network_address_t fromaddr, void *frame)
+{
+    interrupt_status_t intr_status;
+    pop_header_t *hdr = (pop_header_t *)frame;
+    socket_rx_entry_t entry;
+    pop_reasm_t *r = NULL, *victim = NULL;
+    void *expired[POP_MAX_FRAGMENTS];
+    uint32_t now, all, bit;
+    int i, nexpired = 0, complete = 0, accepted = 0;
+
+    /* written so that offset + size can't wrap */
+    if (hdr->nfrags > POP_MAX_FRAGMENTS || hdr->frag >= hdr->nfrags ||
+	hdr->size > CONFIG_POP_MAX_DATAGRAM ||
+	hdr->offset > CONFIG_POP_MAX_DATAGRAM - hdr->size) {
+	netstats_add(pop_stats, NETSTATS_FIELD(drop_invalid), 1);
+	return 0;
+    }
 
-    /* Allocate a page for the send buffer */
-    addr = pagepool_get_phys_page();
+    now = rtc_get_msec();
+    bit = (uint32_t)1 << hdr->frag;
+    all = (hdr->nfrags == POP_MAX_FRAGMENTS) ? 0xffffffff
+	: (((uint32_t)1 << hdr->nfrags) - 1);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pop_reasm_slock);
+
+    for (i = 0; i < CONFIG_POP_REASM_SLOTS; i++) {
+	if (pop_reasm[i].state == POP_REASM_BUSY &&
+	    pop_reasm[i].from == fromaddr &&
+	    pop_reasm[i].sport == hdr->source_port &&
+	    pop_reasm[i].dport == hdr->dest_port &&
+	    pop_reasm[i].id == hdr->id) {
+	    r = &pop_reasm[i];
+	    break;
+	}
 
-    if (addr == 0) {
-	KERNEL_PANIC("pop_init: page allocation failed\n");
+	/* prefer a free slot to an expired one */
+	if (pop_reasm[i].state == POP_REASM_FREE)
+	    victim = &pop_reasm[i];
+	else if (victim == NULL && pop_reasm[i].state == POP_REASM_BUSY &&
+		 now - pop_reasm[i].timestamp >= CONFIG_POP_REASM_TIMEOUT)
+	    victim = &pop_reasm[i];
     }
 
-    pop_send_buffer = (void*)ADDR_PHYS_TO_KERNEL(addr);
+    if (r == NULL && victim != NULL) {
+	r = victim;
 
-    /* semaphores: */
-    pop_send_buffer_sem = semaphore_create(1);    /* this is a lock */
-    pop_queue_sem = semaphore_create(1);          /* this too */
-    pop_service_thread_sem = semaphore_create(0); /* this is a signaler */
+	/* drop what was collected of an expired datagram */
+	if (r->state == POP_REASM_BUSY) {
+	    for (i = 0; i < r->nfrags; i++)
+		if (r->received & ((uint32_t)1 << i))
+		    expired[nexpired++] = r->frames[i];
+	}
 
-    if ((pop_send_buffer_sem == NULL) || (pop_queue_sem == NULL) ||
-	(pop_service_thread_sem == NULL)) {
-	KERNEL_PANIC("pop_init: semaphore allocation failed\n");
+	r->state = POP_REASM_BUSY;
+	r->from = fromaddr;
+	r->sport = hdr->source_port;
+	r->dport = hdr->dest_port;
+	r->id = hdr->id;
+	r->nfrags = hdr->nfrags;
+	r->received = 0;
+	r->length = 0;
+	r->timestamp = now;
     }
 
+    if (r != NULL && r->nfrags == hdr->nfrags && !(r->received & bit)) {
+	r->frames[hdr->frag] = frame;
+	r->received |= bit;
+	r->length = MAX(r->length, hdr->offset + hdr->size);
+	accepted = 1;
 
-    /* zero the POP queue entries */
-    for (i=0; i<CONFIG_POP_QUEUE_SIZE; i++) {
-	pop_queue[i].frame = NULL;
-	pop_queue[i].socket = -1;
-	pop_queue[i].timestamp = 0;
-	pop_queue[i].from = 0;
-	pop_queue[i].busy = 0;
+	if (r->received == all) {
+	    r->state = POP_REASM_DONE;
+	    complete = 1;
+	}
     }
 
-    /* start the service thread (the argument is a dummy) */
-    pop_service_thread_id = thread_create(&pop_service_thread, 0);
-    thread_run(pop_service_thread_id);
+    spinlock_release(&pop_reasm_slock);
+    _interrupt_set_state(intr_status);
+
+    for (i = 0; i < nexpired; i++)
+	network_free_frame(expired[i]);
+    netstats_add(pop_stats, NETSTATS_FIELD(drop_invalid), nexpired);
+
+    if (!accepted) {
+	if (r == NULL)
+	    netstats_add(pop_stats, NETSTATS_FIELD(drop_queue_full), 1);
+	else
+	    netstats_add(pop_stats, NETSTATS_FIELD(drop_invalid), 1);
+    }
+
+    if (complete) {
+	entry.frame = NULL;
+	entry.reasm = r - pop_reasm;
+	entry.from = fromaddr;
+	if (!pop_deliver(&entry, hdr->dest_port))
+	    pop_discard(&entry);
+    }
+
+    return accepted;
 }
 
 
-/** Push a frame to the POP queue. This will place the given frame
- * (packet) into the POP queue. The frame's sender and recipient
- * addresses are supplied as parameters. If this function returns 0,
- * nothing is done for the frame and it can be freed/reused
- * immediately. If the return value is 1, the frame will be freed
- * later by the service thread by calling
- * network_free_frame(frame). NOTE: This function may block, since it
- * uses semaphores.
+/** Push a frame to its destination socket. The socket is looked up
+ * by the destination port of the frame and the frame is appended to
+ * the receive ring of the socket, waking up one receiver. Fragments
+ * are held for reassembly instead and their datagram is appended when
+ * complete. If this function returns 0, nothing is done for the frame
+ * and it can be freed/reused immediately: nobody listens at the port,
+ * the ring of the socket is full or the fragment could not be kept.
+ * If the return value is 1, the frame will be freed later by the
+ * receiver (or socket_close()) by calling network_free_frame(frame).
+ * This function does not block.
  *
  * @param fromaddr    Sender address of the frame
  * @param toaddr      Recipient address of the frame
@@ -298,7 +646,8 @@ int pop_push_frame(network_address_t fromaddr,
 		   uint32_t protocol_id,
 		   void *frame)
 {
-    int i, free = -1, oldest = -1;
+    pop_header_t *hdr = (pop_header_t *)frame;
+    socket_rx_entry_t entry;
 
     /* unused variables will cause a warning: (since all sockets
      * bound, we don't need toaddr anywhere)
@@ -308,181 +657,22 @@ int pop_push_frame(network_address_t fromaddr,
     /* Wrong protocol */
     KERNEL_ASSERT(protocol_id == PROTOCOL_POP);
 
-    semaphore_P(pop_queue_sem);
-
-    /* find a free slot or the oldest slot */
-    for (i=0; i<CONFIG_POP_QUEUE_SIZE; i++) {
-	/* free slot: */
-	if (free == -1 && pop_queue[i].frame == NULL)
-	    free = i;
-	
-	/* oldest nonbusy slot: */
-	if (!pop_queue[i].busy &&
-	    (oldest == -1 || 
-	     pop_queue[i].timestamp < pop_queue[oldest].timestamp))
-	    oldest = i;
-    }
+    netstats_add(pop_stats, NETSTATS_FIELD(frames_in), 1);
+    netstats_add(pop_stats, NETSTATS_FIELD(bytes_in), hdr->size);
 
-    /* no free slot or the oldest slot is not old enough
-     * => the packet is dropped
-     */
-    if (free == -1 && (oldest == -1 || 
-		       rtc_get_msec() - pop_queue[oldest].timestamp 
-		       < CONFIG_POP_QUEUE_MIN_AGE)) { /* queue full */
-	semaphore_V(pop_queue_sem);
+    /* the payload of every packet, fragment or not, must be within
+       the one page frame */
+    if (hdr->size > PAGE_SIZE - POP_HEADROOM) {
+	netstats_add(pop_stats, NETSTATS_FIELD(drop_invalid), 1);
 	return 0;
     }
 
-    /* use the oldest slot if no free slot was found (this is btw the
-     * only way that the packets in the queue will age)
-     */
-    if (free == -1)
-	free = oldest;
-
-    /* set the entry values for the given frame */
-    if( pop_queue[free].frame) 
-        network_free_frame(pop_queue[free].frame);
-    pop_queue[free].frame = frame;
-    pop_queue[free].socket = -1;
-    pop_queue[free].timestamp = rtc_get_msec();
-    pop_queue[free].from = fromaddr;
-    pop_queue[free].busy = 0;
-
-    semaphore_V(pop_queue_sem);
-
-    /* signal the service thread that a frame has arrived */
-    semaphore_V(pop_service_thread_sem);
-
-    return 1; /* accepted */
-}
-
+    if (hdr->nfrags > 1)
+	return pop_reassemble(fromaddr, frame);
 
-/* action for the service thread */
-#define POP_ACTION_NONE 0
-#define POP_ACTION_DISCARD 1
-#define POP_ACTION_TRANSFER 2
-
-
-/** The service thread for incoming packets. This thread loops through
- * the POP queue looking for packets to deliver (if recvfrom has been
- * called) or discard (no one listening at the given port). When there
- * is nothing to do, it will wait on the service thread semaphore.
- *
- * @param dummy Dummy parameter, required for threads
- */
-static void pop_service_thread(uint32_t dummy)
-{
-    int action, i, j, slot = 0;
-    pop_header_t *f = NULL;
-    void *wake;
-
-    dummy = 0; /* prevent warning */
-
-    /* loop the POP queue */
-    while(1) {
-	/* lock the queue and the socket table */
-	semaphore_P(open_sockets_sem);
-	semaphore_P(pop_queue_sem);
-	
-	action = POP_ACTION_NONE;
-
-	/* find a nonempty slot in the queue */
-	for (i=0; i<CONFIG_POP_QUEUE_SIZE; i++) {
-	    if (pop_queue[i].frame == NULL) continue; /* skip empty slots */
-
-	    f = (pop_header_t*)pop_queue[i].frame;
-
-	    /* find the recipient socket, if necessary */
-	    if (pop_queue[i].socket == -1) {
-		for (j=0; j<CONFIG_MAX_OPEN_SOCKETS; j++) {
-		    if (open_sockets[j].protocol == PROTOCOL_POP &&
-			open_sockets[j].port == f->dest_port) {
-			pop_queue[i].socket = j;
-			break;
-		    }
-		}
-	    }
-  	    
-            slot = i;
-
-	    /* dest port not listened */
-	    if (pop_queue[i].socket == -1) {
-		action = POP_ACTION_DISCARD;
-		break;
-	    }
-
-	    /* frame has recipient socket, but it has been closed */
-	    if (pop_queue[i].socket >= 0 && 
-		open_sockets[pop_queue[i].socket].protocol != PROTOCOL_POP) {
-		action = POP_ACTION_DISCARD;
-		break;
-	    }
-	    
-	    /* someone has called recvfrom for the destination socket */
-	    if (open_sockets[pop_queue[i].socket].rbuf != NULL) {
-		pop_queue[i].busy = 1; /* mark busy so it won't be touched */
-		action = POP_ACTION_TRANSFER;
-		break;
-	    }
-
-	}
-
-	/* unlock the queue and the socket table */
-	semaphore_V(pop_queue_sem);
-	semaphore_V(open_sockets_sem);
-
-
-	/* the actions themselves are done here, where no locks are held */
-
-	/* discard the frame */
-	if (action == POP_ACTION_DISCARD) {
-	    network_free_frame(f);
-            pop_queue[slot].frame = NULL;
-	}
-
-	/* transfer frame payload to the buffer specified by the
-	 * caller of recvfrom
-	 */
-	if (action == POP_ACTION_TRANSFER) {
-	    int bytes;
-
-	    /* copy the payload */
-	    bytes = MIN(f->size, open_sockets[pop_queue[slot].socket].bufsize);
-	    memcopy(bytes,
-		    open_sockets[pop_queue[slot].socket].rbuf,
-		    (void*)((uint32_t)f + sizeof(pop_header_t)));
-
-	    /* set return value variables */
-	    *(open_sockets[pop_queue[slot].socket].sender) = pop_queue[slot].from;
-	    *(open_sockets[pop_queue[slot].socket].copied) = bytes;
-	    *(open_sockets[pop_queue[slot].socket].sport) = f->source_port;
-	    
-	    /* save the receive buffer address */
-	    wake = open_sockets[pop_queue[slot].socket].rbuf;
-
-	    /* zero the return value variables from the socket */
-	    open_sockets[pop_queue[slot].socket].rbuf = NULL;
-	    open_sockets[pop_queue[slot].socket].bufsize = 0;
-	    open_sockets[pop_queue[slot].socket].sender = NULL;
-	    open_sockets[pop_queue[slot].socket].copied = NULL;
-	    open_sockets[pop_queue[slot].socket].sport = NULL;
-
-	    /* discard the frame */
-	    network_free_frame(f);
-
-	    /* wake the caller of recvfrom */
-	    semaphore_V(open_sockets[pop_queue[slot].socket].receive_complete);
-
-	    /* This will mark the queue slot as free. No synch needed,
-	     * since this is only one write operation. 
-	     */
-	    pop_queue[slot].frame = NULL;
-	}
+    entry.frame = frame;
+    entry.reasm = -1;
+    entry.from = fromaddr;
 
-	/* only sleep if nothing was done, otherwise there may be more
-	 * frames ready to be handled.
-	 */
-	if (action == POP_ACTION_NONE)
-	    semaphore_P(pop_service_thread_sem);
-    } /* while(1) */
+    return pop_deliver(&entry, hdr->dest_port);
 }
@@ -41,24 +41,26 @@
 #include "net/network.h"
 #include "net/socket.h"
 
-/* POP packet header, 8 bytes, immediately after the network frame
- * header (see network.c)
+/* POP packet header, 16 bytes, immediately after the network frame
+ * header (see network.c). A datagram larger than one packet is sent
+ * as nfrags fragments with the same id, each carrying the part of the
+ * datagram starting at offset.
  */
 typedef struct {
     uint16_t source_port __attribute__ ((packed));
     uint16_t dest_port   __attribute__ ((packed));
     uint32_t size        __attribute__ ((packed)); /* payload size */
+    uint16_t id          __attribute__ ((packed)); /* datagram number */
+    uint8_t frag;                                  /* fragment index */
+    uint8_t nfrags;                                /* 1 if unfragmented */
+    uint32_t offset      __attribute__ ((packed)); /* in the datagram */
 } pop_header_t;
 
+/* Maximum number of fragments of one datagram */
+#define POP_MAX_FRAGMENTS 32
 
-/* POP queue data type */
-typedef struct {
-    void *frame;            /* the incoming packet */
-    sock_t socket;          /* socket this frame belongs to */
-    uint32_t timestamp;     /* when this frame was put into the queue */
-    network_address_t from; /* address of the sender */
-    int busy;               /* is this queue entry in use? */
-} pop_queue_t;
+/* Headroom of the frame buffers given to socket_sendto_buf() */
+#define POP_HEADROOM (NETWORK_HEADER_SIZE + sizeof(pop_header_t))
 
 
 void pop_init();
@@ -66,6 +68,10 @@ int pop_push_frame(network_address_t fromaddr,
 		   network_address_t toaddr,
 		   uint32_t protocol_id,
 		   void *frame);
+void pop_discard(socket_rx_entry_t *entry);
+
+/* Statistics of POP */
+extern netstats_percpu_t pop_stats;
 
 
 #endif /* NET_POP_H */
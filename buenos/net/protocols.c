@@ -36,6 +36,7 @@
 
 #include "net/protocols.h"
 #include "net/pop.h"
+#include "net/sop.h"
 #include "lib/types.h"
 #include "lib/libc.h"
 
@@ -57,12 +58,16 @@ typedef struct {
 
     /* Initialization function for this protocol. */
     void (*init)(void);
+
+    /* Statistics of this protocol. */
+    netstats_block_t *stats;
 } network_protocols_t;
 
 /** List of available network protocols. */
 network_protocols_t network_protocols[] = {
-    {PROTOCOL_POP, &pop_push_frame, &pop_init},
-    {0, NULL, NULL}
+    {PROTOCOL_POP, &pop_push_frame, &pop_init, pop_stats},
+    {PROTOCOL_SOP, &sop_push_frame, &sop_init, sop_stats},
+    {0, NULL, NULL, NULL}
 };
 
 /** 
@@ -86,6 +91,25 @@ frame_handler_t protocols_get_frame_handler(uint32_t protocol_id)
     return NULL;
 }
 
+/**
+ * Gets the statistics of the given protocol.
+ *
+ * @param protocol_id The id of the protocol.
+ *
+ * @return The statistics, or NULL for unknown protocols.
+ */
+netstats_block_t *protocols_get_stats(uint32_t protocol_id)
+{
+    network_protocols_t *p;
+
+    for(p = network_protocols; p->frame_handler != NULL; p++) {
+	if(p->protocol_id == protocol_id)
+	    return p->stats;
+    }
+
+    return NULL;
+}
+
 /**
  * Initialize all network protocols.
  */
@@ -38,10 +38,10 @@
 #define NET_PROTOCOLS_H
 
 #include "drivers/gnd.h"
+#include "net/network.h"
 
 /* Protocol ids of implemented protocols. */
 #define PROTOCOL_POP 1
-/* SOP not implemented but defined to be 2 */
 #define PROTOCOL_SOP 2
 
 /* Type declaration for a function which is used by the network frame
@@ -52,6 +52,7 @@ typedef int (*frame_handler_t)(network_address_t source,
 			       void *payload);
 
 frame_handler_t protocols_get_frame_handler(uint32_t protocol_id);
+netstats_block_t *protocols_get_stats(uint32_t protocol_id);
 
 void protocols_init(void);
 
@@ -36,18 +36,37 @@
 
 #include "net/socket.h"
 #include "net/pop.h"
+#include "net/sop.h"
 #include "net/protocols.h"
+#include "net/network.h"
 #include "kernel/config.h"
 #include "kernel/semaphore.h"
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
+#include "kernel/sleepq.h"
 #include "kernel/panic.h"
 #include "kernel/assert.h"
 #include "vm/pagepool.h"
 #include "lib/types.h"
 
-/* open socket table and a semaphore to synch access to it */
+/* open socket table and a semaphore to synch access to it. The
+ * semaphore serializes socket_open() and socket_close(); the receive
+ * path only takes the spinlock below.
+ */
 socket_descriptor_t open_sockets[CONFIG_MAX_OPEN_SOCKETS];
 semaphore_t *open_sockets_sem;
 
+/* Number of chains in the port hash, a power of two */
+#define SOCKET_HASH_SIZE 64
+#define SOCKET_HASH(port) ((port) & (SOCKET_HASH_SIZE - 1))
+
+/* Open sockets hashed by port, chained through hash_next. Protected
+ * by open_sockets_slock, which is also held by frame handlers while
+ * they deliver to the socket they found.
+ */
+static sock_t socket_hash[SOCKET_HASH_SIZE];
+spinlock_t open_sockets_slock;
+
 
 /** Initializes the socket system. Creates the semaphore and sets
  *  the open socket table entries to null values.
@@ -68,21 +87,47 @@ void socket_init()
 	KERNEL_PANIC("socket_init: semaphore allocation failed\n");
     }
 
+    spinlock_reset(&open_sockets_slock);
+
+    for (i=0; i<SOCKET_HASH_SIZE; i++)
+	socket_hash[i] = -1;
+
     /* init socket table */
     for (i=0; i<CONFIG_MAX_OPEN_SOCKETS; i++) {
 	open_sockets[i].port = 0;
 	open_sockets[i].protocol = 0;
-	open_sockets[i].rbuf = NULL;
-	open_sockets[i].bufsize = 0;
-	open_sockets[i].sender = NULL;
-	open_sockets[i].copied = NULL;
-	open_sockets[i].sport = NULL;
-	open_sockets[i].receive_complete = NULL;
+	open_sockets[i].hash_next = -1;
+	spinlock_reset(&open_sockets[i].slock);
+	open_sockets[i].rx_head = 0;
+	open_sockets[i].rx_count = 0;
+	open_sockets[i].rx_limit = 0;
+	pollq_init(&open_sockets[i].pollq);
     }
 
 }
 
 
+/** Finds the open socket bound to the given port. The caller must
+ * hold open_sockets_slock (or open_sockets_sem, which excludes
+ * changes to the hash) while it uses the result.
+ *
+ * @param port The port to look for
+ *
+ * @return The socket bound to port, or negative if there is none.
+ */
+sock_t socket_find(uint16_t port)
+{
+    sock_t s;
+
+    for (s = socket_hash[SOCKET_HASH(port)]; s >= 0;
+	 s = open_sockets[s].hash_next) {
+	if (open_sockets[s].port == port)
+	    return s;
+    }
+
+    return -1;
+}
+
 
 /** Opens a socket to be used for subsequent network communication.
  * The socket is bound to the given port and will be of the given
@@ -97,6 +142,7 @@ void socket_init()
  */
 sock_t socket_open(uint8_t protocol, uint16_t port)
 {
+    interrupt_status_t intr_status;
     int i, s;
 
     /* protocol must be supported: */
@@ -118,49 +164,38 @@ sock_t socket_open(uint8_t protocol, uint16_t port)
     }
     s = i;
 
+    /* The hash only changes under open_sockets_sem, so it can be
+     * read here without the spinlock.
+     */
     if (port == 0) { /* find the first free port */
-	int notfree = 1;
-
-	while (notfree) {
+	do {
 	    port++;
-	    notfree = 0;
-	    
-	    for (i=0; i<CONFIG_MAX_OPEN_SOCKETS; i++) {
-		if (open_sockets[i].protocol != 0 &&
-		    open_sockets[i].port == port) {
-		    notfree = 1;
-		    break;
-		}
-	    }
-	    
-	}
+	} while (socket_find(port) >= 0);
 	
 	KERNEL_ASSERT(port != 0);
 
-    } else { /* check that the port is unused */
-	for (i=0; i<CONFIG_MAX_OPEN_SOCKETS; i++) {
-	    if (open_sockets[i].protocol != 0 &&
-		open_sockets[i].port == port) {
-		semaphore_V(open_sockets_sem);
-		return -1;
-	    }
-	}
-    }
-
-    /* allocate the signaling semaphore*/
-    open_sockets[s].receive_complete = semaphore_create(0);
-    if (open_sockets[s].receive_complete == NULL) {
+    } else if (socket_find(port) >= 0) { /* port already in use */
 	semaphore_V(open_sockets_sem);
 	return -1;
     }
 
-    /* init the entry */
+    /* init the entry and make it visible to the receive path */
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&open_sockets_slock);
+    spinlock_acquire(&open_sockets[s].slock);
+
     open_sockets[s].port = port;
     open_sockets[s].protocol = protocol;
-    open_sockets[s].rbuf = NULL;
-    open_sockets[s].bufsize = 0;
-    open_sockets[s].sender = NULL;
-    open_sockets[s].copied = NULL;
+    open_sockets[s].rx_head = 0;
+    open_sockets[s].rx_count = 0;
+    open_sockets[s].rx_limit = CONFIG_POP_SOCKET_BACKLOG;
+
+    open_sockets[s].hash_next = socket_hash[SOCKET_HASH(port)];
+    socket_hash[SOCKET_HASH(port)] = s;
+
+    spinlock_release(&open_sockets[s].slock);
+    spinlock_release(&open_sockets_slock);
+    _interrupt_set_state(intr_status);
 
     semaphore_V(open_sockets_sem);
 
@@ -169,29 +204,143 @@ sock_t socket_open(uint8_t protocol, uint16_t port)
 
 
 /** Close the given socket. The socket must not be used after this
- * operation.
+ * operation. Packets still queued on the socket are discarded and
+ * threads waiting in socket_recvmsgs() return with an error.
  *
  * @param socket The socket to be closed
  */
 void socket_close(sock_t socket)
 {
+    interrupt_status_t intr_status;
+    socket_descriptor_t *sock;
+    sock_t *link;
+
     /* check sanity */
     KERNEL_ASSERT(socket >= 0 && socket < CONFIG_MAX_OPEN_SOCKETS);
 
+    sock = &open_sockets[socket];
+
+    /* a stream is shut down first, which may take a while */
+    if (sock->protocol == PROTOCOL_SOP)
+	sop_close(socket);
+
     semaphore_P(open_sockets_sem);
 
     /* zero the entry if it is an open socket */
-    if (open_sockets[socket].receive_complete != NULL) {
-	open_sockets[socket].port = 0;
-	open_sockets[socket].protocol = 0;
-	open_sockets[socket].rbuf = NULL;
-	open_sockets[socket].bufsize = 0;
-	open_sockets[socket].sender = NULL;
-	open_sockets[socket].copied = NULL;
-	
-	semaphore_destroy(open_sockets[socket].receive_complete);
-	open_sockets[socket].receive_complete = NULL;
+    if (sock->protocol != 0) {
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&open_sockets_slock);
+	spinlock_acquire(&sock->slock);
+
+	/* unlink from the hash, after this no new frames arrive */
+	link = &socket_hash[SOCKET_HASH(sock->port)];
+	while (*link != socket)
+	    link = &open_sockets[*link].hash_next;
+	*link = sock->hash_next;
+	sock->hash_next = -1;
+
+	sock->port = 0;
+	sock->protocol = 0;
+	sock->rx_limit = 0;
+
+	sleepq_wake_all(&sock->rx);
+	poll_detach(&sock->pollq);
+
+	spinlock_release(&sock->slock);
+	spinlock_release(&open_sockets_slock);
+	_interrupt_set_state(intr_status);
+
+	/* discard the packets nobody received */
+	while (sock->rx_count > 0) {
+	    pop_discard(&sock->rx[sock->rx_head]);
+	    netstats_add(pop_stats, NETSTATS_FIELD(drop_closed), 1);
+	    sock->rx_head = (sock->rx_head + 1) % CONFIG_POP_SOCKET_QUEUE_SIZE;
+	    sock->rx_count--;
+	}
     }
 
     semaphore_V(open_sockets_sem);
 }
+
+
+/** Tells which events of the given socket are ready, for poll. A POP
+ * socket is readable when a datagram is queued and always writable;
+ * SOP sockets are handled by sop_poll(). A closed socket reports
+ * POLL_HUP.
+ *
+ * @param s     The socket
+ * @param pollq The pollq of the socket is stored here
+ *
+ * @return The POLL_* events that are ready, POLL_NVAL if s is not a
+ * socket.
+ */
+int socket_poll(sock_t s, pollq_t **pollq)
+{
+    interrupt_status_t intr_status;
+    socket_descriptor_t *sock;
+    int protocol, events = 0;
+
+    *pollq = NULL;
+    if (s < 0 || s >= CONFIG_MAX_OPEN_SOCKETS)
+	return POLL_NVAL;
+
+    sock = &open_sockets[s];
+    *pollq = &sock->pollq;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&sock->slock);
+
+    protocol = sock->protocol;
+    if (protocol == PROTOCOL_POP) {
+	events = POLL_OUT;
+	if (sock->rx_count > 0)
+	    events |= POLL_IN;
+    }
+
+    spinlock_release(&sock->slock);
+    _interrupt_set_state(intr_status);
+
+    if (protocol == PROTOCOL_SOP)
+	return sop_poll(s);
+    if (protocol == 0)
+	return POLL_HUP;
+
+    return events;
+}
+
+
+/** Sets the number of received packets that may be queued on the
+ * given POP socket. Packets arriving while the queue is full are
+ * dropped. Lowering the backlog below the number of packets already
+ * queued drops nothing, it only refuses new ones until the queue has
+ * drained.
+ *
+ * @param s       The socket
+ * @param backlog The new backlog, 1 to CONFIG_POP_SOCKET_QUEUE_SIZE
+ *
+ * @return 0 on success, negative if s is not a POP socket or the
+ * backlog is out of range.
+ */
+int socket_set_backlog(sock_t s, int backlog)
+{
+    interrupt_status_t intr_status;
+    int ret = -1;
+
+    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
+
+    if (backlog < 1 || backlog > CONFIG_POP_SOCKET_QUEUE_SIZE)
+	return -1;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&open_sockets[s].slock);
+
+    if (open_sockets[s].protocol == PROTOCOL_POP) {
+	open_sockets[s].rx_limit = backlog;
+	ret = 0;
+    }
+
+    spinlock_release(&open_sockets[s].slock);
+    _interrupt_set_state(intr_status);
+
+    return ret;
+}
@@ -41,6 +41,9 @@
 #include "net/network.h"
 #include "net/protocols.h"
 #include "kernel/semaphore.h"
+#include "kernel/spinlock.h"
+#include "kernel/config.h"
+#include "proc/poll.h"
 
 /* sock_t is an index to the open socket table 
  * valid values 0..CONFIG_MAX_OPEN_SOCKETS-1
@@ -48,36 +51,73 @@
 typedef int sock_t; 
 
 
+/* A received POP datagram waiting in the receive ring of a socket */
+typedef struct {
+    void *frame;                   /* the packet, POP header first */
+    int reasm;                     /* reassembly slot if frame is NULL */
+    network_address_t from;        /* address of the sender */
+} socket_rx_entry_t;
+
 /* Open socket structure */
 typedef struct {
     uint16_t port;             /* port this socket is bound to */
     uint8_t protocol;          /* protocol of this socket */
 
-    /* These are used when waiting for a packet on this socket */
-    semaphore_t *receive_complete; /* signaled when packet arrived */
-    void *rbuf;                    /* payload copied here */
-    uint32_t bufsize;              /* size of the receive buffer */
-    network_address_t *sender;     /* sender's address stored here */
-    int *copied;                   /* bytes copied stored here */
-    uint16_t *sport;               /* sender's port stored here */
+    sock_t hash_next;          /* next socket in the same port hash chain */
+
+    /* Receive ring, filled by pop_push_frame() and emptied by
+     * socket_recvmsgs(). Receivers sleep on rx while it is empty.
+     * Protected by slock, which also guards protocol against a
+     * concurrent close. */
+    spinlock_t slock;
+    socket_rx_entry_t rx[CONFIG_POP_SOCKET_QUEUE_SIZE];
+    int rx_head;                   /* oldest frame in rx */
+    int rx_count;                  /* number of frames in rx */
+    int rx_limit;                  /* backlog, at most the size of rx */
+
+    pollq_t pollq;                 /* notified when the socket may have
+				      become ready, see socket_poll() */
 } socket_descriptor_t;
 
 
+/* One datagram of socket_recvmsgs(). The caller fills in buf and
+ * buflength, the rest is filled in on receive.
+ */
+typedef struct {
+    void *buf;                     /* payload copied here */
+    int buflength;                 /* size of buf */
+    int length;                    /* bytes copied stored here */
+    network_address_t addr;        /* sender's address stored here */
+    uint16_t sport;                /* sender's port stored here */
+} socket_msg_t;
+
+/* Flag for socket_recvmsgs(): return 0 instead of waiting if no
+ * datagram is queued. */
+#define SOCKET_NONBLOCK 0x1
+
 /* function prototypes */
 void socket_init();
 sock_t socket_open(uint8_t protocol, uint16_t port);
 void socket_close(sock_t socket);
+sock_t socket_find(uint16_t port);
 int socket_sendto(sock_t s,
 		  network_address_t addr,
 		  uint16_t dport,
 		  void *buf,
 		  int size);
+int socket_sendto_buf(sock_t s,
+		      network_address_t addr,
+		      uint16_t dport,
+		      netbuf_t *frame);
 int socket_recvfrom(sock_t s,
 		    network_address_t *addr,
 		    uint16_t *sport,
 		    void *buf,
 		    int maxlength,
 		    int *length);
+int socket_recvmsgs(sock_t s, socket_msg_t *msgs, int count, int flags);
+int socket_set_backlog(sock_t s, int backlog);
+int socket_poll(sock_t s, pollq_t **pollq);
 
 
 #endif /* NET_SOCKET_H */
@@ -0,0 +1,1218 @@
+/*
+ * SOP (Stream Oriented Protocol) protocol layer
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#include "net/sop.h"
+#include "net/socket.h"
+#include "net/network.h"
+#include "net/netbuf.h"
+#include "net/protocols.h"
+#include "kernel/config.h"
+#include "kernel/semaphore.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleepq.h"
+#include "kernel/interrupt.h"
+#include "kernel/thread.h"
+#include "kernel/timeout.h"
+#include "kernel/panic.h"
+#include "kernel/assert.h"
+#include "drivers/metadev.h"
+#include "drivers/yams.h"
+#include "vm/pagepool.h"
+#include "lib/libc.h"
+
+/** @name SOP
+ *
+ * A reliable, connection oriented byte stream between two sockets,
+ * in the spirit of a much reduced TCP. Each connection has a send
+ * buffer and a receive buffer of CONFIG_SOP_BUFFER_PAGES pages each;
+ * the receive buffer bounds the window.
+ *
+ * The sender keeps sending segments from its buffer as long as they
+ * fit in the window last advertised by the receiver, without waiting
+ * for each one to be acknowledged. The receiver places segments at
+ * their offset in its buffer, so segments arriving out of order are
+ * kept, and acknowledges the end of the in-order data it holds.
+ * Repeated acknowledgements of the same byte tell the sender that a
+ * later segment arrived but the one at that byte was lost, and it
+ * resends just that segment (fast retransmit). If nothing is
+ * acknowledged within the retransmission timeout, the sender goes
+ * back to the oldest unacknowledged byte and sends again
+ * (go-back-N), doubling the timeout, and gives up on the connection
+ * after CONFIG_SOP_RETRIES timeouts in a row.
+ *
+ * A connection is set up with a SYN, SYN|ACK, ACK exchange and each
+ * direction is closed with a FIN. Only one connection per socket is
+ * supported: socket_listen() waits for one peer on its socket.
+ *
+ * Frames are handled directly in the network receive thread. To keep
+ * the nesting bounded on loopback, where sending runs the receiver's
+ * handler in the sender's thread, handlers only ever send pure
+ * acknowledgements. Sending data opened up by an acknowledgement is
+ * left to the writer or to the service thread, which also runs the
+ * retransmission timers.
+ *
+ * @{
+ */
+
+/* Connection states */
+#define SOP_CLOSED      0
+#define SOP_LISTEN      1
+#define SOP_SYN_SENT    2
+#define SOP_SYN_RCVD    3
+#define SOP_ESTABLISHED 4
+
+/* Size of the send and receive buffers */
+#define SOP_BUFFER_SIZE (CONFIG_SOP_BUFFER_PAGES * PAGE_SIZE)
+
+/* Number of duplicate acknowledgements that trigger a fast
+ * retransmit */
+#define SOP_DUP_ACKS 3
+
+/* Upper limit of the retransmission timeout backoff */
+#define SOP_MAX_RTO (CONFIG_SOP_RTO * 16)
+
+/* Wrap-around safe sequence number comparisons */
+#define SOP_SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SOP_SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+
+/* State of the connection of one SOP socket */
+typedef struct {
+    spinlock_t slock;
+    int state;                 /* SOP_CLOSED etc. */
+    int error;                 /* reset by the peer or timed out */
+
+    network_address_t raddr;   /* peer address */
+    uint16_t rport;            /* peer port */
+    uint32_t iss;              /* our initial sequence number */
+
+    /* Send side. The buffer holds snd_len bytes starting at snd_head,
+     * the first of them has sequence number snd_una. */
+    uint8_t *snd_buf[CONFIG_SOP_BUFFER_PAGES];
+    int snd_head;
+    int snd_len;
+    uint32_t snd_una;          /* oldest unacknowledged sequence number */
+    uint32_t snd_nxt;          /* next sequence number to send */
+    uint32_t snd_wnd;          /* window advertised by the peer */
+    int fin_queued;            /* closed by us, FIN follows the data */
+    int fin_acked;             /* our FIN has been acknowledged */
+
+    /* Receive side. The buffer holds rcv_len bytes of in-order data
+     * starting at rcv_head, followed by room for the window. Bytes
+     * received ahead of rcv_nxt are marked in rcv_map, a page of its
+     * own. */
+    uint8_t *rcv_buf[CONFIG_SOP_BUFFER_PAGES];
+    int rcv_head;
+    int rcv_len;
+    uint32_t rcv_nxt;          /* next sequence number expected */
+    uint32_t rcv_adv;          /* window last advertised */
+    int rcv_fin;               /* the peer has closed */
+    uint8_t *rcv_map;
+
+    /* Retransmission timer, rtx_deadline 0 when not running */
+    uint32_t rtx_deadline;
+    uint32_t rto;
+    int retries;
+    int dup_acks;              /* acknowledgements of snd_una in a row */
+    int fast_rtx;              /* resend the segment at snd_una */
+
+    /* Window opened and data waits for the service thread */
+    int output_pending;
+} sop_connection_t;
+
+/* socket data from socket.c */
+extern socket_descriptor_t open_sockets[CONFIG_MAX_OPEN_SOCKETS];
+extern spinlock_t open_sockets_slock;
+
+/* Connection of each socket, indexed like open_sockets */
+static sop_connection_t sop_connections[CONFIG_MAX_OPEN_SOCKETS];
+
+/* Largest payload of one segment */
+static int sop_mss;
+
+/* Signals the service thread that a timer was armed or output is
+ * pending. */
+static semaphore_t *sop_service_sem;
+
+/* Raises sop_service_sem when the earliest retransmission timer
+ * expires. Only used by the service thread. */
+static timeout_t sop_service_timeout;
+
+/* Statistics of SOP, see netstats.h */
+netstats_percpu_t sop_stats;
+
+/* A segment to send once the connection lock has been released */
+typedef struct {
+    network_address_t raddr;
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t seq;
+    uint32_t ack;
+    uint16_t flags;
+    uint16_t window;
+} sop_reply_t;
+
+
+/**
+ * Returns the free space of the receive buffer, the window to
+ * advertise. The connection lock must be held.
+ */
+static uint32_t sop_window(sop_connection_t *conn)
+{
+    return SOP_BUFFER_SIZE - conn->rcv_len;
+}
+
+/**
+ * Copies len bytes between buf and a send or receive buffer, starting
+ * at offset pos of the buffer and wrapping around its end.
+ *
+ * @param ring The pages of the buffer.
+ *
+ * @param to_ring 1 to copy from buf to the buffer, 0 the other way.
+ */
+static void sop_copy(uint8_t **ring, int pos, uint8_t *buf, int len,
+		     int to_ring)
+{
+    uint8_t *page;
+    int n;
+
+    while (len > 0) {
+	n = MIN(len, PAGE_SIZE - pos % PAGE_SIZE);
+	page = ring[pos / PAGE_SIZE] + pos % PAGE_SIZE;
+	if (to_ring)
+	    memcopy(n, page, buf);
+	else
+	    memcopy(n, buf, page);
+
+	buf += n;
+	len -= n;
+	pos = (pos + n) % SOP_BUFFER_SIZE;
+    }
+}
+
+/**
+ * Wakes everybody waiting on a connection, both threads sleeping on it
+ * and pollers of its socket. The connection lock must be held.
+ */
+static void sop_wake(sop_connection_t *conn)
+{
+    sleepq_wake_all(conn);
+    poll_notify(&open_sockets[conn - sop_connections].pollq);
+}
+
+/**
+ * Starts the retransmission timer unless it is already running. The
+ * connection lock must be held.
+ */
+static void sop_arm_timer(sop_connection_t *conn)
+{
+    if (conn->rtx_deadline == 0) {
+	conn->rtx_deadline = rtc_get_msec() + conn->rto;
+	if (conn->rtx_deadline == 0)
+	    conn->rtx_deadline = 1;
+	semaphore_V(sop_service_sem);
+    }
+}
+
+/**
+ * Fills in a header-only segment of the connection of socket s to be
+ * sent with sop_send_reply(). The connection lock must be held.
+ */
+static void sop_make_reply(sock_t s, sop_reply_t *reply,
+			   uint32_t seq, uint16_t flags)
+{
+    sop_connection_t *conn = &sop_connections[s];
+
+    reply->raddr = conn->raddr;
+    reply->sport = open_sockets[s].port;
+    reply->dport = conn->rport;
+    reply->seq = seq;
+    reply->ack = conn->rcv_nxt;
+    reply->flags = flags;
+    reply->window = sop_window(conn);
+    conn->rcv_adv = reply->window;
+}
+
+/**
+ * Writes the header of a segment into the headroom of frame and sends
+ * it. The frame is consumed.
+ */
+static void sop_transmit(netbuf_t *frame, sop_reply_t *reply)
+{
+    sop_header_t *hdr;
+    uint32_t size = frame->length;
+
+    hdr = (sop_header_t *)netbuf_push(frame, sizeof(sop_header_t));
+    hdr->source_port = reply->sport;
+    hdr->dest_port = reply->dport;
+    hdr->seq = reply->seq;
+    hdr->ack = reply->ack;
+    hdr->flags = reply->flags;
+    hdr->window = reply->window;
+    hdr->size = size;
+
+    if (network_send_buf(NETWORK_BROADCAST_ADDRESS, reply->raddr,
+			 PROTOCOL_SOP, frame) != NET_OK) {
+	netstats_add(sop_stats, NETSTATS_FIELD(send_errors), 1);
+	return;
+    }
+
+    netstats_add(sop_stats, NETSTATS_FIELD(frames_out), 1);
+    netstats_add(sop_stats, NETSTATS_FIELD(bytes_out), size);
+}
+
+/**
+ * Sends a segment without payload. Must be called without locks.
+ */
+static void sop_send_reply(sop_reply_t *reply)
+{
+    netbuf_t frame;
+
+    if (netbuf_alloc(&frame, SOP_HEADROOM) != 0)
+	return;
+
+    sop_transmit(&frame, reply);
+}
+
+/**
+ * Sends the data of socket s that fits in the window, and the FIN
+ * after the data if the socket is being closed. Must be called
+ * without locks.
+ *
+ * @param s The socket.
+ *
+ * @param force Send one segment even if the window is closed. Used
+ * for retransmissions, which also probe a zero window.
+ */
+static void sop_output(sock_t s, int force)
+{
+    interrupt_status_t intr_status;
+    sop_connection_t *conn = &sop_connections[s];
+    sop_reply_t reply;
+    netbuf_t frame;
+    int inflight, unsent, len;
+
+    while (1) {
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&conn->slock);
+
+	if (conn->state != SOP_ESTABLISHED) {
+	    spinlock_release(&conn->slock);
+	    _interrupt_set_state(intr_status);
+	    return;
+	}
+
+	inflight = conn->snd_nxt - conn->snd_una;
+	unsent = conn->snd_len - inflight;
+
+	len = MIN(unsent, sop_mss);
+	if (!force)
+	    len = MIN(len, (int)conn->snd_wnd - inflight);
+
+	/* Nothing to send, except perhaps the FIN after all data */
+	if (len <= 0 && !(conn->fin_queued && unsent == 0)) {
+	    /* data waits for the window, keep probing it */
+	    if (unsent > 0)
+		sop_arm_timer(conn);
+	    spinlock_release(&conn->slock);
+	    _interrupt_set_state(intr_status);
+	    return;
+	}
+
+	if (netbuf_alloc(&frame, SOP_HEADROOM) != 0) {
+	    /* the timer will try again */
+	    sop_arm_timer(conn);
+	    spinlock_release(&conn->slock);
+	    _interrupt_set_state(intr_status);
+	    return;
+	}
+
+	if (len > 0) {
+	    sop_copy(conn->snd_buf,
+		     (conn->snd_head + inflight) % SOP_BUFFER_SIZE,
+		     netbuf_put(&frame, len), len, 0);
+
+	    sop_make_reply(s, &reply, conn->snd_nxt, SOP_ACK);
+	    conn->snd_nxt += len;
+	} else {
+	    sop_make_reply(s, &reply, conn->snd_nxt, SOP_ACK | SOP_FIN);
+	    conn->snd_nxt++;
+	}
+
+	sop_arm_timer(conn);
+
+	spinlock_release(&conn->slock);
+	_interrupt_set_state(intr_status);
+
+	sop_transmit(&frame, &reply);
+
+	/* a FIN is the last thing sent */
+	if (len <= 0)
+	    return;
+	force = 0;
+    }
+}
+
+/**
+ * Resends the oldest unacknowledged segment of socket s, or the FIN
+ * if that is all that is outstanding. Must be called without locks.
+ */
+static void sop_retransmit(sock_t s)
+{
+    interrupt_status_t intr_status;
+    sop_connection_t *conn = &sop_connections[s];
+    sop_reply_t reply;
+    netbuf_t frame;
+    int len;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&conn->slock);
+
+    if (conn->state != SOP_ESTABLISHED || conn->snd_nxt == conn->snd_una ||
+	netbuf_alloc(&frame, SOP_HEADROOM) != 0) {
+	spinlock_release(&conn->slock);
+	_interrupt_set_state(intr_status);
+	return;
+    }
+
+    len = MIN(MIN(conn->snd_len, (int)(conn->snd_nxt - conn->snd_una)),
+	      sop_mss);
+    if (len > 0) {
+	sop_copy(conn->snd_buf, conn->snd_head, netbuf_put(&frame, len),
+		 len, 0);
+	sop_make_reply(s, &reply, conn->snd_una, SOP_ACK);
+    } else {
+	sop_make_reply(s, &reply, conn->snd_una, SOP_ACK | SOP_FIN);
+    }
+
+    spinlock_release(&conn->slock);
+    _interrupt_set_state(intr_status);
+
+    sop_transmit(&frame, &reply);
+}
+
+/**
+ * Resets the connection after a timeout or a reset from the peer and
+ * wakes everybody waiting on it. The connection lock must be held.
+ */
+static void sop_abort(sop_connection_t *conn)
+{
+    conn->state = SOP_CLOSED;
+    conn->error = 1;
+    conn->rtx_deadline = 0;
+    conn->output_pending = 0;
+    sop_wake(conn);
+}
+
+/**
+ * Handles an acknowledgement in an established connection. The
+ * connection lock must be held.
+ *
+ * @return 1 if the window opened so more data may be sent.
+ */
+static int sop_process_ack(sop_connection_t *conn, sop_header_t *hdr)
+{
+    uint32_t acked;
+    int data, same_window;
+
+    same_window = (hdr->window == conn->snd_wnd);
+    conn->snd_wnd = hdr->window;
+
+    /* the peer is alive */
+    conn->retries = 0;
+    conn->rto = CONFIG_SOP_RTO;
+
+    if (!SOP_SEQ_LT(conn->snd_una, hdr->ack) ||
+	!SOP_SEQ_LEQ(hdr->ack, conn->snd_nxt)) {
+	/* the peer got a later segment but misses the one at snd_una */
+	if (hdr->ack == conn->snd_una && hdr->size == 0 && same_window &&
+	    conn->snd_nxt != conn->snd_una &&
+	    ++conn->dup_acks == SOP_DUP_ACKS)
+	    conn->fast_rtx = 1;
+
+	return conn->snd_wnd > conn->snd_nxt - conn->snd_una;
+    }
+
+    conn->dup_acks = 0;
+
+    acked = hdr->ack - conn->snd_una;
+    data = MIN(acked, (uint32_t)conn->snd_len);
+
+    conn->snd_head = (conn->snd_head + data) % SOP_BUFFER_SIZE;
+    conn->snd_len -= data;
+    conn->snd_una = hdr->ack;
+
+    /* the rest acknowledges our FIN */
+    if (acked > (uint32_t)data)
+	conn->fin_acked = 1;
+
+    /* restart the timer for what is still outstanding, keep it
+     * running as a persist timer while data waits for the window */
+    conn->rtx_deadline = 0;
+    if (conn->snd_nxt != conn->snd_una || conn->snd_len > 0 ||
+	(conn->fin_queued && !conn->fin_acked))
+	sop_arm_timer(conn);
+
+    /* writers wait for room in the buffer, close for the FIN ack */
+    sop_wake(conn);
+
+    return 1;
+}
+
+/**
+ * Places the payload of a segment in the receive buffer and advances
+ * rcv_nxt over the data that is now in order. The connection lock
+ * must be held.
+ */
+static void sop_process_data(sop_connection_t *conn, sop_header_t *hdr)
+{
+    uint8_t *data = (uint8_t *)hdr + sizeof(sop_header_t);
+    int32_t start, end, free, i, pos;
+    int old_len = conn->rcv_len;
+
+    /* offsets relative to rcv_nxt, clipped to the window */
+    start = hdr->seq - conn->rcv_nxt;
+    end = start + hdr->size;
+    free = sop_window(conn);
+
+    if (start < 0) {
+	data -= start;
+	start = 0;
+    }
+    if (end > free) {
+	netstats_add(sop_stats, NETSTATS_FIELD(drop_queue_full), 1);
+	end = free;
+    }
+
+    if (start < end) {
+	sop_copy(conn->rcv_buf,
+		 (conn->rcv_head + conn->rcv_len + start) % SOP_BUFFER_SIZE,
+		 data, end - start, 1);
+
+	for (i = start; i < end; i++) {
+	    pos = (conn->rcv_head + conn->rcv_len + i) % SOP_BUFFER_SIZE;
+	    conn->rcv_map[pos / 8] |= 1 << (pos % 8);
+	}
+    }
+
+    /* move the in-order part to the readable data */
+    while (conn->rcv_len < SOP_BUFFER_SIZE) {
+	pos = (conn->rcv_head + conn->rcv_len) % SOP_BUFFER_SIZE;
+	if (!(conn->rcv_map[pos / 8] & (1 << (pos % 8))))
+	    break;
+	conn->rcv_map[pos / 8] &= ~(1 << (pos % 8));
+	conn->rcv_len++;
+	conn->rcv_nxt++;
+    }
+
+    if (conn->rcv_len != old_len) {
+	netstats_max(sop_stats, NETSTATS_FIELD(queue_max), conn->rcv_len);
+	sop_wake(conn);
+    }
+}
+
+/**
+ * Answers a segment for a port without a connection with a reset, so
+ * the peer gives up at once instead of retrying. Must be called
+ * without locks.
+ */
+static void sop_refuse(network_address_t fromaddr, sop_header_t *hdr)
+{
+    sop_reply_t reply;
+
+    /* never answer a reset */
+    if (hdr->flags & SOP_RST)
+	return;
+
+    reply.raddr = fromaddr;
+    reply.sport = hdr->dest_port;
+    reply.dport = hdr->source_port;
+    reply.seq = hdr->ack;
+    reply.ack = hdr->seq + hdr->size;
+    reply.flags = SOP_RST;
+    reply.window = 0;
+
+    sop_send_reply(&reply);
+}
+
+/** Push a frame to the stream protocol. The segment is handled at
+ * once: its payload is copied into the receive buffer of its
+ * connection, and an acknowledgement or handshake reply is sent if
+ * needed. Segments for ports without a connection are answered with
+ * a reset. The frame is always freed here.
+ *
+ * @param fromaddr    Sender address of the frame
+ * @param toaddr      Recipient address of the frame
+ * @param protocol_id Protocol of the frame, should be PROTOCOL_SOP
+ * @param frame       The frame payload
+ *
+ * @return 1, the frame is always accepted
+ */
+int sop_push_frame(network_address_t fromaddr,
+		   network_address_t toaddr,
+		   uint32_t protocol_id,
+		   void *frame)
+{
+    interrupt_status_t intr_status;
+    sop_header_t *hdr = (sop_header_t *)frame;
+    sop_connection_t *conn;
+    sop_reply_t reply;
+    int send_reply = 0, wake_service = 0;
+    sock_t s;
+
+    toaddr = toaddr;
+
+    KERNEL_ASSERT(protocol_id == PROTOCOL_SOP);
+
+    netstats_add(sop_stats, NETSTATS_FIELD(frames_in), 1);
+    netstats_add(sop_stats, NETSTATS_FIELD(bytes_in), hdr->size);
+
+    /* ignore garbage */
+    if (hdr->size > PAGE_SIZE - SOP_HEADROOM) {
+	netstats_add(sop_stats, NETSTATS_FIELD(drop_invalid), 1);
+	network_free_frame(frame);
+	return 1;
+    }
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&open_sockets_slock);
+
+    s = socket_find(hdr->dest_port);
+    if (s < 0 || open_sockets[s].protocol != PROTOCOL_SOP ||
+	sop_connections[s].state == SOP_CLOSED) {
+	if (s < 0 || open_sockets[s].protocol != PROTOCOL_SOP)
+	    netstats_add(sop_stats, NETSTATS_FIELD(drop_no_listener), 1);
+	else
+	    netstats_add(sop_stats, NETSTATS_FIELD(drop_closed), 1);
+	spinlock_release(&open_sockets_slock);
+	_interrupt_set_state(intr_status);
+	sop_refuse(fromaddr, hdr);
+	network_free_frame(frame);
+	return 1;
+    }
+
+    conn = &sop_connections[s];
+    spinlock_acquire(&conn->slock);
+    spinlock_release(&open_sockets_slock);
+
+    /* segments of other peers, except a SYN to a listener */
+    if (conn->state != SOP_LISTEN &&
+	(fromaddr != conn->raddr || hdr->source_port != conn->rport)) {
+	spinlock_release(&conn->slock);
+	_interrupt_set_state(intr_status);
+	netstats_add(sop_stats, NETSTATS_FIELD(drop_invalid), 1);
+	network_free_frame(frame);
+	return 1;
+    }
+
+    if (hdr->flags & SOP_RST) {
+	if (conn->state != SOP_LISTEN && conn->state != SOP_CLOSED)
+	    sop_abort(conn);
+	spinlock_release(&conn->slock);
+	_interrupt_set_state(intr_status);
+	network_free_frame(frame);
+	return 1;
+    }
+
+    switch (conn->state) {
+    case SOP_LISTEN:
+	if (hdr->flags == SOP_SYN) {
+	    conn->raddr = fromaddr;
+	    conn->rport = hdr->source_port;
+	    conn->rcv_nxt = hdr->seq + 1;
+	    conn->snd_wnd = hdr->window;
+	    conn->iss = rtc_get_msec() * 251;
+	    conn->snd_una = conn->iss;
+	    conn->snd_nxt = conn->iss + 1;
+	    conn->state = SOP_SYN_RCVD;
+	    sop_arm_timer(conn);
+	    sop_make_reply(s, &reply, conn->iss, SOP_SYN | SOP_ACK);
+	    send_reply = 1;
+	}
+	break;
+
+    case SOP_SYN_SENT:
+	if (hdr->flags == (SOP_SYN | SOP_ACK) && hdr->ack == conn->iss + 1) {
+	    conn->rcv_nxt = hdr->seq + 1;
+	    conn->snd_una = hdr->ack;
+	    conn->snd_wnd = hdr->window;
+	    conn->state = SOP_ESTABLISHED;
+	    conn->rtx_deadline = 0;
+	    conn->retries = 0;
+	    conn->rto = CONFIG_SOP_RTO;
+	    sop_wake(conn);
+	    sop_make_reply(s, &reply, conn->snd_nxt, SOP_ACK);
+	    send_reply = 1;
+	}
+	break;
+
+    case SOP_SYN_RCVD:
+	/* our SYN|ACK was lost, the peer sent its SYN again */
+	if (hdr->flags == SOP_SYN) {
+	    sop_make_reply(s, &reply, conn->iss, SOP_SYN | SOP_ACK);
+	    send_reply = 1;
+	    break;
+	}
+	if (!(hdr->flags & SOP_ACK) || hdr->ack != conn->iss + 1)
+	    break;
+
+	conn->snd_una = hdr->ack;
+	conn->state = SOP_ESTABLISHED;
+	conn->rtx_deadline = 0;
+	conn->retries = 0;
+	conn->rto = CONFIG_SOP_RTO;
+	sop_wake(conn);
+	/* the segment may carry data already */
+	/* FALLTHROUGH */
+
+    case SOP_ESTABLISHED:
+	/* our ACK of the handshake was lost */
+	if (hdr->flags & SOP_SYN) {
+	    sop_make_reply(s, &reply, conn->snd_nxt, SOP_ACK);
+	    send_reply = 1;
+	    break;
+	}
+
+	if ((hdr->flags & SOP_ACK) && sop_process_ack(conn, hdr) &&
+	    conn->snd_len > (int)(conn->snd_nxt - conn->snd_una)) {
+	    conn->output_pending = 1;
+	    wake_service = 1;
+	}
+	if (conn->fast_rtx)
+	    wake_service = 1;
+
+	if (hdr->size > 0) {
+	    sop_process_data(conn, hdr);
+	    send_reply = 1;
+	}
+
+	if (hdr->flags & SOP_FIN) {
+	    if (hdr->seq + hdr->size == conn->rcv_nxt && !conn->rcv_fin) {
+		conn->rcv_nxt++;
+		conn->rcv_fin = 1;
+		sop_wake(conn);
+	    }
+	    send_reply = 1;
+	}
+
+	if (send_reply)
+	    sop_make_reply(s, &reply, conn->snd_nxt, SOP_ACK);
+	break;
+
+    default:
+	break;
+    }
+
+    if (wake_service)
+	semaphore_V(sop_service_sem);
+
+    spinlock_release(&conn->slock);
+    _interrupt_set_state(intr_status);
+
+    network_free_frame(frame);
+
+    if (send_reply)
+	sop_send_reply(&reply);
+
+    return 1;
+}
+
+/**
+ * Timeout function of the service thread, wakes it up.
+ *
+ * @param arg Not used.
+ */
+static void sop_service_expired(void *arg)
+{
+    arg = arg;
+    semaphore_V(sop_service_sem);
+}
+
+/**
+ * The service thread of SOP. Retransmits on timeouts and duplicate
+ * acknowledgements, and sends data
+ * whose window was opened by an acknowledgement while no writer was
+ * around. Between rounds it sleeps until a timer is armed, output is
+ * pending or the earliest running timer expires.
+ *
+ * @param dummy Dummy parameter, required for threads
+ */
+static void sop_service_thread(uint32_t dummy)
+{
+    interrupt_status_t intr_status;
+    sop_connection_t *conn;
+    sop_reply_t reply;
+    int s, timer, output, resend, fast;
+    uint32_t now, next;
+
+    dummy = dummy;
+
+    while (1) {
+	timer = 0;
+	next = 0;
+
+	for (s = 0; s < CONFIG_MAX_OPEN_SOCKETS; s++) {
+	    conn = &sop_connections[s];
+	    output = 0;
+	    resend = 0;
+	    fast = 0;
+
+	    intr_status = _interrupt_disable();
+	    spinlock_acquire(&conn->slock);
+
+	    now = rtc_get_msec();
+	    if (conn->rtx_deadline != 0 &&
+		SOP_SEQ_LEQ(conn->rtx_deadline, now)) {
+		conn->rtx_deadline = 0;
+		if (++conn->retries > CONFIG_SOP_RETRIES) {
+		    sop_abort(conn);
+		} else {
+		    conn->rto = MIN(conn->rto * 2, SOP_MAX_RTO);
+		    sop_arm_timer(conn);
+
+		    if (conn->state == SOP_SYN_SENT) {
+			sop_make_reply(s, &reply, conn->iss, SOP_SYN);
+			resend = 1;
+		    } else if (conn->state == SOP_SYN_RCVD) {
+			sop_make_reply(s, &reply, conn->iss,
+				       SOP_SYN | SOP_ACK);
+			resend = 1;
+		    } else if (conn->state == SOP_ESTABLISHED) {
+			/* go back to the oldest unacknowledged byte */
+			conn->snd_nxt = conn->snd_una;
+			output = 2;
+		    }
+		}
+	    }
+
+	    if (conn->fast_rtx) {
+		conn->fast_rtx = 0;
+		fast = (output == 0);
+	    }
+
+	    if (conn->output_pending) {
+		conn->output_pending = 0;
+		if (output == 0)
+		    output = 1;
+	    }
+
+	    if (conn->rtx_deadline != 0 &&
+		(!timer || SOP_SEQ_LT(conn->rtx_deadline, next))) {
+		timer = 1;
+		next = conn->rtx_deadline;
+	    }
+
+	    spinlock_release(&conn->slock);
+	    _interrupt_set_state(intr_status);
+
+	    if (resend)
+		sop_send_reply(&reply);
+	    if (fast)
+		sop_retransmit(s);
+	    if (output)
+		sop_output(s, output == 2);
+	}
+
+	if (timer) {
+	    now = rtc_get_msec();
+	    timeout_set(&sop_service_timeout,
+			SOP_SEQ_LEQ(next, now) ? 0 : next - now,
+			sop_service_expired, NULL);
+	}
+	semaphore_P(sop_service_sem);
+    }
+}
+
+/** Initialize the stream protocol. Resets the connection table and
+ * starts the service thread.
+ */
+void sop_init()
+{
+    static int init_done = 0;
+    TID_t tid;
+    int i, j;
+
+    KERNEL_ASSERT(!init_done);
+    init_done = 1;
+
+    /* Check that the compiler has made correct size structures */
+    KERNEL_ASSERT(sizeof(sop_header_t) == 20);
+
+    sop_mss = MIN(network_get_mtu(NETWORK_BROADCAST_ADDRESS)
+		  - sizeof(sop_header_t),
+		  PAGE_SIZE - SOP_HEADROOM);
+
+    for (i = 0; i < CONFIG_MAX_OPEN_SOCKETS; i++) {
+	spinlock_reset(&sop_connections[i].slock);
+	sop_connections[i].state = SOP_CLOSED;
+	for (j = 0; j < CONFIG_SOP_BUFFER_PAGES; j++) {
+	    sop_connections[i].snd_buf[j] = NULL;
+	    sop_connections[i].rcv_buf[j] = NULL;
+	}
+	sop_connections[i].rcv_map = NULL;
+	sop_connections[i].rtx_deadline = 0;
+	sop_connections[i].output_pending = 0;
+    }
+
+    sop_service_sem = semaphore_create(0);
+    if (sop_service_sem == NULL)
+	KERNEL_PANIC("sop_init: semaphore allocation failed\n");
+
+    tid = thread_create(&sop_service_thread, 0);
+    KERNEL_ASSERT(tid >= 0);
+    thread_run(tid);
+}
+
+/**
+ * Returns page if it is not NULL, otherwise allocates a new page.
+ *
+ * @return Kernel address of the page, NULL if out of memory.
+ */
+static uint8_t *sop_get_page(uint8_t *page)
+{
+    uint32_t phys;
+
+    if (page != NULL)
+	return page;
+
+    phys = pagepool_get_phys_page();
+    if (phys == 0)
+	return NULL;
+
+    return (uint8_t *)ADDR_PHYS_TO_KERNEL(phys);
+}
+
+/**
+ * Prepares the connection of socket s for a new handshake. Allocates
+ * the buffers and resets the sequence state.
+ *
+ * @return 0 on success, negative if s is not an idle SOP socket or
+ * out of memory.
+ */
+static int sop_prepare(sock_t s)
+{
+    interrupt_status_t intr_status;
+    sop_connection_t *conn;
+    int i, ok = 1;
+
+    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
+    conn = &sop_connections[s];
+
+    if (open_sockets[s].protocol != PROTOCOL_SOP ||
+	conn->state != SOP_CLOSED)
+	return -1;
+
+    /* Frames are not handled in the closed state, so the buffers can
+     * be set up without the lock. Pages got before running out of
+     * memory are freed by sop_close(). */
+    for (i = 0; i < CONFIG_SOP_BUFFER_PAGES; i++) {
+	conn->snd_buf[i] = sop_get_page(conn->snd_buf[i]);
+	conn->rcv_buf[i] = sop_get_page(conn->rcv_buf[i]);
+	ok = ok && conn->snd_buf[i] != NULL && conn->rcv_buf[i] != NULL;
+    }
+    conn->rcv_map = sop_get_page(conn->rcv_map);
+    if (!ok || conn->rcv_map == NULL)
+	return -1;
+
+    for (i = 0; i < SOP_BUFFER_SIZE / 8; i++)
+	conn->rcv_map[i] = 0;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&conn->slock);
+
+    conn->error = 0;
+    conn->snd_head = 0;
+    conn->snd_len = 0;
+    conn->fin_queued = 0;
+    conn->fin_acked = 0;
+    conn->rcv_head = 0;
+    conn->rcv_len = 0;
+    conn->rcv_fin = 0;
+    conn->rtx_deadline = 0;
+    conn->rto = CONFIG_SOP_RTO;
+    conn->retries = 0;
+    conn->dup_acks = 0;
+    conn->fast_rtx = 0;
+    conn->output_pending = 0;
+
+    spinlock_release(&conn->slock);
+    _interrupt_set_state(intr_status);
+
+    return 0;
+}
+
+/**
+ * Waits until the handshake of socket s has finished, one way or the
+ * other. The connection lock must be held.
+ */
+static void sop_wait_established(sop_connection_t *conn)
+{
+    while (conn->state != SOP_ESTABLISHED && conn->state != SOP_CLOSED) {
+	sleepq_add(conn);
+	spinlock_release(&conn->slock);
+	thread_switch();
+	spinlock_acquire(&conn->slock);
+    }
+}
+
+/* Connect to remote address addr, port port with given socket s.
+Return 0 on success and 1 on failure. */
+int socket_connect(sock_t s, network_address_t addr, int port)
+{
+    interrupt_status_t intr_status;
+    sop_connection_t *conn;
+    sop_reply_t reply;
+    int ret;
+
+    if (port <= 0 || port > 0xffff || sop_prepare(s) != 0)
+	return 1;
+
+    conn = &sop_connections[s];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&conn->slock);
+
+    conn->raddr = addr;
+    conn->rport = port;
+    conn->iss = rtc_get_msec() * 251;
+    conn->snd_una = conn->iss;
+    conn->snd_nxt = conn->iss + 1;
+    conn->snd_wnd = 0;
+    conn->rcv_nxt = 0;
+    conn->state = SOP_SYN_SENT;
+    sop_arm_timer(conn);
+    sop_make_reply(s, &reply, conn->iss, SOP_SYN);
+
+    spinlock_release(&conn->slock);
+    _interrupt_set_state(intr_status);
+
+    sop_send_reply(&reply);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&conn->slock);
+    sop_wait_established(conn);
+    ret = (conn->state == SOP_ESTABLISHED) ? 0 : 1;
+    spinlock_release(&conn->slock);
+    _interrupt_set_state(intr_status);
+
+    return ret;
+}
+
+/* Wait until some remote entity has connected to given socket s. */
+void socket_listen(sock_t s)
+{
+    interrupt_status_t intr_status;
+    sop_connection_t *conn;
+
+    if (sop_prepare(s) != 0)
+	return;
+
+    conn = &sop_connections[s];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&conn->slock);
+
+    conn->state = SOP_LISTEN;
+    sop_wait_established(conn);
+
+    spinlock_release(&conn->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/* Read at most length bytes from given socket s to buffer buf.
+Return number of bytes read, zero on end of stream and negative on error. */
+int socket_read(sock_t s, void *buf, int length)
+{
+    interrupt_status_t intr_status;
+    sop_connection_t *conn;
+    sop_reply_t reply;
+    int n, update = 0;
+
+    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
+    KERNEL_ASSERT(buf != NULL && length >= 0);
+
+    conn = &sop_connections[s];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&conn->slock);
+
+    while (conn->state == SOP_ESTABLISHED && conn->rcv_len == 0 &&
+	   !conn->rcv_fin) {
+	sleepq_add(conn);
+	spinlock_release(&conn->slock);
+	thread_switch();
+	spinlock_acquire(&conn->slock);
+    }
+
+    if (conn->rcv_len == 0) {
+	n = (conn->rcv_fin && !conn->error) ? 0 : -1;
+	spinlock_release(&conn->slock);
+	_interrupt_set_state(intr_status);
+	return n;
+    }
+
+    n = MIN(length, conn->rcv_len);
+    sop_copy(conn->rcv_buf, conn->rcv_head, buf, n, 0);
+
+    conn->rcv_head = (conn->rcv_head + n) % SOP_BUFFER_SIZE;
+    conn->rcv_len -= n;
+
+    /* tell the sender once a good part of the buffer has opened up,
+     * it may be waiting for a closed window */
+    if (conn->state == SOP_ESTABLISHED &&
+	(int)(sop_window(conn) - conn->rcv_adv) >= SOP_BUFFER_SIZE / 2) {
+	sop_make_reply(s, &reply, conn->snd_nxt, SOP_ACK);
+	update = 1;
+    }
+
+    spinlock_release(&conn->slock);
+    _interrupt_set_state(intr_status);
+
+    if (update)
+	sop_send_reply(&reply);
+
+    return n;
+}
+
+/* Write length bytes from buffer buf to socket s. Return number of
+bytes delivered to target socket. If return value is not equal to
+length, connection (and some data) has been lost. */
+int socket_write(sock_t s, void *buf, int length)
+{
+    interrupt_status_t intr_status;
+    sop_connection_t *conn;
+    int done = 0, n;
+
+    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
+    KERNEL_ASSERT(buf != NULL && length >= 0);
+
+    conn = &sop_connections[s];
+
+    while (done < length) {
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&conn->slock);
+
+	while (conn->state == SOP_ESTABLISHED && !conn->fin_queued &&
+	       conn->snd_len == SOP_BUFFER_SIZE) {
+	    sleepq_add(conn);
+	    spinlock_release(&conn->slock);
+	    thread_switch();
+	    spinlock_acquire(&conn->slock);
+	}
+
+	if (conn->state != SOP_ESTABLISHED || conn->fin_queued) {
+	    spinlock_release(&conn->slock);
+	    _interrupt_set_state(intr_status);
+	    break;
+	}
+
+	/* append to the send buffer */
+	n = MIN(length - done, SOP_BUFFER_SIZE - conn->snd_len);
+	sop_copy(conn->snd_buf,
+		 (conn->snd_head + conn->snd_len) % SOP_BUFFER_SIZE,
+		 (uint8_t *)buf + done, n, 1);
+	conn->snd_len += n;
+	done += n;
+
+	spinlock_release(&conn->slock);
+	_interrupt_set_state(intr_status);
+
+	sop_output(s, 0);
+    }
+
+    return done;
+}
+
+/* Called by socket_poll() for SOP sockets. Returns the POLL_* events
+that are ready: POLL_IN if socket_read() would not block, POLL_OUT if
+socket_write() would not, POLL_HUP if the connection is closed. */
+int sop_poll(sock_t s)
+{
+    interrupt_status_t intr_status;
+    sop_connection_t *conn;
+    int events = 0;
+
+    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
+    conn = &sop_connections[s];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&conn->slock);
+
+    if (conn->rcv_len > 0 || conn->rcv_fin)
+	events |= POLL_IN;
+
+    if (conn->state == SOP_ESTABLISHED && !conn->fin_queued &&
+	conn->snd_len < SOP_BUFFER_SIZE)
+	events |= POLL_OUT;
+
+    /* connections being set up are not ready for anything yet */
+    if (conn->state == SOP_CLOSED)
+	events |= POLL_HUP;
+
+    spinlock_release(&conn->slock);
+    _interrupt_set_state(intr_status);
+
+    return events;
+}
+
+/* Called by socket_close() for SOP sockets. Sends the data still
+buffered and the end of stream, then releases the connection. */
+void sop_close(sock_t s)
+{
+    interrupt_status_t intr_status;
+    sop_connection_t *conn;
+    uint8_t *pages[1 + 2 * CONFIG_SOP_BUFFER_PAGES];
+    int i;
+
+    KERNEL_ASSERT(s >= 0 && s < CONFIG_MAX_OPEN_SOCKETS);
+    conn = &sop_connections[s];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&conn->slock);
+
+    if (conn->state == SOP_ESTABLISHED && !conn->fin_queued) {
+	conn->fin_queued = 1;
+	sop_arm_timer(conn);
+	spinlock_release(&conn->slock);
+	_interrupt_set_state(intr_status);
+
+	sop_output(s, 0);
+
+	/* wait for the peer to acknowledge everything, or give up */
+	intr_status = _interrupt_disable();
+	spinlock_acquire(&conn->slock);
+	while (conn->state == SOP_ESTABLISHED && !conn->fin_acked) {
+	    sleepq_add(conn);
+	    spinlock_release(&conn->slock);
+	    thread_switch();
+	    spinlock_acquire(&conn->slock);
+	}
+    }
+
+    conn->state = SOP_CLOSED;
+    conn->rtx_deadline = 0;
+    conn->output_pending = 0;
+    sop_wake(conn);
+
+    spinlock_release(&conn->slock);
+    _interrupt_set_state(intr_status);
+
+    /* nothing touches the buffers of a closed connection */
+    pages[0] = conn->rcv_map;
+    conn->rcv_map = NULL;
+    for (i = 0; i < CONFIG_SOP_BUFFER_PAGES; i++) {
+	pages[1 + 2 * i] = conn->snd_buf[i];
+	pages[2 + 2 * i] = conn->rcv_buf[i];
+	conn->snd_buf[i] = NULL;
+	conn->rcv_buf[i] = NULL;
+    }
+
+    for (i = 0; i < 1 + 2 * CONFIG_SOP_BUFFER_PAGES; i++) {
+	if (pages[i] != NULL)
+	    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)pages[i]));
+    }
+}
+
+/** @} */
@@ -41,12 +41,44 @@
 #include "net/network.h"
 #include "net/socket.h"
 
-/* NOTE: None of these functions are implemented, this is just an API. */
+/* SOP segment header, 20 bytes, immediately after the network frame
+ * header. Sequence numbers count payload bytes; SYN and FIN take one
+ * sequence number each.
+ */
+typedef struct {
+    uint16_t source_port __attribute__ ((packed));
+    uint16_t dest_port   __attribute__ ((packed));
+    uint32_t seq         __attribute__ ((packed)); /* first byte sent */
+    uint32_t ack         __attribute__ ((packed)); /* next byte expected */
+    uint16_t flags       __attribute__ ((packed)); /* SOP_SYN etc. */
+    uint16_t window      __attribute__ ((packed)); /* free receive space */
+    uint32_t size        __attribute__ ((packed)); /* payload size */
+} sop_header_t;
+
+/* Segment flags */
+#define SOP_SYN 0x1
+#define SOP_ACK 0x2
+#define SOP_FIN 0x4
+#define SOP_RST 0x8
+
+/* Headroom of the frame buffers SOP segments are built in */
+#define SOP_HEADROOM (NETWORK_HEADER_SIZE + sizeof(sop_header_t))
+
+/* Statistics of SOP */
+extern netstats_percpu_t sop_stats;
 
 /* Initialization function for streaming protocol. Implements interface
 to protocols_init() */
 void sop_init();
 
+/* Called by socket_poll() for SOP sockets. Returns the POLL_* events
+that are ready. */
+int sop_poll(sock_t s);
+
+/* Called by socket_close() for SOP sockets. Sends the data still
+buffered and the end of stream, then releases the connection. */
+void sop_close(sock_t s);
+
 
 /* Implementation for frame_handler_t (protocols.h) for streaming protocol. */
 int sop_push_frame(network_address_t fromaddr,
@@ -39,6 +39,7 @@
 #include "lib/libc.h"
 #include "kernel/thread.h"
 #include "kernel/exception.h"
+#include "vm/tlb.h"
 
 void syscall_handle(context_t *user_context);
 
@@ -70,13 +71,16 @@ void user_exception_handle(int exception)
 
     switch(exception) {
     case EXCEPTION_TLBM:
-	KERNEL_PANIC("TLB Modification: not handled yet");
+	if(!tlb_modified_exception(0))
+	    KERNEL_PANIC("TLB Modification: write to a read-only page");
 	break;
     case EXCEPTION_TLBL:
-	KERNEL_PANIC("TLB Load: not handled yet");
+	if(!tlb_load_exception(0))
+	    KERNEL_PANIC("TLB Load: access to an unmapped page");
 	break;
     case EXCEPTION_TLBS:
-	KERNEL_PANIC("TLB Store: not handled yet");
+	if(!tlb_store_exception(0))
+	    KERNEL_PANIC("TLB Store: access to an unmapped page");
 	break;
     case EXCEPTION_ADDRL:
 	KERNEL_PANIC("Address Error Load: not handled yet");
@@ -0,0 +1,185 @@
+/*
+ * Asynchronous I/O submission and completion rings.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#include "proc/io_ring.h"
+#include "proc/mmap.h"
+#include "proc/process.h"
+#include "proc/syscall.h"
+#include "kernel/interrupt.h"
+#include "kernel/spinlock.h"
+#include "fs/vfs.h"
+
+extern spinlock_t process_table_slock;
+
+/** @name Asynchronous I/O rings
+ *
+ * A process registers an io_ring_t living in its own memory with
+ * io_ring_setup(). Afterwards it can queue any number of operations
+ * in the submission ring and hand them to the kernel with a single
+ * io_ring_enter() call; results are posted to the completion ring,
+ * which the process reaps without further system calls.
+ *
+ * The file system layer below us is synchronous, so the kernel
+ * executes the submitted batch inside the one trap. The gain is in
+ * the number of traps, not in overlapping the transfers with user
+ * code.
+ *
+ * @{
+ */
+
+/* Is n a non-zero power of two? */
+#define IO_RING_POW2(n) ((n) != 0 && ((n) & ((n) - 1)) == 0)
+
+/**
+ * Registers the ring pointed to by ring for the current process.
+ * Only one ring per process is supported; a new call replaces the
+ * old registration. A NULL ring unregisters.
+ *
+ * @param ring Userland address of the ring structure.
+ *
+ * @return 0 on success, SYSCALL_ILLEGAL_ARGUMENT if the ring sizes
+ * are not powers of two or the entry arrays are missing.
+ */
+int io_ring_setup(io_ring_t *ring) {
+    interrupt_status_t intr_status;
+    process_table_t *process;
+
+    /* This function _should_ also test if ring is in a legal memory area */
+    if(ring != NULL &&
+       (!IO_RING_POW2(ring->sq_entries) || !IO_RING_POW2(ring->cq_entries) ||
+        ring->sqes == NULL || ring->cqes == NULL))
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process_table_slock);
+
+    process = process_get_current_process_entry();
+    process->io_ring = ring;
+
+    spinlock_release(&process_table_slock);
+    _interrupt_set_state(intr_status);
+
+    return 0;
+}
+
+/**
+ * Executes one submission queue entry.
+ *
+ * @param sqe The submission to execute.
+ *
+ * @return Number of bytes transferred or a negative error code, as
+ * the corresponding blocking syscall would return.
+ */
+static int io_ring_execute(io_sqe_t *sqe) {
+    int handle = sqe->filehandle;
+    openfile_t file;
+    int ret;
+
+    if(sqe->opcode == IO_OP_NOP)
+        return 0;
+
+    if(handle < 0 || handle >= PROCESS_MAX_FILES || sqe->length < 0)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    ret = mmap_prefault(sqe->buffer, sqe->length);
+    if(ret < 0)
+        return ret;
+
+    switch(sqe->opcode) {
+    case IO_OP_READ:
+        if(handle == FILEHANDLE_STDIN)
+            return tty_console->read(tty_console, sqe->buffer, sqe->length);
+        if(handle == FILEHANDLE_STDOUT || handle == FILEHANDLE_STDERR)
+            return SYSCALL_ILLEGAL_ARGUMENT;
+        break;
+
+    case IO_OP_WRITE:
+        if(handle == FILEHANDLE_STDOUT || handle == FILEHANDLE_STDERR)
+            return tty_console->write(tty_console, sqe->buffer, sqe->length);
+        if(handle == FILEHANDLE_STDIN)
+            return SYSCALL_ILLEGAL_ARGUMENT;
+        break;
+
+    default:
+        return SYSCALL_ILLEGAL_ARGUMENT;
+    }
+
+    file = process_get_file(handle);
+    if(file < 0)
+        return file;
+
+    /* An absolute offset leaves the file position alone */
+    if(sqe->offset == IO_OFFSET_CURRENT && sqe->opcode == IO_OP_READ)
+        ret = vfs_read(file, sqe->buffer, sqe->length);
+    else if(sqe->offset == IO_OFFSET_CURRENT)
+        ret = vfs_write(file, sqe->buffer, sqe->length);
+    else if(sqe->offset < 0)
+        ret = SYSCALL_ILLEGAL_ARGUMENT;
+    else if(sqe->opcode == IO_OP_READ)
+        ret = vfs_pread(file, sqe->buffer, sqe->length, sqe->offset);
+    else
+        ret = vfs_pwrite(file, sqe->buffer, sqe->length, sqe->offset);
+
+    vfs_close(file);
+    return ret;
+}
+
+/**
+ * Consumes up to to_submit entries from the submission ring of the
+ * current process, executes them and posts their results to the
+ * completion ring. Submission stops early if the completion ring is
+ * full, so no completion is ever lost; the caller sees this as a
+ * short submit count.
+ *
+ * @param to_submit Maximum number of submissions to consume.
+ *
+ * @param min_complete Number of completions the caller wants to be
+ * available on return. Since every submission completes before this
+ * call returns, this is only validated against the ring size.
+ *
+ * @return Number of submissions consumed, or a negative error code.
+ */
+int io_ring_enter(int to_submit, int min_complete) {
+    io_ring_t *ring = process_get_current_process_entry()->io_ring;
+    io_sqe_t *sqe;
+    io_cqe_t *cqe;
+    int submitted = 0;
+
+    if(ring == NULL)
+        return SYSCALL_NOT_OPEN;
+
+    /* The ring may live in a memory mapped file */
+    if(mmap_prefault(ring, sizeof(io_ring_t)) < 0)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    if(to_submit < 0 || min_complete < 0 ||
+       (uint32_t)min_complete > ring->cq_entries)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    while(submitted < to_submit && ring->sq_head != ring->sq_tail) {
+        /* Don't consume a submission we could not report */
+        if(ring->cq_tail - ring->cq_head >= ring->cq_entries)
+            break;
+
+        sqe = &ring->sqes[ring->sq_head & (ring->sq_entries - 1)];
+        cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+        if(mmap_prefault(sqe, sizeof(io_sqe_t)) < 0 ||
+           mmap_prefault(cqe, sizeof(io_cqe_t)) < 0)
+            break;
+
+        cqe->user_data = sqe->user_data;
+        cqe->result = io_ring_execute(sqe);
+
+        /* Publish the completion only after it has been written */
+        ring->cq_tail++;
+        ring->sq_head++;
+        submitted++;
+    }
+
+    return submitted;
+}
+
+/** @} */
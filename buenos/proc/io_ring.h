@@ -0,0 +1,67 @@
+/*
+ * Asynchronous I/O submission and completion rings.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef BUENOS_PROC_IO_RING
+#define BUENOS_PROC_IO_RING
+
+#include "lib/types.h"
+
+/* Operation codes for submission queue entries */
+#define IO_OP_NOP   0
+#define IO_OP_READ  1
+#define IO_OP_WRITE 2
+
+/* Offset value meaning "use and advance the current file position" */
+#define IO_OFFSET_CURRENT -1
+
+/* Submission queue entry, filled in by userland. */
+typedef struct {
+    /* One of IO_OP_* */
+    int opcode;
+    /* File handle as returned by syscall_open (or stdin/stdout) */
+    int filehandle;
+    /* Userland buffer to read into or write from */
+    void *buffer;
+    /* Number of bytes to transfer */
+    int length;
+    /* Absolute file offset, or IO_OFFSET_CURRENT. An absolute offset
+       does not move the file position. */
+    int offset;
+    /* Opaque value copied to the matching completion entry */
+    uint32_t user_data;
+} io_sqe_t;
+
+/* Completion queue entry, filled in by the kernel. */
+typedef struct {
+    /* user_data of the completed submission */
+    uint32_t user_data;
+    /* Bytes transferred, or a negative error code */
+    int result;
+} io_cqe_t;
+
+/* A pair of single producer / single consumer rings living in the
+ * memory of the process. Userland produces submissions (advances
+ * sq_tail) and consumes completions (advances cq_head); the kernel
+ * does the opposite. Heads and tails are free running counters, the
+ * slot is the counter masked with entries-1, so both entry counts
+ * must be powers of two. */
+typedef struct {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    uint32_t sq_entries;
+    io_sqe_t *sqes;
+
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    uint32_t cq_entries;
+    io_cqe_t *cqes;
+} io_ring_t;
+
+/* Kernel side, called from the syscall handler */
+int io_ring_setup(io_ring_t *ring);
+int io_ring_enter(int to_submit, int min_complete);
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * Buffer descriptors for vectored and positional file I/O.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef BUENOS_PROC_IOVEC
+#define BUENOS_PROC_IOVEC
+
+#include "lib/types.h"
+
+/* Maximum number of buffers in one readv or writev call */
+#define IOV_MAX 16
+
+/* One buffer of a readv or writev call. The buffers are transferred
+ * in order, as if they were one contiguous buffer. pread and pwrite
+ * pass their single buffer in one of these too. */
+typedef struct {
+    /* Userland buffer to read into or write from */
+    void *buffer;
+    /* Number of bytes to transfer */
+    int length;
+} iovec_t;
+
+#endif
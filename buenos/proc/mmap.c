@@ -0,0 +1,694 @@
+/*
+ * Memory mapped files.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#include "proc/mmap.h"
+#include "proc/process.h"
+#include "proc/syscall.h"
+#include "kernel/assert.h"
+#include "kernel/config.h"
+#include "kernel/interrupt.h"
+#include "kernel/spinlock.h"
+#include "kernel/thread.h"
+#include "fs/vfs.h"
+#include "vm/vm.h"
+#include "vm/tlb.h"
+#include "vm/pagepool.h"
+#include "lib/libc.h"
+
+extern spinlock_t process_table_slock;
+
+/** @name Memory mapped files
+ *
+ * A mapping reserves a range of the address space of a process for a
+ * part of a file, but maps no pages. Each page is read from the file
+ * when first touched, by mmap_fault() called from the TLB miss
+ * handler, so only the pages actually used cost memory and disk
+ * reads.
+ *
+ * Drivers and filesystems touch user buffers with spinlocks held, so
+ * a fault taken in kernel mode must not read the file. Syscalls pass
+ * their buffers to mmap_prefault() first, which reads in the pages
+ * from syscall context; in kernel mode mmap_fault() only maps pages
+ * already read in.
+ *
+ * Pages of writable mappings are first mapped read-only. The first
+ * store to a page traps, and the page is made writable, which also
+ * marks it dirty in the pagetable. Only dirty pages are written back.
+ *
+ * Pages of read-only mappings are shared between all read-only
+ * mappings of the same file page, found through a small table keyed
+ * by the file. They reflect the file as it was when the page was
+ * first read; writes to the file through other means do not update
+ * pages already mapped.
+ *
+ * Every page of a mapping must fit in the pagetable, which has room
+ * for only PAGETABLE_ENTRIES page pairs. mmap_map() refuses mappings
+ * that could not all be mapped at once.
+ *
+ * When a page is unmapped or made read-only, the TLBs of the other
+ * CPUs running threads of the process are shot down before the page
+ * is freed or written back.
+ *
+ * The mappings of a process are only changed by its own mmap and
+ * munmap calls. A program must not touch a mapping while another of
+ * its threads unmaps it.
+ *
+ * @{
+ */
+
+/* A file page shared by read-only mappings */
+typedef struct {
+    /* The file, as told by vfs_identify() */
+    fs_t *fs;
+    int fileid;
+
+    /* Page number in the file */
+    int page;
+
+    /* The physical page holding the data */
+    uint32_t physaddr;
+
+    /* Number of mappings of the page, 0 if this entry is unused */
+    int refs;
+} mmap_shared_t;
+
+/* Table of shared pages. */
+static struct {
+    /* Spinlock protecting the table */
+    spinlock_t slock;
+
+    mmap_shared_t pages[CONFIG_MMAP_SHARED_PAGES];
+} mmap_shared;
+
+/* Number of pages needed for length bytes */
+#define MMAP_PAGES(length) (((length) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+/**
+ * Initializes the table of shared pages.
+ */
+void mmap_init(void)
+{
+    int i;
+
+    spinlock_reset(&mmap_shared.slock);
+    for(i = 0; i < CONFIG_MMAP_SHARED_PAGES; i++)
+        mmap_shared.pages[i].refs = 0;
+}
+
+/**
+ * Takes a reference to a shared page, if the page is in the table.
+ *
+ * @param fs, fileid The file.
+ *
+ * @param page Page number in the file.
+ *
+ * @return Physical address of the page, 0 if not found.
+ */
+static uint32_t mmap_shared_get(fs_t *fs, int fileid, int page)
+{
+    interrupt_status_t intr_status;
+    uint32_t physaddr = 0;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&mmap_shared.slock);
+
+    for(i = 0; i < CONFIG_MMAP_SHARED_PAGES; i++) {
+        mmap_shared_t *shared = &mmap_shared.pages[i];
+
+        if(shared->refs > 0 && shared->fs == fs &&
+           shared->fileid == fileid && shared->page == page) {
+            shared->refs++;
+            physaddr = shared->physaddr;
+            break;
+        }
+    }
+
+    spinlock_release(&mmap_shared.slock);
+    _interrupt_set_state(intr_status);
+
+    return physaddr;
+}
+
+/**
+ * Adds a freshly read page to the table of shared pages. If another
+ * thread added the same page meanwhile, that page is used instead
+ * and the given one freed. If the table is full the page is simply
+ * not shared.
+ *
+ * @param fs, fileid The file.
+ *
+ * @param page Page number in the file.
+ *
+ * @param physaddr Physical address of the page.
+ *
+ * @return Physical address of the page to map.
+ */
+static uint32_t mmap_shared_add(fs_t *fs, int fileid, int page,
+                                uint32_t physaddr)
+{
+    interrupt_status_t intr_status;
+    mmap_shared_t *free = NULL;
+    uint32_t existing = 0;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&mmap_shared.slock);
+
+    for(i = 0; i < CONFIG_MMAP_SHARED_PAGES; i++) {
+        mmap_shared_t *shared = &mmap_shared.pages[i];
+
+        if(shared->refs == 0) {
+            if(free == NULL)
+                free = shared;
+        } else if(shared->fs == fs && shared->fileid == fileid &&
+                  shared->page == page) {
+            shared->refs++;
+            existing = shared->physaddr;
+            break;
+        }
+    }
+
+    if(existing == 0 && free != NULL) {
+        free->fs = fs;
+        free->fileid = fileid;
+        free->page = page;
+        free->physaddr = physaddr;
+        free->refs = 1;
+    }
+
+    spinlock_release(&mmap_shared.slock);
+    _interrupt_set_state(intr_status);
+
+    if(existing != 0) {
+        pagepool_free_phys_page(physaddr);
+        return existing;
+    }
+    return physaddr;
+}
+
+/**
+ * Drops a mapping of a page. Shared pages are freed when their last
+ * mapping goes, other pages right away.
+ *
+ * @param physaddr Physical address of the page.
+ */
+static void mmap_release(uint32_t physaddr)
+{
+    interrupt_status_t intr_status;
+    int free = 1;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&mmap_shared.slock);
+
+    for(i = 0; i < CONFIG_MMAP_SHARED_PAGES; i++) {
+        mmap_shared_t *shared = &mmap_shared.pages[i];
+
+        if(shared->refs > 0 && shared->physaddr == physaddr) {
+            shared->refs--;
+            free = (shared->refs == 0);
+            break;
+        }
+    }
+
+    spinlock_release(&mmap_shared.slock);
+    _interrupt_set_state(intr_status);
+
+    if(free)
+        pagepool_free_phys_page(physaddr);
+}
+
+/**
+ * Finds the mapping of the current process containing given address.
+ *
+ * @param vaddr The address.
+ *
+ * @return The mapping, or NULL if the address is not mapped.
+ */
+static mmap_region_t *mmap_find(uint32_t vaddr)
+{
+    process_table_t *process = process_get_current_process_entry();
+    int i;
+
+    for(i = 0; i < MMAP_MAX_REGIONS; i++) {
+        mmap_region_t *region = &process->mmaps[i];
+
+        if(region->start != 0 && vaddr >= region->start &&
+           vaddr < region->start + MMAP_PAGES(region->length) * PAGE_SIZE)
+            return region;
+    }
+
+    return NULL;
+}
+
+/**
+ * Counts the pagetable entries the current process may need: the
+ * entries in use outside the mapping area, and enough for all pages
+ * of every mapping. Called with process_table_slock held.
+ *
+ * @param pagetable Pagetable of the process.
+ *
+ * @return Number of entries.
+ */
+static uint32_t mmap_entries_needed(pagetable_t *pagetable)
+{
+    process_table_t *process = process_get_current_process_entry();
+    uint32_t needed = 0;
+    uint32_t vaddr;
+    uint32_t i;
+
+    for(i = 0; i < pagetable->valid_count; i++) {
+        vaddr = pagetable->entries[i].VPN2 << 13;
+        if(vaddr < MMAP_AREA_START || vaddr >= MMAP_AREA_END)
+            needed++;
+    }
+
+    /* A mapping of n pages spans at most n / 2 + 1 page pairs */
+    for(i = 0; i < MMAP_MAX_REGIONS; i++) {
+        if(process->mmaps[i].start != 0)
+            needed += MMAP_PAGES(process->mmaps[i].length) / 2 + 1;
+    }
+
+    return needed;
+}
+
+/**
+ * Reads a page of a mapping from its file, or finds it among the
+ * shared pages. May sleep.
+ *
+ * @param region The mapping.
+ *
+ * @param offset Offset of the page in the mapping.
+ *
+ * @return Physical address of the page, 0 on failure.
+ */
+static uint32_t mmap_page_in(mmap_region_t *region, int offset)
+{
+    interrupt_status_t intr_status;
+    int shared = !(region->flags & MMAP_WRITE);
+    int count = MIN(PAGE_SIZE, region->length - offset);
+    int page = (region->offset + offset) / PAGE_SIZE;
+    uint32_t physaddr;
+    fs_t *fs = NULL;
+    int fileid = 0;
+    int ret;
+
+    if(shared) {
+        vfs_identify(region->file, &fs, &fileid);
+        physaddr = mmap_shared_get(fs, fileid, page);
+        if(physaddr != 0)
+            return physaddr;
+    }
+
+    physaddr = pagepool_get_phys_page();
+    if(physaddr == 0)
+        return 0;
+
+    /* The fault handlers run with interrupts disabled, but reading
+       the file needs them. */
+    intr_status = _interrupt_enable();
+    ret = vfs_pread(region->file, (void *)ADDR_PHYS_TO_KERNEL(physaddr),
+                    count, region->offset + offset);
+    _interrupt_set_state(intr_status);
+
+    if(ret < 0) {
+        pagepool_free_phys_page(physaddr);
+        return 0;
+    }
+
+    /* The part past the end of the file reads as zeros */
+    memoryset((void *)(ADDR_PHYS_TO_KERNEL(physaddr) + ret), 0,
+              PAGE_SIZE - ret);
+
+    if(shared)
+        physaddr = mmap_shared_add(fs, fileid, page, physaddr);
+
+    return physaddr;
+}
+
+/**
+ * Writes a page of a writable mapping back to its file.
+ *
+ * @param region The mapping.
+ *
+ * @param offset Offset of the page in the mapping.
+ *
+ * @param physaddr Physical address of the page.
+ *
+ * @return Number of bytes written, or a negative error code.
+ */
+static int mmap_write_back(mmap_region_t *region, int offset,
+                           uint32_t physaddr)
+{
+    return vfs_pwrite(region->file, (void *)ADDR_PHYS_TO_KERNEL(physaddr),
+                      MIN(PAGE_SIZE, region->length - offset),
+                      region->offset + offset);
+}
+
+/**
+ * Handles a TLB exception on an address that is not in the pagetable,
+ * or a store to a read-only page. If the address belongs to a mapping
+ * of the current process, the page is read in and mapped, or made
+ * writable.
+ *
+ * @param vaddr The faulting address.
+ *
+ * @param write 1 if the access was a store.
+ *
+ * @param sleep 1 if the page may be read from the file, which sleeps.
+ * 0 when the caller may hold spinlocks; then only the access rights
+ * of a mapped page are changed.
+ *
+ * @return 1 if the page is now mapped for the access, 0 if the
+ * access is illegal or the page would have to be read.
+ */
+int mmap_fault(uint32_t vaddr, int write, int sleep)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    interrupt_status_t intr_status;
+    mmap_region_t *region;
+    uint32_t page = vaddr & PAGE_SIZE_MASK;
+    uint32_t physaddr;
+    uint32_t mapped;
+    int dirty;
+    int ret;
+
+    region = mmap_find(vaddr);
+    if(region == NULL || (write && !(region->flags & MMAP_WRITE)))
+        return 0;
+
+    /* A first store to a page already read in */
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process_table_slock);
+    if(vm_get_mapping(pagetable, page, &mapped, &dirty)) {
+        if(write)
+            vm_set_dirty(pagetable, page, 1);
+        spinlock_release(&process_table_slock);
+        _interrupt_set_state(intr_status);
+        return 1;
+    }
+    spinlock_release(&process_table_slock);
+    _interrupt_set_state(intr_status);
+
+    if(!sleep)
+        return 0;
+
+    physaddr = mmap_page_in(region, page - region->start);
+    if(physaddr == 0)
+        return 0;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process_table_slock);
+    if(vm_get_mapping(pagetable, page, &mapped, &dirty)) {
+        /* Another thread of the process read the page meanwhile */
+        if(write)
+            vm_set_dirty(pagetable, page, 1);
+        ret = 1;
+    } else if(pagetable->valid_count < PAGETABLE_ENTRIES ||
+              vm_get_mapping(pagetable, page ^ PAGE_SIZE, &mapped, &dirty)) {
+        vm_map(pagetable, physaddr, page, write);
+        physaddr = 0;
+        ret = 1;
+    } else {
+        /* mmap_map() leaves room for the pages of all mappings, but
+           other mappings may have been added since */
+        ret = 0;
+    }
+    spinlock_release(&process_table_slock);
+    _interrupt_set_state(intr_status);
+
+    if(physaddr != 0)
+        mmap_release(physaddr);
+
+    return ret;
+}
+
+/**
+ * Reads in the pages of memory mappings in a user buffer, so that a
+ * syscall can pass the buffer to code that must not sleep in a page
+ * fault. Parts of the buffer outside the mappings are left alone.
+ * Called from syscall context.
+ *
+ * @param buffer Userland address of the buffer.
+ *
+ * @param length Length of the buffer in bytes.
+ *
+ * @return 0 on success, or a negative error code if a page could not
+ * be read.
+ */
+int mmap_prefault(void *buffer, int length)
+{
+    uint32_t start = (uint32_t)buffer;
+    uint32_t end;
+    uint32_t page;
+
+    if(length <= 0 || start >= MMAP_AREA_END)
+        return 0;
+
+    /* Both are below 2GB, so the sum can't wrap */
+    end = MIN(start + length, MMAP_AREA_END);
+
+    for(page = MAX(start, MMAP_AREA_START) & PAGE_SIZE_MASK; page < end;
+        page += PAGE_SIZE) {
+        if(mmap_find(page) != NULL && !mmap_fault(page, 0, 1))
+            return SYSCALL_ILLEGAL_ARGUMENT;
+    }
+
+    return 0;
+}
+
+/**
+ * Maps a file into the address space of the current process. No
+ * pages are read until they are touched.
+ *
+ * @param filehandle File descriptor of the file.
+ *
+ * @param args Offset, length and flags of the mapping.
+ *
+ * @return Address of the mapping, or a negative error code.
+ */
+int mmap_map(int filehandle, mmap_args_t *args)
+{
+    process_table_t *process = process_get_current_process_entry();
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    interrupt_status_t intr_status;
+    mmap_region_t *region = NULL;
+    openfile_t file;
+    uint32_t start = MMAP_AREA_START;
+    uint32_t size;
+    int fits;
+    int moved;
+    int i;
+
+    /* This function _should_ also test if args is in a legal memory area */
+    if(args == NULL || args->length <= 0 || args->offset < 0 ||
+       args->offset % PAGE_SIZE != 0 || (args->flags & ~MMAP_WRITE) != 0 ||
+       MMAP_PAGES(args->length) > (MMAP_AREA_END - MMAP_AREA_START) / PAGE_SIZE)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    size = MMAP_PAGES(args->length) * PAGE_SIZE;
+
+    /* The mapping keeps its own reference to the file, so it stays
+       valid after the descriptor is closed. */
+    file = process_get_file(filehandle);
+    if(file < 0)
+        return file;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process_table_slock);
+
+    fits = (mmap_entries_needed(pagetable) + MMAP_PAGES(args->length) / 2 + 1
+            <= PAGETABLE_ENTRIES);
+
+    /* Find a free entry and the lowest free range that fits */
+    do {
+        moved = 0;
+        for(i = 0; i < MMAP_MAX_REGIONS; i++) {
+            mmap_region_t *other = &process->mmaps[i];
+            uint32_t end = other->start + MMAP_PAGES(other->length) * PAGE_SIZE;
+
+            if(other->start == 0) {
+                if(region == NULL)
+                    region = other;
+            } else if(start < end && other->start < start + size) {
+                start = end;
+                moved = 1;
+            }
+        }
+    } while(moved);
+
+    if(fits && region != NULL && start + size <= MMAP_AREA_END) {
+        region->length = args->length;
+        region->offset = args->offset;
+        region->flags = args->flags;
+        region->file = file;
+        region->start = start;
+    } else {
+        start = 0;
+    }
+
+    spinlock_release(&process_table_slock);
+    _interrupt_set_state(intr_status);
+
+    if(start == 0) {
+        vfs_close(file);
+        return SYSCALL_OPERATION_NOT_POSSIBLE;
+    }
+
+    return start;
+}
+
+/**
+ * Writes the dirty pages of a writable mapping back to its file. The
+ * pages are made read-only again first, so that later stores are
+ * noticed.
+ *
+ * @param region The mapping.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+static int mmap_sync_region(mmap_region_t *region)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    interrupt_status_t intr_status;
+    uint32_t physaddr;
+    uint32_t page;
+    int result = 0;
+    int dirty;
+    int mapped;
+    int ret;
+    int i;
+
+    for(i = 0; i < MMAP_PAGES(region->length); i++) {
+        page = region->start + i * PAGE_SIZE;
+
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&process_table_slock);
+        mapped = vm_get_mapping(pagetable, page, &physaddr, &dirty);
+        if(mapped && dirty) {
+            vm_set_dirty(pagetable, page, 0);
+            tlb_update(pagetable, page);
+        }
+        spinlock_release(&process_table_slock);
+        _interrupt_set_state(intr_status);
+
+        if(mapped && dirty) {
+            /* Stores on other CPUs after the write back must fault */
+            tlb_shootdown(pagetable);
+            ret = mmap_write_back(region, i * PAGE_SIZE, physaddr);
+            if(ret < 0 && result == 0)
+                result = ret;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Writes the dirty pages of all writable mappings of the current
+ * process back to their files.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int mmap_sync(void)
+{
+    process_table_t *process = process_get_current_process_entry();
+    int result = 0;
+    int ret;
+    int i;
+
+    for(i = 0; i < MMAP_MAX_REGIONS; i++) {
+        if(process->mmaps[i].start != 0 &&
+           (process->mmaps[i].flags & MMAP_WRITE)) {
+            ret = mmap_sync_region(&process->mmaps[i]);
+            if(ret < 0 && result == 0)
+                result = ret;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Removes a mapping of the current process. Dirty pages are written
+ * back to the file.
+ *
+ * @param addr Address of the mapping, as returned by mmap_map().
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int mmap_unmap(uint32_t addr)
+{
+    process_table_t *process = process_get_current_process_entry();
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    interrupt_status_t intr_status;
+    mmap_region_t *region = NULL;
+    uint32_t physaddr;
+    uint32_t page;
+    int result = 0;
+    int dirty;
+    int mapped;
+    int ret;
+    int i;
+
+    for(i = 0; i < MMAP_MAX_REGIONS; i++) {
+        if(addr != 0 && process->mmaps[i].start == addr)
+            region = &process->mmaps[i];
+    }
+
+    if(region == NULL)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    for(i = 0; i < MMAP_PAGES(region->length); i++) {
+        page = region->start + i * PAGE_SIZE;
+
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&process_table_slock);
+        mapped = vm_get_mapping(pagetable, page, &physaddr, &dirty);
+        if(mapped) {
+            vm_unmap(pagetable, page);
+            tlb_update(pagetable, page);
+        }
+        spinlock_release(&process_table_slock);
+        _interrupt_set_state(intr_status);
+
+        if(!mapped)
+            continue;
+
+        /* The page must be out of every TLB before it is freed */
+        tlb_shootdown(pagetable);
+
+        if(dirty) {
+            ret = mmap_write_back(region, i * PAGE_SIZE, physaddr);
+            if(ret < 0 && result == 0)
+                result = ret;
+        }
+        mmap_release(physaddr);
+    }
+
+    region->start = 0;
+    vfs_close(region->file);
+
+    return result;
+}
+
+/**
+ * Removes all mappings of the current process. Called when the last
+ * thread of the process exits.
+ */
+void mmap_unmap_all(void)
+{
+    process_table_t *process = process_get_current_process_entry();
+    int i;
+
+    for(i = 0; i < MMAP_MAX_REGIONS; i++) {
+        if(process->mmaps[i].start != 0)
+            mmap_unmap(process->mmaps[i].start);
+    }
+}
+
+/** @} */
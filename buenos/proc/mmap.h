@@ -0,0 +1,45 @@
+/*
+ * Memory mapped files.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef BUENOS_PROC_MMAP
+#define BUENOS_PROC_MMAP
+
+#include "lib/types.h"
+
+/* Mapping flag: the mapping is writable and changed pages are written
+ * back to the file on munmap, sync and exit. Without it the mapping
+ * is read-only and its pages are shared with the read-only mappings
+ * of the same file in other processes. */
+#define MMAP_WRITE 0x1
+
+/* Mappings are placed in this range of the address space */
+#define MMAP_AREA_START 0x40000000
+#define MMAP_AREA_END   0x60000000
+
+/* Maximum number of mappings in one process */
+#define MMAP_MAX_REGIONS 8
+
+/* Arguments of the mmap syscall, which don't all fit in registers. */
+typedef struct {
+    /* File offset of the start of the mapping, a multiple of the
+       page size */
+    int offset;
+    /* Length of the mapping in bytes */
+    int length;
+    /* MMAP_* flags */
+    int flags;
+} mmap_args_t;
+
+/* Kernel side */
+void mmap_init(void);
+int mmap_map(int filehandle, mmap_args_t *args);
+int mmap_unmap(uint32_t addr);
+int mmap_sync(void);
+void mmap_unmap_all(void);
+int mmap_fault(uint32_t vaddr, int write, int sleep);
+int mmap_prefault(void *buffer, int length);
+
+#endif
@@ -0,0 +1,704 @@
+/*
+ * Readiness polling.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#include "proc/poll.h"
+#include "proc/mmap.h"
+#include "proc/process.h"
+#include "proc/syscall.h"
+#include "net/socket.h"
+#include "fs/vfs.h"
+#include "kernel/assert.h"
+#include "kernel/config.h"
+#include "kernel/interrupt.h"
+#include "kernel/sleepq.h"
+#include "kernel/spinlock.h"
+#include "kernel/thread.h"
+#include "kernel/timeout.h"
+#include "lib/libc.h"
+
+/** @name Readiness polling
+ *
+ * A thread sleeps on one sleep queue resource at a time, so it cannot
+ * wait on several objects directly. Instead every object that can
+ * become ready (the tty and sockets) has a pollq, a list of poll
+ * entries. Each entry belongs to a poll set, and a thread waiting for
+ * any entry of a set sleeps on the set. When an object may have
+ * become ready it calls poll_notify(), which moves its entries to the
+ * ready lists of their sets and wakes the waiters of the sets.
+ *
+ * Entries on a ready list are only candidates: the waiter asks each
+ * object for its current state, reports the entries that really are
+ * ready and puts them back at the end of the list (level triggered),
+ * dropping the others until their object notifies again. A wait thus
+ * costs time in proportion to the number of ready entries, not the
+ * size of the set. Objects that never block, like plain files, have
+ * no pollq and simply stay on the ready list.
+ *
+ * A persistent set made with pollset_create() keeps its entries
+ * registered between waits; poll_fds() builds a set on the stack for
+ * one call.
+ *
+ * All pollqs, entries and sets are protected by one spinlock, which
+ * is taken inside the locks of the objects calling poll_notify(), so
+ * objects are never asked for their state with it held.
+ *
+ * @{
+ */
+
+/* One polled object in a set */
+typedef struct poll_entry_struct {
+    /* Set of the entry */
+    struct pollset_struct *set;
+    /* The entry is in use, entries of persistent sets may be free */
+    int used;
+    /* What is polled, see poll_fd_t */
+    int type;
+    int id;
+    int events;
+    /* pollq the entry is registered on, NULL if none */
+    pollq_t *pollq;
+    /* Next entry on the same pollq */
+    struct poll_entry_struct *next;
+    /* The entry is on the ready list of its set, linked by ready_next */
+    int ready;
+    struct poll_entry_struct *ready_next;
+} poll_entry_t;
+
+/* A set of polled objects */
+typedef struct pollset_struct {
+    /* Owning process, -1 if this persistent set is free */
+    process_id_t owner;
+    poll_entry_t *entries;
+    int nentries;
+    /* Entries that may be ready, in the order they became so */
+    poll_entry_t *ready_head;
+    poll_entry_t *ready_tail;
+} pollset_t;
+
+/* Time limit of one wait on a set, see poll_wait_set() */
+typedef struct {
+    timeout_t timeout;
+    pollset_t *set;
+    /* Set by the timeout, protected by poll_slock */
+    int expired;
+} poll_timer_t;
+
+static spinlock_t poll_slock;
+
+/* Persistent sets */
+static pollset_t pollsets[CONFIG_MAX_POLLSETS];
+static poll_entry_t pollset_entries[CONFIG_MAX_POLLSETS][CONFIG_POLLSET_SIZE];
+
+/**
+ * Initializes the table of persistent sets.
+ */
+void poll_init(void)
+{
+    int i, j;
+
+    KERNEL_ASSERT(POLL_MAX_FDS <= CONFIG_POLLSET_SIZE);
+
+    spinlock_reset(&poll_slock);
+    for(i = 0; i < CONFIG_MAX_POLLSETS; i++) {
+        pollsets[i].owner = -1;
+        pollsets[i].entries = pollset_entries[i];
+        pollsets[i].nentries = CONFIG_POLLSET_SIZE;
+        pollsets[i].ready_head = NULL;
+        pollsets[i].ready_tail = NULL;
+
+        for(j = 0; j < CONFIG_POLLSET_SIZE; j++) {
+            pollset_entries[i][j].set = &pollsets[i];
+            pollset_entries[i][j].used = 0;
+            pollset_entries[i][j].pollq = NULL;
+            pollset_entries[i][j].ready = 0;
+        }
+    }
+}
+
+/**
+ * Initializes the pollq of an object.
+ */
+void pollq_init(pollq_t *pollq)
+{
+    pollq->head = NULL;
+}
+
+/**
+ * Appends an entry to the ready list of its set, if not there yet,
+ * and wakes the threads waiting on the set. poll_slock must be held.
+ */
+static void poll_mark_ready(poll_entry_t *entry)
+{
+    pollset_t *set = entry->set;
+
+    if(entry->ready)
+        return;
+
+    entry->ready = 1;
+    entry->ready_next = NULL;
+    if(set->ready_tail != NULL)
+        set->ready_tail->ready_next = entry;
+    else
+        set->ready_head = entry;
+    set->ready_tail = entry;
+
+    sleepq_wake_all(set);
+}
+
+/**
+ * Removes an entry from the ready list of its set. poll_slock must be
+ * held.
+ */
+static void poll_unready(poll_entry_t *entry)
+{
+    pollset_t *set = entry->set;
+    poll_entry_t **link, *prev = NULL;
+
+    if(!entry->ready)
+        return;
+
+    for(link = &set->ready_head; *link != entry; link = &(*link)->ready_next)
+        prev = *link;
+    *link = entry->ready_next;
+    if(set->ready_tail == entry)
+        set->ready_tail = prev;
+
+    entry->ready = 0;
+}
+
+/**
+ * Tells the waiters of an object that some of its events may have
+ * become ready. Called by the object, usually with its own lock held.
+ *
+ * @param pollq The pollq of the object.
+ */
+void poll_notify(pollq_t *pollq)
+{
+    interrupt_status_t intr_status;
+    poll_entry_t *entry;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&poll_slock);
+
+    for(entry = pollq->head; entry != NULL; entry = entry->next)
+        poll_mark_ready(entry);
+
+    spinlock_release(&poll_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Unregisters all waiters of an object that is going away, waking
+ * them up so they find out. Entries stay in their sets until removed.
+ *
+ * @param pollq The pollq of the object.
+ */
+void poll_detach(pollq_t *pollq)
+{
+    interrupt_status_t intr_status;
+    poll_entry_t *entry;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&poll_slock);
+
+    for(entry = pollq->head; entry != NULL; entry = entry->next) {
+        entry->pollq = NULL;
+        poll_mark_ready(entry);
+    }
+    pollq->head = NULL;
+
+    spinlock_release(&poll_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Asks an object for the events that are ready now.
+ *
+ * @param type, id The object, see poll_fd_t.
+ *
+ * @param pollq The pollq of the object is stored here, NULL if it
+ * never blocks.
+ *
+ * @return The ready POLL_* events.
+ */
+static int poll_source(int type, int id, pollq_t **pollq)
+{
+    openfile_t file;
+    int events;
+
+    *pollq = NULL;
+
+    switch(type) {
+    case POLL_TYPE_FILE:
+        if(id == FILEHANDLE_STDIN || id == FILEHANDLE_STDOUT ||
+           id == FILEHANDLE_STDERR) {
+            if(tty_console->poll == NULL)
+                events = POLL_IN | POLL_OUT;
+            else
+                events = tty_console->poll(tty_console, pollq);
+            return events & (id == FILEHANDLE_STDIN ? POLL_IN : POLL_OUT);
+        }
+
+        /* Reading and writing files never waits for other parties */
+        file = process_get_file(id);
+        if(file < 0)
+            return POLL_NVAL;
+        vfs_close(file);
+        return POLL_IN | POLL_OUT;
+
+    case POLL_TYPE_SOCKET:
+        return socket_poll(id, pollq);
+
+    default:
+        return POLL_NVAL;
+    }
+}
+
+/**
+ * Registers a filled in entry on the pollq of its object and puts it
+ * on the ready list, so the next wait checks it.
+ */
+static void poll_register(poll_entry_t *entry)
+{
+    interrupt_status_t intr_status;
+    pollq_t *pollq;
+
+    poll_source(entry->type, entry->id, &pollq);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&poll_slock);
+
+    entry->pollq = pollq;
+    if(pollq != NULL) {
+        entry->next = pollq->head;
+        pollq->head = entry;
+    }
+    poll_mark_ready(entry);
+
+    spinlock_release(&poll_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Unregisters an entry and frees it.
+ */
+static void poll_unregister(poll_entry_t *entry)
+{
+    interrupt_status_t intr_status;
+    poll_entry_t **link;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&poll_slock);
+
+    if(entry->pollq != NULL) {
+        for(link = &entry->pollq->head; *link != entry;
+            link = &(*link)->next)
+            ;
+        *link = entry->next;
+        entry->pollq = NULL;
+    }
+    poll_unready(entry);
+    entry->used = 0;
+
+    spinlock_release(&poll_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Ends a timed wait on a set. Called from the timer interrupt, so
+ * the timeout lock is taken before poll_slock; timeouts are never set
+ * or cancelled with poll_slock held.
+ */
+static void poll_timer_expired(void *arg)
+{
+    poll_timer_t *timer = arg;
+
+    spinlock_acquire(&poll_slock);
+    timer->expired = 1;
+    sleepq_wake_all(timer->set);
+    spinlock_release(&poll_slock);
+}
+
+/**
+ * Waits until some entries of a set are ready.
+ *
+ * @param set The set.
+ *
+ * @param found, revents The ready entries and their ready events are
+ * stored here.
+ *
+ * @param max Size of found and revents.
+ *
+ * @param timeout Milliseconds to wait, 0 for not at all and negative
+ * for no limit. A limit is kept by a timeout that wakes the set.
+ *
+ * @return The number of ready entries, or a negative error code if
+ * the set was closed.
+ */
+static int poll_wait_set(pollset_t *set, poll_entry_t **found,
+                         int *revents, int max, int timeout)
+{
+    interrupt_status_t intr_status;
+    poll_entry_t *taken[CONFIG_POLLSET_SIZE];
+    poll_entry_t *entry;
+    pollq_t *pollq;
+    poll_timer_t timer;
+    int n, nfound, ready, i, armed = 0;
+
+    timer.set = set;
+    timer.expired = 0;
+    timer.timeout.pending = 0;
+
+    for(;;) {
+        /* Take the candidates; each entry is on the list once */
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&poll_slock);
+
+        if(set->owner < 0) {
+            spinlock_release(&poll_slock);
+            _interrupt_set_state(intr_status);
+            nfound = SYSCALL_NOT_OPEN;
+            break;
+        }
+
+        n = 0;
+        while(set->ready_head != NULL) {
+            entry = set->ready_head;
+            set->ready_head = entry->ready_next;
+            entry->ready = 0;
+            taken[n++] = entry;
+        }
+        set->ready_tail = NULL;
+
+        spinlock_release(&poll_slock);
+        _interrupt_set_state(intr_status);
+
+        /* Check them without the lock, keeping the ready ones */
+        nfound = 0;
+        for(i = 0; i < n; i++) {
+            entry = taken[i];
+            ready = poll_source(entry->type, entry->id, &pollq) &
+                (entry->events | POLL_HUP | POLL_NVAL);
+            if(ready == 0)
+                continue;
+
+            intr_status = _interrupt_disable();
+            spinlock_acquire(&poll_slock);
+
+            /* It may have been removed meanwhile */
+            if(entry->used) {
+                poll_mark_ready(entry);
+                if(nfound < max) {
+                    found[nfound] = entry;
+                    revents[nfound] = ready;
+                    nfound++;
+                }
+            }
+
+            spinlock_release(&poll_slock);
+            _interrupt_set_state(intr_status);
+        }
+
+        if(nfound > 0 || timeout == 0)
+            break;
+
+        /* Start the clock before the first sleep */
+        if(timeout > 0 && !armed) {
+            timeout_set(&timer.timeout, timeout, poll_timer_expired,
+                        &timer);
+            armed = 1;
+        }
+
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&poll_slock);
+
+        if(set->ready_head != NULL) {
+            spinlock_release(&poll_slock);
+        } else if(timer.expired) {
+            spinlock_release(&poll_slock);
+            _interrupt_set_state(intr_status);
+            break;
+        } else {
+            sleepq_add(set);
+            spinlock_release(&poll_slock);
+            thread_switch();
+        }
+
+        _interrupt_set_state(intr_status);
+    }
+
+    timeout_cancel(&timer.timeout);
+    return nfound;
+}
+
+/**
+ * Waits until some of the given descriptors are ready. Handles
+ * syscall_poll.
+ *
+ * @param fds The descriptors. revents is filled in for each.
+ *
+ * @param nfds Number of descriptors, at most POLL_MAX_FDS.
+ *
+ * @param timeout Milliseconds to wait, 0 for not at all and negative
+ * for no limit.
+ *
+ * @return The number of ready descriptors, or a negative error code.
+ */
+int poll_fds(poll_fd_t *fds, int nfds, int timeout)
+{
+    pollset_t set;
+    poll_entry_t entries[POLL_MAX_FDS];
+    poll_entry_t *found[POLL_MAX_FDS];
+    int revents[POLL_MAX_FDS];
+    int n, i;
+
+    if(fds == NULL || nfds < 1 || nfds > POLL_MAX_FDS ||
+       mmap_prefault(fds, nfds * sizeof(poll_fd_t)) < 0)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    set.owner = process_get_current_process();
+    set.entries = entries;
+    set.nentries = nfds;
+    set.ready_head = NULL;
+    set.ready_tail = NULL;
+
+    for(i = 0; i < nfds; i++) {
+        entries[i].set = &set;
+        entries[i].used = 1;
+        entries[i].type = fds[i].type;
+        entries[i].id = fds[i].id;
+        entries[i].events = fds[i].events;
+        entries[i].pollq = NULL;
+        entries[i].ready = 0;
+        fds[i].revents = 0;
+        poll_register(&entries[i]);
+    }
+
+    n = poll_wait_set(&set, found, revents, nfds, timeout);
+    for(i = 0; i < n; i++)
+        fds[found[i] - entries].revents = revents[i];
+
+    for(i = 0; i < nfds; i++)
+        poll_unregister(&entries[i]);
+
+    return n;
+}
+
+/**
+ * Creates a persistent set for the current process. Handles
+ * syscall_pollset_create.
+ *
+ * @return The set, or a negative error code if all are in use.
+ */
+int pollset_create(void)
+{
+    interrupt_status_t intr_status;
+    int set = SYSCALL_OPERATION_NOT_POSSIBLE;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&poll_slock);
+
+    for(i = 0; i < CONFIG_MAX_POLLSETS; i++) {
+        if(pollsets[i].owner < 0) {
+            pollsets[i].owner = process_get_current_process();
+            pollsets[i].ready_head = NULL;
+            pollsets[i].ready_tail = NULL;
+            set = i;
+            break;
+        }
+    }
+
+    spinlock_release(&poll_slock);
+    _interrupt_set_state(intr_status);
+
+    return set;
+}
+
+/**
+ * Looks up a persistent set of the current process.
+ *
+ * @return The set, NULL if set is not one.
+ */
+static pollset_t *pollset_get(int set)
+{
+    if(set < 0 || set >= CONFIG_MAX_POLLSETS ||
+       pollsets[set].owner != process_get_current_process())
+        return NULL;
+    return &pollsets[set];
+}
+
+/**
+ * Adds, modifies or removes a descriptor of a persistent set. Handles
+ * syscall_pollset_ctl.
+ *
+ * @param set The set.
+ *
+ * @param op POLLSET_ADD, POLLSET_MODIFY or POLLSET_REMOVE.
+ *
+ * @param fd The descriptor, identified by type and id. events is
+ * used by POLLSET_ADD and POLLSET_MODIFY.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int pollset_ctl(int set, int op, poll_fd_t *fd)
+{
+    interrupt_status_t intr_status;
+    pollset_t *s = pollset_get(set);
+    poll_entry_t *entry = NULL, *free = NULL;
+    pollq_t *pollq;
+    int ret = 0;
+    int i;
+
+    if(s == NULL || fd == NULL)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    if(op == POLLSET_ADD &&
+       (poll_source(fd->type, fd->id, &pollq) & POLL_NVAL))
+        return SYSCALL_NOT_OPEN;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&poll_slock);
+
+    for(i = 0; i < s->nentries; i++) {
+        if(!s->entries[i].used) {
+            if(free == NULL)
+                free = &s->entries[i];
+        } else if(s->entries[i].type == fd->type &&
+                  s->entries[i].id == fd->id) {
+            entry = &s->entries[i];
+        }
+    }
+
+    switch(op) {
+    case POLLSET_ADD:
+        if(entry != NULL) {
+            ret = SYSCALL_ILLEGAL_ARGUMENT;
+        } else if(free == NULL) {
+            ret = SYSCALL_OPERATION_NOT_POSSIBLE;
+        } else {
+            /* Reserve it, registering is done without the lock */
+            free->used = 1;
+            free->type = fd->type;
+            free->id = fd->id;
+            free->events = fd->events;
+        }
+        break;
+
+    case POLLSET_MODIFY:
+        if(entry == NULL) {
+            ret = SYSCALL_NOT_OPEN;
+        } else {
+            entry->events = fd->events;
+            poll_mark_ready(entry);
+        }
+        break;
+
+    case POLLSET_REMOVE:
+        if(entry == NULL)
+            ret = SYSCALL_NOT_OPEN;
+        break;
+
+    default:
+        ret = SYSCALL_ILLEGAL_ARGUMENT;
+    }
+
+    spinlock_release(&poll_slock);
+    _interrupt_set_state(intr_status);
+
+    if(ret == 0 && op == POLLSET_ADD)
+        poll_register(free);
+    else if(ret == 0 && op == POLLSET_REMOVE)
+        poll_unregister(entry);
+
+    return ret;
+}
+
+/**
+ * Waits until some descriptors of a persistent set are ready. Any
+ * number of threads of the process may wait on the same set. Handles
+ * syscall_pollset_wait.
+ *
+ * @param set The set.
+ *
+ * @param args Where to store the ready descriptors and how long to
+ * wait.
+ *
+ * @return The number of ready descriptors stored, or a negative error
+ * code.
+ */
+int pollset_wait(int set, poll_wait_args_t *args)
+{
+    pollset_t *s = pollset_get(set);
+    poll_entry_t *found[CONFIG_POLLSET_SIZE];
+    int revents[CONFIG_POLLSET_SIZE];
+    int n, i;
+
+    if(s == NULL || args == NULL || args->events == NULL || args->max < 1 ||
+       mmap_prefault(args->events,
+                     MIN(args->max, CONFIG_POLLSET_SIZE) * sizeof(poll_fd_t)) < 0)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    n = poll_wait_set(s, found, revents,
+                      MIN(args->max, CONFIG_POLLSET_SIZE), args->timeout);
+
+    for(i = 0; i < n; i++) {
+        args->events[i].type = found[i]->type;
+        args->events[i].id = found[i]->id;
+        args->events[i].events = found[i]->events;
+        args->events[i].revents = revents[i];
+    }
+
+    return n;
+}
+
+/**
+ * Closes a persistent set. Threads waiting on it return an error.
+ * Handles syscall_pollset_close.
+ *
+ * @param set The set.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int pollset_close(int set)
+{
+    interrupt_status_t intr_status;
+    pollset_t *s = pollset_get(set);
+    int i;
+
+    if(s == NULL)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    for(i = 0; i < s->nentries; i++) {
+        if(s->entries[i].used)
+            poll_unregister(&s->entries[i]);
+    }
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&poll_slock);
+    s->owner = -1;
+    sleepq_wake_all(s);
+    spinlock_release(&poll_slock);
+    _interrupt_set_state(intr_status);
+
+    return 0;
+}
+
+/**
+ * Closes all persistent sets of the current process. Called when the
+ * last thread of the process finishes.
+ */
+void pollset_close_all(void)
+{
+    int i;
+
+    for(i = 0; i < CONFIG_MAX_POLLSETS; i++) {
+        if(pollset_get(i) != NULL)
+            pollset_close(i);
+    }
+}
+
+/** @} */
@@ -0,0 +1,77 @@
+/*
+ * Readiness polling.
+ *
+ * Copyright (C) 2011 The noobs
+ */
+
+#ifndef BUENOS_PROC_POLL
+#define BUENOS_PROC_POLL
+
+#include "lib/types.h"
+
+/* Events. POLL_HUP and POLL_NVAL are reported even if not asked for. */
+#define POLL_IN   0x1 /* reading would not block */
+#define POLL_OUT  0x2 /* writing would not block */
+#define POLL_HUP  0x4 /* closed or not connected */
+#define POLL_NVAL 0x8 /* no such descriptor or socket */
+
+/* What the id of a poll_fd_t refers to */
+#define POLL_TYPE_FILE   0 /* file descriptor, including the console */
+#define POLL_TYPE_SOCKET 1 /* socket (sock_t) */
+
+/* Maximum number of descriptors in one syscall_poll */
+#define POLL_MAX_FDS 16
+
+/* Operations of syscall_pollset_ctl */
+#define POLLSET_ADD    1
+#define POLLSET_MODIFY 2
+#define POLLSET_REMOVE 3
+
+/* One polled descriptor */
+typedef struct {
+    /* POLL_TYPE_* */
+    int type;
+    /* File descriptor or socket */
+    int id;
+    /* POLL_* events to wait for */
+    int events;
+    /* POLL_* events that are ready, filled in by the kernel */
+    int revents;
+} poll_fd_t;
+
+/* Arguments of the pollset wait syscall, which don't all fit in
+ * registers. */
+typedef struct {
+    /* Ready descriptors are stored here */
+    poll_fd_t *events;
+    /* Size of events */
+    int max;
+    /* Milliseconds to wait, 0 for not at all and negative for no
+       limit */
+    int timeout;
+} poll_wait_args_t;
+
+/* Kernel side */
+
+struct poll_entry_struct;
+
+/* Waiters on one pollable object. An object that can become ready
+ * embeds one of these and calls poll_notify() on it whenever some of
+ * its events may have become ready. */
+typedef struct pollq_struct {
+    struct poll_entry_struct *head;
+} pollq_t;
+
+void poll_init(void);
+void pollq_init(pollq_t *pollq);
+void poll_notify(pollq_t *pollq);
+void poll_detach(pollq_t *pollq);
+
+int poll_fds(poll_fd_t *fds, int nfds, int timeout);
+int pollset_create(void);
+int pollset_ctl(int set, int op, poll_fd_t *fd);
+int pollset_wait(int set, poll_wait_args_t *args);
+int pollset_close(int set);
+void pollset_close_all(void);
+
+#endif
@@ -44,6 +44,9 @@
 #include "kernel/config.h"
 #include "kernel/sleepq.h"
 #include "fs/vfs.h"
+#include "proc/mmap.h"
+#include "proc/poll.h"
+#include "net/netmap.h"
 #include "drivers/yams.h"
 #include "vm/vm.h"
 #include "vm/pagepool.h"
@@ -79,6 +82,17 @@ process_table_t process_table[CONFIG_MAX_PROCESSES];
 /* General character device for tty */
 gcd_t *tty_console;
 
+/* Descriptors of the console, always in use */
+#define PROCESS_CONSOLE_FILES 0x7
+
+/* Bit index of a power of two x, looked up with the top five bits of
+   x * 0x077cb531. The constant is a de Bruijn sequence, so each of
+   the 32 powers of two gives a different index. */
+static const int process_fd_index[32] = {
+    0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+    31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+};
+
 /**
  * Initializes the process table, the process table spinlock,
  * sets up stdin, stdout and stderr and finally sets of the idle process
@@ -97,6 +111,9 @@ void process_init(void) {
     /* Initializes spinlock */
     spinlock_reset(&process_table_slock);
 
+    mmap_init();
+    poll_init();
+
     /* Sets all processes to free */
     for(n = 0; n < CONFIG_MAX_PROCESSES; n++)
         process_table[n].state = PROCESS_FREE;
@@ -107,6 +124,8 @@ void process_init(void) {
     /* Sets process name and state */
     stringcopy(idle_process->process_name, "idle", CONFIG_MAX_PROCESS_NAME);
     idle_process->state = PROCESS_ALIVE;
+    spinlock_reset(&idle_process->files_slock);
+    idle_process->files_used = PROCESS_CONSOLE_FILES;
 }
 
 /**
@@ -292,6 +311,11 @@ process_id_t process_spawn(const char *executable) {
     process->stack_end = (USERLAND_STACK_TOP & PAGE_SIZE_MASK) -
                          (CONFIG_USERLAND_STACK_SIZE-1)*PAGE_SIZE;
     process->bot_free_stack = 0;
+    process->io_ring = NULL;
+    spinlock_reset(&process->files_slock);
+    process->files_used = PROCESS_CONSOLE_FILES;
+    for(i = 0; i < MMAP_MAX_REGIONS; i++)
+        process->mmaps[i].start = 0;
 
     /* Spawns the a new thread for the process */
     spawned_thread = thread_create((void (*)(uint32_t)) &process_start, (uint32_t) (process->process_name));
@@ -332,6 +356,34 @@ void process_free_stack(thread_table_t *my_thread) {
     *(uint32_t*)stack = old_free_list;
 }
 
+/**
+ * Closes all files the given process has open. Called when the last
+ * thread of the process finishes.
+ *
+ * @param process The process.
+ */
+static void process_close_files(process_table_t *process) {
+    interrupt_status_t intr_status;
+    openfile_t files[PROCESS_MAX_FILES];
+    int n = 0;
+    int fd;
+
+    /* Take the files out of the table first; closing them may sleep. */
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process->files_slock);
+    for(fd = 0; fd < PROCESS_MAX_FILES; fd++) {
+        if((PROCESS_CONSOLE_FILES & (1 << fd)) == 0 &&
+           (process->files_used & (1 << fd)) != 0)
+            files[n++] = process->files[fd];
+    }
+    process->files_used = PROCESS_CONSOLE_FILES;
+    spinlock_release(&process->files_slock);
+    _interrupt_set_state(intr_status);
+
+    while(n > 0)
+        vfs_close(files[--n]);
+}
+
 /**
  * Frees a process' resources, kills its thread and sets it to a zombie-state,
  * so it can be finished by its parent.
@@ -341,6 +393,7 @@ void process_finish(int retval) {
     TID_t thread_id;
     thread_table_t *thread;
     process_table_t *process;
+    int last;
 
     /* Acquire the lock */
     intr_status = _interrupt_disable();
@@ -353,8 +406,22 @@ void process_finish(int retval) {
     process_free_stack(thread);
 
     process->threads--;
+    last = (process->threads == 0);
+
+    /* Unmapping and closing files may sleep, so it is done without
+       the lock. The process stays alive until its files are closed. */
+    if(last) {
+        spinlock_release(&process_table_slock);
+        _interrupt_set_state(intr_status);
+
+        mmap_unmap_all();
+        pollset_close_all();
+        netmap_detach_all();
+        process_close_files(process);
+
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&process_table_slock);
 
-    if(process->threads == 0) {
         process->retval = retval;
         process->state = PROCESS_ZOMBIE;
 
@@ -444,6 +511,107 @@ int process_join(process_id_t pid) {
 
 }
 
+/**
+ * Gives the given open file a descriptor in the current process. The
+ * lowest free descriptor is used.
+ *
+ * @param file The open file. Its reference is owned by the descriptor
+ * on success.
+ *
+ * @return The descriptor, or VFS_LIMIT if the process has no free
+ * descriptors.
+ */
+int process_add_file(openfile_t file) {
+    process_table_t *process = process_get_current_process_entry();
+    interrupt_status_t intr_status;
+    uint32_t free;
+    int fd = VFS_LIMIT;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process->files_slock);
+
+    free = ~process->files_used;
+    if(free != 0) {
+        /* Isolate the lowest free bit and look up its index */
+        free &= -free;
+        fd = process_fd_index[(free * 0x077cb531) >> 27];
+        process->files_used |= free;
+        process->files[fd] = file;
+    }
+
+    spinlock_release(&process->files_slock);
+    _interrupt_set_state(intr_status);
+
+    return fd;
+}
+
+/**
+ * Looks up the open file of a descriptor in the current process. The
+ * open file gets an extra reference, so it stays open even if another
+ * thread closes the descriptor; the caller must drop the reference
+ * with vfs_close() when done.
+ *
+ * @param fd The descriptor. The console descriptors are not open
+ * files.
+ *
+ * @return The open file, or a negative error code.
+ */
+openfile_t process_get_file(int fd) {
+    process_table_t *process = process_get_current_process_entry();
+    interrupt_status_t intr_status;
+    openfile_t file = SYSCALL_NOT_OPEN;
+
+    if(fd < 0 || fd >= PROCESS_MAX_FILES)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process->files_slock);
+
+    if((PROCESS_CONSOLE_FILES & (1 << fd)) == 0 &&
+       (process->files_used & (1 << fd)) != 0) {
+        file = process->files[fd];
+        vfs_dup(file);
+    }
+
+    spinlock_release(&process->files_slock);
+    _interrupt_set_state(intr_status);
+
+    return file;
+}
+
+/**
+ * Frees a descriptor of the current process and drops its reference
+ * to the open file.
+ *
+ * @param fd The descriptor.
+ *
+ * @return The return value of vfs_close(), or a negative error code.
+ */
+int process_remove_file(int fd) {
+    process_table_t *process = process_get_current_process_entry();
+    interrupt_status_t intr_status;
+    openfile_t file = SYSCALL_NOT_OPEN;
+
+    if(fd < 0 || fd >= PROCESS_MAX_FILES)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process->files_slock);
+
+    if((PROCESS_CONSOLE_FILES & (1 << fd)) == 0 &&
+       (process->files_used & (1 << fd)) != 0) {
+        file = process->files[fd];
+        process->files_used &= ~(1 << fd);
+    }
+
+    spinlock_release(&process->files_slock);
+    _interrupt_set_state(intr_status);
+
+    if(file < 0)
+        return file;
+    return vfs_close(file);
+}
+
 void setup_thread(thread_params_t *params) {
     context_t user_context;
     uint32_t phys_page;
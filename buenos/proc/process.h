@@ -39,6 +39,10 @@
 
 #include "drivers/gcd.h"
 #include "kernel/config.h"
+#include "kernel/spinlock.h"
+#include "proc/io_ring.h"
+#include "proc/mmap.h"
+#include "proc/syscall.h"
 
 /** Character devices for console */
 extern gcd_t *tty_console;
@@ -52,6 +56,20 @@ typedef enum  {
     PROCESS_ALIVE
 } process_state_t;
 
+/* One memory mapped file of a process, see proc/mmap.c */
+typedef struct {
+    /* First address of the mapping, 0 if this entry is unused */
+    uint32_t start;
+    /* Length in bytes, the last page is mapped whole */
+    int length;
+    /* File offset of start */
+    int offset;
+    /* MMAP_* flags */
+    int flags;
+    /* The mapped file (openfile_t), with a reference of its own */
+    int file;
+} mmap_region_t;
+
 typedef struct {
     /* process name */
     char process_name[CONFIG_MAX_PROCESS_NAME];
@@ -71,6 +89,23 @@ typedef struct {
     /* Start of lowest free stack (0 if none). */
     uint32_t bot_free_stack;
 
+    /* Registered asynchronous I/O ring (NULL if none). */
+    io_ring_t *io_ring;
+
+    /* Spinlock protecting files and files_used. */
+    spinlock_t files_slock;
+
+    /* Bitmap of descriptors in use. Descriptors 0-2 are the console
+       and always marked used. */
+    uint32_t files_used;
+
+    /* Memory mapped files */
+    mmap_region_t mmaps[MMAP_MAX_REGIONS];
+
+    /* Open file (openfile_t) of each descriptor in use. fs/vfs.h
+       can't be included here, it includes this file indirectly. */
+    int files[PROCESS_MAX_FILES];
+
 } process_table_t;
 
 void process_init(void);
@@ -81,6 +116,9 @@ process_id_t process_get_current_process(void);
 process_table_t *process_get_current_process_entry(void);
 int process_join(process_id_t pid);
 int process_fork(void (*func)(int), int arg);
+int process_add_file(int file);
+int process_get_file(int fd);
+int process_remove_file(int fd);
 #define IDLE_PROCESS_PID 0
 #define USERLAND_STACK_TOP 0x7fffeffc
 #define USERLAND_STACK_MASK (PAGE_SIZE_MASK*CONFIG_USERLAND_STACK_SIZE)
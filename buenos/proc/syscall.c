@@ -34,7 +34,10 @@
  *
  */
 #include "drivers/polltty.h"
+#include "drivers/disk.h"
 #include "fs/vfs.h"
+#include "net/network.h"
+#include "net/netmap.h"
 #include "kernel/assert.h"
 #include "kernel/cswitch.h"
 #include "kernel/halt.h"
@@ -43,6 +46,10 @@
 #include "lib/libc.h"
 #include "proc/syscall.h"
 #include "proc/process.h"
+#include "proc/io_ring.h"
+#include "proc/iovec.h"
+#include "proc/mmap.h"
+#include "proc/poll.h"
 
 /**
  * Local helper-function to handle a syscall_write.
@@ -53,21 +60,30 @@ int _syscall_write(context_t *user_context) {
     char *buffer = (char*) user_context->cpu_regs[MIPS_REGISTER_A2];
     int length = user_context->cpu_regs[MIPS_REGISTER_A3];
 
+    openfile_t file;
+    int ret;
+
     /* Sanity checks */
     if(file_handle < 0 ||
        file_handle == FILEHANDLE_STDIN ||
-       file_handle >= CONFIG_MAX_OPEN_FILES)
+       file_handle >= PROCESS_MAX_FILES)
         return SYSCALL_ILLEGAL_ARGUMENT;
 
     /* This function _should_ also test if buffer in a legal memory area */
+    ret = mmap_prefault(buffer, length);
+    if(ret < 0)
+        return ret;
 
     if(file_handle == FILEHANDLE_STDOUT || file_handle == FILEHANDLE_STDERR)
         /* If the output is STDOUT/STDERR, write to console */
-        length = tty_console->write(tty_console, buffer, length);    
-    else
-        /* Otherwise write using vfs - but we are using the first three numbers
-         * as magic values, hence the "-3" */
-        length = vfs_write(file_handle, buffer, length);
+        return tty_console->write(tty_console, buffer, length);
+
+    /* Otherwise write to the open file of the descriptor */
+    file = process_get_file(file_handle);
+    if(file < 0)
+        return file;
+    length = vfs_write(file, buffer, length);
+    vfs_close(file);
 
     return length;
 }
@@ -81,26 +97,213 @@ int _syscall_read(context_t *user_context) {
     char *buffer = (char*) user_context->cpu_regs[MIPS_REGISTER_A2];
     int length = user_context->cpu_regs[MIPS_REGISTER_A3];
 
+    openfile_t file;
+    int ret;
+
     /* Sanity checks */
     if(file_handle < 0 ||
        file_handle == FILEHANDLE_STDOUT ||
        file_handle == FILEHANDLE_STDERR ||
-       file_handle >= CONFIG_MAX_OPEN_FILES)
+       file_handle >= PROCESS_MAX_FILES)
         return SYSCALL_ILLEGAL_ARGUMENT;
 
     /* This function _should_ also test if buffer in a legal memory area */
+    ret = mmap_prefault(buffer, length);
+    if(ret < 0)
+        return ret;
 
     if(file_handle == FILEHANDLE_STDIN)
         /* If the input is STDIN, write to console */
-        length = tty_console->read(tty_console, buffer, length);
-    else
-        /* Otherwise read using vfs - but we are using the first three numbers
-         * as magic values, hence the "-3" */
-        length = vfs_read(file_handle, buffer, length);
+        return tty_console->read(tty_console, buffer, length);
+
+    /* Otherwise read from the open file of the descriptor */
+    file = process_get_file(file_handle);
+    if(file < 0)
+        return file;
+    length = vfs_read(file, buffer, length);
+    vfs_close(file);
 
     return length;
 }
 
+/**
+ * Local helper-function to handle syscall_readv and syscall_writev.
+ * The buffers are filled or written in order, and the transfer stops
+ * at the first short or failed one.
+ */
+int _syscall_vector(context_t *user_context, int write) {
+    /* Syscall argument */
+    int file_handle = user_context->cpu_regs[MIPS_REGISTER_A1];
+    iovec_t *iov = (iovec_t*) user_context->cpu_regs[MIPS_REGISTER_A2];
+    int iovcnt = user_context->cpu_regs[MIPS_REGISTER_A3];
+    openfile_t file = -1;
+    int total = 0;
+    int ret = 0;
+    int i;
+
+    /* Sanity checks */
+    if(file_handle < 0 ||
+       file_handle >= PROCESS_MAX_FILES ||
+       iovcnt < 0 || iovcnt > IOV_MAX ||
+       (write && file_handle == FILEHANDLE_STDIN) ||
+       (!write && (file_handle == FILEHANDLE_STDOUT ||
+                   file_handle == FILEHANDLE_STDERR)))
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    /* This function _should_ also test if iov and the buffers are in
+       a legal memory area */
+    ret = mmap_prefault(iov, iovcnt * sizeof(iovec_t));
+    if(ret < 0)
+        return ret;
+    for(i = 0; i < iovcnt; i++) {
+        if(iov[i].buffer == NULL || iov[i].length < 0)
+            return SYSCALL_ILLEGAL_ARGUMENT;
+        ret = mmap_prefault(iov[i].buffer, iov[i].length);
+        if(ret < 0)
+            return ret;
+    }
+
+    if(file_handle > FILEHANDLE_STDERR) {
+        file = process_get_file(file_handle);
+        if(file < 0)
+            return file;
+    }
+
+    for(i = 0; i < iovcnt; i++) {
+        if(file < 0 && write)
+            ret = tty_console->write(tty_console, iov[i].buffer,
+                                     iov[i].length);
+        else if(file < 0)
+            ret = tty_console->read(tty_console, iov[i].buffer,
+                                    iov[i].length);
+        else if(write)
+            ret = vfs_write(file, iov[i].buffer, iov[i].length);
+        else
+            ret = vfs_read(file, iov[i].buffer, iov[i].length);
+
+        if(ret < 0)
+            break;
+        total += ret;
+        if(ret < iov[i].length)
+            break;
+    }
+
+    if(file >= 0)
+        vfs_close(file);
+
+    /* Report an error only if nothing was transferred */
+    if(ret < 0 && total == 0)
+        return ret;
+    return total;
+}
+
+/**
+ * Local helper-function to handle syscall_pread and syscall_pwrite.
+ * The buffer is passed in an iovec_t, since the offset takes the
+ * last argument register.
+ */
+int _syscall_positional(context_t *user_context, int write) {
+    /* Syscall argument */
+    int file_handle = user_context->cpu_regs[MIPS_REGISTER_A1];
+    iovec_t *iov = (iovec_t*) user_context->cpu_regs[MIPS_REGISTER_A2];
+    int offset = user_context->cpu_regs[MIPS_REGISTER_A3];
+    openfile_t file;
+    int ret;
+
+    /* Sanity checks. The console has no file position. */
+    if(file_handle <= FILEHANDLE_STDERR || iov == NULL)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+    ret = mmap_prefault(iov, sizeof(iovec_t));
+    if(ret < 0)
+        return ret;
+    if(iov->buffer == NULL || iov->length < 0 || offset < 0)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+    ret = mmap_prefault(iov->buffer, iov->length);
+    if(ret < 0)
+        return ret;
+
+    file = process_get_file(file_handle);
+    if(file < 0)
+        return file;
+
+    if(write)
+        ret = vfs_pwrite(file, iov->buffer, iov->length, offset);
+    else
+        ret = vfs_pread(file, iov->buffer, iov->length, offset);
+    vfs_close(file);
+
+    return ret;
+}
+
+/**
+ * Local helper-function to handle a syscall_sync. The memory mapped
+ * files of the calling process are written back first, so that their
+ * changes reach the disk too.
+ */
+int _syscall_sync(void) {
+    int mmap_ret = mmap_sync();
+    int vfs_ret = vfs_sync();
+
+    return mmap_ret < 0 ? mmap_ret : vfs_ret;
+}
+
+/**
+ * Local helper-function to handle a syscall_open.
+ */
+int _syscall_open(context_t *user_context) {
+    char *pathname = (char*) user_context->cpu_regs[MIPS_REGISTER_A1];
+    openfile_t file;
+    int fd;
+
+    file = mmap_prefault(pathname, VFS_PATH_LENGTH);
+    if(file < 0)
+        return file;
+
+    file = vfs_open(pathname);
+    if(file < 0)
+        return file;
+
+    fd = process_add_file(file);
+    if(fd < 0)
+        vfs_close(file);
+
+    return fd;
+}
+
+/**
+ * Local helper-function to handle a syscall_seek.
+ */
+int _syscall_seek(context_t *user_context) {
+    int file_handle = user_context->cpu_regs[MIPS_REGISTER_A1];
+    int position = user_context->cpu_regs[MIPS_REGISTER_A2];
+    openfile_t file;
+    int ret;
+
+    if(position < 0)
+        return SYSCALL_ILLEGAL_ARGUMENT;
+
+    file = process_get_file(file_handle);
+    if(file < 0)
+        return file;
+    ret = vfs_seek(file, position);
+    vfs_close(file);
+
+    return ret;
+}
+
+/**
+ * Local helper-function that reads in the memory mapped pages of a
+ * structure or string passed to a syscall, see mmap_prefault(). On
+ * failure the syscall returns without touching the argument.
+ */
+static int _syscall_prefault(context_t *user_context, int reg, int length) {
+    int ret = mmap_prefault((void*) user_context->cpu_regs[reg], length);
+
+    if(ret < 0)
+        user_context->cpu_regs[MIPS_REGISTER_V0] = ret;
+    return ret >= 0;
+}
+
 /**
  * Handle system calls. Interrupts are enabled when this function is
  * called.
@@ -125,19 +328,16 @@ void syscall_handle(context_t *user_context)
         break;
 
     case SYSCALL_OPEN:
-        user_context->cpu_regs[MIPS_REGISTER_V0] = vfs_open(
-            (char*) user_context->cpu_regs[MIPS_REGISTER_A1]);
+        user_context->cpu_regs[MIPS_REGISTER_V0] = _syscall_open(user_context);
         break;
 
     case SYSCALL_CLOSE:
-        user_context->cpu_regs[MIPS_REGISTER_V0] = vfs_close(
+        user_context->cpu_regs[MIPS_REGISTER_V0] = process_remove_file(
             user_context->cpu_regs[MIPS_REGISTER_A1]);
         break;
 
     case SYSCALL_SEEK:
-        user_context->cpu_regs[MIPS_REGISTER_V0] = vfs_seek(
-            user_context->cpu_regs[MIPS_REGISTER_A1],
-            user_context->cpu_regs[MIPS_REGISTER_A2]);
+        user_context->cpu_regs[MIPS_REGISTER_V0] = _syscall_seek(user_context);
         break;
 
     case SYSCALL_READ:
@@ -148,22 +348,150 @@ void syscall_handle(context_t *user_context)
         user_context->cpu_regs[MIPS_REGISTER_V0] = _syscall_write(user_context);
         break;
 
+    case SYSCALL_READV:
+        user_context->cpu_regs[MIPS_REGISTER_V0] =
+            _syscall_vector(user_context, 0);
+        break;
+
+    case SYSCALL_WRITEV:
+        user_context->cpu_regs[MIPS_REGISTER_V0] =
+            _syscall_vector(user_context, 1);
+        break;
+
+    case SYSCALL_PREAD:
+        user_context->cpu_regs[MIPS_REGISTER_V0] =
+            _syscall_positional(user_context, 0);
+        break;
+
+    case SYSCALL_PWRITE:
+        user_context->cpu_regs[MIPS_REGISTER_V0] =
+            _syscall_positional(user_context, 1);
+        break;
+
     case SYSCALL_CREATE:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1, VFS_PATH_LENGTH))
+            break;
         user_context->cpu_regs[MIPS_REGISTER_V0] = vfs_create(
             (char*) user_context->cpu_regs[MIPS_REGISTER_A1],
             user_context->cpu_regs[MIPS_REGISTER_A2]);
         break;
 
     case SYSCALL_DELETE:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1, VFS_PATH_LENGTH))
+            break;
         user_context->cpu_regs[MIPS_REGISTER_V0] = vfs_remove(
             (char*) user_context->cpu_regs[MIPS_REGISTER_A1]);
         break;
 
+    case SYSCALL_IO_SETUP:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1,
+                              sizeof(io_ring_t)))
+            break;
+        user_context->cpu_regs[MIPS_REGISTER_V0] = io_ring_setup(
+            (io_ring_t*) user_context->cpu_regs[MIPS_REGISTER_A1]);
+        break;
+
+    case SYSCALL_IO_ENTER:
+        user_context->cpu_regs[MIPS_REGISTER_V0] = io_ring_enter(
+            user_context->cpu_regs[MIPS_REGISTER_A1],
+            user_context->cpu_regs[MIPS_REGISTER_A2]);
+        break;
+
+    case SYSCALL_DISKSTATS:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A2,
+                              sizeof(disk_stats_t)))
+            break;
+        user_context->cpu_regs[MIPS_REGISTER_V0] = disk_get_stats(
+            user_context->cpu_regs[MIPS_REGISTER_A1],
+            (disk_stats_t*) user_context->cpu_regs[MIPS_REGISTER_A2]);
+        break;
+
+    case SYSCALL_SYNC:
+        user_context->cpu_regs[MIPS_REGISTER_V0] = _syscall_sync();
+        break;
+
+    case SYSCALL_MMAP:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A2,
+                              sizeof(mmap_args_t)))
+            break;
+        user_context->cpu_regs[MIPS_REGISTER_V0] = mmap_map(
+            user_context->cpu_regs[MIPS_REGISTER_A1],
+            (mmap_args_t*) user_context->cpu_regs[MIPS_REGISTER_A2]);
+        break;
+
+    case SYSCALL_MUNMAP:
+        user_context->cpu_regs[MIPS_REGISTER_V0] = mmap_unmap(
+            user_context->cpu_regs[MIPS_REGISTER_A1]);
+        break;
+
+    case SYSCALL_POLL:
+        user_context->cpu_regs[MIPS_REGISTER_V0] = poll_fds(
+            (poll_fd_t*) user_context->cpu_regs[MIPS_REGISTER_A1],
+            user_context->cpu_regs[MIPS_REGISTER_A2],
+            user_context->cpu_regs[MIPS_REGISTER_A3]);
+        break;
+
+    case SYSCALL_POLLSET_CREATE:
+        user_context->cpu_regs[MIPS_REGISTER_V0] = pollset_create();
+        break;
+
+    case SYSCALL_POLLSET_CTL:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A3,
+                              sizeof(poll_fd_t)))
+            break;
+        user_context->cpu_regs[MIPS_REGISTER_V0] = pollset_ctl(
+            user_context->cpu_regs[MIPS_REGISTER_A1],
+            user_context->cpu_regs[MIPS_REGISTER_A2],
+            (poll_fd_t*) user_context->cpu_regs[MIPS_REGISTER_A3]);
+        break;
+
+    case SYSCALL_POLLSET_WAIT:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A2,
+                              sizeof(poll_wait_args_t)))
+            break;
+        user_context->cpu_regs[MIPS_REGISTER_V0] = pollset_wait(
+            user_context->cpu_regs[MIPS_REGISTER_A1],
+            (poll_wait_args_t*) user_context->cpu_regs[MIPS_REGISTER_A2]);
+        break;
+
+    case SYSCALL_POLLSET_CLOSE:
+        user_context->cpu_regs[MIPS_REGISTER_V0] = pollset_close(
+            user_context->cpu_regs[MIPS_REGISTER_A1]);
+        break;
+
+    case SYSCALL_NETSTATS:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A3,
+                              sizeof(netstats_t)))
+            break;
+        user_context->cpu_regs[MIPS_REGISTER_V0] = network_get_stats(
+            user_context->cpu_regs[MIPS_REGISTER_A1],
+            user_context->cpu_regs[MIPS_REGISTER_A2],
+            (netstats_t*) user_context->cpu_regs[MIPS_REGISTER_A3]);
+        break;
+
+    case SYSCALL_NETMAP_ATTACH:
+        user_context->cpu_regs[MIPS_REGISTER_V0] = netmap_attach(
+            user_context->cpu_regs[MIPS_REGISTER_A1]);
+        break;
+
+    case SYSCALL_NETMAP_SYNC:
+        user_context->cpu_regs[MIPS_REGISTER_V0] = netmap_sync(
+            user_context->cpu_regs[MIPS_REGISTER_A1],
+            user_context->cpu_regs[MIPS_REGISTER_A2]);
+        break;
+
+    case SYSCALL_NETMAP_DETACH:
+        user_context->cpu_regs[MIPS_REGISTER_V0] = netmap_detach(
+            user_context->cpu_regs[MIPS_REGISTER_A1]);
+        break;
+
     case SYSCALL_EXIT:
         process_finish((int) user_context->cpu_regs[MIPS_REGISTER_A1]);
         break;
 
     case SYSCALL_EXEC:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1, VFS_PATH_LENGTH))
+            break;
         user_context->cpu_regs[MIPS_REGISTER_V0] =
             process_spawn((const char*) user_context->cpu_regs[MIPS_REGISTER_A1]);
         break;
@@ -180,33 +508,48 @@ void syscall_handle(context_t *user_context)
         break;
 
     case SYSCALL_LOCK_CREATE:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1, sizeof(lock_t)))
+            break;
         user_context->cpu_regs[MIPS_REGISTER_V0] =
             lock_reset((lock_t*) user_context->cpu_regs[MIPS_REGISTER_A1]);
         break;
 
     case SYSCALL_LOCK_ACQUIRE:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1, sizeof(lock_t)))
+            break;
         lock_acquire((lock_t*) user_context->cpu_regs[MIPS_REGISTER_A1]);
         break;
 
     case SYSCALL_LOCK_RELEASE:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1, sizeof(lock_t)))
+            break;
         lock_release((lock_t*) user_context->cpu_regs[MIPS_REGISTER_A1]);
         break;
 
     case SYSCALL_CONDITION_CREATE:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1, sizeof(cond_t)))
+            break;
         user_context->cpu_regs[MIPS_REGISTER_V0] =
             condition_reset((cond_t*) user_context->cpu_regs[MIPS_REGISTER_A1]);
         break;
 
     case SYSCALL_CONDITION_WAIT:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1, sizeof(cond_t)) ||
+           !_syscall_prefault(user_context, MIPS_REGISTER_A2, sizeof(lock_t)))
+            break;
         condition_wait((cond_t*) user_context->cpu_regs[MIPS_REGISTER_A1],
                        (lock_t*) user_context->cpu_regs[MIPS_REGISTER_A2]);
         break;
 
     case SYSCALL_CONDITION_SIGNAL:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1, sizeof(cond_t)))
+            break;
         condition_signal((cond_t*) user_context->cpu_regs[MIPS_REGISTER_A1]);
         break;
 
     case SYSCALL_CONDITION_BROADCAST:
+        if(!_syscall_prefault(user_context, MIPS_REGISTER_A1, sizeof(cond_t)))
+            break;
         condition_broadcast((cond_t*) user_context->cpu_regs[MIPS_REGISTER_A1]);
         break;
 
@@ -53,6 +53,25 @@
 #define SYSCALL_WRITE 0x205
 #define SYSCALL_CREATE 0x206
 #define SYSCALL_DELETE 0x207
+#define SYSCALL_IO_SETUP 0x208
+#define SYSCALL_IO_ENTER 0x209
+#define SYSCALL_DISKSTATS 0x20a
+#define SYSCALL_SYNC 0x20b
+#define SYSCALL_READV 0x20c
+#define SYSCALL_WRITEV 0x20d
+#define SYSCALL_PREAD 0x20e
+#define SYSCALL_PWRITE 0x20f
+#define SYSCALL_MMAP 0x210
+#define SYSCALL_MUNMAP 0x211
+#define SYSCALL_POLL 0x212
+#define SYSCALL_POLLSET_CREATE 0x213
+#define SYSCALL_POLLSET_CTL 0x214
+#define SYSCALL_POLLSET_WAIT 0x215
+#define SYSCALL_POLLSET_CLOSE 0x216
+#define SYSCALL_NETSTATS 0x217
+#define SYSCALL_NETMAP_ATTACH 0x218
+#define SYSCALL_NETMAP_SYNC 0x219
+#define SYSCALL_NETMAP_DETACH 0x21a
 #define SYSCALL_LOCK_CREATE 0x301
 #define SYSCALL_LOCK_ACQUIRE 0x302
 #define SYSCALL_LOCK_RELEASE 0x303
@@ -68,6 +87,11 @@
 #define FILEHANDLE_STDOUT 1
 #define FILEHANDLE_STDERR 2
 
+/* Number of file descriptors per process, the console ones included.
+ * There is one bit per descriptor in files_used of the process
+ * table, so this can't be raised above 32. */
+#define PROCESS_MAX_FILES 32
+
 /* Standard errors file system calls */
 #define SYSCALL_ILLEGAL_ARGUMENT -1
 #define SYSCALL_NOT_OPEN -2
@@ -0,0 +1,78 @@
+#include "tests/lib.h"
+
+/* Per-process descriptor tables: the lowest free descriptor is used,
+   descriptors have positions of their own, and all threads of a
+   process share the table. */
+
+static const char name[] = "[disk1]fdtab";
+static int fds[PROCESS_MAX_FILES];
+
+static volatile int thread_fd = -1;
+static volatile int thread_done = 0;
+
+static void opener(int arg)
+{
+    arg = arg;
+    thread_fd = syscall_open(name);
+    thread_done = 1;
+    syscall_exit(0);
+}
+
+int main(void)
+{
+    char x, y;
+    int fd1, fd2, n, i;
+
+    syscall_delete(name);
+    syscall_create(name, 10);
+    fd1 = syscall_open(name);
+    test_check("write file", syscall_write(fd1, "0123456789", 10) == 10);
+    syscall_close(fd1);
+
+    /* Lowest free descriptor first */
+    fd1 = syscall_open(name);
+    fd2 = syscall_open(name);
+    test_check("first descriptor after the console", fd1 == 3);
+    test_check("next descriptor", fd2 == 4);
+    test_check("close", syscall_close(fd1) == 0);
+    test_check("closed descriptor reused", syscall_open(name) == fd1);
+
+    /* Each open has its own position */
+    test_check("independent positions",
+               syscall_read(fd1, &x, 1) == 1 &&
+               syscall_read(fd1, &x, 1) == 1 &&
+               syscall_read(fd2, &y, 1) == 1 && x == '1' && y == '0');
+
+    /* Bad descriptors */
+    test_check("close twice fails",
+               syscall_close(fd2) == 0 && syscall_close(fd2) < 0);
+    test_check("read from a closed descriptor fails",
+               syscall_read(fd2, &x, 1) < 0);
+    test_check("descriptor out of range",
+               syscall_close(PROCESS_MAX_FILES) < 0);
+
+    /* Fill the table */
+    n = 0;
+    while(n < PROCESS_MAX_FILES && (fds[n] = syscall_open(name)) >= 0)
+        n++;
+    /* 0-2 are the console and fd1 is open */
+    test_check("table holds all descriptors", n == PROCESS_MAX_FILES - 4);
+    for(i = 0; i < n; i++)
+        syscall_close(fds[i]);
+    test_check("emptied table reused from the start",
+               syscall_open(name) == 4);
+    syscall_close(4);
+
+    /* Threads share the table */
+    syscall_fork(opener, 0);
+    while(!thread_done)
+        ;
+    test_check("descriptor opened by another thread",
+               thread_fd >= 0 && syscall_read(thread_fd, &x, 1) == 1 &&
+               x == '0');
+    syscall_close(thread_fd);
+    syscall_close(fd1);
+    syscall_delete(name);
+
+    return test_report();
+}
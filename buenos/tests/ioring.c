@@ -0,0 +1,100 @@
+#include "tests/lib.h"
+
+/* Submission and completion rings: every submission gets a completion
+   with its user_data, and nothing is consumed that can't be reported. */
+
+static const char name[] = "[disk1]ioring";
+
+/* The rings live in static memory, the stack is only one page */
+static io_sqe_t sqes[4];
+static io_cqe_t cqes[4];
+static io_cqe_t small_cqes[2];
+static io_ring_t ring;
+static char buf[16];
+
+static void submit(int opcode, int fd, void *buffer, int length, int offset,
+                   uint32_t user_data)
+{
+    io_sqe_t *sqe = &ring.sqes[ring.sq_tail & (ring.sq_entries - 1)];
+
+    sqe->opcode = opcode;
+    sqe->filehandle = fd;
+    sqe->buffer = buffer;
+    sqe->length = length;
+    sqe->offset = offset;
+    sqe->user_data = user_data;
+    ring.sq_tail++;
+}
+
+/* Takes the next completion, its result or -1000 if there is none. */
+static int complete(uint32_t user_data)
+{
+    io_cqe_t *cqe;
+
+    if(ring.cq_head == ring.cq_tail)
+        return -1000;
+    cqe = &ring.cqes[ring.cq_head & (ring.cq_entries - 1)];
+    ring.cq_head++;
+    if(cqe->user_data != user_data)
+        return -1000;
+    return cqe->result;
+}
+
+int main(void)
+{
+    int fd, i;
+
+    syscall_delete(name);
+    syscall_create(name, 10);
+    fd = syscall_open(name);
+
+    test_check("enter without a ring", syscall_io_enter(1, 0) < 0);
+
+    ring.sq_entries = 3;
+    ring.sqes = sqes;
+    ring.cq_entries = 4;
+    ring.cqes = cqes;
+    test_check("entries not a power of two", syscall_io_setup(&ring) < 0);
+    ring.sq_entries = 4;
+    test_check("setup", syscall_io_setup(&ring) == 0);
+
+    submit(IO_OP_WRITE, fd, "abcdef", 6, 0, 1);
+    submit(IO_OP_READ, fd, buf, 10, 2, 2);
+    submit(IO_OP_NOP, 0, NULL, 0, 0, 3);
+    submit(42, fd, buf, 1, 0, 4);
+    test_check("enter", syscall_io_enter(4, 4) == 4);
+    test_check("submissions consumed", ring.sq_head == ring.sq_tail);
+    test_check("write completion", complete(1) == 6);
+    test_check("read completion",
+               complete(2) == 8 && strncmp(buf, "cdef", 4) == 0);
+    test_check("nop completion", complete(3) == 0);
+    test_check("bad opcode completion", complete(4) < 0);
+    test_check("no more completions", complete(0) == -1000);
+
+    test_check("too many completions waited for", syscall_io_enter(0, 5) < 0);
+    test_check("nothing to submit", syscall_io_enter(4, 0) == 0);
+
+    /* Three submissions, room for two completions */
+    ring.sq_head = ring.sq_tail = 0;
+    ring.cq_head = ring.cq_tail = 0;
+    ring.cq_entries = 2;
+    ring.cqes = small_cqes;
+    test_check("setup small", syscall_io_setup(&ring) == 0);
+    for(i = 0; i < 3; i++)
+        submit(IO_OP_NOP, 0, NULL, 0, 0, 10 + i);
+    test_check("stops when completions are full",
+               syscall_io_enter(3, 0) == 2);
+    test_check("submission left in the ring",
+               ring.sq_tail - ring.sq_head == 1);
+    test_check("completions", complete(10) == 0 && complete(11) == 0);
+    test_check("rest submitted",
+               syscall_io_enter(1, 0) == 1 && complete(12) == 0);
+
+    test_check("detach", syscall_io_setup(NULL) == 0);
+    test_check("enter after detach", syscall_io_enter(1, 0) < 0);
+
+    syscall_close(fd);
+    syscall_delete(name);
+
+    return test_report();
+}
@@ -184,6 +184,236 @@ int syscall_delete(const char *filename)
     return (int)_syscall(SYSCALL_DELETE, (uint32_t)filename, 0, 0);
 }
 
+
+/* Register 'ring' as the asynchronous I/O ring of this process. The
+ * entry counts of both queues must be powers of two. Returns 0 on
+ * success or a negative value on error.
+ */
+int syscall_io_setup(io_ring_t *ring)
+{
+    return (int)_syscall(SYSCALL_IO_SETUP, (uint32_t)ring, 0, 0);
+}
+
+
+/* Submit up to 'to_submit' queued operations from the registered
+ * ring. The result of every consumed submission has been posted to
+ * the completion queue when this returns; 'min_complete' may not
+ * exceed the completion queue size. Returns the number of
+ * submissions consumed or a negative value on error.
+ */
+int syscall_io_enter(int to_submit, int min_complete)
+{
+    return (int)_syscall(SYSCALL_IO_ENTER, (uint32_t)to_submit,
+                         (uint32_t)min_complete, 0);
+}
+
+
+/* Copy the I/O statistics of the disk number 'disk' to 'stats'.
+ * Returns 0 on success or a negative value if there is no such disk.
+ */
+int syscall_diskstats(int disk, disk_stats_t *stats)
+{
+    return (int)_syscall(SYSCALL_DISKSTATS, (uint32_t)disk,
+                         (uint32_t)stats, 0);
+}
+
+
+/* Write all file system changes still kept in memory, and the
+ * changed pages of the writable memory mappings of this process, to
+ * the disks. Returns 0 on success or a negative value on error.
+ */
+int syscall_sync(void)
+{
+    return (int)_syscall(SYSCALL_SYNC, 0, 0, 0);
+}
+
+
+/* Read at most 'length' bytes from 'offset' of the open file
+ * 'filehandle' into 'buffer'. The file position is not used or
+ * changed. Returns the number of bytes read or a negative value on
+ * error.
+ */
+int syscall_pread(int filehandle, void *buffer, int length, int offset)
+{
+    iovec_t iov;
+
+    iov.buffer = buffer;
+    iov.length = length;
+    return (int)_syscall(SYSCALL_PREAD, (uint32_t)filehandle,
+                         (uint32_t)&iov, (uint32_t)offset);
+}
+
+
+/* Write 'length' bytes from 'buffer' to 'offset' of the open file
+ * 'filehandle'. The file position is not used or changed. Returns
+ * the number of bytes written or a negative value on error.
+ */
+int syscall_pwrite(int filehandle, const void *buffer, int length,
+                   int offset)
+{
+    iovec_t iov;
+
+    iov.buffer = (void *)buffer;
+    iov.length = length;
+    return (int)_syscall(SYSCALL_PWRITE, (uint32_t)filehandle,
+                         (uint32_t)&iov, (uint32_t)offset);
+}
+
+
+/* Read from 'filehandle' into the 'iovcnt' (at most IOV_MAX) buffers
+ * of 'iov' in order, from the current file position. Stops at the
+ * first buffer that is not filled completely. Returns the total
+ * number of bytes read or a negative value on error.
+ */
+int syscall_readv(int filehandle, const iovec_t *iov, int iovcnt)
+{
+    return (int)_syscall(SYSCALL_READV, (uint32_t)filehandle,
+                         (uint32_t)iov, (uint32_t)iovcnt);
+}
+
+
+/* Write the 'iovcnt' (at most IOV_MAX) buffers of 'iov' in order to
+ * 'filehandle' at the current file position. Returns the total
+ * number of bytes written or a negative value on error.
+ */
+int syscall_writev(int filehandle, const iovec_t *iov, int iovcnt)
+{
+    return (int)_syscall(SYSCALL_WRITEV, (uint32_t)filehandle,
+                         (uint32_t)iov, (uint32_t)iovcnt);
+}
+
+
+/* Map 'length' bytes of the open file 'filehandle' starting from
+ * 'offset' (a multiple of the page size) into memory. Pages are read
+ * from the file when first touched. With MMAP_WRITE in 'flags' the
+ * memory is writable and changes are written back to the file by
+ * syscall_munmap, syscall_sync and on exit. The mapping stays valid
+ * after the file is closed. Returns the address of the mapping, or
+ * NULL on error.
+ */
+void *syscall_mmap(int filehandle, int offset, int length, int flags)
+{
+    mmap_args_t args;
+    int addr;
+
+    args.offset = offset;
+    args.length = length;
+    args.flags = flags;
+    addr = (int)_syscall(SYSCALL_MMAP, (uint32_t)filehandle,
+                         (uint32_t)&args, 0);
+    return addr < 0 ? NULL : (void *)addr;
+}
+
+
+/* Remove the mapping at 'addr', as returned by syscall_mmap, writing
+ * changed pages back to the file. Returns 0 on success or a negative
+ * value on error.
+ */
+int syscall_munmap(void *addr)
+{
+    return (int)_syscall(SYSCALL_MUNMAP, (uint32_t)addr, 0, 0);
+}
+
+/* Wait until some of the nfds descriptors in fds are ready for the
+ * POLL_* events they ask for, for at most timeout milliseconds (0 for
+ * not at all, negative for no limit). The ready events of each are
+ * stored in its revents. Returns the number of ready descriptors, or
+ * a negative value on error.
+ */
+int syscall_poll(poll_fd_t *fds, int nfds, int timeout)
+{
+    return (int)_syscall(SYSCALL_POLL, (uint32_t)fds, (uint32_t)nfds,
+                         (uint32_t)timeout);
+}
+
+/* Create a poll set, which keeps descriptors to wait for between
+ * calls. Returns the set, or a negative value on error.
+ */
+int syscall_pollset_create(void)
+{
+    return (int)_syscall(SYSCALL_POLLSET_CREATE, 0, 0, 0);
+}
+
+/* Add (POLLSET_ADD), change the events of (POLLSET_MODIFY) or remove
+ * (POLLSET_REMOVE) the descriptor fd of a poll set. Returns 0 on
+ * success or a negative value on error.
+ */
+int syscall_pollset_ctl(int set, int op, poll_fd_t *fd)
+{
+    return (int)_syscall(SYSCALL_POLLSET_CTL, (uint32_t)set, (uint32_t)op,
+                         (uint32_t)fd);
+}
+
+/* Wait until some descriptors of a poll set are ready, as
+ * syscall_poll, and store up to max of them in events. Returns the
+ * number stored, or a negative value on error.
+ */
+int syscall_pollset_wait(int set, poll_fd_t *events, int max, int timeout)
+{
+    poll_wait_args_t args;
+
+    args.events = events;
+    args.max = max;
+    args.timeout = timeout;
+    return (int)_syscall(SYSCALL_POLLSET_WAIT, (uint32_t)set,
+                         (uint32_t)&args, 0);
+}
+
+/* Close a poll set. Returns 0 on success or a negative value on
+ * error.
+ */
+int syscall_pollset_close(int set)
+{
+    return (int)_syscall(SYSCALL_POLLSET_CLOSE, (uint32_t)set, 0, 0);
+}
+
+
+/* Copy network statistics to 'stats'. 'kind' is one of NETSTATS_*
+ * and 'n' the interface index or protocol id, see net/netstats.h.
+ * Returns 0 on success or a negative value if there is no such
+ * interface or protocol.
+ */
+int syscall_netstats(int kind, int n, netstats_t *stats)
+{
+    return (int)_syscall(SYSCALL_NETSTATS, (uint32_t)kind, (uint32_t)n,
+                         (uint32_t)stats);
+}
+
+
+/* Attach network interface number 'interface' to raw frame rings
+ * mapped into this process, see net/netmap.h. Received frames go to
+ * the receive ring instead of the sockets until the interface is
+ * detached. Returns the rings, or NULL on error.
+ */
+netmap_rings_t *syscall_netmap_attach(int interface)
+{
+    int ret = (int)_syscall(SYSCALL_NETMAP_ATTACH, (uint32_t)interface,
+                            0, 0);
+
+    return ret < 0 ? NULL : (netmap_rings_t *)ret;
+}
+
+
+/* Send the frames queued in the transmit ring of an attached
+ * interface and update the receive ring. With NETMAP_SYNC_WAIT in
+ * 'flags' waits for a frame if the receive ring is empty. Returns the
+ * number of frames in the receive ring or a negative value on error.
+ */
+int syscall_netmap_sync(int interface, int flags)
+{
+    return (int)_syscall(SYSCALL_NETMAP_SYNC, (uint32_t)interface,
+                         (uint32_t)flags, 0);
+}
+
+
+/* Detach an interface attached with syscall_netmap_attach. The rings
+ * are unmapped. Returns 0 on success or a negative value on error.
+ */
+int syscall_netmap_detach(int interface)
+{
+    return (int)_syscall(SYSCALL_NETMAP_DETACH, (uint32_t)interface, 0, 0);
+}
+
 int syscall_lock_create(usr_lock_t *lock) {
     return (int)_syscall(SYSCALL_LOCK_CREATE,
                          (uint32_t)lock, 0, 0);
@@ -835,3 +1065,27 @@ int atoi(const char *nptr)
 }
 
 #endif
+
+#ifdef PROVIDE_TEST_CHECKS
+
+/* Number of failed test_check()s */
+static int test_failures = 0;
+
+/* Prints the outcome of one check of a test program. ok is nonzero
+   if the check passed. */
+void test_check(const char *what, int ok)
+{
+    printf("%s: %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        test_failures++;
+}
+
+/* Prints the number of failed checks and returns it, to be used as
+   the return value of main. */
+int test_report(void)
+{
+    printf("%d failures\n", test_failures);
+    return test_failures;
+}
+
+#endif
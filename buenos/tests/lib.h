@@ -47,12 +47,26 @@
 #define PROVIDE_FORMATTED_OUTPUT
 #define PROVIDE_HEAP_ALLOCATOR
 #define PROVIDE_MISC
+#define PROVIDE_TEST_CHECKS
 
 #include <stdarg.h>
 #include <stddef.h>
 
 #include "lib/types.h"
 
+/* The syscall interface headers below are shared with the kernel.
+ * Their types and constants are what the kernel and userland agree
+ * on, so they are kept to plain data. Whatever follows a "Kernel
+ * side" comment in them is the kernel's own and not used here. */
+#include "proc/syscall.h"
+#include "proc/io_ring.h"
+#include "proc/iovec.h"
+#include "proc/mmap.h"
+#include "proc/poll.h"
+#include "drivers/diskstats.h"
+#include "net/netstats.h"
+#include "net/netmap.h"
+
 #define MIN(arg1,arg2) ((arg1) > (arg2) ? (arg2) : (arg1))
 #define MAX(arg1,arg2) ((arg1) > (arg2) ? (arg1) : (arg2))
 
@@ -90,6 +104,32 @@ int syscall_write(int filehandle, const void *buffer, int length);
 int syscall_create(const char *filename, int size);
 int syscall_delete(const char *filename);
 
+int syscall_io_setup(io_ring_t *ring);
+int syscall_io_enter(int to_submit, int min_complete);
+
+int syscall_diskstats(int disk, disk_stats_t *stats);
+
+int syscall_sync(void);
+
+int syscall_pread(int filehandle, void *buffer, int length, int offset);
+int syscall_pwrite(int filehandle, const void *buffer, int length,
+                   int offset);
+int syscall_readv(int filehandle, const iovec_t *iov, int iovcnt);
+int syscall_writev(int filehandle, const iovec_t *iov, int iovcnt);
+
+void *syscall_mmap(int filehandle, int offset, int length, int flags);
+int syscall_munmap(void *addr);
+
+int syscall_poll(poll_fd_t *fds, int nfds, int timeout);
+int syscall_pollset_create(void);
+int syscall_pollset_ctl(int set, int op, poll_fd_t *fd);
+int syscall_pollset_wait(int set, poll_fd_t *events, int max, int timeout);
+int syscall_pollset_close(int set);
+int syscall_netstats(int kind, int n, netstats_t *stats);
+netmap_rings_t *syscall_netmap_attach(int interface);
+int syscall_netmap_sync(int interface, int flags);
+int syscall_netmap_detach(int interface);
+
 int syscall_fork(void (*func)(int), int arg);
 void *syscall_memlimit(void *heap_end);
 
@@ -147,4 +187,9 @@ void *realloc(void *ptr, size_t size);
 int atoi(const char *nptr);
 #endif
 
+#ifdef PROVIDE_TEST_CHECKS
+void test_check(const char *what, int ok);
+int test_report(void);
+#endif
+
 #endif /* BUENOS_USERLAND_LIB_H */
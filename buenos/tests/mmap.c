@@ -0,0 +1,101 @@
+#include "tests/lib.h"
+
+/* Memory mapped files: demand paging, write back on sync and munmap,
+   and reuse of the address space. */
+
+/* Two pages of file data. The stack of a program is one page, so the
+   buffers are static. */
+#define FILE_SIZE 8192
+
+static const char name[] = "[disk1]mmapf";
+static char data[FILE_SIZE];
+
+static char expected(int i)
+{
+    return 'a' + i % 26;
+}
+
+/* Reads one byte of the file with pread, -1 on error. */
+static int file_byte(int fd, int offset)
+{
+    char c;
+
+    if(syscall_pread(fd, &c, 1, offset) != 1)
+        return -1;
+    return c;
+}
+
+int main(void)
+{
+    char *p, *q;
+    int fd, i, ok;
+
+    for(i = 0; i < FILE_SIZE; i++)
+        data[i] = expected(i);
+
+    syscall_delete(name);
+    syscall_create(name, FILE_SIZE);
+    fd = syscall_open(name);
+    test_check("write file", syscall_write(fd, data, FILE_SIZE) == FILE_SIZE);
+
+    test_check("unaligned offset is refused",
+               syscall_mmap(fd, 100, FILE_SIZE, 0) == NULL);
+    test_check("mapping larger than the pagetable is refused",
+               syscall_mmap(fd, 0, 0x1000000, 0) == NULL);
+
+    p = syscall_mmap(fd, 0, FILE_SIZE, MMAP_WRITE);
+    test_check("mmap", p != NULL);
+    if(p == NULL)
+        return 1;
+
+    /* Nothing is read until touched, the second page first */
+    test_check("demand fault, second page", p[4096 + 7] == expected(4096 + 7));
+    test_check("demand fault, first page", p[3] == expected(3));
+
+    ok = 1;
+    for(i = 0; i < FILE_SIZE; i++)
+        ok = ok && p[i] == expected(i);
+    test_check("whole mapping matches the file", ok);
+
+    /* A store marks the page dirty, sync writes it back */
+    p[100] = 'X';
+    test_check("sync", syscall_sync() == 0);
+    test_check("dirty page written back on sync", file_byte(fd, 100) == 'X');
+
+    /* The page is read-only again after the sync, so this store must
+       be noticed too */
+    p[101] = 'Y';
+    test_check("munmap", syscall_munmap(p) == 0);
+    test_check("munmap writes back", file_byte(fd, 101) == 'Y');
+    test_check("munmap of an unmapped address fails", syscall_munmap(p) < 0);
+
+    q = syscall_mmap(fd, 0, FILE_SIZE, MMAP_WRITE);
+    test_check("address reused after munmap", q == p);
+    if(q == NULL)
+        return 1;
+    test_check("new mapping sees the changes", q[100] == 'X' && q[101] == 'Y');
+
+    /* Syscalls get buffers in pages never touched; the kernel reads
+       them in before a driver or file system copies them */
+    test_check("read into an untouched page",
+               syscall_pread(fd, q + 4096 + 10, 4, 100) == 4 &&
+               q[4096 + 10] == 'X' && q[4096 + 11] == 'Y');
+    test_check("munmap", syscall_munmap(q) == 0);
+    test_check("read through a mapping written back",
+               file_byte(fd, 4096 + 10) == 'X');
+
+    q = syscall_mmap(fd, 0, FILE_SIZE, 0);
+    test_check("read-only mmap", q != NULL);
+    if(q == NULL)
+        return 1;
+    i = syscall_write(stdout, q + 4096 + 12, 5);
+    printf("\n");
+    test_check("console write from an untouched page", i == 5);
+    test_check("read-only mapping reads", q[0] == expected(0));
+    test_check("munmap", syscall_munmap(q) == 0);
+
+    syscall_close(fd);
+    syscall_delete(name);
+
+    return test_report();
+}
@@ -0,0 +1,66 @@
+#include "tests/lib.h"
+
+/* Raw frame rings: a frame put in the transmit ring is sent on sync,
+   and an interface is attached to one process at a time. Needs a
+   network interface, the test is skipped without one. */
+
+/* Destination of the test frame, the broadcast address */
+#define BROADCAST 0xffffffff
+/* Protocol id nobody listens to, so receivers drop the frame */
+#define PROTOCOL  0x7e
+
+static netstats_t before, after;
+
+/* Puts a frame with the given payload length at the tail of tx. */
+static void put_frame(netmap_ring_t *tx, int length)
+{
+    uint32_t *header = (uint32_t *)NETMAP_BUF(tx, tx->tail);
+    int i;
+
+    header[0] = BROADCAST;
+    header[1] = 0;
+    header[2] = PROTOCOL;
+    for(i = 0; i < length; i++)
+        ((char *)&header[3])[i] = 'a' + i % 26;
+    tx->slots[tx->tail & (tx->entries - 1)].length = 12 + length;
+    tx->tail++;
+}
+
+int main(void)
+{
+    netmap_rings_t *rings;
+
+    rings = syscall_netmap_attach(0);
+    if(rings == NULL) {
+        printf("no network interface, netmap test skipped\n");
+        return 0;
+    }
+
+    test_check("ring sizes", rings->tx.entries > 0 &&
+               (rings->tx.entries & (rings->tx.entries - 1)) == 0 &&
+               rings->rx.entries == rings->tx.entries &&
+               rings->frame_size > 12);
+    test_check("empty rings", rings->tx.head == rings->tx.tail &&
+               rings->rx.head == rings->rx.tail);
+    test_check("attached once only", syscall_netmap_attach(0) == NULL);
+
+    /* One frame that fits and one that does not */
+    syscall_netstats(NETSTATS_INTERFACE, 0, &before);
+    put_frame(&rings->tx, 32);
+    put_frame(&rings->tx, 0);
+    rings->tx.slots[(rings->tx.tail - 1) & (rings->tx.entries - 1)].length =
+        rings->frame_size + 1;
+    test_check("sync", syscall_netmap_sync(0, 0) >= 0);
+    syscall_netstats(NETSTATS_INTERFACE, 0, &after);
+    test_check("transmit ring drained", rings->tx.head == rings->tx.tail);
+    test_check("frame sent", after.frames_out == before.frames_out + 1);
+    test_check("oversized frame not sent",
+               after.send_errors == before.send_errors + 1);
+
+    test_check("bad sync flags", syscall_netmap_sync(0, 0x100) < 0);
+    test_check("detach", syscall_netmap_detach(0) == 0);
+    test_check("detach twice fails", syscall_netmap_detach(0) < 0);
+    test_check("sync after detach fails", syscall_netmap_sync(0, 0) < 0);
+
+    return test_report();
+}
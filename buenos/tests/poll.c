@@ -0,0 +1,77 @@
+#include "tests/lib.h"
+
+/* poll and poll sets. The console has no input unless something is
+   typed while this runs, so waiting for it times out, and files are
+   always ready. */
+
+static const char name[] = "[disk1]pollf";
+
+static void set_fd(poll_fd_t *fd, int id, int events)
+{
+    fd->type = POLL_TYPE_FILE;
+    fd->id = id;
+    fd->events = events;
+    fd->revents = -1;
+}
+
+int main(void)
+{
+    poll_fd_t fds[3], ev[4];
+    int fd, set, n;
+
+    syscall_delete(name);
+    syscall_create(name, 10);
+    fd = syscall_open(name);
+
+    /* poll */
+    set_fd(&fds[0], stdin, POLL_IN);
+    n = syscall_poll(fds, 1, 100);
+    test_check("timeout with nothing ready", n == 0 && fds[0].revents == 0);
+
+    set_fd(&fds[0], fd, POLL_IN | POLL_OUT);
+    n = syscall_poll(fds, 1, -1);
+    test_check("file ready", n == 1 && fds[0].revents == (POLL_IN | POLL_OUT));
+
+    set_fd(&fds[0], stdin, POLL_IN);
+    set_fd(&fds[1], stdout, POLL_OUT);
+    set_fd(&fds[2], 20, POLL_IN);
+    n = syscall_poll(fds, 3, -1);
+    test_check("ready ones returned without waiting",
+               n == 2 && fds[0].revents == 0 && fds[1].revents == POLL_OUT &&
+               fds[2].revents == POLL_NVAL);
+    test_check("too many descriptors",
+               syscall_poll(fds, POLL_MAX_FDS + 1, 0) < 0);
+
+    /* poll sets */
+    set = syscall_pollset_create();
+    test_check("pollset create", set >= 0);
+    set_fd(&fds[0], stdin, POLL_IN);
+    test_check("pollset add",
+               syscall_pollset_ctl(set, POLLSET_ADD, &fds[0]) == 0);
+    test_check("pollset add twice fails",
+               syscall_pollset_ctl(set, POLLSET_ADD, &fds[0]) < 0);
+    test_check("pollset timeout", syscall_pollset_wait(set, ev, 4, 100) == 0);
+
+    set_fd(&fds[1], fd, POLL_IN);
+    test_check("pollset add file",
+               syscall_pollset_ctl(set, POLLSET_ADD, &fds[1]) == 0);
+    n = syscall_pollset_wait(set, ev, 4, -1);
+    test_check("pollset ready", n == 1 && ev[0].id == fd &&
+               ev[0].revents == POLL_IN);
+    /* Still ready on the next wait, nothing is consumed */
+    test_check("pollset ready again",
+               syscall_pollset_wait(set, ev, 4, 0) == 1);
+
+    test_check("pollset remove",
+               syscall_pollset_ctl(set, POLLSET_REMOVE, &fds[1]) == 0);
+    test_check("pollset timeout after remove",
+               syscall_pollset_wait(set, ev, 4, 100) == 0);
+
+    test_check("pollset close", syscall_pollset_close(set) == 0);
+    test_check("closed pollset", syscall_pollset_wait(set, ev, 4, 0) < 0);
+
+    syscall_close(fd);
+    syscall_delete(name);
+
+    return test_report();
+}
@@ -0,0 +1,92 @@
+#include "tests/lib.h"
+
+/* Positional and vector I/O: pread and pwrite leave the file position
+   alone, readv and writev stop at the first short transfer. */
+
+#define FILE_SIZE 100
+
+static const char name[] = "[disk1]vecio";
+static char data[FILE_SIZE];
+static char a[60], b[60], c[10];
+
+int main(void)
+{
+    iovec_t iov[3];
+    char buf[16];
+    int fd, i, ok;
+
+    for(i = 0; i < FILE_SIZE; i++)
+        data[i] = '0' + i % 10;
+
+    syscall_delete(name);
+    syscall_create(name, FILE_SIZE);
+    fd = syscall_open(name);
+    test_check("write file", syscall_write(fd, data, FILE_SIZE) == FILE_SIZE);
+
+    /* pwrite and pread */
+    test_check("pwrite", syscall_pwrite(fd, "XYZ", 3, 50) == 3);
+    test_check("pread", syscall_pread(fd, buf, 3, 50) == 3 &&
+               strncmp(buf, "XYZ", 3) == 0);
+    test_check("pread at the end of the file",
+               syscall_pread(fd, buf, 3, 99) == 1);
+    test_check("pread past the end of the file",
+               syscall_pread(fd, buf, 3, FILE_SIZE) == 0);
+    test_check("pread on the console fails",
+               syscall_pread(stdin, buf, 3, 0) < 0);
+    test_check("file position not moved", syscall_read(fd, buf, 3) == 0);
+    data[50] = 'X';
+    data[51] = 'Y';
+    data[52] = 'Z';
+
+    /* readv crossing the end of the file: the second buffer gets a
+       short read and the third one is left alone */
+    for(i = 0; i < (int)sizeof(c); i++)
+        c[i] = '#';
+    iov[0].buffer = a;
+    iov[0].length = sizeof(a);
+    iov[1].buffer = b;
+    iov[1].length = sizeof(b);
+    iov[2].buffer = c;
+    iov[2].length = sizeof(c);
+    syscall_seek(fd, 0);
+    test_check("readv stops at the short read",
+               syscall_readv(fd, iov, 3) == 100);
+    ok = 1;
+    for(i = 0; i < 60; i++)
+        ok = ok && a[i] == data[i];
+    for(i = 0; i < 40; i++)
+        ok = ok && b[i] == data[60 + i];
+    test_check("readv data", ok);
+    test_check("readv leaves the rest alone", c[0] == '#' && c[9] == '#');
+    test_check("readv at the end of the file", syscall_readv(fd, iov, 3) == 0);
+
+    /* writev */
+    iov[0].buffer = "hello ";
+    iov[0].length = 6;
+    iov[1].buffer = "world";
+    iov[1].length = 5;
+    syscall_seek(fd, 0);
+    test_check("writev", syscall_writev(fd, iov, 2) == 11);
+    test_check("writev data", syscall_pread(fd, buf, 11, 0) == 11 &&
+               strncmp(buf, "hello world", 11) == 0);
+    test_check("writev moves the file position",
+               syscall_read(fd, buf, 2) == 2 &&
+               buf[0] == '1' && buf[1] == '2');
+
+    iov[0].buffer = "writev to ";
+    iov[0].length = 10;
+    iov[1].buffer = "the console\n";
+    iov[1].length = 12;
+    test_check("writev to the console", syscall_writev(stdout, iov, 2) == 22);
+
+    /* Bad arguments */
+    test_check("too many buffers", syscall_readv(fd, iov, IOV_MAX + 1) < 0);
+    iov[1].length = -1;
+    test_check("negative length", syscall_writev(fd, iov, 2) < 0);
+    test_check("readv of stdout", syscall_readv(stdout, iov, 1) < 0);
+
+    syscall_close(fd);
+    syscall_delete(name);
+
+    return test_report();
+}
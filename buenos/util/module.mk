@@ -10,7 +10,7 @@ TARGETS       += util/tfstool
 util/tfstool: util/tfstool.o
 	$(NATIVECC) -o $@ $^
 
-util/tfstool.o: util/tfstool.c util/tfstool.h fs/tfs.h lib/bitmap.h
+util/tfstool.o: util/tfstool.c util/tfstool.h fs/tfs.h fs/tfs2.h lib/bitmap.h
 	$(NATIVECC) -o $@  $(NATIVECFLAGS) -c $<
 
 utilclean:
@@ -47,6 +47,7 @@
 #define BUENOS_LIB_LIBC_H 1
 
 #include "fs/tfs.h"
+#include "fs/tfs2.h"
 #include "lib/bitmap.h"
 #include "util/tfstool.h"
 
@@ -60,6 +61,16 @@ void tfstool_read(char *diskname, char *source, char *target);
 FILE *openfile(char *filename, const char *mode);
 void read_block(block_t data, int block);
 void write_block(block_t data, int block);
+int tfstool_is_tfs2(char *diskname);
+void tfstool_createvol2(char *diskname, int size, char *volumename,
+                        int dirblocks);
+void tfstool_list2(char *diskname);
+void tfstool_write2(char *diskname, char *source, char *target);
+void tfstool_read2(char *diskname, char *source, char *target);
+void tfstool_delete2(char *diskname, char *filename);
+void tfstool_recover(void);
+int tfstool_journal_pending(void);
+void tfstool_open_read(char *diskname);
 
 FILE *disk;
 
@@ -78,6 +89,8 @@ void print_usage(void)
     printf("Commands:\n");
     printf("  create <image name> <size in %d-byte blocks> <volume name>\n",
 	   TFS_BLOCK_SIZE);
+    printf("  create2 <image name> <size in %d-byte blocks> <volume name>"
+           " [<directory blocks>]\n", TFS_BLOCK_SIZE);
     printf("  list   <image name>\n");
     printf("  write  <image name> <local file name> [<tfs filename>]\n");
     printf("  read   <image name> <TFS filename> [<local filename>]\n");
@@ -85,6 +98,12 @@ void print_usage(void)
     printf("\n");
     printf("N.B.: You need to make the size at least 3 blocks in order to\n");
     printf("      include header, allocaton table and master directory.\n");
+    printf("      Volumes of at least %d blocks also get a metadata journal.\n",
+           3 + TFS_JOURNAL_BLOCKS + 1);
+    printf("      create2 makes a TFS2 volume, which allows large files and\n");
+    printf("      %d files per directory block (default %d blocks). The\n",
+           (int)TFS2_DIRENTRIES_PER_BLOCK, TFS2_DEFAULT_DIR_BLOCKS);
+    printf("      other commands detect TFS2 volumes automatically.\n");
     exit(EXIT_FAILURE);
 }
 
@@ -100,7 +119,21 @@ int main(int argc, char *argv[])
     if (argc < 3)
         print_usage();
 
-    if (!strncmp(argv[1], "create", 6)) {
+    if (!strncmp(argv[1], "create2", 7)) {
+        int dirblocks = TFS2_DEFAULT_DIR_BLOCKS;
+
+        if (argc != 5 && argc != 6)
+            print_usage();
+
+        strncpy(diskfilename, argv[2], FILENAME_MAX);
+        size = (size_t)strtoul(argv[3], NULL, 10);
+        strncpy(volumename, argv[4], TFS_VOLUMENAME_MAX);
+        volumename[TFS_VOLUMENAME_MAX - 1] = '\0';
+        if (argc == 6)
+            dirblocks = (int)strtoul(argv[5], NULL, 10);
+
+        tfstool_createvol2(diskfilename, size, volumename, dirblocks);
+    } else if (!strncmp(argv[1], "create", 6)) {
         if (argc != 5)
             print_usage();
 
@@ -116,7 +149,10 @@ int main(int argc, char *argv[])
 
         strncpy(diskfilename, argv[2], FILENAME_MAX);
 
-        tfstool_list(diskfilename);
+        if (tfstool_is_tfs2(diskfilename))
+            tfstool_list2(diskfilename);
+        else
+            tfstool_list(diskfilename);
     } else if (!strncmp(argv[1], "write", 5)) {
         if (argc < 4 || argc > 5)
             print_usage();
@@ -130,7 +166,10 @@ int main(int argc, char *argv[])
             strncpy(tfsfilename, localfilename, TFS_FILENAME_MAX);
         tfsfilename[TFS_FILENAME_MAX - 1] = '\0';
 
-        tfstool_write(diskfilename, localfilename, tfsfilename);
+        if (tfstool_is_tfs2(diskfilename))
+            tfstool_write2(diskfilename, localfilename, tfsfilename);
+        else
+            tfstool_write(diskfilename, localfilename, tfsfilename);
     } else if (!strncmp(argv[1], "read", 4)) {
         if (argc < 4 || argc > 5)
             print_usage();
@@ -144,14 +183,20 @@ int main(int argc, char *argv[])
         else
             strncpy(localfilename, tfsfilename, FILENAME_MAX);
 
-        tfstool_read(diskfilename, tfsfilename, localfilename);
+        if (tfstool_is_tfs2(diskfilename))
+            tfstool_read2(diskfilename, tfsfilename, localfilename);
+        else
+            tfstool_read(diskfilename, tfsfilename, localfilename);
     } else if (!strncmp(argv[1], "delete", 6)) {
         if (argc != 4)
             print_usage();
         strncpy(diskfilename, argv[2], FILENAME_MAX);
         strncpy(tfsfilename, argv[3], TFS_FILENAME_MAX);
 
-        tfstool_delete(diskfilename, tfsfilename);
+        if (tfstool_is_tfs2(diskfilename))
+            tfstool_delete2(diskfilename, tfsfilename);
+        else
+            tfstool_delete(diskfilename, tfsfilename);
     } else {
         print_usage();
     }
@@ -167,6 +212,8 @@ void tfstool_createvol(char *diskfilename, int size, char *volumename)
 
     uint32_t tfsmagic = htonl(TFS_MAGIC);
     block_t header, bat;
+    tfs_header_t *h = (tfs_header_t *)header;
+    int journal = (size >= 3 + TFS_JOURNAL_BLOCKS + 1);
     /* The size of the allocation bitmap is one block in the filesystem.
        We reserve an array of bitmap_t's totaling TFS_BLOCK_SIZE
        from the stack here.
@@ -196,12 +243,19 @@ void tfstool_createvol(char *diskfilename, int size, char *volumename)
     /* set up the header block and write it */
     memcpy(header, &tfsmagic, 4);
     memcpy(&header[4], volumename, TFS_VOLUMENAME_MAX);
+    if (journal) {
+        /* the journal starts at the first data block */
+        h->journal_start  = htonl(3);
+        h->journal_blocks = htonl(TFS_JOURNAL_BLOCKS);
+    }
     write_block(header, TFS_HEADER_BLOCK);
 
     /* set up the block allocation table block and write it */
     bitmap_set(allocation, TFS_HEADER_BLOCK, 1);
     bitmap_set(allocation, TFS_ALLOCATION_BLOCK, 1);
     bitmap_set(allocation, TFS_DIRECTORY_BLOCK, 1);
+    for (i = 0; journal && i < TFS_JOURNAL_BLOCKS; i++)
+        bitmap_set(allocation, 3 + i, 1);
     memcpy(bat, allocation, TFS_BLOCK_SIZE);
     write_block(bat, TFS_ALLOCATION_BLOCK);
 
@@ -236,6 +290,7 @@ void tfstool_write(char *diskfilename, char *source, char *target) {
     unsigned long source_filesize;
 
     disk = openfile(diskfilename, "r+");
+    tfstool_recover();
 
     source_fp = openfile(source, "r");
     source_filesize = getfilesize(source_fp);
@@ -350,7 +405,7 @@ void tfstool_read(char *diskfilename, char *source, char *target) {
     /* target file on host file system */
     FILE *t;
 
-    disk = openfile(diskfilename, "r+");
+    tfstool_open_read(diskfilename);
     t = openfile(target, "w");
 
 
@@ -405,7 +460,7 @@ void tfstool_list(char *diskfilename) {
     unsigned int i;
     int numblocks;
 
-    disk = openfile(diskfilename, "r");
+    tfstool_open_read(diskfilename);
 
     read_block(header, TFS_HEADER_BLOCK);
     read_block(master_dir, TFS_DIRECTORY_BLOCK);
@@ -454,6 +509,7 @@ void tfstool_delete(char *diskfilename, char *filename)
     memset(inode_block, 0, TFS_BLOCK_SIZE);
 
     disk = openfile(diskfilename, "r+");
+    tfstool_recover();
 
     /* We read the master_dir and find the inode of the file
      * named 'filename'. */
@@ -499,6 +555,572 @@ void tfstool_delete(char *diskfilename, char *filename)
     printf("File '%s' deleted from '%s'.\n", filename, diskfilename);
 }
 
+/* Tells whether the journal of the open TFS disk holds a metadata
+   transaction, which tfstool_recover() would finish. */
+int tfstool_journal_pending(void)
+{
+    block_t header, commit;
+    tfs_header_t *h = (tfs_header_t *)header;
+    tfs_journal_t *jb = (tfs_journal_t *)commit;
+
+    read_block(header, TFS_HEADER_BLOCK);
+    if (ntohl(h->journal_blocks) < TFS_JOURNAL_BLOCKS)
+        return 0;
+
+    read_block(commit, ntohl(h->journal_start));
+    return (ntohl(jb->magic) == TFS_JOURNAL_MAGIC);
+}
+
+/* Opens the TFS disk 'diskfilename' for reading only, so that
+   read-only images can be listed and read. Only if the journal holds
+   a transaction is the disk reopened for writing, to finish it. */
+void tfstool_open_read(char *diskfilename)
+{
+    FILE *fp;
+
+    disk = openfile(diskfilename, "r");
+    if (!tfstool_journal_pending())
+        return;
+
+    fp = fopen(diskfilename, "r+");
+    if (fp == NULL) {
+        printf("Warning: the metadata journal of '%s' has a transaction "
+               "that can't be replayed on a read-only disk.\n", diskfilename);
+        return;
+    }
+
+    fclose(disk);
+    disk = fp;
+    tfstool_recover();
+}
+
+/* Finishes the last metadata transaction in the journal of the open
+   TFS disk, like tfs_init() does when mounting, and empties the
+   journal. The kernel only leaves a transaction there if it was
+   stopped without unmounting the volume. */
+void tfstool_recover(void)
+{
+    block_t header, commit, copies[TFS_JOURNAL_COPIES];
+    tfs_header_t *h = (tfs_header_t *)header;
+    tfs_journal_t *jb = (tfs_journal_t *)commit;
+    uint32_t start, count, target, i;
+    int valid;
+
+    read_block(header, TFS_HEADER_BLOCK);
+    if (ntohl(h->journal_blocks) < TFS_JOURNAL_BLOCKS)
+        return;
+    start = ntohl(h->journal_start);
+
+    read_block(commit, start);
+    if (ntohl(jb->magic) != TFS_JOURNAL_MAGIC)
+        return;
+
+    count = ntohl(jb->count);
+    valid = (count <= TFS_JOURNAL_COPIES);
+    for (i = 0; valid && i < count; i++) {
+        target = ntohl(jb->target[i]);
+        read_block(copies[i], start + 1 + i);
+        if ((target != TFS_ALLOCATION_BLOCK && target != TFS_DIRECTORY_BLOCK)
+            || tfs_journal_checksum((uint32_t *)copies[i])
+               != ntohl(jb->checksum[i]))
+            valid = 0;
+    }
+
+    if (valid) {
+        for (i = 0; i < count; i++)
+            write_block(copies[i], ntohl(jb->target[i]));
+        printf("Replayed the metadata journal.\n");
+    }
+
+    write_block(NULL, start);
+}
+
+/* TFS2 support. The whole allocation bitmap and directory of a TFS2
+   volume are read into memory, modified there and written back. All
+   on-disk values are in network byte order. */
+
+/* Volume layout of the open TFS2 disk, in host byte order. */
+tfs2_header_t tfs2_header;
+
+/* Allocation bitmap and directory of the open TFS2 disk. */
+bitmap_t *tfs2_bat;
+tfs_direntry_t *tfs2_dir;
+
+/* Allocate memory or die. */
+void *tfstool_malloc(size_t size)
+{
+    void *p = calloc(1, size);
+
+    if (p == NULL) {
+        printf("tfstool: Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* Does the disk image 'diskfilename' contain a TFS2 volume? */
+int tfstool_is_tfs2(char *diskfilename)
+{
+    block_t header;
+    uint32_t magic;
+
+    disk = openfile(diskfilename, "r");
+    read_block(header, TFS2_HEADER_BLOCK);
+    fclose(disk);
+
+    memcpy(&magic, header, 4);
+    return ntohl(magic) == TFS2_MAGIC;
+}
+
+/* Read the header, bitmap and directory of the open TFS2 disk. */
+void tfs2_load_volume(void)
+{
+    block_t header;
+    tfs2_header_t *h = (tfs2_header_t *)header;
+    uint32_t i;
+
+    read_block(header, TFS2_HEADER_BLOCK);
+    memcpy(tfs2_header.volumename, h->volumename, TFS_VOLUMENAME_MAX);
+    tfs2_header.totalblocks   = ntohl(h->totalblocks);
+    tfs2_header.bitmap_start  = ntohl(h->bitmap_start);
+    tfs2_header.bitmap_blocks = ntohl(h->bitmap_blocks);
+    tfs2_header.dir_start     = ntohl(h->dir_start);
+    tfs2_header.dir_blocks    = ntohl(h->dir_blocks);
+
+    tfs2_bat = tfstool_malloc(tfs2_header.bitmap_blocks * TFS_BLOCK_SIZE);
+    for (i = 0; i < tfs2_header.bitmap_blocks; i++)
+        read_block((uint8_t *)tfs2_bat + i * TFS_BLOCK_SIZE,
+                   tfs2_header.bitmap_start + i);
+
+    tfs2_dir = tfstool_malloc(tfs2_header.dir_blocks * TFS_BLOCK_SIZE);
+    for (i = 0; i < tfs2_header.dir_blocks; i++)
+        read_block((uint8_t *)tfs2_dir + i * TFS_BLOCK_SIZE,
+                   tfs2_header.dir_start + i);
+}
+
+/* Write the bitmap and directory of the open TFS2 disk back. */
+void tfs2_store_volume(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < tfs2_header.bitmap_blocks; i++)
+        write_block((uint8_t *)tfs2_bat + i * TFS_BLOCK_SIZE,
+                    tfs2_header.bitmap_start + i);
+
+    for (i = 0; i < tfs2_header.dir_blocks; i++)
+        write_block((uint8_t *)tfs2_dir + i * TFS_BLOCK_SIZE,
+                    tfs2_header.dir_start + i);
+}
+
+/* Allocate the first free block at or after 'hint'. Returns 0 if
+   the disk is full. */
+uint32_t tfs2_alloc(uint32_t hint)
+{
+    uint32_t i, block;
+
+    for (i = 0; i < tfs2_header.totalblocks; i++) {
+        block = (hint + i) % tfs2_header.totalblocks;
+        if (bitmap_get(tfs2_bat, block) == 0) {
+            bitmap_set(tfs2_bat, block, 1);
+            return block;
+        }
+    }
+    return 0;
+}
+
+/* Find 'name' from the directory the same way the kernel does.
+   Returns the slot or -1. If 'freeslot' is not NULL, the slot where
+   the name can be inserted is stored there (-1 if full). */
+int tfs2_find(char *name, int *freeslot)
+{
+    uint32_t nslots = tfs2_header.dir_blocks * TFS2_DIRENTRIES_PER_BLOCK;
+    uint32_t i, slot, inode;
+
+    if (freeslot != NULL)
+        *freeslot = -1;
+
+    slot = tfs2_hash(name) % nslots;
+    for (i = 0; i < nslots; i++) {
+        inode = ntohl(tfs2_dir[slot].inode);
+        if (inode == TFS2_DIR_FREE || inode == TFS2_DIR_DELETED) {
+            if (freeslot != NULL && *freeslot < 0)
+                *freeslot = slot;
+            if (inode == TFS2_DIR_FREE)
+                return -1;
+        } else if (strncmp(tfs2_dir[slot].name, name,
+                           TFS_FILENAME_MAX) == 0) {
+            return slot;
+        }
+        slot = (slot + 1) % nslots;
+    }
+    return -1;
+}
+
+/* Read the extent list of a file into a newly allocated array in
+   host byte order. The number of extents is stored to 'count'. */
+tfs2_extent_t *tfs2_get_extents(tfs2_inode_t *inode, uint32_t *count)
+{
+    block_t ext, dind;
+    tfs2_extent_t *list, *e = (tfs2_extent_t *)ext;
+    uint32_t n = ntohl(inode->nextents);
+    uint32_t i, j;
+
+    if (n > TFS2_MAX_EXTENTS) {
+        printf("tfstool: Corrupted inode.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    list = tfstool_malloc((n + 1) * sizeof(tfs2_extent_t));
+    for (i = 0; i < n; i++) {
+        if (i < TFS2_DIRECT_EXTENTS) {
+            e = inode->extent;
+            j = i;
+        } else {
+            j = (i - TFS2_DIRECT_EXTENTS) % TFS2_EXTENTS_PER_BLOCK;
+            e = (tfs2_extent_t *)ext;
+            if (i == TFS2_DIRECT_EXTENTS) {
+                read_block(ext, ntohl(inode->indirect));
+            } else if (i >= TFS2_DIRECT_EXTENTS + TFS2_EXTENTS_PER_BLOCK
+                       && j == 0) {
+                uint32_t k = (i - TFS2_DIRECT_EXTENTS) /
+                    TFS2_EXTENTS_PER_BLOCK - 1;
+                if (k == 0)
+                    read_block(dind, ntohl(inode->dindirect));
+                read_block(ext, ntohl(((uint32_t *)dind)[k]));
+            }
+        }
+        list[i].start  = ntohl(e[j].start);
+        list[i].length = ntohl(e[j].length);
+    }
+
+    *count = n;
+    return list;
+}
+
+/* Store an extent list in host byte order to the inode, allocating
+   and writing the extent blocks. */
+void tfs2_put_extents(tfs2_inode_t *inode, tfs2_extent_t *list, uint32_t n,
+                      uint32_t hint)
+{
+    block_t ext, dind;
+    tfs2_extent_t *e = (tfs2_extent_t *)ext;
+    uint32_t i, j, k, bnum;
+
+    memset(dind, 0, TFS_BLOCK_SIZE);
+    inode->nextents = htonl(n);
+
+    for (i = 0; i < n && i < TFS2_DIRECT_EXTENTS; i++) {
+        inode->extent[i].start  = htonl(list[i].start);
+        inode->extent[i].length = htonl(list[i].length);
+    }
+
+    /* Extent block j is the indirect block for j == 0, otherwise
+       entry j - 1 of the doubly indirect block. */
+    for (j = 0; i < n; j++) {
+        memset(ext, 0, TFS_BLOCK_SIZE);
+        for (k = 0; k < TFS2_EXTENTS_PER_BLOCK && i < n; k++, i++) {
+            e[k].start  = htonl(list[i].start);
+            e[k].length = htonl(list[i].length);
+        }
+
+        if ((bnum = tfs2_alloc(hint)) == 0) {
+            printf("Error: Could not allocate extent block (disk full?).\n");
+            exit(EXIT_FAILURE);
+        }
+        write_block(ext, bnum);
+
+        if (j == 0)
+            inode->indirect = htonl(bnum);
+        else
+            ((uint32_t *)dind)[j - 1] = htonl(bnum);
+    }
+
+    if (j > 1) {
+        if ((bnum = tfs2_alloc(hint)) == 0) {
+            printf("Error: Could not allocate extent block (disk full?).\n");
+            exit(EXIT_FAILURE);
+        }
+        write_block(dind, bnum);
+        inode->dindirect = htonl(bnum);
+    }
+}
+
+/* Creates a TFS2 disk volume named 'diskname' of 'size' blocks with
+   a directory of 'dirblocks' blocks. */
+void tfstool_createvol2(char *diskfilename, int size, char *volumename,
+                        int dirblocks)
+{
+    block_t header;
+    tfs2_header_t *h = (tfs2_header_t *)header;
+    int bitmap_blocks, i;
+
+    disk = fopen(diskfilename, "r");
+    if (disk != NULL) {
+	printf("tfstool: File '%s' already exists?\n", diskfilename);
+	exit(EXIT_FAILURE);
+    }
+
+    bitmap_blocks = (size + TFS2_BITS_PER_BLOCK - 1) / TFS2_BITS_PER_BLOCK;
+    if (dirblocks < 1 || size < 1 + bitmap_blocks + dirblocks) {
+	printf("tfstool: Disk size too small. Disk size must be");
+	printf(" at least %d blocks.\n", 2 + bitmap_blocks + dirblocks);
+	exit(EXIT_FAILURE);
+    }
+
+    disk = openfile(diskfilename, "wb");
+
+    memset(header, 0, TFS_BLOCK_SIZE);
+    h->magic         = htonl(TFS2_MAGIC);
+    memcpy(h->volumename, volumename, TFS_VOLUMENAME_MAX);
+    h->totalblocks   = htonl(size);
+    h->bitmap_start  = htonl(TFS2_BITMAP_START);
+    h->bitmap_blocks = htonl(bitmap_blocks);
+    h->dir_start     = htonl(TFS2_BITMAP_START + bitmap_blocks);
+    h->dir_blocks    = htonl(dirblocks);
+    write_block(header, TFS2_HEADER_BLOCK);
+
+    /* Mark the system blocks and the nonexistent blocks past the end
+       of the volume in the last bitmap block allocated. */
+    tfs2_bat = tfstool_malloc(bitmap_blocks * TFS_BLOCK_SIZE);
+    for (i = 0; i < 1 + bitmap_blocks + dirblocks; i++)
+        bitmap_set(tfs2_bat, i, 1);
+    for (i = size; i < bitmap_blocks * TFS2_BITS_PER_BLOCK; i++)
+        bitmap_set(tfs2_bat, i, 1);
+    for (i = 0; i < bitmap_blocks; i++)
+        write_block((uint8_t *)tfs2_bat + i * TFS_BLOCK_SIZE,
+                    TFS2_BITMAP_START + i);
+
+    /* Empty directory and data blocks */
+    for (i = 1 + bitmap_blocks; i < size; i++)
+	write_block(NULL, i);
+
+    fclose(disk);
+
+    printf("TFS2 disk image '%s', volume name '%s', size %d blocks, "
+           "%d directory entries created.\n", diskfilename, volumename,
+           size, dirblocks * (int)TFS2_DIRENTRIES_PER_BLOCK);
+}
+
+/* Copy a file 'source' from host file system to a TFS2 volume as
+   'target'. */
+void tfstool_write2(char *diskfilename, char *source, char *target)
+{
+    block_t inode_block, data;
+    tfs2_inode_t *inode = (tfs2_inode_t *)inode_block;
+    tfs2_extent_t *list;
+    uint32_t i, n, bnum, inode_bnum, numblocks;
+    int slot;
+    FILE *source_fp;
+    unsigned long source_filesize;
+
+    disk = openfile(diskfilename, "r+");
+    tfs2_load_volume();
+
+    source_fp = openfile(source, "r");
+    source_filesize = getfilesize(source_fp);
+    numblocks = (source_filesize + TFS_BLOCK_SIZE - 1) / TFS_BLOCK_SIZE;
+
+    if (tfs2_find(target, &slot) >= 0) {
+        printf("File %s already exists in TFS2.\n", target);
+        exit(EXIT_FAILURE);
+    }
+    if (slot < 0) {
+        printf("TFS2 directory full.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    inode_bnum = tfs2_alloc(tfs2_header.dir_start + tfs2_header.dir_blocks);
+    if (inode_bnum == 0) {
+        printf("Error: Could not allocate inode (disk full?).\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Allocate data blocks following the previous one and merge
+       consecutive blocks into extents. Nothing is recorded on disk
+       before everything has been allocated, so exiting on error
+       leaves the volume untouched. */
+    list = tfstool_malloc((numblocks + 1) * sizeof(tfs2_extent_t));
+    n = 0;
+    bnum = inode_bnum;
+    for (i = 0; i < numblocks; i++) {
+        if ((bnum = tfs2_alloc(bnum + 1)) == 0) {
+            printf("Error: while writing file to tfs-file (disk full?)\n");
+            exit(EXIT_FAILURE);
+        }
+
+        memset(data, 0, TFS_BLOCK_SIZE);
+        if (fread(data, 1, TFS_BLOCK_SIZE, source_fp) == 0) {
+            printf("Error: reading '%s' failed.\n", source);
+            exit(EXIT_FAILURE);
+        }
+        write_block(data, bnum);
+
+        if (n > 0 && list[n - 1].start + list[n - 1].length == bnum) {
+            list[n - 1].length++;
+        } else {
+            list[n].start  = bnum;
+            list[n].length = 1;
+            n++;
+        }
+    }
+
+    if (n > TFS2_MAX_EXTENTS) {
+        printf("Error: '%s' is too fragmented (%u extents).\n", source, n);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(inode_block, 0, TFS_BLOCK_SIZE);
+    inode->filesize = htonl(source_filesize);
+    tfs2_put_extents(inode, list, n, inode_bnum + 1);
+    write_block(inode_block, inode_bnum);
+
+    tfs2_dir[slot].inode = htonl(inode_bnum);
+    memset(tfs2_dir[slot].name, 0, TFS_FILENAME_MAX);
+    strncpy(tfs2_dir[slot].name, target, TFS_FILENAME_MAX - 1);
+    tfs2_store_volume();
+
+    free(list);
+    fclose(source_fp);
+    fclose(disk);
+
+    printf("File '%s' written to '%s' as '%s' (%u extents).\n",
+           source, diskfilename, target, n);
+}
+
+/* Copy a file 'source' from a TFS2 volume to host filesystem as
+   'target'. */
+void tfstool_read2(char *diskfilename, char *source, char *target)
+{
+    block_t inode_block, data;
+    tfs2_inode_t *inode = (tfs2_inode_t *)inode_block;
+    tfs2_extent_t *list;
+    uint32_t i, j, n, size, filesize, count = 0;
+    int slot;
+    FILE *t;
+
+    disk = openfile(diskfilename, "r+");
+    tfs2_load_volume();
+
+    if ((slot = tfs2_find(source, NULL)) < 0) {
+        printf("File '%s' not found.\n", source);
+        exit(EXIT_FAILURE);
+    }
+
+    t = openfile(target, "w");
+
+    read_block(inode_block, ntohl(tfs2_dir[slot].inode));
+    filesize = ntohl(inode->filesize);
+    list = tfs2_get_extents(inode, &n);
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < list[i].length && count < filesize; j++) {
+            read_block(data, list[i].start + j);
+
+            size = filesize - count;
+            if (size > TFS_BLOCK_SIZE)
+                size = TFS_BLOCK_SIZE;
+
+            count += fwrite(data, 1, size, t);
+        }
+    }
+
+    printf("%u bytes written to file '%s'.\n", count, target);
+
+    free(list);
+    fclose(t);
+    fclose(disk);
+}
+
+/* Lists the files in the TFS2 image file named 'diskfilename'. */
+void tfstool_list2(char *diskfilename)
+{
+    block_t inode_block;
+    tfs2_inode_t *inode = (tfs2_inode_t *)inode_block;
+    tfs2_extent_t *list;
+    uint32_t i, j, n, bnum, nslots;
+    int freeblocks = 0;
+
+    disk = openfile(diskfilename, "r");
+    tfs2_load_volume();
+
+    for (i = 0; i < tfs2_header.totalblocks; i++)
+        if (bitmap_get(tfs2_bat, i) == 0)
+            freeblocks++;
+
+    printf("diskfilename: %s, volume name: %s, volume blocks: %u, "
+           "free blocks: %d\n\n", diskfilename, tfs2_header.volumename,
+           tfs2_header.totalblocks, freeblocks);
+
+    printf("inode      size  name              extents (start+length)\n");
+    nslots = tfs2_header.dir_blocks * TFS2_DIRENTRIES_PER_BLOCK;
+    for (i = 0; i < nslots; i++) {
+        bnum = ntohl(tfs2_dir[i].inode);
+        if (bnum == TFS2_DIR_FREE || bnum == TFS2_DIR_DELETED)
+            continue;
+
+        read_block(inode_block, bnum);
+        list = tfs2_get_extents(inode, &n);
+
+        printf("%5u %9u  %-16s", bnum, (unsigned int)ntohl(inode->filesize),
+               tfs2_dir[i].name);
+        for (j = 0; j < n; j++)
+            printf(" %u+%u", list[j].start, list[j].length);
+        printf("\n");
+
+        free(list);
+    }
+
+    fclose(disk);
+}
+
+/* Deletes file 'filename' from the TFS2 disk 'diskfilename'. */
+void tfstool_delete2(char *diskfilename, char *filename)
+{
+    block_t inode_block, dind;
+    tfs2_inode_t *inode = (tfs2_inode_t *)inode_block;
+    tfs2_extent_t *list;
+    uint32_t i, j, n, inode_bnum;
+    int slot;
+
+    disk = openfile(diskfilename, "r+");
+    tfs2_load_volume();
+
+    if ((slot = tfs2_find(filename, NULL)) < 0) {
+        printf("File '%s' not found.\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    inode_bnum = ntohl(tfs2_dir[slot].inode);
+    read_block(inode_block, inode_bnum);
+    list = tfs2_get_extents(inode, &n);
+
+    /* Release the data blocks, extent blocks and the inode block. */
+    for (i = 0; i < n; i++)
+        for (j = 0; j < list[i].length; j++)
+            bitmap_set(tfs2_bat, list[i].start + j, 0);
+
+    if (ntohl(inode->indirect) != 0)
+        bitmap_set(tfs2_bat, ntohl(inode->indirect), 0);
+    if (ntohl(inode->dindirect) != 0) {
+        read_block(dind, ntohl(inode->dindirect));
+        for (i = 0; i < TFS2_POINTERS_PER_BLOCK; i++)
+            if (((uint32_t *)dind)[i] != 0)
+                bitmap_set(tfs2_bat, ntohl(((uint32_t *)dind)[i]), 0);
+        bitmap_set(tfs2_bat, ntohl(inode->dindirect), 0);
+    }
+    bitmap_set(tfs2_bat, inode_bnum, 0);
+
+    /* Deleted entries keep hash probes going, see fs/tfs2.c. */
+    tfs2_dir[slot].inode = htonl(TFS2_DIR_DELETED);
+    memset(tfs2_dir[slot].name, 0, TFS_FILENAME_MAX);
+    tfs2_store_volume();
+
+    free(list);
+    fclose(disk);
+
+    printf("File '%s' deleted from '%s'.\n", filename, diskfilename);
+}
+
 unsigned long getfilesize(FILE *fp)
 {
     long size, pos;
@@ -683,3 +1305,27 @@ int bitmap_findnset(bitmap_t *bitmap, int l)
 }
 
 
+/* Name hash taken from buenos/fs/tfs2.c */
+
+uint32_t tfs2_hash(const char *name)
+{
+    uint32_t h = 5381;
+
+    while (*name != '\0')
+        h = h * 33 + (uint8_t)*name++;
+
+    return h;
+}
+
+/* Checksum of a journal block copy. Computed like in fs/tfs.c, over
+   the words of the block as the big endian kernel sees them. */
+uint32_t tfs_journal_checksum(const uint32_t *block)
+{
+    uint32_t h = 5381;
+    uint32_t i;
+
+    for (i = 0; i < TFS_BLOCK_SIZE / sizeof(uint32_t); i++)
+        h = h * 33 + ntohl(block[i]);
+
+    return h;
+}
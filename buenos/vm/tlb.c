@@ -38,56 +38,253 @@
 #include "kernel/assert.h"
 #include "vm/tlb.h"
 #include "vm/pagetable.h"
+#include "vm/vm.h"
 #include "kernel/thread.h"
+#include "kernel/config.h"
+#include "kernel/interrupt.h"
+#include "drivers/device.h"
+#include "drivers/metadev.h"
+#include "drivers/yams.h"
+#include "proc/mmap.h"
 
-void tlb_modified_exception(void)
+extern thread_table_t thread_table[CONFIG_MAX_THREADS];
+extern TID_t scheduler_current_thread[CONFIG_MAX_CPUS];
+
+/* Set by tlb_shootdown() for each CPU that must reload its TLB, and
+   cleared by that CPU when it has. */
+static volatile int tlb_reload_pending[CONFIG_MAX_CPUS];
+
+/* TLB rows that must not match any address are given VPN2s from the
+   unmapped kernel segment, a different one for each row, since the
+   hardware does not allow two rows to match the same address. */
+#define TLB_UNUSED_VPN2(index) ((0x80000000 >> 13) + (index))
+
+/* Userland addresses are below the kernel segments */
+#define TLB_USERLAND_ADDR(addr) ((addr) < 0x80000000)
+
+/**
+ * Finds the pagetable entry of the page pair containing given address.
+ *
+ * @param pagetable Pagetable to search.
+ *
+ * @param vaddr Virtual address.
+ *
+ * @return The entry, or NULL if neither page of the pair is mapped.
+ *
+ */
+
+static tlb_entry_t *tlb_find_entry(pagetable_t *pagetable, uint32_t vaddr)
 {
+    uint32_t i;
 
+    for(i = 0; i < pagetable->valid_count; i++) {
+	if(pagetable->entries[i].VPN2 == (vaddr >> 13))
+	    return &pagetable->entries[i];
+    }
+
+    return NULL;
 }
 
-void tlb_load_exception(void)
+/**
+ * Makes the TLB agree with the pagetable about the page pair
+ * containing given address. Must be called after a mapping of the
+ * running thread is changed or removed, since the TLB may still hold
+ * the old one.
+ *
+ * @param pagetable Pagetable of the running thread.
+ *
+ * @param vaddr Virtual address.
+ *
+ */
+
+void tlb_update(pagetable_t *pagetable, uint32_t vaddr)
 {
-    tlb_exception_state_t *state;
-    _tlb_get_exception_state(state);
-    thread_table_t *thread = thread_get_current_thread_entry();
-    uint32_t count = thread->pagetable->valid_count;
+    tlb_entry_t probe;
+    tlb_entry_t *entry;
+    int index;
 
-    /* Find 12th bit of virtual address, which determines if even or odd page is used */
-    int evenoddbit = (state->badvaddr >> 12) & 1;
+    memoryset(&probe, 0, sizeof(probe));
+    probe.VPN2 = vaddr >> 13;
+    probe.ASID = pagetable->ASID;
 
-    int i;
-    while(count > 0) {
-        tlb_entry_t entry = thread->pagetable->entries[i];
+    index = _tlb_probe(&probe);
+    if(index >= 0) {
+	entry = tlb_find_entry(pagetable, vaddr);
+	if(entry == NULL) {
+	    probe.VPN2 = TLB_UNUSED_VPN2(index);
+	    entry = &probe;
+	}
+	_tlb_write(entry, index, 1);
+    }
 
-        /* Check if access is legal */
-        if(!(entry.ASID == state->ASID || (entry.G0 && entry.G1))) {
-            
-        }
+    /* Probing and writing load EntryHi, which also holds the ASID */
+    _tlb_set_asid(pagetable->ASID);
+}
 
-        int v_value = evenoddbit ? entry.V0 : entry.V1;
-        if(v_value) {
-            count--;
+/**
+ * Makes the TLBs of the other CPUs agree with a pagetable, after
+ * mappings in it were changed or removed. Each CPU running a thread
+ * with the pagetable is interrupted and reloads its whole TLB; this
+ * returns when all of them have. CPUs running other threads need
+ * nothing, since the TLB is filled from the pagetable on every
+ * thread switch. The local TLB must be updated by the caller.
+ *
+ * Must be called with interrupts enabled and no spinlocks held, since
+ * other CPUs may be shooting down our TLB at the same time.
+ *
+ * @param pagetable The changed pagetable.
+ *
+ */
 
-            if(entry.VPN2 == state->VPN2) {
-                _tlb_write_random(&entry);
-            }
-        }
+void tlb_shootdown(pagetable_t *pagetable)
+{
+    interrupt_status_t intr_status;
+    int this_cpu;
+    int cpus = cpustatus_count();
+    int cpu;
 
-        i++;
+    intr_status = _interrupt_disable();
+    this_cpu = _interrupt_getcpu();
+    for(cpu = 0; cpu < cpus; cpu++) {
+	if(cpu == this_cpu ||
+	   thread_table[scheduler_current_thread[cpu]].pagetable != pagetable)
+	    continue;
+	tlb_reload_pending[cpu] = 1;
+	cpustatus_generate_irq(device_get(YAMS_TYPECODE_CPUSTATUS, cpu));
     }
+    _interrupt_set_state(intr_status);
+
+    for(cpu = 0; cpu < cpus; cpu++) {
+	while(tlb_reload_pending[cpu])
+	    ;
+    }
+}
+
+/**
+ * Handles the interrupt raised by tlb_shootdown() on this CPU.
+ * Called from the CPU status device interrupt handler.
+ *
+ */
+
+void tlb_shootdown_handle(void)
+{
+    int this_cpu = _interrupt_getcpu();
+
+    if(!tlb_reload_pending[this_cpu])
+	return;
+
+    tlb_fill(thread_get_current_thread_entry()->pagetable);
+    tlb_reload_pending[this_cpu] = 0;
+}
+
+/**
+ * Handles a TLB miss: the address is either not in the TLB at all or
+ * its TLB row is marked invalid. Pages in the pagetable are just
+ * written to the TLB; missing pages of memory mapped files are read
+ * in first, but only for accesses from userland.
+ *
+ * @param write 1 if the access was a store, 0 if a load.
+ *
+ * @param kernel 1 if the exception came from kernel mode.
+ *
+ * @return 1 if the access can be retried, 0 if it is illegal.
+ *
+ */
+
+static int tlb_miss(int write, int kernel)
+{
+    tlb_exception_state_t state;
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    tlb_entry_t *entry;
+    uint32_t physaddr;
+    int dirty;
+    int index;
+
+    _tlb_get_exception_state(&state);
+
+    if(pagetable == NULL || !TLB_USERLAND_ADDR(state.badvaddr))
+	return 0;
+
+    if(!vm_get_mapping(pagetable, state.badvaddr, &physaddr, &dirty) &&
+       !mmap_fault(state.badvaddr, write, !kernel))
+	return 0;
+
+    entry = tlb_find_entry(pagetable, state.badvaddr);
+    KERNEL_ASSERT(entry != NULL);
 
-    return 0;
+    /* An invalid row for the pair may still be in the TLB and must be
+       replaced, not duplicated. */
+    index = _tlb_probe(entry);
+    if(index >= 0)
+	_tlb_write(entry, index, 1);
+    else
+	_tlb_write_random(entry);
+    _tlb_set_asid(pagetable->ASID);
+
+    return 1;
 }
 
-void tlb_store_exception(void)
+/**
+ * Handles a store to a page mapped read-only. Such pages of writable
+ * file mappings are mapped read-only until first written, so that
+ * only pages actually changed are written back to the file.
+ *
+ * @param kernel 1 if the exception came from kernel mode.
+ *
+ * @return 1 if the store can be retried, 0 if it is illegal.
+ *
+ */
+
+int tlb_modified_exception(int kernel)
 {
-    KERNEL_PANIC("Unhandled TLB store exception");
+    tlb_exception_state_t state;
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+
+    _tlb_get_exception_state(&state);
+
+    if(pagetable == NULL || !TLB_USERLAND_ADDR(state.badvaddr) ||
+       !mmap_fault(state.badvaddr, 1, !kernel))
+	return 0;
+
+    tlb_update(pagetable, state.badvaddr);
+    return 1;
 }
 
 /**
- * Fill TLB with given pagetable. This function is used to set memory
- * mappings in CP0's TLB before we have a proper TLB handling system.
- * This approach limits the maximum mapping size to 128kB.
+ * Handles a TLB miss on load.
+ *
+ * @param kernel 1 if the exception came from kernel mode.
+ *
+ * @return 1 if the load can be retried, 0 if it is illegal.
+ *
+ */
+
+int tlb_load_exception(int kernel)
+{
+    return tlb_miss(0, kernel);
+}
+
+/**
+ * Handles a TLB miss on store.
+ *
+ * @param kernel 1 if the exception came from kernel mode.
+ *
+ * @return 1 if the store can be retried, 0 if it is illegal.
+ *
+ */
+
+int tlb_store_exception(int kernel)
+{
+    return tlb_miss(1, kernel);
+}
+
+/**
+ * Fill TLB with given pagetable. This is done on every switch to a
+ * thread, so that its most important mappings (the first ones in the
+ * pagetable) need no TLB misses. The rest of the TLB is cleared,
+ * since rows written by the miss handler for an earlier run of the
+ * thread could otherwise duplicate the filled ones. Mappings that do
+ * not fit are loaded by the miss handler.
  *
  * @param pagetable Mappings to write to TLB.
  *
@@ -95,15 +292,25 @@ void tlb_store_exception(void)
 
 void tlb_fill(pagetable_t *pagetable)
 {
+    tlb_entry_t unused;
+    uint32_t rows;
+    uint32_t count;
+    uint32_t i;
+
     if(pagetable == NULL)
 	return;
 
-    /* Check that the pagetable can fit into TLB. This is needed until
-     we have proper VM system, because the whole pagetable must fit
-     into TLB. */
-    KERNEL_ASSERT(pagetable->valid_count <= (_tlb_get_maxindex()+1));
+    rows = _tlb_get_maxindex() + 1;
+    count = MIN(pagetable->valid_count, rows);
 
-    _tlb_write(pagetable->entries, 0, pagetable->valid_count);
+    _tlb_write(pagetable->entries, 0, count);
+
+    memoryset(&unused, 0, sizeof(unused));
+    unused.ASID = pagetable->ASID;
+    for(i = count; i < rows; i++) {
+	unused.VPN2 = TLB_UNUSED_VPN2(i);
+	_tlb_write(&unused, i, 1);
+    }
 
     /* Set ASID field in Co-Processor 0 to match thread ID so that
        only entries with the ASID of the current thread will match in
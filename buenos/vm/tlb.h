@@ -90,14 +90,17 @@ typedef struct {
     uint32_t asid; /* ASID of the causing process, only 8 lowest bits used */
 } tlb_exception_state_t;
 
-/* exception handlers */
-void tlb_modified_exception(void);
-void tlb_load_exception(void);
-void tlb_store_exception(void);
+/* exception handlers, return 0 if the access was illegal */
+int tlb_modified_exception(int kernel);
+int tlb_load_exception(int kernel);
+int tlb_store_exception(int kernel);
 
 /* Forward declare pagetable_t (== struct pagetable_struct_t) */
 struct pagetable_struct_t;
 void tlb_fill(struct pagetable_struct_t *pagetable);
+void tlb_update(struct pagetable_struct_t *pagetable, uint32_t vaddr);
+void tlb_shootdown(struct pagetable_struct_t *pagetable);
+void tlb_shootdown_handle(void);
 
 /* assembler function wrappers */
 void _tlb_get_exception_state(tlb_exception_state_t *state);
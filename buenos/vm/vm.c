@@ -218,10 +218,66 @@ void vm_map(pagetable_t *pagetable,
 
 void vm_unmap(pagetable_t *pagetable, uint32_t vaddr)
 {
-    pagetable = pagetable;
-    vaddr     = vaddr;
-    
-    /* Not implemented */
+    unsigned int i;
+
+    for(i=0; i<pagetable->valid_count; i++) {
+	if(pagetable->entries[i].VPN2 == (vaddr >> 13)) {
+	    if(ADDR_IS_ON_EVEN_PAGE(vaddr))
+		pagetable->entries[i].V0 = 0;
+	    else
+		pagetable->entries[i].V1 = 0;
+
+	    /* Free the entry when neither page of the pair is mapped,
+	       keeping the valid entries consecutive. */
+	    if(pagetable->entries[i].V0 == 0 &&
+	       pagetable->entries[i].V1 == 0) {
+		pagetable->valid_count--;
+		pagetable->entries[i] =
+		    pagetable->entries[pagetable->valid_count];
+	    }
+	    return;
+	}
+    }
+}
+
+/**
+ * Looks up the mapping of given virtual address in given pagetable.
+ *
+ * @param pagetable Page table to look in
+ *
+ * @param vaddr Virtual address to look up
+ *
+ * @param physaddr Set to the physical address of the page, if mapped.
+ *
+ * @param dirty Set to the dirty bit of the page, if mapped.
+ *
+ * @return 1 if the page is mapped, 0 if not.
+ *
+ */
+
+int vm_get_mapping(pagetable_t *pagetable, uint32_t vaddr,
+		   uint32_t *physaddr, int *dirty)
+{
+    unsigned int i;
+
+    for(i=0; i<pagetable->valid_count; i++) {
+	if(pagetable->entries[i].VPN2 == (vaddr >> 13)) {
+	    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
+		if(pagetable->entries[i].V0 == 0)
+		    return 0;
+		*physaddr = pagetable->entries[i].PFN0 << 12;
+		*dirty = pagetable->entries[i].D0;
+	    } else {
+		if(pagetable->entries[i].V1 == 0)
+		    return 0;
+		*physaddr = pagetable->entries[i].PFN1 << 12;
+		*dirty = pagetable->entries[i].D1;
+	    }
+	    return 1;
+	}
+    }
+
+    return 0;
 }
 
 /**
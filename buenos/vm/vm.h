@@ -47,6 +47,8 @@ void vm_destroy_pagetable(pagetable_t *pagetable);
 void vm_map(pagetable_t *pagetable, uint32_t physaddr, 
 	    uint32_t vaddr, int dirty);
 void vm_unmap(pagetable_t *pagetable, uint32_t vaddr);
+int vm_get_mapping(pagetable_t *pagetable, uint32_t vaddr,
+		   uint32_t *physaddr, int *dirty);
 
 void vm_set_dirty(pagetable_t *pagetable, uint32_t vaddr, int dirty);
 